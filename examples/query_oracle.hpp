@@ -0,0 +1,112 @@
+// The values the examples fill their containers with, and the queries that
+// check a container against a KDTree holding the same values.
+
+#ifndef INCLUDE_KDTREE_EXAMPLES_QUERY_ORACLE_HPP
+#define INCLUDE_KDTREE_EXAMPLES_QUERY_ORACLE_HPP
+
+#include <kdtree++/kdtree.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+struct point
+{
+  typedef double value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[3];
+  int id;
+};
+
+inline bool operator<(point const& a, point const& b) { return a.id < b.id; }
+inline bool operator==(point const& a, point const& b) { return a.id == b.id; }
+
+typedef KDTree::KDTree<3, point> tree_type;
+
+struct above_plane
+{
+  bool operator()(point const& p) const { return p[2] > 50; }
+};
+
+// A point within [0, 100)^3.
+static point
+random_point(int id)
+{
+  point p;
+  for (size_t i = 0; i != 3; ++i)
+    p.d[i] = rand() % 100 + rand() / double(RAND_MAX);
+  p.id = id;
+  return p;
+}
+
+// Asserts that other, any container whose searches return iterators like
+// those of a KDTree, answers 50 random queries of each kind like tree.
+template <class Tree>
+static void
+check_queries(tree_type const& tree, Tree const& other)
+{
+  typedef typename Tree::const_iterator other_iterator;
+  assert(other.size() == tree.size());
+  for (int q = 0; q != 50; ++q)
+    {
+      point s = random_point(-1);
+
+      std::pair<tree_type::const_iterator, double> a = tree.find_nearest(s);
+      std::pair<other_iterator, double> b = other.find_nearest(s);
+      assert((a.first == tree.end()) == (b.first == other.end()));
+      assert(a.second == b.second);
+
+      double const max = (q % 10) + 0.5;
+      a = tree.find_nearest_if(s, max * 4, above_plane());
+      b = other.find_nearest_if(s, max * 4, above_plane());
+      assert((a.first == tree.end()) == (b.first == other.end()));
+      assert(a.second == b.second);
+      if (b.first != other.end())
+        assert(above_plane()(*b.first));
+
+      size_t const k = q % 12 + 1;
+      std::pair<tree_type::const_iterator, double> ka[12];
+      std::pair<other_iterator, double> kb[12];
+      size_t n = tree.find_k_nearest(s, k, ka);
+      assert(n == other.find_k_nearest(s, k, kb));
+      for (size_t j = 0; j != n; ++j)
+        assert(ka[j].second == kb[j].second);
+      n = tree.find_k_nearest_if(s, k, ka, max * 4, above_plane());
+      assert(n == other.find_k_nearest_if(s, k, kb, max * 4, above_plane()));
+      for (size_t j = 0; j != n; ++j)
+        {
+          assert(ka[j].second == kb[j].second);
+          assert(above_plane()(*kb[j].first));
+        }
+
+      double const range = q % 20;
+      assert(tree.count_within_range(s, range)
+             == other.count_within_range(s, range));
+      std::vector<point> found_a, found_b;
+      tree.find_within_range(s, range, std::back_inserter(found_a));
+      other.find_within_range(s, range, std::back_inserter(found_b));
+      std::sort(found_a.begin(), found_a.end());
+      std::sort(found_b.begin(), found_b.end());
+      assert(found_a == found_b);
+    }
+}
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
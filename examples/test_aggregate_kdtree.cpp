@@ -0,0 +1,168 @@
+// Checks that AggregateKDTree::aggregate_within_range() agrees with
+// aggregating the values within the region one by one, for sum, min/max
+// and mean aggregates, through inserts, erases, rebalancing and optimise().
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/aggregate_kdtree.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <utility>
+#include <vector>
+
+struct point
+{
+  typedef double value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[2];
+  long weight;
+  int id;
+};
+
+inline bool operator==(point const& a, point const& b) { return a.id == b.id; }
+
+struct weight_sum
+{
+  typedef long result_type;
+  result_type identity() const { return 0; }
+  result_type lift(point const& p) const { return p.weight; }
+  result_type combine(result_type a, result_type b) const { return a + b; }
+};
+
+// smallest and largest weight
+struct weight_bounds
+{
+  typedef std::pair<long, long> result_type;
+  result_type identity() const
+  {
+    return result_type(std::numeric_limits<long>::max(),
+                       std::numeric_limits<long>::min());
+  }
+  result_type lift(point const& p) const { return result_type(p.weight, p.weight); }
+  result_type combine(result_type a, result_type b) const
+  {
+    return result_type(std::min(a.first, b.first), std::max(a.second, b.second));
+  }
+};
+
+// count and sum of the weights, for their mean
+struct weight_mean
+{
+  typedef std::pair<size_t, long> result_type;
+  result_type identity() const { return result_type(0, 0); }
+  result_type lift(point const& p) const { return result_type(1, p.weight); }
+  result_type combine(result_type a, result_type b) const
+  {
+    return result_type(a.first + b.first, a.second + b.second);
+  }
+};
+
+template <class Agg>
+static typename Agg::result_type
+brute_force(std::vector<point> const& points, point const& s, double range)
+{
+  Agg agg;
+  typename Agg::result_type r = agg.identity();
+  for (size_t i = 0; i != points.size(); ++i)
+    if (std::fabs(points[i][0] - s[0]) <= range
+        && std::fabs(points[i][1] - s[1]) <= range)
+      r = agg.combine(r, agg.lift(points[i]));
+  return r;
+}
+
+static point
+random_point(int id)
+{
+  point p;
+  p.d[0] = rand() % 1000;
+  p.d[1] = rand() % 1000;
+  p.weight = rand() % 2001 - 1000;
+  p.id = id;
+  return p;
+}
+
+template <class Tree>
+static void
+check_queries(Tree const& tree, std::vector<point> const& points)
+{
+  typedef typename Tree::aggregate_functor Agg;
+  assert(tree.aggregate() == brute_force<Agg>(points, points[0], 1e9));
+  for (int q = 0; q != 300; ++q)
+    {
+      point const s = random_point(-1);
+      double const range = q % 100 * 5;
+      assert(tree.aggregate_within_range(s, range)
+             == brute_force<Agg>(points, s, range));
+    }
+}
+
+template <class Agg>
+static void
+check_aggregate()
+{
+  typedef KDTree::AggregateKDTree<2, point, Agg> tree_type;
+
+  tree_type empty;
+  assert(empty.aggregate() == Agg().identity());
+  assert(empty.aggregate_within_range(random_point(-1), 10) == Agg().identity());
+
+  std::vector<point> points;
+  for (int i = 0; i != 3000; ++i)
+    points.push_back(random_point(i));
+  tree_type tree(points.begin(), points.end());
+  tree.check_tree();
+  check_queries(tree, points);
+
+  // one by one, through partial rebuilds
+  tree.set_balance_factor(0.6);
+  for (int i = 3000; i != 4000; ++i)
+    {
+      points.push_back(random_point(i));
+      tree.insert(points.back());
+    }
+  for (int i = 0; i != 1500; ++i)
+    {
+      size_t const j = rand() % points.size();
+      tree.erase_exact(points[j]);
+      points.erase(points.begin() + j);
+    }
+  tree.check_tree();
+  check_queries(tree, points);
+
+  tree.optimise();
+  check_queries(tree, points);
+
+  tree_type copy(tree);
+  check_queries(copy, points);
+}
+
+int main()
+{
+  check_aggregate<weight_sum>();
+  check_aggregate<weight_bounds>();
+  check_aggregate<weight_mean>();
+
+  std::cout << "AggregateKDTree agrees with brute force" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
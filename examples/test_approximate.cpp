@@ -0,0 +1,187 @@
+// Checks the approximate nearest neighbour searches: exact without limits,
+// within 1+epsilon of the exact distances, stopping after max checks, and
+// the same in batches.  Reports how many distances they compute and how
+// often they find the exact nearest value.
+//
+// usage: test_approximate [number of points] [number of queries]
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/kdtree.hpp>
+
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+struct point
+{
+  typedef double value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[3];
+};
+
+typedef KDTree::KDTree<3, point, KDTree::_Bracket_accessor<point>,
+                       KDTree::squared_difference_counted<double, double> >
+  counted_tree_type;
+typedef std::pair<counted_tree_type::const_iterator, double> counted_result;
+typedef KDTree::KDTree<3, point> tree_type;
+typedef std::pair<tree_type::const_iterator, double> result_type;
+
+static point
+random_point()
+{
+  point p;
+  for (size_t j = 0; j != 3; ++j)
+    p.d[j] = rand() % 1000 + rand() / double(RAND_MAX);
+  return p;
+}
+
+int main(int argc, char** argv)
+{
+  size_t const n = argc > 1 ? std::atol(argv[1]) : 100000;
+  size_t const queries = argc > 2 ? std::atol(argv[2]) : 2000;
+  size_t const k = 10;
+
+  std::vector<point> points(n);
+  for (size_t i = 0; i != n; ++i)
+    points[i] = random_point();
+  std::vector<point> q(queries);
+  for (size_t i = 0; i != queries; ++i)
+    q[i] = random_point();
+
+  {
+    counted_tree_type tree(points.begin(), points.end());
+    long& count = tree.value_distance().count();
+    std::vector<counted_result> nearest(queries);
+    std::vector<counted_result> k_nearest(queries * k);
+    count = 0;
+    for (size_t i = 0; i != queries; ++i)
+      {
+        nearest[i] = tree.find_nearest(q[i]);
+        tree.find_k_nearest(q[i], k, &k_nearest[i * k]);
+      }
+    std::cout << "exact: " << double(count) / queries
+              << " distances per nearest and " << k << " nearest queries"
+              << std::endl;
+
+    double const epsilons[] = { 0, 0.1, 0.5, 2 };
+    for (size_t e = 0; e != 4; ++e)
+      {
+        KDTree::approximation const approx(epsilons[e]);
+        size_t exact = 0;
+        count = 0;
+        for (size_t i = 0; i != queries; ++i)
+          {
+            counted_result const r = tree.find_nearest(q[i], approx);
+            assert(r.first != tree.end());
+            assert(r.second <= nearest[i].second * (1 + epsilons[e]));
+            exact += r.second == nearest[i].second;
+            counted_result found[k];
+            assert(tree.find_k_nearest(q[i], k, found, approx) == k);
+            for (size_t j = 0; j != k; ++j)
+              {
+                assert(found[j].second
+                       <= k_nearest[i * k + j].second * (1 + epsilons[e]));
+                if (epsilons[e] == 0)
+                  assert(found[j].second == k_nearest[i * k + j].second);
+              }
+          }
+        if (epsilons[e] == 0)
+          assert(exact == queries);
+        std::cout << "epsilon " << epsilons[e] << ": "
+                  << double(count) / queries << " distances, nearest "
+                  << 100.0 * exact / queries << "% exact" << std::endl;
+      }
+
+    size_t const checks[] = { 1, 10, 50, 200 };
+    size_t last_exact = 0;
+    for (size_t c = 0; c != 4; ++c)
+      {
+        KDTree::approximation const approx(0, checks[c]);
+        size_t exact = 0;
+        for (size_t i = 0; i != queries; ++i)
+          {
+            count = 0;
+            counted_result const r = tree.find_nearest(q[i], approx);
+            // each value checked costs 3 distances, each branch set aside 1
+            assert(count <= long(checks[c] * 4));
+            assert(r.second >= nearest[i].second);
+            // the same search as for the nearest one of k
+            counted_result first[1];
+            assert(tree.find_k_nearest(q[i], 1, first, approx) == 1);
+            assert(first[0] == r);
+            exact += r.second == nearest[i].second;
+          }
+        assert(exact >= last_exact);
+        last_exact = exact;
+        std::cout << "at most " << checks[c] << " checks: nearest "
+                  << 100.0 * exact / queries << "% exact" << std::endl;
+      }
+    // with checks to spare, nothing is missed
+    for (size_t i = 0; i != queries; ++i)
+      assert(tree.find_nearest(q[i], KDTree::approximation(0, n + 1)).second
+             == nearest[i].second);
+  }
+
+  {
+    tree_type tree(points.begin(), points.end());
+    KDTree::approximation const approx(0.2, 100);
+    std::vector<result_type> nearest(queries);
+    std::vector<result_type> k_nearest(queries * k);
+    std::vector<size_t> k_counts(queries);
+    for (size_t i = 0; i != queries; ++i)
+      {
+        nearest[i] = tree.find_nearest(q[i], approx);
+        k_counts[i] = tree.find_k_nearest(q[i], k, &k_nearest[i * k], approx);
+      }
+
+    std::vector<result_type> batch(queries);
+    tree.batch_find_nearest(q.begin(), q.end(), batch.begin(), approx);
+    assert(batch == nearest);
+
+    KDTree::thread_pool pool(3);
+    KDTree::query_order const orders[] =
+      { KDTree::given_order, KDTree::hilbert_order };
+    for (size_t o = 0; o != 2; ++o)
+      {
+        std::vector<result_type> batch_nearest(queries);
+        std::vector<result_type> batch_k_nearest(queries * k);
+        std::vector<size_t> batch_k_counts(queries);
+        tree.batch_find_nearest(q.begin(), q.end(), batch_nearest.begin(),
+                                approx, pool, 0, orders[o]);
+        tree.batch_find_k_nearest(q.begin(), q.end(), k, &batch_k_nearest[0],
+                                  batch_k_counts.begin(), approx, pool, 7,
+                                  orders[o]);
+        assert(batch_nearest == nearest);
+        assert(batch_k_nearest == k_nearest);
+        assert(batch_k_counts == k_counts);
+      }
+
+    tree_type empty;
+    result_type found[k];
+    assert(empty.find_nearest(q[0], approx).first == empty.end());
+    assert(empty.find_k_nearest(q[0], k, found, approx) == 0);
+    assert(tree.find_k_nearest(q[0], 0, found, approx) == 0);
+  }
+
+  std::cout << "approximate searches stay within their bounds" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
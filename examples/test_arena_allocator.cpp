@@ -0,0 +1,158 @@
+// Checks that a KDTree allocating its nodes from an arena_allocator behaves
+// like one using std::allocator, that values needing destruction are still
+// destroyed, and compares the time both take to tear down a large tree.
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/kdtree.hpp>
+
+#include <cassert>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+#include "query_oracle.hpp"
+
+// counts the values alive
+struct counted : point
+{
+  static long alive;
+
+  counted(point const& p) : point(p) { ++alive; }
+  counted(counted const& c) : point(c) { ++alive; }
+  ~counted() { --alive; }
+};
+
+long counted::alive = 0;
+
+typedef KDTree::KDTree<3, point, KDTree::_Bracket_accessor<point>,
+                       KDTree::squared_difference<double, double>,
+                       std::less<double>,
+                       KDTree::arena_allocator<KDTree::_Node<point> > >
+  arena_tree_type;
+typedef KDTree::KDTree<3, counted, KDTree::_Bracket_accessor<counted>,
+                       KDTree::squared_difference<double, double>,
+                       std::less<double>,
+                       KDTree::arena_allocator<KDTree::_Node<counted>, 16> >
+  counted_tree_type;
+
+template <class Tree>
+static double
+time_clear(Tree& tree)
+{
+  std::clock_t const start = std::clock();
+  tree.clear();
+  return double(std::clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main()
+{
+  {
+    std::vector<point> points;
+    for (int i = 0; i != 5000; ++i)
+      points.push_back(random_point(i));
+    tree_type tree;
+    arena_tree_type arena_tree;
+    for (int i = 0; i != 5000; ++i)
+      {
+        tree.insert(points[i]);
+        arena_tree.insert(points[i]);
+      }
+    arena_tree.check_tree();
+    check_queries(tree, arena_tree);
+
+    // erased nodes are reused
+    for (int i = 0; i != 2500; ++i)
+      {
+        tree.erase_exact(points[i * 2]);
+        arena_tree.erase_exact(points[i * 2]);
+      }
+    for (int i = 0; i != 2500; ++i)
+      {
+        tree.insert(points[i * 2]);
+        arena_tree.insert(points[i * 2]);
+      }
+    arena_tree.check_tree();
+    check_queries(tree, arena_tree);
+
+    arena_tree_type copy(arena_tree);
+    check_queries(tree, copy);
+    arena_tree.optimise();
+    check_queries(tree, arena_tree);
+
+    arena_tree.clear();
+    assert(arena_tree.empty() && arena_tree.begin() == arena_tree.end());
+    for (int i = 0; i != 5000; ++i)
+      arena_tree.insert(points[i]);
+    check_queries(tree, arena_tree);
+
+    // the arenas change hands along with the nodes
+    arena_tree_type other(points.begin(), points.begin() + 10);
+    other.swap(arena_tree);
+    check_queries(tree, other);
+    assert(arena_tree.size() == 10);
+    arena_tree.clear();
+#if __cplusplus >= 201103L
+    arena_tree_type moved(std::move(other));
+    assert(other.empty());
+    check_queries(tree, moved);
+    other = std::move(moved);
+    check_queries(tree, other);
+    moved.insert(points[0]);
+#endif
+
+    // a tree of one node, whose block is a single slot
+    arena_tree_type one(points.begin(), points.begin() + 1);
+    one.insert(points[1]);
+    one.clear();
+    one.insert(points[2]);
+    assert(one.size() == 1);
+  }
+
+  {
+    counted_tree_type tree;
+    for (int i = 0; i != 1000; ++i)
+      tree.insert(counted(random_point(i)));
+    assert(counted::alive == 1000);
+    for (int i = 0; i != 500; ++i)
+      tree.erase(*tree.begin());
+    assert(counted::alive == 500);
+    tree.clear();
+    assert(counted::alive == 0);
+  }
+  assert(counted::alive == 0);
+
+  {
+    size_t const n = 1000000;
+    tree_type tree;
+    arena_tree_type arena_tree;
+    for (size_t i = 0; i != n; ++i)
+      {
+        point const p = random_point(int(i));
+        tree.insert(p);
+        arena_tree.insert(p);
+      }
+    double const arena_time = time_clear(arena_tree);
+    std::cout << "clear() of " << n << " nodes: std::allocator "
+              << time_clear(tree) << "s, arena_allocator "
+              << arena_time << "s" << std::endl;
+  }
+
+  std::cout << "arena_allocator works with KDTree" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
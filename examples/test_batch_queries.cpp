@@ -0,0 +1,152 @@
+// Runs the same queries one at a time, interleaved, and in batches on 1 to
+// N threads, checks that the batches give the same results and reports how
+// their throughput scales.
+//
+// usage: test_batch_queries [number of points] [max number of threads]
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/kdtree.hpp>
+
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct point
+{
+  typedef double value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[3];
+};
+
+typedef KDTree::KDTree<3, point> tree_type;
+typedef std::pair<tree_type::const_iterator, double> result_type;
+
+template <class Run>
+static double
+time_run(Run run)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  run();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static point
+random_point()
+{
+  point p;
+  for (size_t j = 0; j != 3; ++j)
+    p.d[j] = rand() % 1000 + rand() / double(RAND_MAX);
+  return p;
+}
+
+int main(int argc, char** argv)
+{
+  size_t const n = argc > 1 ? std::atol(argv[1]) : 200000;
+  size_t max_threads = argc > 2 ? std::atol(argv[2]) : std::thread::hardware_concurrency();
+  if (max_threads < 4)
+    max_threads = 4; // always check that concurrent batches agree
+
+  std::vector<point> points(n);
+  for (size_t i = 0; i != n; ++i)
+    points[i] = random_point();
+  tree_type tree(points.begin(), points.end());
+
+  size_t const queries = n / 2;
+  size_t const k = 5;
+  double const range = 20;
+  std::vector<point> q(queries);
+  for (size_t i = 0; i != queries; ++i)
+    q[i] = random_point();
+
+  std::vector<result_type> nearest(queries);
+  std::vector<result_type> k_nearest(queries * k);
+  std::vector<size_t> k_counts(queries), counts(queries);
+  double const serial_time = time_run([&]()
+    {
+      for (size_t i = 0; i != queries; ++i)
+        {
+          nearest[i] = tree.find_nearest(q[i]);
+          k_counts[i] = tree.find_k_nearest(q[i], k, &k_nearest[i * k]);
+          counts[i] = tree.count_within_range(q[i], range);
+        }
+    });
+  std::cout << "serial queries on " << n << " points: " << serial_time << "s"
+            << std::endl;
+
+  {
+    std::vector<result_type> interleaved(queries);
+    double const serial_nearest = time_run([&]()
+      {
+        for (size_t i = 0; i != queries; ++i)
+          interleaved[i] = tree.find_nearest(q[i]);
+      });
+    double const t = time_run([&]()
+      { tree.batch_find_nearest(q.begin(), q.end(), interleaved.begin(), 16); });
+    assert(interleaved == nearest);
+    // the batch interleaves only if the tree outgrows the caches
+    double const chosen = time_run([&]()
+      { tree.batch_find_nearest(q.begin(), q.end(), interleaved.begin()); });
+    assert(interleaved == nearest);
+    std::cout << "find_nearest(): one at a time " << serial_nearest
+              << "s, interleaved " << t << "s, batch " << chosen << "s"
+              << std::endl;
+  }
+
+  for (size_t threads = 1; threads <= max_threads; ++threads)
+    {
+      KDTree::thread_pool pool(threads);
+      std::vector<result_type> batch_nearest(queries);
+      std::vector<result_type> batch_k_nearest(queries * k);
+      std::vector<size_t> batch_k_counts(queries), batch_counts(queries);
+      double const t = time_run([&]()
+        {
+          tree.batch_find_nearest(q.begin(), q.end(), batch_nearest.begin(), pool);
+          tree.batch_find_k_nearest(q.begin(), q.end(), k, &batch_k_nearest[0],
+                                    batch_k_counts.begin(), pool);
+          tree.batch_count_within_range(q.begin(), q.end(), range,
+                                        batch_counts.begin(), pool);
+        });
+      assert(batch_nearest == nearest);
+      assert(batch_k_nearest == k_nearest);
+      assert(batch_k_counts == k_counts && batch_counts == counts);
+      std::cout << threads << " thread(s): " << t << "s, speedup "
+                << serial_time / t << std::endl;
+    }
+
+  {
+    // chunks of one, and chunks longer than the batch
+    KDTree::thread_pool pool(3);
+    std::vector<size_t> batch_counts(queries);
+    tree.batch_count_within_range(q.begin(), q.begin() + 100, range,
+                                  batch_counts.begin(), pool, 1);
+    tree.batch_count_within_range(q.begin() + 100, q.end(), range,
+                                  batch_counts.begin() + 100, pool, queries);
+    assert(batch_counts == counts);
+    tree.batch_count_within_range(q.begin(), q.begin(), range,
+                                  batch_counts.begin(), pool);
+  }
+
+  std::cout << "batch queries agree with single queries" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
@@ -0,0 +1,281 @@
+// Checks that a DynamicKDTree answers every query like a linear scan, for
+// numbers of dimensions from 1 to 32, built balanced or by insertion, and
+// compares its query times to those of the KDTree of the same number of
+// dimensions.
+//
+// usage: test_dynamic_kdtree [number of points] [number of queries]
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/dynamic_kdtree.hpp>
+#include <kdtree++/kdtree.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+typedef KDTree::DynamicKDTree<double> tree_type;
+typedef std::pair<tree_type::const_iterator, double> result_type;
+
+template <size_t K>
+struct point
+{
+  typedef double value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[K];
+};
+
+// Coordinates of n random rows of k dimensions.  With a small side, many
+// coordinates, and some rows, are equal.
+static std::vector<double>
+random_rows(size_t const n, size_t const k, int const side)
+{
+  std::vector<double> c(n * k);
+  for (size_t i = 0; i != c.size(); ++i)
+    c[i] = side < 100 ? rand() % side : rand() % side + rand() / double(RAND_MAX);
+  return c;
+}
+
+static double
+distance(double const* a, double const* b, size_t const k)
+{
+  double d = 0;
+  for (size_t i = 0; i != k; ++i)
+    d += (a[i] - b[i]) * (a[i] - b[i]);
+  return std::sqrt(d);
+}
+
+struct not_row
+{
+  not_row(double const* r) : row(r) {}
+  bool operator()(double const* r) const { return r != row; }
+  double const* row;
+};
+
+struct sum_first
+{
+  sum_first() : sum(0) {}
+  void operator()(double const* r) { sum += r[0]; }
+  double sum;
+};
+
+// Checks the queries of tree, whose rows are the n rows of coords in the
+// order of their ids, at q.
+static void
+check(tree_type const& tree, std::vector<double> const& coords,
+      double const* q, double const range)
+{
+  size_t const k = tree.dimensions();
+  size_t const n = coords.size() / k;
+  std::vector<double> d(n);
+  size_t within = 0;
+  double sum = 0;
+  for (size_t i = 0; i != n; ++i)
+    {
+      d[i] = distance(&coords[i * k], q, k);
+      bool inside = true;
+      for (size_t j = 0; j != k; ++j)
+        inside = inside && std::fabs(coords[i * k + j] - q[j]) <= range;
+      within += inside;
+      sum += inside ? coords[i * k] : 0;
+    }
+  std::vector<double> sorted(d);
+  std::sort(sorted.begin(), sorted.end());
+
+  result_type const nearest = tree.find_nearest(q);
+  assert(nearest.second == sorted[0]);
+  assert(distance(*nearest.first, q, k) == nearest.second);
+
+  // the nearest row but the one found
+  result_type const other
+    = tree.find_nearest_if(q, 1e9, not_row(*nearest.first));
+  assert(other.first != nearest.first && other.second == sorted[1]);
+
+  result_type found[10];
+  size_t const count = tree.find_k_nearest(q, 10, found);
+  assert(count == std::min(size_t(10), n));
+  for (size_t i = 0; i != count; ++i)
+    {
+      assert(found[i].second == sorted[i]);
+      size_t const id = tree.id(*found[i].first);
+      assert(id < n && d[id] == found[i].second);
+      assert(std::equal(&coords[id * k], &coords[id * k] + k,
+                        *found[i].first));
+    }
+
+  assert(tree.count_within_range(q, range) == within);
+  std::vector<double const*> rows;
+  tree.find_within_range(q, range, std::back_inserter(rows));
+  assert(rows.size() == within);
+  // summed in another order
+  assert(std::fabs(tree.visit_within_range(q, range, sum_first()).sum - sum)
+         <= 1e-9 * sum);
+
+  assert(tree.find(&coords[(rand() % n) * k]) != tree.end());
+}
+
+template <size_t K>
+static double
+time_queries(KDTree::KDTree<K, point<K> > const& tree,
+             std::vector<point<K> > const& queries)
+{
+  std::clock_t start = std::clock();
+  double sum = 0;
+  for (size_t i = 0; i != queries.size(); ++i)
+    sum += tree.find_nearest(queries[i]).second;
+  assert(sum >= 0);
+  return double(std::clock() - start) / CLOCKS_PER_SEC;
+}
+
+template <size_t K>
+static double
+time_queries(tree_type const& tree, std::vector<point<K> > const& queries)
+{
+  std::clock_t start = std::clock();
+  double sum = 0;
+  for (size_t i = 0; i != queries.size(); ++i)
+    sum += tree.find_nearest(queries[i].d).second;
+  assert(sum >= 0);
+  return double(std::clock() - start) / CLOCKS_PER_SEC;
+}
+
+// Times the nearest neighbour searches of a KDTree<K> and of a
+// DynamicKDTree of K dimensions, on the same points, and checks that they
+// find the same distances.
+template <size_t K>
+static void
+compare(size_t const n, size_t const queries)
+{
+  std::vector<double> const coords = random_rows(n, K, 1000);
+  std::vector<point<K> > points(n);
+  for (size_t i = 0; i != n; ++i)
+    std::copy(&coords[i * K], &coords[i * K] + K, points[i].d);
+  std::vector<double> const q = random_rows(queries, K, 1000);
+  std::vector<point<K> > qs(queries);
+  for (size_t i = 0; i != queries; ++i)
+    std::copy(&q[i * K], &q[i * K] + K, qs[i].d);
+
+  KDTree::KDTree<K, point<K> > templated(points.begin(), points.end());
+  tree_type dynamic(K, coords.begin(), coords.end());
+  for (size_t i = 0; i < queries; i += 97)
+    assert(templated.find_nearest(qs[i]).second
+           == dynamic.find_nearest(qs[i].d).second);
+
+  double const t = time_queries(templated, qs);
+  double const d = time_queries<K>(dynamic, qs);
+  std::cout << K << " dimensions: KDTree " << t << "s, DynamicKDTree " << d
+            << "s, " << d / t << " times as long" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  size_t const n = argc > 1 ? std::atol(argv[1]) : 100000;
+  size_t const queries = argc > 2 ? std::atol(argv[2]) : 10000;
+
+  {
+    tree_type empty(4);
+    double const q[4] = { 1, 2, 3, 4 };
+    assert(empty.empty() && empty.begin() == empty.end());
+    assert(empty.find_nearest(q).first == empty.end());
+    assert(empty.find(q) == empty.end());
+    assert(empty.count_within_range(q, 10) == 0);
+    result_type found[1];
+    assert(empty.find_k_nearest(q, 1, found) == 0);
+
+    // neither the range constructor nor optimise() has a median to build
+    empty.optimise();
+    assert(empty.empty() && empty.find_nearest(q).first == empty.end());
+    tree_type none(4, q, q);
+    assert(none.empty() && none.find_nearest(q).first == none.end());
+    none.insert(q, q + 4);
+    assert(none.size() == 1 && none.find_nearest(q).second == 0);
+  }
+
+  size_t const dims[] = { 1, 2, 3, 7, 16, 32 };
+  for (size_t t = 0; t != sizeof(dims) / sizeof(dims[0]); ++t)
+    {
+      size_t const k = dims[t];
+      for (int side = 10; side <= 1000; side *= 100)
+        {
+          std::vector<double> const coords = random_rows(2000, k, side);
+          std::vector<double> const q = random_rows(50, k, side);
+          double const range = side / 4.0;
+
+          tree_type balanced(k, coords.begin(), coords.end());
+          assert(balanced.size() == 2000 && balanced.dimensions() == k);
+          tree_type inserted(k);
+          for (size_t i = 0; i != 2000; ++i)
+            {
+              tree_type::const_iterator const it = inserted.insert(&coords[i * k]);
+              assert(it - inserted.begin() == std::ptrdiff_t(i)
+                     && inserted.id(*it) == i);
+            }
+          // a row of the tree itself, and its copy
+          inserted.insert(*inserted.begin());
+          std::vector<double> const more(inserted.begin()[0],
+                                         inserted.begin()[0] + k);
+          std::vector<double> all(coords);
+          all.insert(all.end(), more.begin(), more.end());
+          assert(std::equal(all.begin(), all.end(), *inserted.begin()));
+
+          for (size_t i = 0; i != 50; ++i)
+            {
+              check(balanced, coords, &q[i * k], range);
+              check(inserted, all, &q[i * k], range);
+            }
+          inserted.optimise();
+          tree_type copy(inserted);
+          copy.insert(q.begin(), q.end());
+          all.insert(all.end(), q.begin(), q.end());
+          for (size_t i = 0; i != 50; ++i)
+            {
+              check(inserted, std::vector<double>(all.begin(),
+                                                  all.end() - q.size()),
+                    &q[i * k], range);
+              check(copy, all, &q[i * k], range);
+            }
+        }
+    }
+  {
+    // any value with an operator[] will do
+    tree_type tree(3);
+    std::vector<double> v(3, 1.0);
+    tree.insert(v);
+    v[2] = 2.0;
+    tree.insert(v);
+    assert(tree.find_nearest(v).second == 0);
+    assert(tree.find(v) == tree.begin() + 1);
+    point<3> const p = { { 1, 1, 1 } };
+    assert(tree.count_within_range(p, 0.5) == 1);
+  }
+  std::cout << "dynamic trees agree with a linear scan" << std::endl;
+
+  // uniform points in many dimensions are about the worst case for a
+  // kd-tree, with every search close to a linear scan
+  compare<3>(n, queries);
+  compare<8>(n, queries / 4);
+  compare<16>(n, queries / 64);
+  compare<32>(n, queries / 64);
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
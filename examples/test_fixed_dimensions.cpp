@@ -0,0 +1,144 @@
+// Checks the searches of trees of 2, 3, 4 and 5 dimensions, whose distance
+// and region loops are unrolled at compile time up to 4 dimensions,
+// against a linear scan, and reports their query times.
+//
+// usage: test_fixed_dimensions [number of points] [number of queries]
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/kdtree.hpp>
+
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+template <size_t K>
+struct point
+{
+  typedef double value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[K];
+};
+
+template <size_t K>
+static point<K>
+random_point()
+{
+  point<K> p;
+  for (size_t i = 0; i != K; ++i)
+    p.d[i] = rand() % 1000 + rand() / double(RAND_MAX);
+  return p;
+}
+
+static double
+seconds_since(std::clock_t const start)
+{
+  return double(std::clock() - start) / CLOCKS_PER_SEC;
+}
+
+template <size_t K>
+static void
+check(size_t const n, size_t const queries)
+{
+  typedef KDTree::KDTree<K, point<K> > tree_type;
+  typedef std::pair<typename tree_type::const_iterator, double> result_type;
+
+  std::vector<point<K> > points(n);
+  for (size_t i = 0; i != n; ++i)
+    points[i] = random_point<K>();
+  std::vector<point<K> > q(queries);
+  for (size_t i = 0; i != queries; ++i)
+    q[i] = random_point<K>();
+  tree_type tree(points.begin(), points.end());
+  tree_type inserted;
+  for (size_t i = 0; i != n; ++i)
+    inserted.insert(points[i]);
+  KDTree::squared_difference<double, double> dist;
+  KDTree::_Bracket_accessor<point<K> > acc;
+
+  for (size_t i = 0; i < queries; i += 101)
+    {
+      double best = -1;
+      size_t within = 0;
+      for (size_t j = 0; j != n; ++j)
+        {
+          double const d
+            = KDTree::_S_accumulate_node_distance(K, dist, acc, points[j], q[i]);
+          assert(d == KDTree::_S_accumulate_node_distance<K>(dist, acc,
+                                                             points[j], q[i]));
+          if (best < 0 || d < best)
+            best = d;
+          bool inside = true;
+          for (size_t k = 0; k != K; ++k)
+            inside = inside && std::fabs(points[j][k] - q[i][k]) <= 50;
+          within += inside;
+        }
+      assert(tree.find_nearest_squared(q[i]).second == best);
+      assert(inserted.find_nearest_squared(q[i]).second == best);
+      assert(tree.count_within_range(q[i], 50) == within);
+      assert(inserted.count_within_range(q[i], 50) == within);
+    }
+
+  std::clock_t start = std::clock();
+  double sum = 0;
+  for (size_t i = 0; i != queries; ++i)
+    sum += tree.find_nearest(q[i]).second;
+  double const nearest = seconds_since(start);
+
+  start = std::clock();
+  typename tree_type::nearest_cursor cursor;
+  for (size_t i = 0; i != queries; ++i)
+    sum -= tree.find_nearest(q[i], cursor).second;
+  double const from_cursor = seconds_since(start);
+  assert(std::fabs(sum) < 1e-6 * queries);
+
+  start = std::clock();
+  result_type found[10];
+  for (size_t i = 0; i != queries; ++i)
+    assert(tree.find_k_nearest(q[i], 10, found) == 10);
+  double const k_nearest = seconds_since(start);
+
+  start = std::clock();
+  size_t count = 0;
+  for (size_t i = 0; i != queries; ++i)
+    count += tree.count_within_range(q[i], 20);
+  double const range = seconds_since(start);
+  assert(count < n * queries);
+
+  std::cout << K << " dimensions, " << queries << " queries: find_nearest "
+            << nearest << "s, from a cursor " << from_cursor
+            << "s, find_k_nearest " << k_nearest << "s, count_within_range "
+            << range << "s" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  size_t const n = argc > 1 ? std::atol(argv[1]) : 200000;
+  size_t const queries = argc > 2 ? std::atol(argv[2]) : 200000;
+
+  check<2>(n, queries);
+  check<3>(n, queries);
+  check<4>(n, queries);
+  check<5>(n, queries);
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
@@ -0,0 +1,213 @@
+// Checks that a KDForest finds the exact nearest values when its search is
+// not limited, and compares the recall and the time of its searches, with
+// a budget of checks, to those of a single tree and of a linear scan, on
+// 64-dimensional values that spread over a few directions, like
+// embeddings do.
+//
+// usage: test_kdforest [number of points] [number of queries]
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/kdforest.hpp>
+
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <utility>
+#include <vector>
+
+size_t const dims = 64;
+size_t const latent = 20;
+
+struct point
+{
+  typedef float value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[dims];
+};
+
+typedef KDTree::KDForest<dims, point> forest_type;
+typedef KDTree::KDTree<dims, point> tree_type;
+typedef std::pair<forest_type::const_iterator, forest_type::distance_type>
+  result_type;
+
+static double
+distance(point const& a, point const& b)
+{
+  double d = 0;
+  for (size_t j = 0; j != dims; ++j)
+    d += (a.d[j] - b.d[j]) * (a.d[j] - b.d[j]);
+  return d;
+}
+
+// Points near a random 10-dimensional subspace, in 20 clusters.
+struct generator
+{
+  generator()
+    : random(42), normal(0, 1)
+  {
+    for (size_t j = 0; j != dims * latent; ++j)
+      basis[j] = normal(random);
+    for (size_t c = 0; c != 20; ++c)
+      for (size_t i = 0; i != latent; ++i)
+        centers[c][i] = normal(random) * 4;
+  }
+
+  point
+  operator()()
+  {
+    double z[latent];
+    size_t const c = random() % 20;
+    for (size_t i = 0; i != latent; ++i)
+      z[i] = centers[c][i] + normal(random);
+    point p;
+    for (size_t j = 0; j != dims; ++j)
+      {
+        double x = normal(random) * 0.1;
+        for (size_t i = 0; i != latent; ++i)
+          x += basis[j * latent + i] * z[i];
+        p.d[j] = float(x);
+      }
+    return p;
+  }
+
+  std::mt19937 random;
+  std::normal_distribution<double> normal;
+  double basis[dims * latent];
+  double centers[20][latent];
+};
+
+template <class Run>
+static double
+time_run(Run run)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  run();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+  size_t const n = argc > 1 ? std::atol(argv[1]) : 50000;
+  size_t const queries = argc > 2 ? std::atol(argv[2]) : 200;
+
+  generator next;
+  std::vector<point> points(n);
+  for (size_t i = 0; i != n; ++i)
+    points[i] = next();
+  std::vector<point> q(queries);
+  for (size_t i = 0; i != queries; ++i)
+    q[i] = next();
+
+  std::vector<double> exact(queries);
+  double const scan_time = time_run([&]()
+    {
+      for (size_t i = 0; i != queries; ++i)
+        {
+          double best = distance(q[i], points[0]);
+          for (size_t j = 1; j != n; ++j)
+            best = std::min(best, distance(q[i], points[j]));
+          exact[i] = std::sqrt(best);
+        }
+    });
+  std::cout << queries << " queries on " << n << " points in " << dims
+            << " dimensions, linear scan: " << scan_time << "s" << std::endl;
+
+  tree_type tree(points.begin(), points.end());
+  double const tree_time = time_run([&]()
+    {
+      for (size_t i = 0; i != queries; ++i)
+        assert(std::abs(tree.find_nearest(q[i]).second - exact[i])
+               <= 1e-6 * exact[i]);
+    });
+  std::cout << "one tree, exact: " << tree_time << "s" << std::endl;
+
+  KDTree::thread_pool pool(2);
+  forest_type forest(points.begin(), points.end(), 8, 5489u, pool);
+  assert(forest.size() == n && forest.tree_count() == 8);
+  // every tree splits on each dimension once in its first 64 levels
+  for (size_t t = 0; t != forest.tree_count(); ++t)
+    {
+      std::vector<bool> seen(dims);
+      for (size_t depth = 0; depth != dims; ++depth)
+        seen[forest.split_dimension(t, depth)] = true;
+      assert(std::find(seen.begin(), seen.end(), false) == seen.end());
+    }
+
+  // without a budget, the forest is exact
+  for (size_t i = 0; i != 20; ++i)
+    {
+      result_type const r = forest.find_nearest(q[i]);
+      assert(std::abs(r.second - exact[i]) <= 1e-6 * exact[i]);
+      assert(std::abs(std::sqrt(distance(q[i], *r.first)) - r.second)
+             <= 1e-6 * exact[i]);
+    }
+
+  size_t const budgets[] = { 64, 256, 1024, 4096 };
+  for (size_t trees = 1; trees <= 8; trees *= 2)
+    {
+      forest_type const f(points.begin(), points.end(), trees);
+      size_t last_found = 0;
+      for (size_t b = 0; b != 4; ++b)
+        {
+          KDTree::approximation const approx(0, budgets[b]);
+          size_t found = 0;
+          double const t = time_run([&]()
+            {
+              for (size_t i = 0; i != queries; ++i)
+                found += f.find_nearest(q[i], approx).second
+                  <= exact[i] * (1 + 1e-6);
+            });
+          assert(found >= last_found);
+          last_found = found;
+          std::cout << trees << " tree(s), " << budgets[b] << " checks: "
+                    << 100.0 * found / queries << "% recall, " << t << "s, "
+                    << scan_time / t << " times faster than the scan"
+                    << std::endl;
+        }
+    }
+
+  {
+    // k nearest, each value once, even when found in every tree
+    result_type k_nearest[10];
+    assert(forest.find_k_nearest(q[0], 10, k_nearest) == 10);
+    for (size_t j = 1; j != 10; ++j)
+      {
+        assert(k_nearest[j - 1].second <= k_nearest[j].second);
+        for (size_t l = 0; l != j; ++l)
+          assert(k_nearest[l].first != k_nearest[j].first);
+      }
+    assert(std::abs(k_nearest[0].second - exact[0]) <= 1e-6 * exact[0]);
+
+    std::vector<point> two(2, points[0]);
+    forest_type const duplicates(two.begin(), two.end(), 3);
+    assert(duplicates.find_k_nearest(points[0], 10, k_nearest) == 2);
+    assert(k_nearest[0].second == 0 && k_nearest[1].second == 0);
+
+    forest_type const empty(points.begin(), points.begin());
+    assert(empty.find_nearest(q[0]).first == empty.end());
+    assert(empty.find_k_nearest(q[0], 10, k_nearest) == 0);
+  }
+
+  std::cout << "forest searches agree with a linear scan" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
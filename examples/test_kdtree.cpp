@@ -5,12 +5,17 @@
 
 #include <kdtree++/kdtree.hpp>
 
+#include <algorithm>
 #include <deque>
 #include <iostream>
 #include <vector>
 #include <limits>
 #include <functional>
 #include <set>
+#include <cstdlib>
+#if __cplusplus >= 201103L
+#  include <type_traits>
+#endif
 
 // used to ensure all triplets that are accessed via the operator<< are initialised.
 std::set<const void*> registered;
@@ -118,6 +123,118 @@ struct FalsePredicate
    bool operator()( triplet const& t ) const { return false; }
 };
 
+// integer coordinates, whose distances are integers too
+struct int_point
+{
+  typedef int value_type;
+
+  int_point(value_type a, value_type b)
+  {
+    d[0] = a;
+    d[1] = b;
+  }
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[2];
+};
+
+#if __cplusplus >= 201103L
+// counts its copies, but may be moved freely
+struct payload
+{
+  typedef double value_type;
+
+  static int copies;
+
+  payload(double x, double y, double z) : d(new double[3])
+  { d[0] = x; d[1] = y; d[2] = z; }
+  payload(payload const& x) : d(new double[3])
+  { std::copy(x.d, x.d + 3, d); ++copies; }
+  payload(payload&& x) noexcept : d(x.d) { x.d = NULL; }
+  ~payload() { delete[] d; }
+
+  payload& operator=(payload const& x)
+  { std::copy(x.d, x.d + 3, d); ++copies; return *this; }
+  payload& operator=(payload&& x) noexcept
+  { std::swap(d, x.d); return *this; }
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  double* d;
+};
+
+int payload::copies = 0;
+
+// counts its copies, which may throw, but is moved without throwing
+struct payload_accessor
+{
+  typedef double result_type;
+
+  static int copies;
+
+  payload_accessor() {}
+  payload_accessor(payload_accessor const&) { ++copies; }
+  payload_accessor(payload_accessor&&) noexcept {}
+  payload_accessor& operator=(payload_accessor const&)
+  { ++copies; return *this; }
+  payload_accessor& operator=(payload_accessor&&) noexcept { return *this; }
+
+  double operator()(payload const& p, size_t const k) const { return p[k]; }
+};
+
+int payload_accessor::copies = 0;
+
+// the same, but whose moves may throw
+struct throwing_accessor : payload_accessor
+{
+  throwing_accessor() {}
+  throwing_accessor(throwing_accessor const& x) : payload_accessor(x) {}
+  throwing_accessor& operator=(throwing_accessor const& x)
+  { payload_accessor::operator=(x); return *this; }
+};
+
+inline bool operator==(payload const& A, payload const& B) {
+  return std::equal(A.d, A.d + 3, B.d);
+}
+#endif
+
+// the number of nodes on the longest path from the root
+size_t depth(tree_type const& tree)
+{
+   size_t deepest = 0;
+   for (tree_type::const_iterator i = tree.begin(); i != tree.end(); ++i)
+   {
+      size_t d = 0;
+      for (KDTree::_Node_base const* n = i.get_raw_node(); n != tree.end().get_raw_node(); n = n->_M_parent)
+         ++d;
+      deepest = std::max(deepest, d);
+   }
+   return deepest;
+}
+
+// whether both trees hold the same values in the same places: the depths
+// of the values in order determine the shape of the tree.
+bool same_shape(tree_type const& a, tree_type const& b)
+{
+   tree_type::const_iterator i = a.begin(), j = b.begin();
+   for (; i != a.end() && j != b.end(); ++i, ++j)
+   {
+      if (!(*i == *j))
+         return false;
+      KDTree::_Node_base const* n = i.get_raw_node();
+      KDTree::_Node_base const* m = j.get_raw_node();
+      while (n != a.end().get_raw_node() && m != b.end().get_raw_node())
+      {
+         n = n->_M_parent;
+         m = m->_M_parent;
+      }
+      if (n != a.end().get_raw_node() || m != b.end().get_raw_node())
+         return false;
+   }
+   return i == a.end() && j == b.end();
+}
+
 int main()
 {
    // check that it'll find nodes exactly MAX away
@@ -407,6 +524,438 @@ int main()
   }
 
 
+  // Bulk construction links the medians directly into one block of nodes.
+  // Check the result is a valid tree, and that erasing nodes from the block
+  // and inserting new ones (which reuse the erased slots) keeps it valid.
+  {
+     std::vector<triplet> points;
+     for (int i = 0; i != 1000; ++i)
+        points.push_back(triplet(rand() % 50, rand() % 50, rand() % 50));
+
+     tree_type tree(points.begin(), points.end(), std::ptr_fun(tac));
+     assert(tree.size() == points.size());
+     assert(size_t(std::distance(tree.begin(), tree.end())) == points.size());
+     tree.check_tree();
+
+     for (int i = 0; i != 100; ++i)
+     {
+        triplet s(rand() % 50, rand() % 50, rand() % 50);
+        double best = std::numeric_limits<double>::max();
+        for (std::vector<triplet>::const_iterator p = points.begin(); p != points.end(); ++p)
+           best = std::min(best, s.distance_to(*p));
+        std::pair<tree_type::const_iterator,double> found = tree.find_nearest(s);
+        assert(found.first != tree.end());
+        assert(fabs(found.second - best) < 1e-9);
+     }
+
+     for (int i = 0; i != 500; ++i)
+        tree.erase(points[i]);
+     for (int i = 0; i != 500; ++i)
+        tree.insert(points[i]);
+     assert(tree.size() == points.size());
+     tree.check_tree();
+
+     tree_type copy(tree);
+     copy.check_tree();
+     assert(copy.size() == tree.size());
+     tree.optimise();
+     tree.check_tree();
+     assert(size_t(std::distance(tree.rbegin(), tree.rend())) == points.size());
+
+     std::cout << "Test bulk construction of " << points.size() << " nodes passed" << std::endl;
+  }
+
+  // find_k_nearest() finds the same distances as sorting all the values.
+  {
+     std::vector<triplet> points;
+     for (int i = 0; i != 2000; ++i)
+        points.push_back(triplet(rand() % 50, rand() % 50, rand() % 50));
+     tree_type tree(points.begin(), points.end(), std::ptr_fun(tac));
+
+     std::pair<tree_type::const_iterator,double> found[20];
+     for (int i = 0; i != 200; ++i)
+     {
+        triplet s(rand() % 50, rand() % 50, rand() % 50);
+        std::vector<double> all, matching;
+        for (std::vector<triplet>::const_iterator p = points.begin(); p != points.end(); ++p)
+        {
+           all.push_back(s.distance_to(*p));
+           if (Predicate()(*p))
+              matching.push_back(s.distance_to(*p));
+        }
+        std::sort(all.begin(), all.end());
+        std::sort(matching.begin(), matching.end());
+
+        size_t const k = i % 20 + 1;
+        size_t n = tree.find_k_nearest(s, k, found);
+        assert(n == k);
+        for (size_t j = 0; j != n; ++j)
+        {
+           assert(found[j].second == all[j]);
+           assert(s.distance_to(*found[j].first) == found[j].second);
+        }
+
+        double const max = i % 7;
+        n = tree.find_k_nearest(s, k, found, max);
+        size_t const within = std::upper_bound(all.begin(), all.end(), max) - all.begin();
+        assert(n == std::min(k, within));
+        for (size_t j = 0; j != n; ++j)
+           assert(found[j].second == all[j]);
+
+        n = tree.find_k_nearest_if(s, k, found, max * 2, Predicate());
+        size_t const matching_within
+           = std::upper_bound(matching.begin(), matching.end(), max * 2) - matching.begin();
+        assert(n == std::min(k, matching_within));
+        for (size_t j = 0; j != n; ++j)
+        {
+           assert(found[j].second == matching[j]);
+           assert(Predicate()(*found[j].first));
+        }
+     }
+
+     // find_nearest_if() and the squared variants against the same lists
+     for (int i = 0; i != 200; ++i)
+     {
+        triplet s(rand() % 50, rand() % 50, rand() % 50);
+        double best = std::numeric_limits<double>::max();
+        double best_matching = best;
+        for (std::vector<triplet>::const_iterator p = points.begin(); p != points.end(); ++p)
+        {
+           double const d = s.distance_to(*p);
+           best = std::min(best, d);
+           if (Predicate()(*p))
+              best_matching = std::min(best_matching, d);
+        }
+        std::pair<tree_type::const_iterator,double> nearest
+           = tree.find_nearest_if(s, std::numeric_limits<double>::max(), Predicate());
+        assert(nearest.first != tree.end() && Predicate()(*nearest.first));
+        assert(nearest.second == best_matching);
+
+        nearest = tree.find_nearest_squared(s);
+        assert(std::sqrt(nearest.second) == best);
+        double const squared = nearest.second;
+        nearest = tree.find_nearest_squared(s, squared);
+        assert(nearest.first != tree.end() && nearest.second == squared);
+        if (squared > 0)
+        {
+           nearest = tree.find_nearest_squared(s, squared / 2);
+           assert(nearest.first == tree.end() && nearest.second == squared / 2);
+        }
+        nearest = tree.find_nearest_squared_if(s, std::numeric_limits<double>::max(), Predicate());
+        assert(std::sqrt(nearest.second) == best_matching);
+     }
+
+     tree_type empty(std::ptr_fun(tac));
+     assert(empty.find_k_nearest(points[0], 5, found) == 0);
+     assert(empty.find_nearest_squared(points[0]).second == 0);
+     assert(tree.find_k_nearest(points[0], 0, found) == 0);
+
+     // interleaved searches find the very same nodes, ties included
+     std::vector<triplet> queries;
+     for (int i = 0; i != 100; ++i)
+        queries.push_back(triplet(rand() % 50, rand() % 50, rand() % 50));
+     // whatever their number, and one after the other with width 1
+     std::vector<std::pair<tree_type::const_iterator,double> > batch(queries.size());
+     size_t const widths[] = { 0, 1, 3, 16, 100 };
+     for (size_t w = 0; w != sizeof(widths) / sizeof(widths[0]); ++w)
+     {
+        tree.batch_find_nearest(queries.begin(), queries.end(), batch.begin(),
+                                widths[w]);
+        for (size_t i = 0; i != queries.size(); ++i)
+           assert(batch[i] == tree.find_nearest(queries[i]));
+     }
+     empty.batch_find_nearest(queries.begin(), queries.begin() + 3, batch.begin());
+     assert(batch[2].first == empty.end() && batch[2].second == 0);
+
+     std::cout << "Test find_k_nearest() and find_nearest_squared() passed" << std::endl;
+  }
+
+  {
+     // With integer distances, the square roots returned are rounded down,
+     // and a value is within __max when its rounded distance is, whatever
+     // the int __max.
+     typedef KDTree::KDTree<2, int_point> int_tree_type;
+     int_tree_type tree;
+     tree.insert(int_point(1, 1)); // at sqrt(2) of the origin
+     tree.insert(int_point(3, 4)); // at 5
+     tree.insert(int_point(5, 3)); // at sqrt(34)
+     tree.insert(int_point(6, 0)); // at 6
+     int_point const origin(0, 0);
+     int const top = std::numeric_limits<int>::max();
+
+     std::pair<int_tree_type::const_iterator, int> nearest
+        = tree.find_nearest(origin, top);
+     assert(nearest.first != tree.end() && nearest.second == 1);
+     nearest = tree.find_nearest(origin, 1);
+     assert(nearest.first != tree.end() && nearest.second == 1);
+     nearest = tree.find_nearest(origin, 0);
+     assert(nearest.first == tree.end() && nearest.second == 0);
+     nearest = tree.find_nearest(int_point(-30000, 0), top);
+     assert(nearest.first != tree.end() && (*nearest.first)[0] == 1);
+
+     std::pair<int_tree_type::const_iterator, int> found[4];
+     assert(tree.find_k_nearest(origin, 4, found, top) == 4);
+     assert(found[0].second == 1 && found[3].second == 6);
+     assert(tree.find_k_nearest(origin, 4, found, 5) == 3);
+     assert(found[1].second == 5 && found[2].second == 5);
+     assert(tree.find_k_nearest(origin, 4, found, 4) == 1);
+     assert(tree.find_k_nearest(origin, 4, found, -1) == 0);
+
+     std::cout << "Test integer distances passed" << std::endl;
+  }
+
+  // Range queries on a degenerate tree: a chain of left children, each with
+  // a right leaf, so that a traversal has one right child pending per level.
+  {
+     tree_type tree(std::ptr_fun(tac));
+     int const n = 1000;
+     for (int i = n; i >= 0; --i)
+     {
+        tree.insert(triplet(i, i, i));
+        if (i != n)
+           tree.insert(triplet(i + 0.5, i + 0.5, i + 0.5));
+     }
+     tree.check_tree();
+
+     std::vector<triplet> found;
+     tree.find_within_range(triplet(n / 2, n / 2, n / 2), n, std::back_inserter(found));
+     assert(found.size() == tree.size());
+     // in pre-order: down the chain, then the right leaves from the bottom up
+     for (int i = 0; i <= n; ++i)
+        assert(found[i][0] == n - i);
+     for (int i = 0; i != n; ++i)
+        assert(found[n + 1 + i][0] == i + 0.5);
+
+     assert(tree.count_within_range(triplet(0, 0, 0), 10) == 21);
+     assert(tree.count_within_range(triplet(n, n, n), 0.25) == 1);
+
+     std::cout << "Test range queries on a degenerate tree passed" << std::endl;
+  }
+
+  // Range queries over regions that hold whole subtrees, on a tree whose
+  // subtree sizes have been kept up by inserts and erases.
+  {
+     std::vector<triplet> points;
+     for (int i = 0; i != 3000; ++i)
+        points.push_back(triplet(rand() % 100, rand() % 100, rand() % 100));
+     tree_type tree(points.begin(), points.begin() + 2000, std::ptr_fun(tac));
+     for (int i = 2000; i != 3000; ++i)
+        tree.insert(points[i]);
+     for (int i = 0; i != 1000; ++i)
+        tree.erase_exact(points[i * 3]);
+     tree.check_tree();
+
+     for (int i = 0; i != 200; ++i)
+     {
+        triplet s(rand() % 100, rand() % 100, rand() % 100);
+        double const range = i % 60;
+        size_t expected = 0;
+        for (tree_type::const_iterator p = tree.begin(); p != tree.end(); ++p)
+           if (fabs((*p)[0] - s[0]) <= range && fabs((*p)[1] - s[1]) <= range
+               && fabs((*p)[2] - s[2]) <= range)
+              ++expected;
+        assert(tree.count_within_range(s, range) == expected);
+        std::vector<triplet> found;
+        tree.find_within_range(s, range, std::back_inserter(found));
+        assert(found.size() == expected);
+        for (size_t j = 0; j != found.size(); ++j)
+           assert(fabs(found[j][0] - s[0]) <= range && fabs(found[j][1] - s[1]) <= range
+                  && fabs(found[j][2] - s[2]) <= range);
+     }
+     assert(tree.count_within_range(triplet(50, 50, 50), 100) == tree.size());
+
+     std::cout << "Test range queries over contained subtrees passed" << std::endl;
+  }
+
+  // With a balance factor, sorted inserts and erasures no longer make a
+  // deep tree.
+  {
+     tree_type tree(std::ptr_fun(tac));
+     double const alpha = 0.7;
+     tree.set_balance_factor(alpha);
+     assert(tree.balance_factor() == alpha);
+     std::vector<triplet> points;
+     for (int i = 0; i != 5000; ++i)
+     {
+        points.push_back(triplet(i, i % 100, -i));
+        tree.insert(points.back());
+     }
+     tree.check_tree();
+     assert(tree.size() == points.size());
+     assert(depth(tree) <= std::log(double(tree.size())) / std::log(1 / alpha) + 1);
+
+     for (int i = 0; i != 4000; ++i)
+        tree.erase_exact(points[i]);
+     points.erase(points.begin(), points.begin() + 4000);
+     tree.check_tree();
+     assert(tree.size() == points.size());
+     assert(depth(tree) <= std::log(double(tree.size())) / std::log(1 / alpha) + 1);
+
+     for (int i = 0; i != 100; ++i)
+     {
+        triplet s(rand() % 5000, rand() % 100, -(rand() % 5000));
+        double best = std::numeric_limits<double>::max();
+        for (std::vector<triplet>::const_iterator p = points.begin(); p != points.end(); ++p)
+           best = std::min(best, s.distance_to(*p));
+        assert(tree.find_nearest(s).second == best);
+        assert(tree.find_exact(points[i * 7]) != tree.end());
+     }
+     assert(size_t(std::distance(tree.begin(), tree.end())) == points.size());
+
+     std::cout << "Test balanced inserts and erasures passed, depth "
+               << depth(tree) << " for " << tree.size() << " nodes" << std::endl;
+  }
+
+  // Copies keep the shape of the tree they copy, unbalanced or not.
+  {
+     std::vector<triplet> points;
+     for (int i = 0; i != 2000; ++i)
+        points.push_back(triplet(i % 50, rand() % 100, i));
+     tree_type tree(std::ptr_fun(tac));
+     for (int i = 0; i != 2000; ++i)
+        tree.insert(points[i]);
+     for (int i = 0; i != 500; ++i)
+        tree.erase_exact(points[i * 4]);
+
+     tree_type copy(tree);
+     assert(copy.size() == tree.size());
+     assert(same_shape(tree, copy));
+     copy.check_tree();
+     assert(*copy.rbegin() == *tree.rbegin());
+
+     tree_type assigned(std::ptr_fun(tac));
+     assigned.insert(points[0]);
+     assigned = tree;
+     assert(same_shape(tree, assigned));
+
+     // the copied nodes can be erased and reused
+     for (int i = 0; i != 500; ++i)
+     {
+        copy.erase_exact(points[i * 4 + 1]);
+        copy.insert(points[i * 4]);
+        tree.erase_exact(points[i * 4 + 1]);
+        tree.insert(points[i * 4]);
+     }
+     copy.check_tree();
+     assert(same_shape(tree, copy));
+
+     tree_type empty(std::ptr_fun(tac));
+     copy = empty;
+     assert(copy.empty() && copy.begin() == copy.end());
+
+     std::cout << "Test structure-preserving copies passed" << std::endl;
+  }
+
+  // swap() exchanges the nodes, which stay reachable from their new header.
+  {
+     std::vector<triplet> points;
+     for (int i = 0; i != 300; ++i)
+        points.push_back(triplet(rand() % 100, rand() % 100, rand() % 100));
+     tree_type a(points.begin(), points.begin() + 200, std::ptr_fun(tac));
+     tree_type b(points.begin() + 200, points.end(), std::ptr_fun(tac));
+     tree_type empty(std::ptr_fun(tac));
+     tree_type::const_iterator first_of_a = a.begin();
+     a.set_balance_factor(0.7);
+
+     a.swap(b);
+     assert(a.size() == 100 && b.size() == 200);
+     assert(b.balance_factor() == 0.7 && a.balance_factor() == 0);
+     assert(b.begin() == first_of_a);
+     assert(size_t(std::distance(a.begin(), a.end())) == 100);
+     assert(size_t(std::distance(b.rbegin(), b.rend())) == 200);
+     assert(b.find_exact(points[0]) != b.end());
+     assert(a.find_exact(points[0]) == a.end());
+     b.erase_exact(points[0]);
+     a.insert(points[0]);
+     a.check_tree();
+     b.check_tree();
+
+     swap(b, empty);
+     assert(b.empty() && b.begin() == b.end());
+     assert(empty.size() == 199);
+     b.insert(points[1]);
+     assert(b.size() == 1 && *b.begin() == points[1]);
+     empty.check_tree();
+
+     std::cout << "Test swap passed" << std::endl;
+  }
+
+#if __cplusplus >= 201103L
+  // Values are moved into the nodes, and whole trees are moved by swapping
+  // their nodes.
+  {
+     typedef KDTree::KDTree<3, payload> payload_tree;
+     std::vector<payload> points;
+     for (int i = 0; i != 1000; ++i)
+        points.push_back(payload(rand() % 100, rand() % 100, rand() % 100));
+
+     payload::copies = 0;
+     payload_tree tree;
+     for (int i = 0; i != 500; ++i)
+        tree.insert(payload(points[i]));
+     for (int i = 500; i != 1000; ++i)
+        tree.emplace(points[i][0], points[i][1], points[i][2]);
+     assert(payload::copies == 500);
+     tree.check_tree();
+     assert(tree.find_exact(points[700]) != tree.end());
+
+     payload::copies = 0;
+     tree.optimise();
+     assert(payload::copies == 0);
+     tree.check_tree();
+     assert(tree.size() == 1000);
+
+     payload_tree copy(tree);
+     assert(payload::copies == 1000);
+     payload::copies = 0;
+
+     payload_tree moved(std::move(tree));
+     assert(tree.empty() && tree.begin() == tree.end());
+     assert(moved.size() == 1000);
+     assert(moved.find_exact(points[3]) != moved.end());
+     tree.insert(payload(1, 2, 3));
+     moved = std::move(tree);
+     assert(moved.size() == 1 && tree.empty());
+     moved.check_tree();
+
+     std::vector<payload> values(points);
+     payload::copies = 0;
+     moved.efficient_replace_and_optimise(std::move(values));
+     assert(payload::copies == 0);
+     assert(moved.size() == 1000);
+     moved.check_tree();
+     for (int i = 0; i != 50; ++i)
+     {
+        payload s(rand() % 100, rand() % 100, rand() % 100);
+        assert(moved.find_nearest(s).second == copy.find_nearest(s).second);
+        assert(moved.count_within_range(s, i) == copy.count_within_range(s, i));
+     }
+
+     // the functors are moved along with the nodes, and moving a tree only
+     // throws if moving one of them may
+     typedef KDTree::KDTree<3, payload, payload_accessor> accessor_tree;
+     typedef KDTree::KDTree<3, payload, throwing_accessor> throwing_tree;
+     static_assert(std::is_nothrow_move_constructible<payload_tree>::value
+                   && std::is_nothrow_move_assignable<payload_tree>::value,
+                   "moving a tree cannot throw");
+     static_assert(std::is_nothrow_move_constructible<accessor_tree>::value
+                   && std::is_nothrow_move_assignable<accessor_tree>::value,
+                   "moving its functors cannot throw");
+     static_assert(!std::is_nothrow_move_constructible<throwing_tree>::value
+                   && !std::is_nothrow_move_assignable<throwing_tree>::value,
+                   "moving its accessor may throw");
+     accessor_tree with_accessor;
+     with_accessor.insert(payload(1, 2, 3));
+     payload_accessor::copies = 0;
+     accessor_tree moved_with_accessor(std::move(with_accessor));
+     with_accessor = std::move(moved_with_accessor);
+     assert(payload_accessor::copies == 0);
+     assert(with_accessor.size() == 1 && moved_with_accessor.empty());
+
+     std::cout << "Test move semantics passed" << std::endl;
+  }
+#endif
+
   return 0;
 }
 
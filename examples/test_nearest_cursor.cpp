@@ -0,0 +1,171 @@
+// Checks that find_nearest() started from a nearest_cursor finds the same
+// distances as from the root, on coherent and random streams of queries,
+// and reports how many distances each computes.
+//
+// usage: test_nearest_cursor [number of points] [number of queries]
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/kdtree.hpp>
+
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+struct point
+{
+  typedef double value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[3];
+};
+
+typedef KDTree::KDTree<3, point, KDTree::_Bracket_accessor<point>,
+                       KDTree::squared_difference_counted<double, double> >
+  tree_type;
+typedef std::pair<tree_type::const_iterator, double> result_type;
+
+static point
+make_point(double x, double y, double z)
+{
+  point p;
+  p.d[0] = x;
+  p.d[1] = y;
+  p.d[2] = z;
+  return p;
+}
+
+static point
+random_point(int side)
+{
+  return make_point(rand() % side + rand() / double(RAND_MAX),
+                    rand() % side + rand() / double(RAND_MAX),
+                    rand() % side + rand() / double(RAND_MAX));
+}
+
+// A walk through the cube of side 1000, a few units at a time.
+static std::vector<point>
+random_walk(size_t const n)
+{
+  std::vector<point> q(n);
+  point p = make_point(500, 500, 500);
+  for (size_t i = 0; i != n; ++i)
+    {
+      for (size_t j = 0; j != 3; ++j)
+        {
+          p.d[j] += (rand() / double(RAND_MAX) - 0.5) * 4;
+          if (p.d[j] < 0 || p.d[j] > 1000)
+            p.d[j] = 500;
+        }
+      q[i] = p;
+    }
+  return q;
+}
+
+// Runs the queries from the root and from a cursor, checks they agree,
+// and returns the distances computed from the root and from the cursor.
+static std::pair<long, long>
+compare(tree_type const& tree, std::vector<point> const& q)
+{
+  long& count = tree.value_distance().count();
+  long from_root = 0;
+  long from_cursor = 0;
+  tree_type::nearest_cursor cursor;
+  for (size_t i = 0; i != q.size(); ++i)
+    {
+      count = 0;
+      result_type const expected = tree.find_nearest(q[i]);
+      from_root += count;
+      count = 0;
+      result_type const found = tree.find_nearest(q[i], cursor);
+      from_cursor += count;
+      assert(found.second == expected.second);
+      assert(found.first != tree.end());
+    }
+  return std::make_pair(from_root, from_cursor);
+}
+
+static void
+report(char const* name, size_t const queries, std::pair<long, long> const& counts)
+{
+  std::cout << name << ": " << double(counts.first) / queries
+            << " distances per query from the root, "
+            << double(counts.second) / queries << " from the cursor"
+            << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  size_t const n = argc > 1 ? std::atol(argv[1]) : 200000;
+  size_t const queries = argc > 2 ? std::atol(argv[2]) : 20000;
+
+  std::vector<point> points(n);
+  for (size_t i = 0; i != n; ++i)
+    points[i] = random_point(1000);
+  tree_type balanced(points.begin(), points.end());
+  tree_type inserted;
+  for (size_t i = 0; i != n; ++i)
+    inserted.insert(points[i]);
+
+  std::vector<point> const walk = random_walk(queries);
+  std::vector<point> scattered(queries);
+  for (size_t i = 0; i != queries; ++i)
+    scattered[i] = random_point(1000);
+
+  std::pair<long, long> const coherent = compare(balanced, walk);
+  assert(coherent.second < coherent.first);
+  report("coherent queries, balanced tree", queries, coherent);
+  report("coherent queries, inserted tree", queries, compare(inserted, walk));
+  report("random queries, balanced tree", queries, compare(balanced, scattered));
+
+  {
+    // many ties, and a chain as deep as the tree is large
+    tree_type tree;
+    for (int i = 0; i != 500; ++i)
+      {
+        tree.insert(make_point(i, i, i));
+        tree.insert(make_point(i % 7, i % 5, i % 3));
+      }
+    std::vector<point> q(2000);
+    for (size_t i = 0; i != q.size(); ++i)
+      q[i] = random_point(i % 2 ? 10 : 600);
+    compare(tree, q);
+    compare(tree, random_walk(2000));
+  }
+
+  {
+    // an empty tree leaves the cursor at the root, for the next search
+    tree_type tree;
+    tree_type::nearest_cursor cursor;
+    result_type r = tree.find_nearest(make_point(1, 2, 3), cursor);
+    assert(r.first == tree.end() && r.second == 0);
+    tree.insert(make_point(1, 2, 4));
+    r = tree.find_nearest(make_point(1, 2, 3), cursor);
+    assert(r.first != tree.end() && r.second == 1);
+    for (int i = 0; i != 100; ++i)
+      tree.insert(random_point(10));
+    cursor.reset();
+    r = tree.find_nearest(make_point(1, 2, 3), cursor);
+    assert(r.second == tree.find_nearest(make_point(1, 2, 3)).second);
+  }
+
+  std::cout << "searches from a cursor agree with find_nearest()" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
@@ -0,0 +1,122 @@
+// Builds the same tree serially and with 1 to N threads, checks that all the
+// trees are identical and reports how the build time scales.
+//
+// usage: test_parallel_build [number of points] [max number of threads]
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/kdtree.hpp>
+
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+struct point
+{
+  typedef double value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[3];
+};
+
+typedef KDTree::KDTree<3, point> tree_type;
+typedef KDTree::_Node<point> node_type;
+
+static node_type const*
+root_of(tree_type const& tree)
+{
+  KDTree::_Node_base const* n = tree.begin().get_raw_node();
+  while (n->_M_parent->_M_parent) // the header is the only parentless node
+    n = n->_M_parent;
+  return static_cast<node_type const*>(n);
+}
+
+// same shape, and the same coordinates at every node
+static bool
+identical(KDTree::_Node_base const* a, KDTree::_Node_base const* b)
+{
+  if (!a || !b)
+    return a == b;
+  point const& pa = static_cast<node_type const*>(a)->_M_value;
+  point const& pb = static_cast<node_type const*>(b)->_M_value;
+  for (size_t i = 0; i != 3; ++i)
+    if (pa[i] != pb[i])
+      return false;
+  return identical(a->_M_left, b->_M_left)
+    && identical(a->_M_right, b->_M_right);
+}
+
+template <class Build>
+static double
+time_build(Build build)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  build();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+  size_t const n = argc > 1 ? std::atol(argv[1]) : 1000000;
+  size_t max_threads = argc > 2 ? std::atol(argv[2]) : std::thread::hardware_concurrency();
+  if (max_threads < 4)
+    max_threads = 4; // always check that concurrent builds agree
+
+  std::vector<point> points(n);
+  for (size_t i = 0; i != n; ++i)
+    for (size_t j = 0; j != 3; ++j)
+      // a coarse grid, so that many values tie on some dimensions
+      points[i].d[j] = rand() % 1000;
+
+  tree_type serial;
+  double const serial_time = time_build([&]()
+    {
+      std::vector<point> v(points);
+      serial.efficient_replace_and_optimise(v);
+    });
+  serial.check_tree();
+  std::cout << "serial build of " << n << " points: " << serial_time << "s" << std::endl;
+
+  for (size_t threads = 1; threads <= max_threads; ++threads)
+    {
+      KDTree::thread_pool pool(threads);
+      tree_type parallel;
+      double const t = time_build([&]()
+        {
+          std::vector<point> v(points);
+          parallel.efficient_replace_and_optimise(v, pool);
+        });
+      assert(parallel.size() == serial.size());
+      assert(identical(root_of(serial), root_of(parallel)));
+      std::cout << threads << " thread(s): " << t << "s, speedup "
+                << serial_time / t << std::endl;
+    }
+
+  {
+    KDTree::thread_pool pool(4);
+    tree_type tree(points.begin(), points.end());
+    tree.optimise(pool);
+    assert(identical(root_of(serial), root_of(tree)));
+  }
+
+  std::cout << "parallel builds are identical to the serial build" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
@@ -0,0 +1,201 @@
+// Checks that the Hilbert keys walk a grid one step at a time, that batch
+// queries give the same results in every query_order, and compares the
+// time and, where the kernel lets us count them, the cache misses of a
+// batch of random queries run in the given order and along each curve.
+//
+// usage: test_query_order [number of points] [number of queries]
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/kdtree.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#  include <cstring>
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+struct point
+{
+  typedef double value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[3];
+};
+
+typedef KDTree::KDTree<3, point> tree_type;
+typedef std::pair<tree_type::const_iterator, double> result_type;
+
+// Counts the cache misses of the calling thread, if the kernel allows it.
+struct cache_miss_counter
+{
+#ifdef __linux__
+  cache_miss_counter()
+  {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof attr;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+
+  ~cache_miss_counter() { if (fd != -1) close(fd); }
+
+  bool available() const { return fd != -1; }
+
+  void
+  start()
+  {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  long long
+  stop()
+  {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long count = 0;
+    if (read(fd, &count, sizeof count) != sizeof count)
+      return -1;
+    return count;
+  }
+
+  int fd;
+#else
+  bool available() const { return false; }
+  void start() {}
+  long long stop() { return -1; }
+#endif
+};
+
+// Sorts the whole __K-dimensional grid of side 2^bits by Hilbert key and
+// checks that each cell is next to the one before.
+template <size_t K>
+static void
+check_hilbert_walk(unsigned const bits)
+{
+  size_t const side = size_t(1) << bits;
+  size_t cells = 1;
+  for (size_t d = 0; d != K; ++d)
+    cells *= side;
+  std::vector<std::pair<std::uint64_t, size_t> > keys(cells);
+  for (size_t c = 0; c != cells; ++c)
+    {
+      std::uint64_t x[K];
+      for (size_t d = 0, r = c; d != K; ++d, r /= side)
+        x[d] = r % side;
+      KDTree::_S_hilbert_transpose(x, K, bits);
+      keys[c] = std::make_pair(KDTree::_S_interleave(x, K, bits), c);
+    }
+  std::sort(keys.begin(), keys.end());
+  for (size_t c = 0; c != cells; ++c)
+    assert(keys[c].first == c); // a bijection onto [0, cells)
+  for (size_t c = 1; c != cells; ++c)
+    {
+      size_t steps = 0;
+      for (size_t d = 0, a = keys[c - 1].second, b = keys[c].second; d != K;
+           ++d, a /= side, b /= side)
+        steps += a % side > b % side ? a % side - b % side : b % side - a % side;
+      assert(steps == 1);
+    }
+}
+
+static point
+random_point()
+{
+  point p;
+  for (size_t j = 0; j != 3; ++j)
+    p.d[j] = rand() % 1000 + rand() / double(RAND_MAX);
+  return p;
+}
+
+int main(int argc, char** argv)
+{
+  check_hilbert_walk<2>(4);
+  check_hilbert_walk<3>(3);
+  check_hilbert_walk<4>(2);
+
+  size_t const n = argc > 1 ? std::atol(argv[1]) : 1000000;
+  size_t const queries = argc > 2 ? std::atol(argv[2]) : 500000;
+  std::vector<point> points(n);
+  for (size_t i = 0; i != n; ++i)
+    points[i] = random_point();
+  tree_type tree(points.begin(), points.end());
+  std::vector<point> q(queries);
+  for (size_t i = 0; i != queries; ++i)
+    q[i] = random_point();
+
+  // a single thread, so that the counter sees all the work
+  KDTree::thread_pool pool(1);
+  cache_miss_counter counter;
+  char const* const names[] = { "given", "morton", "hilbert" };
+  KDTree::query_order const orders[] =
+    { KDTree::given_order, KDTree::morton_order, KDTree::hilbert_order };
+  std::vector<result_type> expected;
+  std::vector<size_t> expected_counts;
+  for (size_t o = 0; o != 3; ++o)
+    {
+      std::vector<result_type> nearest(queries);
+      std::vector<size_t> counts(queries);
+      if (counter.available())
+        counter.start();
+      std::chrono::steady_clock::time_point const start
+        = std::chrono::steady_clock::now();
+      tree.batch_find_nearest(q.begin(), q.end(), nearest.begin(), pool, 0,
+                              orders[o]);
+      tree.batch_count_within_range(q.begin(), q.end(), 10, counts.begin(),
+                                    pool, 0, orders[o]);
+      double const t = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+      long long const misses = counter.available() ? counter.stop() : -1;
+      if (o == 0)
+        {
+          expected.swap(nearest);
+          expected_counts.swap(counts);
+        }
+      else
+        {
+          assert(nearest == expected);
+          assert(counts == expected_counts);
+        }
+      std::cout << queries << " queries on " << n << " points, " << names[o]
+                << " order: " << t << "s";
+      if (misses >= 0)
+        std::cout << ", " << misses << " cache misses";
+      std::cout << std::endl;
+    }
+  if (!counter.available())
+    std::cout << "(cache misses cannot be counted here)" << std::endl;
+
+  std::cout << "batch queries agree in every order" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
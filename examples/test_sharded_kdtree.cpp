@@ -0,0 +1,165 @@
+// Checks that a ShardedKDTree answers every query like a KDTree holding the
+// same values, whether they were inserted one by one, through a thread
+// pool, or by several threads at once, and after erases.
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/sharded_kdtree.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "query_oracle.hpp"
+
+typedef KDTree::ShardedKDTree<3, point> sharded_tree_type;
+
+// The searches walk the cells and skip the shards by their bounding box,
+// so half the queries come from far outside all of them, where a wrong box
+// would skip the shard of the result.  check_queries() does not apply:
+// the results are copies, not iterators.
+static void
+check_shards(tree_type const& tree, sharded_tree_type const& sharded)
+{
+  assert(sharded.size() == tree.size());
+  for (int q = 0; q != 50; ++q)
+    {
+      point s = random_point(-1);
+      if (q % 2)
+        s.d[q % 3] += q % 4 == 1 ? 200 : -200;
+
+      std::pair<tree_type::const_iterator, double> a = tree.find_nearest(s);
+      std::pair<point, double> b;
+      assert((a.first != tree.end()) == sharded.find_nearest(s, b));
+      if (a.first != tree.end())
+        assert(a.second == b.second);
+
+      double const max = q % 2 ? 300 : (q % 10) * 4 + 2;
+      a = tree.find_nearest_if(s, max, above_plane());
+      bool const found = sharded.find_nearest_if(s, max, above_plane(), b);
+      assert((a.first != tree.end()) == found);
+      if (found)
+        assert(a.second == b.second && above_plane()(b.first));
+
+      size_t const k = q % 12 + 1;
+      std::pair<tree_type::const_iterator, double> ka[12];
+      std::pair<point, double> kb[12];
+      size_t n = tree.find_k_nearest(s, k, ka);
+      assert(n == sharded.find_k_nearest(s, k, kb));
+      for (size_t j = 0; j != n; ++j)
+        assert(ka[j].second == kb[j].second);
+      n = tree.find_k_nearest_if(s, k, ka, max, above_plane());
+      assert(n == sharded.find_k_nearest_if(s, k, kb, max, above_plane()));
+      for (size_t j = 0; j != n; ++j)
+        {
+          assert(ka[j].second == kb[j].second);
+          assert(above_plane()(kb[j].first));
+        }
+
+      double const range = q % 2 ? 200 + q : q % 20 * 3;
+      assert(tree.count_within_range(s, range)
+             == sharded.count_within_range(s, range));
+      std::vector<point> found_a, found_b;
+      tree.find_within_range(s, range, std::back_inserter(found_a));
+      sharded.find_within_range(s, range, std::back_inserter(found_b));
+      std::sort(found_a.begin(), found_a.end());
+      std::sort(found_b.begin(), found_b.end());
+      assert(found_a == found_b);
+    }
+}
+
+int main()
+{
+  std::vector<point> points;
+  for (int i = 0; i != 8000; ++i)
+    points.push_back(random_point(i));
+  std::vector<point> const sample(points.begin(), points.begin() + 500);
+
+  {
+    // no sample, a single shard
+    sharded_tree_type one(points.begin(), points.begin(), 8);
+    assert(one.shard_count() == 1 && one.empty());
+    std::pair<point, double> found;
+    assert(!one.find_nearest(points[0], found));
+    one.insert(points[0]);
+    assert(one.find_nearest(points[0], found) && found.first == points[0]);
+  }
+
+  {
+    tree_type tree(points.begin(), points.end());
+    sharded_tree_type sharded(sample.begin(), sample.end(), 7);
+    assert(sharded.shard_count() == 7);
+    sharded.insert(points.begin(), points.end());
+    check_shards(tree, sharded);
+    // find_exact() looks in the cell insert() routed the value to
+    point p;
+    for (size_t i = 0; i != points.size(); ++i)
+      assert(sharded.find_exact(points[i], p) && p == points[i]);
+
+    for (int i = 0; i != 3000; ++i)
+      {
+        tree.erase_exact(points[i]);
+        assert(sharded.erase_exact(points[i]));
+        assert(!sharded.erase_exact(points[i]));
+      }
+    check_shards(tree, sharded);
+    assert(sharded.find_exact(points[3000], p) && p == points[3000]);
+    assert(!sharded.find_exact(points[0], p));
+
+    sharded.optimise();
+    check_shards(tree, sharded);
+    sharded.clear();
+    assert(sharded.empty());
+  }
+
+  {
+    tree_type tree(points.begin(), points.end());
+    sharded_tree_type sharded(sample.begin(), sample.end(), 16);
+    KDTree::thread_pool pool(4);
+    sharded.insert(points.begin(), points.end(), pool);
+    check_shards(tree, sharded);
+  }
+
+  {
+    // each writer inserts its own slice, then erases half of it
+    tree_type tree;
+    sharded_tree_type sharded(sample.begin(), sample.end(), 16);
+    std::vector<std::thread> writers;
+    size_t const slice = points.size() / 4;
+    for (size_t w = 0; w != 4; ++w)
+      writers.push_back(std::thread([&, w]() {
+        for (size_t i = w * slice; i != (w + 1) * slice; ++i)
+          sharded.insert(points[i]);
+        for (size_t i = w * slice; i != (w + 1) * slice; i += 2)
+          assert(sharded.erase_exact(points[i]));
+        std::pair<point, double> found;
+        assert(sharded.find_nearest(points[w * slice + 1], found));
+        assert(found.second == 0);
+      }));
+    for (size_t w = 0; w != writers.size(); ++w)
+      writers[w].join();
+    for (size_t i = 1; i < points.size(); i += 2)
+      tree.insert(points[i]);
+    check_shards(tree, sharded);
+  }
+
+  std::cout << "ShardedKDTree agrees with KDTree" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
@@ -0,0 +1,125 @@
+// Checks that every vectorised kernel the CPU supports gives exactly the
+// results of the scalar kernel, for float and double coordinates, and that
+// a bucketed StaticKDTree of floats still agrees with a KDTree.
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/simd.hpp>
+#include <kdtree++/static_kdtree.hpp>
+
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+static char const* const level_names[] = { "none", "sse2", "avx2", "avx512" };
+
+template <typename T>
+static T
+random_coord()
+{
+  return T(rand() % 200 - 100) + T(rand()) / T(RAND_MAX);
+}
+
+template <typename T>
+static void
+check_kernels(KDTree::simd_level level)
+{
+  size_t const dims = 5;
+  for (size_t count = 0; count <= 70; ++count)
+    {
+      size_t const stride = count + 3; // arrays not packed
+      std::vector<T> coords(dims * stride + 1);
+      for (size_t i = 0; i != coords.size(); ++i)
+        coords[i] = random_coord<T>();
+      if (count > 3)
+        {
+          // values on the bounds, and a NaN, which is never out
+          coords[1] = T(-10);
+          coords[stride + 2] = T(10);
+          coords[2 * stride + 3] = std::numeric_limits<T>::quiet_NaN();
+        }
+      T query[dims], low[dims], high[dims];
+      for (size_t d = 0; d != dims; ++d)
+        {
+          query[d] = random_coord<T>();
+          low[d] = T(-10);
+          high[d] = T(10) + T(d) * 20;
+        }
+
+      std::vector<T> expected(count + 1), got(count + 1);
+      KDTree::_S_squared_distances_scalar(&coords[1], stride, count, dims,
+                                          query, &expected[0]);
+      KDTree::_S_squared_distances(level, &coords[1], stride, count, dims,
+                                   query, &got[0]);
+      for (size_t j = 0; j != count; ++j)
+        assert(expected[j] == got[j]
+               || (expected[j] != expected[j] && got[j] != got[j]));
+
+      std::vector<unsigned char> in_expected(count + 1), in_got(count + 1);
+      KDTree::_S_within_box_scalar(&coords[1], stride, count, dims,
+                                   low, high, &in_expected[0]);
+      KDTree::_S_within_box(level, &coords[1], stride, count, dims,
+                            low, high, &in_got[0]);
+      assert(in_expected == in_got);
+    }
+}
+
+struct fpoint
+{
+  typedef float value_type;
+
+  inline value_type operator[](size_t const N) const { return d[N]; }
+
+  value_type d[4];
+};
+
+int main()
+{
+  KDTree::simd_level const detected = KDTree::detected_simd_level();
+  std::cout << "detected kernels: " << level_names[detected] << std::endl;
+  for (int level = KDTree::simd_none; level <= detected; ++level)
+    {
+      check_kernels<double>(KDTree::simd_level(level));
+      check_kernels<float>(KDTree::simd_level(level));
+      std::cout << level_names[level] << " kernels match the scalar ones"
+                << std::endl;
+    }
+
+  std::vector<fpoint> points(5000);
+  for (size_t i = 0; i != points.size(); ++i)
+    for (size_t d = 0; d != 4; ++d)
+      points[i].d[d] = random_coord<float>();
+  typedef KDTree::KDTree<4, fpoint> tree_type;
+  typedef KDTree::StaticKDTree<4, fpoint> static_tree_type;
+  tree_type tree(points.begin(), points.end());
+  static_tree_type frozen(tree, 32);
+  for (int q = 0; q != 500; ++q)
+    {
+      fpoint s;
+      for (size_t d = 0; d != 4; ++d)
+        s.d[d] = random_coord<float>();
+      assert(tree.find_nearest(s).second == frozen.find_nearest(s).second);
+      float const range = float(q % 40);
+      assert(tree.count_within_range(s, range)
+             == frozen.count_within_range(s, range));
+    }
+
+  std::cout << "float StaticKDTree agrees with KDTree" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
@@ -0,0 +1,246 @@
+// Checks that the snapshots of a SnapshotKDTree keep the values of their
+// version, however the tree changes afterwards, that the nodes left out are
+// reclaimed once no snapshot holds them, and only then, and that readers
+// keep querying consistent snapshots while a writer publishes.
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/snapshot_kdtree.hpp>
+
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "query_oracle.hpp"
+
+// counts the values alive
+struct counted : point
+{
+  static std::atomic<long> alive;
+
+  counted(point const& p) : point(p) { ++alive; }
+  counted(counted const& c) : point(c) { ++alive; }
+  ~counted() { --alive; }
+};
+
+std::atomic<long> counted::alive(0);
+
+typedef KDTree::SnapshotKDTree<3, point> snapshot_tree_type;
+typedef KDTree::SnapshotKDTree<3, counted, KDTree::_Bracket_accessor<counted>,
+                               KDTree::squared_difference<double, double> >
+  counted_tree_type;
+
+struct id_sum
+{
+  id_sum() : sum(0) {}
+  void operator()(point const& p) { sum += p.id; }
+  long sum;
+};
+
+// Asserts that snap holds values, and nothing else.
+static void
+check_version(std::vector<point> const& values,
+              snapshot_tree_type::snapshot const& snap)
+{
+  assert(snap.size() == values.size());
+  long sum = 0;
+  for (size_t i = 0; i != values.size(); ++i)
+    {
+      assert(snap.find_exact(values[i]) != snap.end());
+      assert(*snap.find_exact(values[i]) == values[i]);
+      assert(snap.find_nearest(values[i]).second == 0);
+      sum += values[i].id;
+    }
+  assert(snap.for_each(id_sum()).sum == sum);
+  assert(snap.count_within_range(random_point(-1), 200) == values.size());
+}
+
+int main()
+{
+  {
+    snapshot_tree_type empty;
+    snapshot_tree_type::snapshot snap = empty.get_snapshot();
+    point p = random_point(0);
+    assert(snap.empty() && snap.version() == 0);
+    assert(snap.find_nearest(p).first == snap.end());
+    assert(snap.count_within_range(p, 10) == 0);
+    std::pair<snapshot_tree_type::const_iterator, double> found[1];
+    assert(snap.find_k_nearest(p, 1, found) == 0);
+    assert(!empty.erase_exact(p));
+    assert(empty.publish() == 0);
+  }
+
+  {
+    snapshot_tree_type snapshots;
+    std::vector<point> points;
+    std::vector<std::vector<point> > versions;
+    std::vector<snapshot_tree_type::snapshot> pinned;
+    int id = 0;
+    for (int round = 0; round != 8; ++round)
+      {
+        for (int i = 0; i != 400; ++i)
+          {
+            points.push_back(random_point(id++));
+            snapshots.insert(points.back());
+          }
+        // erase the draft's own nodes as well as published ones
+        for (int i = 0; i != 150; ++i)
+          {
+            size_t const j = rand() % points.size();
+            assert(snapshots.erase_exact(points[j]));
+            assert(!snapshots.erase_exact(points[j]));
+            points.erase(points.begin() + j);
+          }
+        assert(snapshots.size() == points.size());
+        assert(snapshots.publish() == size_t(round + 1));
+        versions.push_back(points);
+        pinned.push_back(snapshots.get_snapshot());
+        assert(pinned.back().version() == size_t(round + 1));
+      }
+    // the older snapshots did not change
+    for (size_t v = 0; v != pinned.size(); ++v)
+      check_version(versions[v], pinned[v]);
+
+    snapshot_tree_type::snapshot moved(std::move(pinned.front()));
+    check_version(versions.front(), moved);
+    snapshots.clear();
+    assert(snapshots.empty() && snapshots.publish() == 9);
+    assert(snapshots.get_snapshot().empty());
+    check_version(versions.back(), pinned.back());
+  }
+
+  {
+    counted_tree_type tree(4);
+    std::vector<point> points;
+    for (int i = 0; i != 1000; ++i)
+      points.push_back(random_point(i));
+    {
+      counted_tree_type::snapshot first = tree.get_snapshot();
+      for (int i = 0; i != 1000; ++i)
+        tree.insert(counted(points[i]));
+      tree.publish();
+      counted_tree_type::snapshot all = tree.get_snapshot();
+      for (int i = 0; i != 500; ++i)
+        assert(tree.erase_exact(counted(points[i])));
+      tree.clear();
+      tree.publish();
+      // the second snapshot still holds the 1000 values, whatever reclaim()
+      tree.reclaim();
+      assert(counted::alive == 1000);
+      assert(all.size() == 1000 && first.empty());
+    }
+    tree.reclaim();
+    assert(counted::alive == 0);
+
+    // a snapshot pinned while later versions erase its values keeps them,
+    // and no node retired after its version is reclaimed either: not the
+    // copies the erases made along their paths, which the next versions
+    // retire in turn
+    for (int i = 0; i != 100; ++i)
+      tree.insert(counted(points[i]));
+    tree.publish();
+    {
+      counted_tree_type::snapshot old = tree.get_snapshot();
+      long alive = counted::alive;
+      assert(alive == 100);
+      for (int v = 0; v != 10; ++v)
+        {
+          for (int i = 0; i != 10; ++i)
+            assert(tree.erase(counted(points[v * 10 + i])));
+          tree.publish();
+          tree.reclaim();
+          assert(counted::alive >= alive);
+          alive = counted::alive;
+        }
+      assert(tree.empty() && old.size() == 100);
+      assert(alive > 100);
+    }
+    // released, the snapshot still holds them until the next reclaim()
+    assert(counted::alive > 100);
+    tree.reclaim();
+    assert(counted::alive == 0);
+
+    // a snapshot of the latest version only keeps the nodes of its own
+    for (int i = 0; i != 100; ++i)
+      tree.insert(counted(points[i]));
+    tree.publish();
+    for (int i = 0; i != 50; ++i)
+      assert(tree.erase(counted(points[i])));
+    tree.publish();
+    {
+      counted_tree_type::snapshot last = tree.get_snapshot();
+      tree.reclaim();
+      assert(counted::alive == 50 && last.size() == 50);
+    }
+    tree.reclaim();
+    assert(counted::alive == 50);
+  }
+  assert(counted::alive == 0);
+
+  {
+    // each version holds the ids from first[v] to last[v] - 1, whose sum
+    // the readers check; they are more than the reader slots, so that they
+    // sometimes wait for one
+    snapshot_tree_type tree(2);
+    size_t const versions = 300;
+    std::vector<int> first(versions + 1), last(versions + 1);
+    std::vector<point> points;
+    for (int i = 0; i != 20000; ++i)
+      points.push_back(random_point(i));
+    std::atomic<bool> done(false);
+    std::atomic<long> checked(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r != 3; ++r)
+      readers.push_back(std::thread([&]() {
+        while (!done.load())
+          {
+            snapshot_tree_type::snapshot snap = tree.get_snapshot();
+            size_t const v = snap.version();
+            assert(snap.size() == size_t(last[v] - first[v]));
+            id_sum ids = snap.for_each(id_sum());
+            assert(ids.sum == (long(first[v]) + last[v] - 1) * (last[v] - first[v]) / 2);
+            assert(snap.count_within_range(points[0], 200) == snap.size());
+            if (snap.size())
+              assert(snap.find_nearest(points[first[v]]).second == 0);
+            ++checked;
+          }
+      }));
+    int low = 0, high = 0;
+    for (size_t v = 1; v <= versions; ++v)
+      {
+        for (int i = 0; i != 50; ++i)
+          tree.insert(points[high++]);
+        for (int i = 0; i != 20 && low != high; ++i)
+          assert(tree.erase_exact(points[low++]));
+        first[v] = low;
+        last[v] = high;
+        assert(tree.publish() == v);
+        std::this_thread::yield();
+      }
+    done = true;
+    for (size_t r = 0; r != readers.size(); ++r)
+      readers[r].join();
+    std::cout << checked.load() << " snapshots checked over " << versions
+              << " versions" << std::endl;
+  }
+
+  std::cout << "SnapshotKDTree snapshots keep their versions" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
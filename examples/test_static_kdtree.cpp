@@ -0,0 +1,162 @@
+// Checks that a StaticKDTree, with or without leaf buckets, answers every
+// query like the KDTree it was frozen from, and compares their query times
+// and memory use.
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/static_kdtree.hpp>
+
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+#include "query_oracle.hpp"
+
+typedef KDTree::StaticKDTree<3, point> static_tree_type;
+
+struct sum_ids
+{
+  sum_ids() : sum(0) {}
+  void operator()(point const& p) { sum += p.id; }
+  long sum;
+};
+
+static double
+distance(point const& a, point const& b)
+{
+  double d = 0;
+  for (size_t i = 0; i != 3; ++i)
+    d += (a[i] - b[i]) * (a[i] - b[i]);
+  return std::sqrt(d);
+}
+
+template <class Tree>
+static double
+time_queries(Tree const& tree, std::vector<point> const& queries)
+{
+  std::clock_t start = std::clock();
+  double sum = 0;
+  for (size_t i = 0; i != queries.size(); ++i)
+    sum += tree.find_nearest(queries[i]).second;
+  assert(sum >= 0);
+  return double(std::clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main()
+{
+  {
+    static_tree_type empty;
+    point p = random_point(0);
+    assert(empty.find_nearest(p).first == empty.end());
+    assert(empty.count_within_range(p, 10) == 0);
+  }
+
+  for (size_t n = 1; n <= 20000; n = n * 3 + 1)
+    {
+      std::vector<point> points;
+      for (size_t i = 0; i != n; ++i)
+        points.push_back(random_point(int(i)));
+      tree_type tree(points.begin(), points.end());
+      for (size_t leaf_size = 0; leaf_size <= 64; leaf_size = leaf_size * 4 + 1)
+        {
+          static_tree_type frozen(tree, leaf_size);
+          assert(frozen.size() == tree.size());
+          assert(frozen.leaf_size() == leaf_size);
+          assert(frozen.node_count() == n / (leaf_size + 1));
+
+          check_queries(tree, frozen);
+
+          // the searches check_queries() leaves out
+          for (int q = 0; q != 50; ++q)
+            {
+              point s = random_point(-1);
+
+              double const max = (q % 10) + 0.5;
+              std::pair<tree_type::const_iterator, double> a = tree.find_nearest(s, max);
+              std::pair<static_tree_type::const_iterator, double> b = frozen.find_nearest(s, max);
+              assert((a.first == tree.end()) == (b.first == frozen.end()));
+              assert(a.second == b.second);
+
+              double best = max * 4;
+              bool any = false;
+              for (size_t i = 0; i != n; ++i)
+                if (above_plane()(points[i]) && distance(s, points[i]) <= best)
+                  {
+                    best = distance(s, points[i]);
+                    any = true;
+                  }
+              b = frozen.find_nearest_if(s, max * 4, above_plane());
+              assert(any == (b.first != frozen.end()));
+              if (any)
+                assert(b.second == best);
+
+              a = tree.find_nearest_squared(s);
+              b = frozen.find_nearest_squared(s);
+              assert(a.second == b.second);
+              a = tree.find_nearest_squared_if(s, max * max, above_plane());
+              b = frozen.find_nearest_squared_if(s, max * max, above_plane());
+              assert((a.first == tree.end()) == (b.first == frozen.end()));
+              assert(a.second == b.second);
+
+              size_t const k = q % 12 + 1;
+              std::pair<tree_type::const_iterator, double> ka[12];
+              std::pair<static_tree_type::const_iterator, double> kb[12];
+              size_t const na = tree.find_k_nearest(s, k, ka, max * 2);
+              assert(na == frozen.find_k_nearest(s, k, kb, max * 2));
+              for (size_t j = 0; j != na; ++j)
+                assert(ka[j].second == kb[j].second);
+
+              double const range = q % 20;
+              assert(tree.visit_within_range(s, range, sum_ids()).sum
+                     == frozen.visit_within_range(s, range, sum_ids()).sum);
+            }
+        }
+    }
+
+  {
+    size_t const n = 200000;
+    std::vector<point> points, queries;
+    for (size_t i = 0; i != n; ++i)
+      points.push_back(random_point(int(i)));
+    for (size_t i = 0; i != n; ++i)
+      queries.push_back(random_point(-1));
+    tree_type tree(points.begin(), points.end());
+    static_tree_type frozen(tree);
+    std::cout << "find_nearest() x " << n << ": KDTree "
+              << time_queries(tree, queries) << "s, StaticKDTree "
+              << time_queries(frozen, queries) << "s" << std::endl;
+    for (size_t leaf_size = 4; leaf_size <= 64; leaf_size *= 2)
+      {
+        static_tree_type bucketed(tree, leaf_size);
+        // the values in buckets keep a copy of their coordinates
+        double const bytes = sizeof(point) + 3 * sizeof(double)
+          * double(n - bucketed.node_count()) / n;
+        std::cout << "  with buckets of " << leaf_size << ": "
+                  << time_queries(bucketed, queries) << "s, "
+                  << bucketed.node_count() << " nodes, " << bytes
+                  << " bytes per value" << std::endl;
+      }
+    std::cout << "bytes per value: KDTree node " << sizeof(KDTree::_Node<point>)
+              << ", StaticKDTree " << sizeof(point) << std::endl;
+  }
+
+  std::cout << "StaticKDTree agrees with KDTree" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
@@ -0,0 +1,126 @@
+// Checks that a TieredKDTree answers every query like a KDTree holding the
+// same values, whatever the state of its buffer and tiers, that no insert()
+// does much of the work of building them all at once, and compares their
+// insertion times.
+
+// Make SURE all our asserts() are checked
+#undef NDEBUG
+
+#include <kdtree++/tiered_kdtree.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+#include "query_oracle.hpp"
+
+typedef KDTree::TieredKDTree<3, point> tiered_tree_type;
+
+static size_t accesses = 0;
+
+struct counting_accessor
+{
+  typedef double result_type;
+
+  double operator()(point const& p, size_t const k) const
+  {
+    ++accesses;
+    return p[k];
+  }
+};
+
+int main()
+{
+  {
+    tiered_tree_type empty;
+    point p = random_point(0);
+    assert(empty.find_nearest(p).first == empty.end());
+    assert(empty.count_within_range(p, 10) == 0);
+    std::pair<tiered_tree_type::const_iterator, double> found[1];
+    assert(empty.find_k_nearest(p, 1, found) == 0);
+  }
+
+  for (size_t buffer_size = 1; buffer_size <= 64; buffer_size *= 4)
+    {
+      tree_type tree;
+      tiered_tree_type tiered(buffer_size, buffer_size / 4);
+      for (int i = 0; i != 3000; ++i)
+        {
+          point const p = random_point(i);
+          tree.insert(p);
+          tiered.insert(p);
+          if (i % 397 == 0)
+            check_queries(tree, tiered);
+        }
+      // level i holds at most four tiers of buffer_size * 4^i values
+      assert(tiered.tier_count() <= 4 * 6);
+      check_queries(tree, tiered);
+      tiered.optimise();
+      assert(tiered.tier_count() == 1);
+      check_queries(tree, tiered);
+      tiered.insert(random_point(-2));
+      tree.insert(random_point(-2));
+      tiered.clear();
+      assert(tiered.empty() && tiered.tier_count() == 0);
+    }
+
+  {
+    // the merges are spread over the inserts, none of which comes close
+    // to building all the values at once
+    size_t const n = 1 << 16;
+    std::vector<point> points;
+    for (size_t i = 0; i != n; ++i)
+      points.push_back(random_point(int(i)));
+    KDTree::TieredKDTree<3, point, counting_accessor> tiered(64, 16);
+    size_t most = 0;
+    for (size_t i = 0; i != n; ++i)
+      {
+        accesses = 0;
+        tiered.insert(points[i]);
+        most = std::max(most, accesses);
+      }
+    accesses = 0;
+    KDTree::StaticKDTree<3, point, counting_accessor> whole;
+    whole.efficient_replace_and_optimise(points, 16);
+    std::cout << "most accesses in one insert(): " << most
+              << ", building " << n << " values: " << accesses << std::endl;
+    assert(most * 64 < accesses);
+  }
+
+  {
+    size_t const n = 500000;
+    std::vector<point> points;
+    for (size_t i = 0; i != n; ++i)
+      points.push_back(random_point(int(i)));
+    std::clock_t start = std::clock();
+    tree_type tree;
+    tree.insert(points.begin(), points.end());
+    double const tree_time = double(std::clock() - start) / CLOCKS_PER_SEC;
+    start = std::clock();
+    tiered_tree_type tiered(1024, 16);
+    tiered.insert(points.begin(), points.end());
+    double const tiered_time = double(std::clock() - start) / CLOCKS_PER_SEC;
+    std::cout << "insert() x " << n << ": KDTree " << tree_time
+              << "s, TieredKDTree " << tiered_time << "s in "
+              << tiered.tier_count() << " tiers" << std::endl;
+  }
+
+  std::cout << "TieredKDTree agrees with KDTree" << std::endl;
+  return 0;
+}
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
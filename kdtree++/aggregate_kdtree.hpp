@@ -0,0 +1,115 @@
+/** \file
+ * Defines the interface for the AggregateKDTree class, a KDTree that can
+ * aggregate the values within a region without visiting them all.
+ *
+ * Every node keeps the aggregate of the values of its subtree, under a
+ * commutative monoid given as the _Agg functor (see _Aggregate_node for
+ * what it must provide).  insert(), erase() and optimise() keep the
+ * aggregates up to date along the nodes they change.
+ * aggregate_within_range() then combines the aggregates of the subtrees
+ * whose cell lies entirely within the region, and only tests the values
+ * of the nodes on the border of the region one by one.
+ *
+ * For instance, a sum over a field of the values:
+ *
+ *   struct weight_sum
+ *   {
+ *     typedef double result_type;
+ *     result_type identity() const { return 0; }
+ *     result_type lift(point const& p) const { return p.weight; }
+ *     result_type combine(result_type a, result_type b) const { return a + b; }
+ *   };
+ *
+ * Minimum and maximum work the same way, and a mean is the combination of
+ * a count and a sum.
+ */
+
+#ifndef INCLUDE_KDTREE_AGGREGATE_KDTREE_HPP
+#define INCLUDE_KDTREE_AGGREGATE_KDTREE_HPP
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+#include "function.hpp"
+#include "node.hpp"
+#include "region.hpp"
+#include "kdtree.hpp"
+
+namespace KDTree
+{
+
+template <size_t const __K, typename _Val, typename _Agg,
+          typename _Acc = _Bracket_accessor<_Val>,
+          typename _Dist = squared_difference<typename _Acc::result_type,
+          typename _Acc::result_type>,
+          typename _Cmp = std::less<typename _Acc::result_type>,
+          typename _Alloc = std::allocator<_Aggregate_node<_Val, _Agg> > >
+class AggregateKDTree : public KDTree<__K, _Val, _Acc, _Dist, _Cmp, _Alloc>
+{
+protected:
+  typedef KDTree<__K, _Val, _Acc, _Dist, _Cmp, _Alloc> _Tree;
+
+public:
+  typedef typename _Tree::_Region_ _Region_;
+  typedef typename _Tree::value_type value_type;
+  typedef typename _Tree::const_reference const_reference;
+  typedef typename _Tree::subvalue_type subvalue_type;
+  typedef typename _Tree::allocator_type allocator_type;
+  typedef _Agg aggregate_functor;
+  typedef typename _Agg::result_type aggregate_type;
+
+  AggregateKDTree(_Acc const& __acc = _Acc(), _Dist const& __dist = _Dist(),
+                  _Cmp const& __cmp = _Cmp(),
+                  allocator_type const& __a = allocator_type())
+    : _Tree(__acc, __dist, __cmp, __a) {}
+
+  template<typename _InputIterator>
+    AggregateKDTree(_InputIterator __first, _InputIterator __last,
+                    _Acc const& __acc = _Acc(), _Dist const& __dist = _Dist(),
+                    _Cmp const& __cmp = _Cmp(),
+                    allocator_type const& __a = allocator_type())
+    : _Tree(__first, __last, __acc, __dist, __cmp, __a) {}
+
+  //! The aggregate of all the values, in O(1).
+  aggregate_type
+  aggregate() const
+  {
+    if (!this->_M_get_root()) return _Agg().identity();
+    return this->_M_get_root()->_M_aggregate;
+  }
+
+  // NOTE: like find_within_range(), this aggregates the values within the
+  // box of half-width __R around __V, not within a sphere.
+  aggregate_type
+  aggregate_within_range(const_reference __V, subvalue_type const __R) const
+  {
+    if (!this->_M_get_root()) return _Agg().identity();
+    _Region_ __region(__V, __R, this->_M_acc, this->_M_cmp);
+    return this->aggregate_within_range(__region);
+  }
+
+  aggregate_type
+  aggregate_within_range(_Region_ const& __REGION) const
+  {
+    _Range_aggregate<value_type, _Agg> __aggregate;
+    return this->_M_visit_within_range(__REGION, __aggregate)._M_value;
+  }
+};
+
+} // namespace KDTree
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
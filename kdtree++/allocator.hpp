@@ -7,23 +7,244 @@
 #ifndef INCLUDE_KDTREE_ALLOCATOR_HPP
 #define INCLUDE_KDTREE_ALLOCATOR_HPP
 
+#include <algorithm>
 #include <cstddef>
+#include <functional>
+#include <new>
+#include <utility>
+#if __cplusplus >= 201103L
+#  include <type_traits>
+#endif
 
 #include "node.hpp"
 
 namespace KDTree
 {
 
+  /*! An allocator handing out single objects from slabs of _SlabSize.
+
+      Objects given back are chained on a free list and handed out again
+      before the current slab is carved any further.  Slabs are only given
+      back to the system by release(), all at once, or when the allocator
+      is destroyed.  Requests for more than one object go straight to
+      operator new.
+
+      Every copy of an arena_allocator starts a new, empty arena: only the
+      allocator that allocated an object may deallocate it.  This is what
+      a KDTree needs of its node allocator, and its clear() then releases
+      the slabs without visiting the nodes, if they need no destruction.
+   */
+  template <typename _Tp, size_t _SlabSize = 1024>
+    class arena_allocator
+    {
+    public:
+      typedef _Tp value_type;
+      typedef _Tp* pointer;
+      typedef _Tp const* const_pointer;
+      typedef _Tp& reference;
+      typedef _Tp const& const_reference;
+      typedef size_t size_type;
+      typedef ptrdiff_t difference_type;
+
+      template <typename _Up>
+        struct rebind
+        { typedef arena_allocator<_Up, _SlabSize> other; };
+
+      arena_allocator()
+        : _M_slabs(NULL), _M_next(NULL), _M_end(NULL), _M_free_list(NULL) {}
+
+      arena_allocator(arena_allocator const&)
+        : _M_slabs(NULL), _M_next(NULL), _M_end(NULL), _M_free_list(NULL) {}
+
+      template <typename _Up>
+        arena_allocator(arena_allocator<_Up, _SlabSize> const&)
+        : _M_slabs(NULL), _M_next(NULL), _M_end(NULL), _M_free_list(NULL) {}
+
+#if __cplusplus >= 201103L
+      // takes the arena of __x over, leaving __x with an empty one
+      arena_allocator(arena_allocator&& __x) noexcept
+        : _M_slabs(NULL), _M_next(NULL), _M_end(NULL), _M_free_list(NULL)
+      { swap(__x); }
+#endif
+
+      ~arena_allocator()
+      { release(); }
+
+      // keeps its own arena
+      arena_allocator&
+      operator=(arena_allocator const&)
+      { return *this; }
+
+#if __cplusplus >= 201103L
+      arena_allocator&
+      operator=(arena_allocator&& __x) noexcept
+      {
+        release();
+        swap(__x);
+        return *this;
+      }
+#endif
+
+      //! Exchanges the arenas, and with them the objects each may deallocate.
+      void
+      swap(arena_allocator& __x)
+      {
+        std::swap(_M_slabs, __x._M_slabs);
+        std::swap(_M_next, __x._M_next);
+        std::swap(_M_end, __x._M_end);
+        std::swap(_M_free_list, __x._M_free_list);
+      }
+
+      pointer
+      allocate(size_type const __n, void const* = 0)
+      {
+        if (__n != 1)
+          return static_cast<pointer>(::operator new(__n * sizeof(_Tp)));
+        if (_M_free_list)
+          {
+            char* const __p = _M_free_list;
+            _M_free_list = *static_cast<char**>(static_cast<void*>(__p));
+            return static_cast<pointer>(static_cast<void*>(__p));
+          }
+        if (_M_next == _M_end)
+          _M_new_slab();
+        char* const __p = _M_next;
+        _M_next += _S_slot;
+        return static_cast<pointer>(static_cast<void*>(__p));
+      }
+
+      void
+      deallocate(pointer const __p, size_type const __n)
+      {
+        if (__n != 1)
+          {
+            ::operator delete(__p);
+            return;
+          }
+        new (static_cast<void*>(__p)) char*(_M_free_list);
+        _M_free_list = static_cast<char*>(static_cast<void*>(__p));
+      }
+
+      //! Gives back all the slabs at once, without destroying any object.
+      void
+      release()
+      {
+        while (_M_slabs)
+          {
+            char* const __next = *static_cast<char**>(static_cast<void*>(_M_slabs));
+            ::operator delete(_M_slabs);
+            _M_slabs = __next;
+          }
+        _M_next = _M_end = _M_free_list = NULL;
+      }
+
+      size_type
+      max_size() const
+      { return size_type(-1) / sizeof(_Tp); }
+
+      pointer address(reference __x) const { return &__x; }
+      const_pointer address(const_reference __x) const { return &__x; }
+
+      void
+      construct(pointer const __p, const_reference __v)
+      { new (static_cast<void*>(__p)) _Tp(__v); }
+
+      void
+      destroy(pointer const __p)
+      { __p->~_Tp(); }
+
+      bool
+      operator==(arena_allocator const& __x) const
+      { return this == &__x; }
+
+      bool
+      operator!=(arena_allocator const& __x) const
+      { return this != &__x; }
+
+    private:
+      // The first slot of a slab links to the previous slab; a free slot
+      // links to the next free one.
+      static size_t const _S_slot
+        = sizeof(_Tp) < sizeof(char*) ? sizeof(char*) : sizeof(_Tp);
+
+      void
+      _M_new_slab()
+      {
+        char* const __slab
+          = static_cast<char*>(::operator new((_SlabSize + 1) * _S_slot));
+        new (static_cast<void*>(__slab)) char*(_M_slabs);
+        _M_slabs = __slab;
+        _M_next = __slab + _S_slot;
+        _M_end = _M_next + _SlabSize * _S_slot;
+      }
+
+      char* _M_slabs;
+      char* _M_next;
+      char* _M_end;
+      char* _M_free_list;
+    };
+
+  template <typename _Tp, size_t _SlabSize>
+    inline void
+    swap(arena_allocator<_Tp, _SlabSize>& __a,
+         arena_allocator<_Tp, _SlabSize>& __b)
+    { __a.swap(__b); }
+
+  //! Whether clear() may give back the nodes allocated by _Alloc without
+  //! visiting them.
+  template <typename _Alloc>
+    struct _Releases_all
+    { static bool const value = false; };
+
+  template <typename _Tp, size_t _SlabSize>
+    struct _Releases_all<arena_allocator<_Tp, _SlabSize> >
+    { static bool const value = true; };
+
+  template <typename _Tp>
+    struct _Trivially_destructible
+    {
+#if __cplusplus >= 201103L
+      static bool const value = std::is_trivially_destructible<_Tp>::value;
+#else
+      static bool const value = false;
+#endif
+    };
+
+  template <bool _Release>
+    struct _Use_release {};
+
   template <typename _Tp, typename _Alloc>
     class _Alloc_base
     {
     public:
-      typedef _Node<_Tp> _Node_;
+      // _Node<_Tp>, or a node type derived from it
+      typedef typename _Alloc::value_type _Node_;
       typedef typename _Node_::_Base_ptr _Base_ptr;
       typedef _Alloc allocator_type;
 
+      // Tells whether the nodes can be dropped all at once, see
+      // _M_release_nodes().
+      typedef _Use_release<_Releases_all<_Alloc>::value
+                           && _Trivially_destructible<_Node_>::value>
+        _Use_release_;
+
       _Alloc_base(allocator_type const& __A)
-        : _M_node_allocator(__A) {}
+        : _M_node_allocator(__A), _M_block(NULL), _M_block_size(0),
+          _M_free_list(NULL) {}
+
+#if __cplusplus >= 201103L
+      // takes the allocator and the block of nodes of __x over
+      _Alloc_base(_Alloc_base&& __x)
+        noexcept(std::is_nothrow_move_constructible<allocator_type>::value)
+        : _M_node_allocator(std::move(__x._M_node_allocator)),
+          _M_block(__x._M_block), _M_block_size(__x._M_block_size),
+          _M_free_list(__x._M_free_list)
+      {
+        __x._M_block = NULL;
+        __x._M_block_size = 0;
+        __x._M_free_list = NULL;
+      }
+#endif
 
       allocator_type
       get_allocator() const
@@ -49,21 +270,72 @@ namespace KDTree
 
     protected:
       allocator_type _M_node_allocator;
-      
+
+      // Nodes handed out by _M_allocate_block() all live in one chunk.  A
+      // node of that chunk cannot be given back to the allocator on its
+      // own, so erased ones are chained on _M_free_list and handed out
+      // again by _M_allocate_node() until the whole block is released.
+      _Node_* _M_block;
+      size_t _M_block_size;
+      _Node_* _M_free_list;
+
       _Node_*
       _M_allocate_node()
       {
+        if (_M_free_list)
+          {
+            _Node_* __p = _M_free_list;
+            _M_free_list = *static_cast<_Node_**>(static_cast<void*>(__p));
+            return __p;
+          }
         return _M_node_allocator.allocate(1);
       }
 
       void
       _M_deallocate_node(_Node_* const __P)
       {
-        return _M_node_allocator.deallocate(__P, 1);
+        if (_M_in_block(__P))
+          {
+            new (static_cast<void*>(__P)) _Node_*(_M_free_list);
+            _M_free_list = __P;
+          }
+        else
+          _M_node_allocator.deallocate(__P, 1);
+      }
+
+      bool
+      _M_in_block(_Node_* const __P) const
+      {
+        std::less<_Node_*> __less;
+        return _M_block
+          && !__less(__P, _M_block) && __less(__P, _M_block + _M_block_size);
+      }
+
+      /*! Allocate storage for __N nodes at once.
+
+          Only one block can be outstanding; it must be released with
+          _M_deallocate_block() once all of its nodes have been destroyed.
+       */
+      _Node_*
+      _M_allocate_block(size_t const __N)
+      {
+        _M_block = _M_node_allocator.allocate(__N);
+        _M_block_size = __N;
+        return _M_block;
+      }
+
+      void
+      _M_deallocate_block()
+      {
+        if (_M_block)
+          _M_node_allocator.deallocate(_M_block, _M_block_size);
+        _M_block = NULL;
+        _M_block_size = 0;
+        _M_free_list = NULL;
       }
 
       void
-      _M_construct_node(_Node_* __p, _Tp const __V = _Tp(),
+      _M_construct_node(_Node_* __p, _Tp const& __V = _Tp(),
                         _Base_ptr const __PARENT = NULL,
                         _Base_ptr const __LEFT = NULL,
                         _Base_ptr const __RIGHT = NULL)
@@ -71,6 +343,61 @@ namespace KDTree
         new (__p) _Node_(__V, __PARENT, __LEFT, __RIGHT);
       }
 
+#if __cplusplus >= 201103L
+      void
+      _M_construct_node(_Node_* __p, _Tp&& __V,
+                        _Base_ptr const __PARENT = NULL,
+                        _Base_ptr const __LEFT = NULL,
+                        _Base_ptr const __RIGHT = NULL)
+      {
+        new (__p) _Node_(std::move(__V), __PARENT, __LEFT, __RIGHT);
+      }
+
+      //! Constructs the value of the node at __p from __args, unlinked.
+      template <typename... _Args>
+        void
+        _M_emplace_node(_Node_* __p, _Args&&... __args)
+        {
+          new (__p) _Node_(_Emplace_tag(), std::forward<_Args>(__args)...);
+        }
+#endif
+
+      //! Copies the node __x, value and all, as an unlinked child of __PARENT.
+      void
+      _M_clone_node(_Node_* __p, _Node_ const& __x,
+                    _Base_ptr const __PARENT)
+      {
+        _Node_* const __n = new (__p) _Node_(__x);
+        __n->_M_parent = __PARENT;
+        __n->_M_left = __n->_M_right = NULL;
+      }
+
+      //! Exchanges the allocators and the node blocks, in constant time.
+      void
+      _M_swap(_Alloc_base& __x)
+      {
+        using std::swap;
+        swap(_M_node_allocator, __x._M_node_allocator);
+        std::swap(_M_block, __x._M_block);
+        std::swap(_M_block_size, __x._M_block_size);
+        std::swap(_M_free_list, __x._M_free_list);
+      }
+
+      //! Gives back every node allocated with _M_allocate_node() at once,
+      //! with no destruction.  Only for _Use_release<true>.
+      void
+      _M_release_nodes()
+      {
+        _M_node_allocator.release();
+        _M_free_list = NULL;
+        if (_M_block_size == 1)
+          {
+            // came from a slab too
+            _M_block = NULL;
+            _M_block_size = 0;
+          }
+      }
+
       void
       _M_destroy_node(_Node_* __p)
       {
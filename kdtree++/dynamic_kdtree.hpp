@@ -0,0 +1,792 @@
+/** \file
+ * Defines the interface for the DynamicKDTree class, a KD-Tree whose number
+ * of dimensions is given to its constructor rather than compiled in.
+ *
+ * A value is a row of K coordinates of the same type.  The rows are kept
+ * one after the other in a single array, with stride K, and a row is
+ * handed around as a pointer to its first coordinate.  The tree itself is
+ * two links per row, the positions of the rows of its children, so that a
+ * copy of the tree is a plain copy of its arrays.  A balanced tree keeps
+ * its rows in pre-order, the way a KDTree lays out the block of nodes of
+ * an optimised tree, and the rows inserted afterwards follow.  Each row
+ * also keeps its rank among the rows inserted, its id().
+ *
+ * It answers the same queries as a KDTree: find(), find_nearest(),
+ * find_nearest_if(), find_k_nearest(), find_k_nearest_if(),
+ * find_within_range(), count_within_range() and visit_within_range().  The
+ * search values may be rows or anything else with an operator[] giving
+ * their K coordinates.  Rows may be inserted one at a time, which leaves
+ * the tree unbalanced as it does a KDTree, until optimise() rebuilds it,
+ * but not erased.  The iterators walk the rows in storage order, and are
+ * invalidated by an insertion or optimise() like those of a std::vector.
+ */
+
+#ifndef INCLUDE_KDTREE_DYNAMIC_KDTREE_HPP
+#define INCLUDE_KDTREE_DYNAMIC_KDTREE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "function.hpp"
+#include "node.hpp"
+#include "region.hpp"
+
+namespace KDTree
+{
+
+  /*! The region of a DynamicKDTree: a box with as many dimensions as the
+      tree, as the _Region is for a KDTree.
+   */
+  template <typename _SubVal, typename _Cmp>
+    struct _Dynamic_region
+    {
+      typedef _SubVal subvalue_type;
+      typedef subvalue_type const* value_type;
+
+      template <typename Val>
+      _Dynamic_region(size_t const __k, Val const& __V,
+                      const _Cmp& __cmp=_Cmp())
+        : _M_low_bounds(__k), _M_high_bounds(__k), _M_cmp(__cmp)
+      {
+        for (size_t __i = 0; __i != __k; ++__i)
+          _M_low_bounds[__i] = _M_high_bounds[__i] = __V[__i];
+      }
+
+      template <typename Val>
+      _Dynamic_region(size_t const __k, Val const& __V,
+                      subvalue_type const& __R, const _Cmp& __cmp=_Cmp())
+        : _M_low_bounds(__k), _M_high_bounds(__k), _M_cmp(__cmp)
+      {
+        for (size_t __i = 0; __i != __k; ++__i)
+          {
+            _M_low_bounds[__i] = __V[__i] - __R;
+            _M_high_bounds[__i] = __V[__i] + __R;
+          }
+      }
+
+      bool
+      encloses(value_type const __V) const
+      {
+        for (size_t __i = 0; __i != _M_low_bounds.size(); ++__i)
+          {
+            if (_M_cmp(__V[__i], _M_low_bounds[__i])
+             || _M_cmp(_M_high_bounds[__i], __V[__i]))
+              return false;
+          }
+        return true;
+      }
+
+      _Dynamic_region&
+      set_high_bound(value_type const __V, size_t const __L)
+      {
+        size_t const __i = __L % _M_high_bounds.size();
+        _M_high_bounds[__i] = __V[__i];
+        return *this;
+      }
+
+      _Dynamic_region&
+      set_low_bound(value_type const __V, size_t const __L)
+      {
+        size_t const __i = __L % _M_low_bounds.size();
+        _M_low_bounds[__i] = __V[__i];
+        return *this;
+      }
+
+      std::vector<subvalue_type> _M_low_bounds, _M_high_bounds;
+      _Cmp _M_cmp;
+    };
+
+template <typename _Tp,
+          typename _Dist = squared_difference<_Tp, _Tp>,
+          typename _Cmp = std::less<_Tp>,
+          typename _Alloc = std::allocator<_Tp> >
+class DynamicKDTree
+{
+protected:
+  typedef std::vector<_Tp, _Alloc> _Storage;
+
+public:
+  typedef _Dynamic_region<_Tp, _Cmp> _Region_;
+  typedef _Tp subvalue_type;
+  typedef subvalue_type const* value_type;
+  typedef value_type const_reference;
+  typedef typename _Dist::distance_type distance_type;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef _Alloc allocator_type;
+
+  // Walks the rows, with a stride of K coordinates.  No mutable iterator,
+  // the rows can't be changed in place.
+  class const_iterator
+  {
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef subvalue_type const* value_type;
+    typedef ptrdiff_t difference_type;
+    typedef value_type const* pointer;
+    typedef value_type reference;
+
+    const_iterator() : _M_row(0), _M_k(0) {}
+
+    reference operator*() const { return _M_row; }
+    reference operator[](difference_type const __n) const
+    { return _M_row + __n * difference_type(_M_k); }
+
+    const_iterator& operator++() { _M_row += _M_k; return *this; }
+    const_iterator& operator--() { _M_row -= _M_k; return *this; }
+    const_iterator operator++(int)
+    { const_iterator const __tmp = *this; _M_row += _M_k; return __tmp; }
+    const_iterator operator--(int)
+    { const_iterator const __tmp = *this; _M_row -= _M_k; return __tmp; }
+
+    const_iterator&
+    operator+=(difference_type const __n)
+    { _M_row += __n * difference_type(_M_k); return *this; }
+
+    const_iterator&
+    operator-=(difference_type const __n)
+    { _M_row -= __n * difference_type(_M_k); return *this; }
+
+    const_iterator
+    operator+(difference_type const __n) const
+    { const_iterator __tmp = *this; return __tmp += __n; }
+
+    const_iterator
+    operator-(difference_type const __n) const
+    { const_iterator __tmp = *this; return __tmp -= __n; }
+
+    friend const_iterator
+    operator+(difference_type const __n, const_iterator const& __it)
+    { return __it + __n; }
+
+    difference_type
+    operator-(const_iterator const& __that) const
+    { return (_M_row - __that._M_row) / difference_type(_M_k); }
+
+    bool operator==(const_iterator const& __that) const
+    { return _M_row == __that._M_row; }
+    bool operator!=(const_iterator const& __that) const
+    { return _M_row != __that._M_row; }
+    bool operator<(const_iterator const& __that) const
+    { return _M_row < __that._M_row; }
+    bool operator>(const_iterator const& __that) const
+    { return __that._M_row < _M_row; }
+    bool operator<=(const_iterator const& __that) const
+    { return !(__that._M_row < _M_row); }
+    bool operator>=(const_iterator const& __that) const
+    { return !(_M_row < __that._M_row); }
+
+  private:
+    friend class DynamicKDTree;
+
+    const_iterator(value_type const __row, size_type const __k)
+      : _M_row(__row), _M_k(__k) {}
+
+    value_type _M_row;
+    size_type _M_k;
+  };
+  typedef const_iterator iterator;
+
+  // __k, the number of dimensions, must not be 0.
+  explicit
+  DynamicKDTree(size_type const __k, _Dist const& __dist = _Dist(),
+                _Cmp const& __cmp = _Cmp(),
+                allocator_type const& __a = allocator_type())
+    : _M_k(__k), _M_coords(__a), _M_root(_S_none),
+      _M_cmp(__cmp), _M_dist(__dist)
+  { assert(__k); }
+
+  // Builds a balanced tree of the rows whose coordinates are read from
+  // [__first, __last), __k at a time, with ids from 0 in that order.
+  template <typename _InputIterator>
+  DynamicKDTree(size_type const __k, _InputIterator __first,
+                _InputIterator __last, _Dist const& __dist = _Dist(),
+                _Cmp const& __cmp = _Cmp(),
+                allocator_type const& __a = allocator_type())
+    : _M_k(__k), _M_coords(__first, __last, __a), _M_root(_S_none),
+      _M_cmp(__cmp), _M_dist(__dist)
+  {
+    assert(__k && _M_coords.size() % __k == 0);
+    _M_links.resize(2 * size(), size_type(_S_none));
+    _M_ids.resize(size());
+    for (size_type __row = 0; __row != _M_ids.size(); ++__row)
+      _M_ids[__row] = __row;
+    this->optimise();
+  }
+
+  allocator_type
+  get_allocator() const
+  { return _M_coords.get_allocator(); }
+
+  //! Number of coordinates of each row.
+  size_type
+  dimensions() const
+  { return _M_k; }
+
+  size_type
+  size() const
+  { return _M_coords.size() / _M_k; }
+
+  bool
+  empty() const
+  { return _M_coords.empty(); }
+
+  void
+  clear()
+  {
+    _M_coords.clear();
+    _M_links.clear();
+    _M_ids.clear();
+    _M_root = _S_none;
+  }
+
+  _Cmp
+  value_comp() const
+  { return _M_cmp; }
+
+  const _Dist&
+  value_distance() const
+  { return _M_dist; }
+
+  _Dist&
+  value_distance()
+  { return _M_dist; }
+
+  const_iterator begin() const { return const_iterator(_M_data(), _M_k); }
+  const_iterator end() const { return begin() + difference_type(size()); }
+
+  //! Rank of the insertion of __row, a row of this tree, from 0.
+  size_type
+  id(value_type const __row) const
+  { return _M_ids[(__row - _M_data()) / _M_k]; }
+
+  // Appends a row, with the coordinates __V[0] to __V[K-1], which may be
+  // those of a row of this tree, and links it below the leaf of the tree
+  // where it belongs.  Its id() is the number of rows before it.
+  template <class SearchVal>
+  const_iterator
+  insert(SearchVal const& __V)
+  {
+    _Storage __row(_M_k, subvalue_type(), _M_coords.get_allocator());
+    for (size_type __i = 0; __i != _M_k; ++__i)
+      __row[__i] = __V[__i];
+    _M_coords.insert(_M_coords.end(), __row.begin(), __row.end());
+    _M_links.resize(_M_links.size() + 2, size_type(_S_none));
+    _M_ids.push_back(_M_ids.size());
+    _M_link(size() - 1);
+    return end() - 1;
+  }
+
+  // Appends the rows whose coordinates are read from [__first, __last), K
+  // at a time, and links them one after the other.  They must not be in
+  // this tree.
+  template <typename _InputIterator>
+  void
+  insert(_InputIterator __first, _InputIterator __last)
+  {
+    size_type const __n = size();
+    _M_coords.insert(_M_coords.end(), __first, __last);
+    assert(_M_coords.size() % _M_k == 0);
+    _M_links.resize(2 * size(), size_type(_S_none));
+    for (size_type __row = __n; __row != size(); ++__row)
+      {
+        _M_ids.push_back(__row);
+        _M_link(__row);
+      }
+  }
+
+  // Rebuilds the tree balanced, splitting each range of rows at its
+  // median like KDTree::optimise(), and moves the rows in pre-order: the
+  // rows of a subtree follow its root, those on the left first.
+  void
+  optimise()
+  {
+    if (this->empty())
+      return;
+    std::vector<size_type> __rows(size());
+    for (size_type __row = 0; __row != __rows.size(); ++__row)
+      __rows[__row] = __row;
+    _Storage __coords(_M_coords.size(), subvalue_type(),
+                      _M_coords.get_allocator());
+    std::vector<size_type> __ids(_M_ids.size());
+    _M_build(__rows.begin(), __rows.end(), 0, 0, __coords, __ids);
+    _M_coords.swap(__coords);
+    _M_ids.swap(__ids);
+    _M_root = 0;
+  }
+
+  // Returns a row with the same coordinates as __V, or end().
+  template <class SearchVal>
+  const_iterator
+  find(SearchVal const& __V) const
+  {
+    // Values equal to a split may be on either side of it, so both are
+    // searched.
+    _Traversal_stack<std::pair<size_type, size_type> > __stack;
+    if (_M_root != _S_none)
+      __stack.push(std::make_pair(_M_root, size_type(0)));
+    while (!__stack.empty())
+      {
+        std::pair<size_type, size_type> const __top = __stack.pop();
+        value_type const __row = _M_row(__top.first);
+        size_type const __dim = __top.second;
+        if (_M_matches(__row, __V))
+          return begin() + difference_type(__top.first);
+        size_type const __next = _M_next_dim(__dim);
+        if (!_M_cmp(__row[__dim], __V[__dim])
+            && _M_left(__top.first) != _S_none)
+          __stack.push(std::make_pair(_M_left(__top.first), __next));
+        if (!_M_cmp(__V[__dim], __row[__dim])
+            && _M_right(__top.first) != _S_none)
+          __stack.push(std::make_pair(_M_right(__top.first), __next));
+      }
+    return end();
+  }
+
+  // NOTE: see notes on KDTree::find_within_range().
+  template <typename SearchVal>
+  size_type
+  count_within_range(SearchVal const& __V, subvalue_type const __R) const
+  {
+    _Region_ __region(_M_k, __V, __R, _M_cmp);
+    return this->count_within_range(__region);
+  }
+
+  size_type
+  count_within_range(_Region_ const& __REGION) const
+  {
+    _Range_counter<value_type> __counter;
+    return _M_visit_within_range(__REGION, __counter)._M_count;
+  }
+
+  template <typename SearchVal, class Visitor>
+  Visitor
+  visit_within_range(SearchVal const& V, subvalue_type const R, Visitor visitor) const
+  {
+    _Region_ region(_M_k, V, R, _M_cmp);
+    return this->visit_within_range(region, visitor);
+  }
+
+  template <class Visitor>
+  Visitor
+  visit_within_range(_Region_ const& REGION, Visitor visitor) const
+  {
+    _Range_visitor<value_type, Visitor> __v(visitor);
+    return _M_visit_within_range(REGION, __v)._M_visitor;
+  }
+
+  template <typename SearchVal, typename _OutputIterator>
+  _OutputIterator
+  find_within_range(SearchVal const& val, subvalue_type const range,
+                    _OutputIterator out) const
+  {
+    _Region_ region(_M_k, val, range, _M_cmp);
+    return this->find_within_range(region, out);
+  }
+
+  template <typename _OutputIterator>
+  _OutputIterator
+  find_within_range(_Region_ const& region,
+                    _OutputIterator out) const
+  {
+    _Range_output<value_type, _OutputIterator> __v(out);
+    return _M_visit_within_range(region, __v)._M_out;
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest (SearchVal const& __val) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared(__val);
+    __r.second = std::sqrt(__r.second);
+    return __r;
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest (SearchVal const& __val, distance_type __max) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared(__val, _S_squared_bound(__max));
+    __r.second = __r.first == end() ? __max : std::sqrt(__r.second);
+    return __r;
+  }
+
+  template <class SearchVal, class _Predicate>
+  std::pair<const_iterator, distance_type>
+  find_nearest_if (SearchVal const& __val, distance_type __max,
+                   _Predicate __p) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared_if(__val, _S_squared_bound(__max), __p);
+    __r.second = __r.first == end() ? __max : std::sqrt(__r.second);
+    return __r;
+  }
+
+  // Same as KDTree::find_nearest_squared(): __max and the distance
+  // returned are in the units of _Dist.
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared (SearchVal const& __val) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = _M_find_nearest(__val, std::numeric_limits<distance_type>::max(),
+                        always_true<value_type>());
+    if (__r.first == end())
+      __r.second = distance_type();
+    return __r;
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared (SearchVal const& __val, distance_type __max) const
+  {
+    return _M_find_nearest(__val, __max, always_true<value_type>());
+  }
+
+  template <class SearchVal, class _Predicate>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared_if (SearchVal const& __val, distance_type __max,
+                           _Predicate __p) const
+  {
+    return _M_find_nearest(__val, __max, __p);
+  }
+
+  // Same as KDTree::find_k_nearest().
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<const_iterator, distance_type>* __out) const
+  {
+    return _M_find_k_nearest(__val, __k, __out,
+                             std::numeric_limits<distance_type>::max(),
+                             always_true<value_type>());
+  }
+
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<const_iterator, distance_type>* __out,
+                 distance_type const __max) const
+  {
+    return _M_find_k_nearest(__val, __k, __out, _S_squared_bound(__max),
+                             always_true<value_type>());
+  }
+
+  template <class SearchVal, class _Predicate>
+  size_type
+  find_k_nearest_if(SearchVal const& __val, size_type const __k,
+                    std::pair<const_iterator, distance_type>* __out,
+                    distance_type const __max, _Predicate __p) const
+  {
+    return _M_find_k_nearest(__val, __k, __out, _S_squared_bound(__max), __p);
+  }
+
+protected:
+  // The link to a missing child.
+  static size_type const _S_none = size_type(-1);
+
+  value_type
+  _M_data() const
+  { return _M_coords.empty() ? 0 : &_M_coords[0]; }
+
+  value_type
+  _M_row(size_type const __row) const
+  { return &_M_coords[__row * _M_k]; }
+
+  size_type
+  _M_left(size_type const __row) const
+  { return _M_links[2 * __row]; }
+
+  size_type
+  _M_right(size_type const __row) const
+  { return _M_links[2 * __row + 1]; }
+
+  size_type
+  _M_next_dim(size_type const __dim) const
+  { return __dim + 1 == _M_k ? 0 : __dim + 1; }
+
+  template <class SearchVal>
+  bool
+  _M_matches(value_type const __row, SearchVal const& __V) const
+  {
+    for (size_type __i = 0; __i != _M_k; ++__i)
+      if (_M_cmp(__row[__i], __V[__i]) || _M_cmp(__V[__i], __row[__i]))
+        return false;
+    return true;
+  }
+
+  // Summed one dimension at a time like _S_accumulate_node_distance(), so
+  // that the distances come out identical to those of a KDTree.
+  template <class SearchVal>
+  distance_type
+  _M_distance(value_type const __row, SearchVal const& __val) const
+  {
+    distance_type __d = 0;
+    for (size_type __i = 0; __i != _M_k; ++__i)
+      __d += _M_dist(__row[__i], __val[__i]);
+    return __d;
+  }
+
+  // Orders the positions of rows on one of their coordinates.
+  struct _Row_compare
+  {
+    _Row_compare(DynamicKDTree const& __tree, size_type const __dim)
+      : _M_coords(__tree._M_data() + __dim), _M_k(__tree._M_k),
+        _M_cmp(__tree._M_cmp) {}
+
+    bool
+    operator()(size_type const __a, size_type const __b) const
+    { return _M_cmp(_M_coords[__a * _M_k], _M_coords[__b * _M_k]); }
+
+    value_type _M_coords;
+    size_type _M_k;
+    _Cmp _M_cmp;
+  };
+
+  // Copies the median of the rows [__A, __B) on dimension __L % K to
+  // position __SLOT of __coords and __ids, and the rows on either side of
+  // it to the positions after, linked below it.
+  void
+  _M_build(std::vector<size_type>::iterator const& __A,
+           std::vector<size_type>::iterator const& __B, size_type const __L,
+           size_type const __SLOT, _Storage& __coords,
+           std::vector<size_type>& __ids)
+  {
+    std::vector<size_type>::iterator const __m = __A + (__B - __A) / 2;
+    std::nth_element(__A, __m, __B, _Row_compare(*this, __L % _M_k));
+    std::copy(_M_row(*__m), _M_row(*__m) + _M_k, &__coords[__SLOT * _M_k]);
+    __ids[__SLOT] = _M_ids[*__m];
+    size_type const __right = __SLOT + 1 + (__m - __A);
+    _M_links[2 * __SLOT] = __m != __A ? __SLOT + 1 : size_type(_S_none);
+    _M_links[2 * __SLOT + 1] = __m + 1 != __B ? __right : size_type(_S_none);
+    if (__m != __A)
+      _M_build(__A, __m, __L + 1, __SLOT + 1, __coords, __ids);
+    if (__m + 1 != __B)
+      _M_build(__m + 1, __B, __L + 1, __right, __coords, __ids);
+  }
+
+  // Links __row below the leaf it falls under, on the left of a split it
+  // is less than and on the right otherwise, like KDTree::insert().
+  void
+  _M_link(size_type const __row)
+  {
+    if (_M_root == _S_none)
+      {
+        _M_root = __row;
+        return;
+      }
+    value_type const __v = _M_row(__row);
+    size_type __node = _M_root;
+    size_type __dim = 0;
+    for (;;)
+      {
+        size_type& __child = _M_links[2 * __node
+                                      + !_M_cmp(__v[__dim], _M_row(__node)[__dim])];
+        if (__child == _S_none)
+          {
+            __child = __row;
+            return;
+          }
+        __node = __child;
+        __dim = _M_next_dim(__dim);
+      }
+  }
+
+  // Visits the rows in __REGION in pre-order, skipping a child as soon as
+  // the region lies entirely on the other side of its parent's split.
+  template <class _Visitor>
+  _Visitor&
+  _M_visit_within_range(_Region_ const& __REGION, _Visitor& __visitor) const
+  {
+    _Traversal_stack<std::pair<size_type, size_type> > __stack;
+    if (_M_root != _S_none)
+      __stack.push(std::make_pair(_M_root, size_type(0)));
+    while (!__stack.empty())
+      {
+        std::pair<size_type, size_type> const __top = __stack.pop();
+        size_type __node = __top.first;
+        size_type __dim = __top.second;
+        for (;;)
+          {
+            value_type const __v = _M_row(__node);
+            if (__REGION.encloses(__v))
+              __visitor(__v);
+            subvalue_type const __split = __v[__dim];
+            bool const __left = !_M_cmp(__split, __REGION._M_low_bounds[__dim]);
+            bool const __right = !_M_cmp(__REGION._M_high_bounds[__dim], __split);
+            __dim = _M_next_dim(__dim);
+            size_type const __l = _M_left(__node);
+            size_type const __r = _M_right(__node);
+            if (__right && __r != _S_none)
+              {
+                if (!__left || __l == _S_none)
+                  {
+                    __node = __r;
+                    continue;
+                  }
+                __stack.push(std::make_pair(__r, __dim));
+              }
+            if (!__left || __l == _S_none)
+              break;
+            __node = __l;
+          }
+      }
+    return __visitor;
+  }
+
+  // Collects the single nearest row; ties go to the last one offered,
+  // like in the KDTree.
+  struct _Nearest
+  {
+    _Nearest(distance_type const __max) : _M_best(_S_none), _M_max(__max) {}
+
+    void
+    offer(size_type const __row, distance_type const __d)
+    {
+      _M_best = __row;
+      _M_max = __d;
+    }
+
+    size_type _M_best;
+    distance_type _M_max;
+  };
+
+  typedef _K_nearest_heap<const_iterator, distance_type> _K_nearest_heap_;
+
+  // Collects the k nearest rows into a _K_nearest_heap.
+  struct _K_nearest
+  {
+    _K_nearest(_K_nearest_heap_& __heap, const_iterator const& __begin)
+      : _M_heap(__heap), _M_begin(__begin), _M_max(__heap._M_max) {}
+
+    void
+    offer(size_type const __row, distance_type const __d)
+    {
+      _M_heap.offer(_M_begin + difference_type(__row), __d);
+      _M_max = _M_heap._M_max;
+    }
+
+    _K_nearest_heap_& _M_heap;
+    const_iterator _M_begin;
+    distance_type _M_max;
+  };
+
+  struct _Pending
+  {
+    size_type _M_node;
+    size_type _M_dim;
+    distance_type _M_plane;
+  };
+
+  // Searches in the units of _Dist (squared, for the default functor),
+  // offering __collector every row within its _M_max, which only ever
+  // shrinks, nearer subtrees first.
+  template <class SearchVal, class _Predicate, class _Collector>
+  void
+  _M_search_nearest(SearchVal const& __val, _Predicate __p,
+                    _Collector& __collector) const
+  {
+    _Traversal_stack<_Pending> __stack;
+    if (_M_root != _S_none)
+      {
+        _Pending const __root = { _M_root, 0, distance_type() };
+        __stack.push(__root);
+      }
+    while (!__stack.empty())
+      {
+        _Pending const __pending = __stack.pop();
+        if (__collector._M_max < __pending._M_plane)
+          continue;
+        size_type __node = __pending._M_node;
+        size_type __dim = __pending._M_dim;
+        for (;;)
+          {
+            value_type const __v = _M_row(__node);
+            if (__p(__v))
+              {
+                distance_type const __d = _M_distance(__v, __val);
+                if (!(__collector._M_max < __d))
+                  __collector.offer(__node, __d);
+              }
+            size_type __near = _M_left(__node);
+            size_type __far = _M_right(__node);
+            if (!_M_cmp(__val[__dim], __v[__dim]))
+              std::swap(__near, __far);
+            distance_type const __plane = _M_dist(__val[__dim], __v[__dim]);
+            __dim = _M_next_dim(__dim);
+            if (__far != _S_none && !(__collector._M_max < __plane))
+              {
+                _Pending const __far_pending = { __far, __dim, __plane };
+                __stack.push(__far_pending);
+              }
+            if (__near == _S_none)
+              break;
+            __node = __near;
+          }
+      }
+  }
+
+  // __max, and the distance returned, are in the units of _Dist.
+  template <class SearchVal, class _Predicate>
+  std::pair<const_iterator, distance_type>
+  _M_find_nearest(SearchVal const& __val, distance_type const __max,
+                  _Predicate __p) const
+  {
+    _Nearest __nearest(__max);
+    _M_search_nearest(__val, __p, __nearest);
+    if (__nearest._M_best == _S_none)
+      return std::pair<const_iterator, distance_type>(end(), __max);
+    return std::pair<const_iterator, distance_type>
+      (begin() + difference_type(__nearest._M_best), __nearest._M_max);
+  }
+
+  template <class SearchVal, class _Predicate>
+  size_type
+  _M_find_k_nearest(SearchVal const& __val, size_type const __k,
+                    std::pair<const_iterator, distance_type>* __out,
+                    distance_type const __max, _Predicate __p) const
+  {
+    if (empty() || !__k) return 0;
+    _K_nearest_heap_ __heap(__out, __k, __max);
+    _K_nearest __k_nearest(__heap, begin());
+    _M_search_nearest(__val, __p, __k_nearest);
+    return __heap.finish(_Square_root());
+  }
+
+  // The coordinates of the row at position r are _M_coords[r*K] to
+  // _M_coords[r*K + K-1], the positions of the rows of its children
+  // _M_links[2r] and _M_links[2r + 1], or _S_none, and its id _M_ids[r].
+  size_type _M_k;
+  _Storage _M_coords;
+  std::vector<size_type> _M_links;
+  std::vector<size_type> _M_ids;
+  size_type _M_root;
+  _Cmp _M_cmp;
+  _Dist _M_dist;
+};
+
+} // namespace KDTree
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
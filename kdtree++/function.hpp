@@ -9,6 +9,9 @@
 #define INCLUDE_KDTREE_ACCESSOR_HPP
 
 #include <cstddef>
+#include <cmath>
+#include <limits>
+#include <math.h>
 
 namespace KDTree
 {
@@ -71,6 +74,101 @@ namespace KDTree
     mutable long _M_count;
   };
 
+  /*! Largest squared distance whose square root does not exceed __max.
+
+      Searches that prune in squared units use this bound, so that a
+      squared distance d is accepted exactly when std::sqrt(d) <= __max.
+      Squaring __max alone can be off by one unit in the last place either
+      way.
+
+      For integer distances, the square root is the one the searches
+      return, rounded down: d is accepted when floor(sqrt(d)) <= __max, as
+      when they compared truncated square roots, and the bound is
+      (__max + 1)^2 - 1.  It saturates to the largest value of the type
+      rather than overflow.  Other types are squared as they are.
+   */
+  template <typename _Tp, bool = std::numeric_limits<_Tp>::is_integer>
+  struct _Squared_bound
+  {
+    static _Tp
+    _S_bound(_Tp const __max)
+    { return __max * __max; }
+  };
+
+  template <typename _Tp>
+  struct _Squared_bound<_Tp, true>
+  {
+    static _Tp
+    _S_bound(_Tp const __max)
+    {
+      if (__max < _Tp(1) && __max != _Tp(0))
+        return _Tp(-1); // nothing passes a negative maximum
+      _Tp const __top = std::numeric_limits<_Tp>::max();
+      // floor(sqrt(__top)), corrected by division rather than overflow
+      _Tp __root = _Tp(std::sqrt(double(__top)));
+      while (__root > __top / __root)
+        --__root;
+      while (__root + 1 <= __top / (__root + 1))
+        ++__root;
+      if (!(__max < __root))
+        return __top;
+      return (__max + 1) * (__max + 1) - 1;
+    }
+  };
+
+  template <typename _Tp>
+  inline _Tp
+  _S_squared_bound(_Tp const __max)
+  { return _Squared_bound<_Tp>::_S_bound(__max); }
+
+  inline float
+  _S_next_after(float const __x, float const __to)
+  { return ::nextafterf(__x, __to); }
+
+  inline double
+  _S_next_after(double const __x, double const __to)
+  { return ::nextafter(__x, __to); }
+
+  inline long double
+  _S_next_after(long double const __x, long double const __to)
+  { return ::nextafterl(__x, __to); }
+
+  template <typename _Tp>
+  inline _Tp
+  _S_squared_float_bound(_Tp const __max)
+  {
+    if (!(__max >= 0))
+      return -1; // nothing but NaN passes a negative or NaN maximum
+    _Tp __s = __max * __max;
+    while (std::sqrt(__s) > __max)
+      __s = _S_next_after(__s, _Tp(0));
+    while (__s < std::numeric_limits<_Tp>::infinity()
+           && !(std::sqrt(_S_next_after(__s, std::numeric_limits<_Tp>::infinity())) > __max))
+      __s = _S_next_after(__s, std::numeric_limits<_Tp>::infinity());
+    return __s;
+  }
+
+  inline float
+  _S_squared_bound(float const __max)
+  { return _S_squared_float_bound(__max); }
+
+  inline double
+  _S_squared_bound(double const __max)
+  { return _S_squared_float_bound(__max); }
+
+  inline long double
+  _S_squared_bound(long double const __max)
+  { return _S_squared_float_bound(__max); }
+
+  //! Turns a squared distance found by a search back into a distance.
+  struct _Square_root
+  {
+    template <typename _Tp>
+    _Tp
+    operator()(_Tp const& __d) const
+    { return std::sqrt(__d); }
+  };
+
 } // namespace KDTree
 
 #endif // include guard
@@ -0,0 +1,373 @@
+/** \file
+ * Defines the interface for the KDForest class, a forest of randomised
+ * KD-Trees for approximate nearest neighbours searches in many dimensions.
+ *
+ * A KDTree splits on the dimension of each level in turn: in 64 or more
+ * dimensions, a tree of a million values only ever splits on its first 20,
+ * and a search has to look at most of it to find the nearest values.  A
+ * KDForest holds several trees over the same values, each splitting on its
+ * own sequence of dimensions, drawn at random, level after level, among
+ * the dimensions of highest variance not drawn yet.  The trees thus cut
+ * space differently, and a value that one of them puts far from the query
+ * is likely near it in another.
+ *
+ * The searches run down all the trees together, best-bin-first like the
+ * approximate searches of a KDTree: they always resume the nearest branch
+ * set aside in any of the trees, and their approximation, with its budget
+ * of max checks, counts the values measured in all the trees.  A value
+ * found in several trees is only returned once.
+ *
+ * The values are stored once, in a vector.  The trees are KDTrees of their
+ * indices, built like KDTree::efficient_replace_and_optimise() does, whose
+ * accessor reads, for the dimension of a level, the dimension the tree
+ * splits on there.  The coordinates must convert to double, to estimate
+ * the variances.  The forest cannot be modified once built.
+ *
+ * Requires C++11.
+ */
+
+#ifndef INCLUDE_KDTREE_KDFOREST_HPP
+#define INCLUDE_KDTREE_KDFOREST_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "kdtree.hpp"
+
+namespace KDTree
+{
+
+template <size_t const __K, typename _Val,
+          typename _Acc = _Bracket_accessor<_Val>,
+          typename _Dist = squared_difference<typename _Acc::result_type,
+          typename _Acc::result_type>,
+          typename _Cmp = std::less<typename _Acc::result_type>,
+          typename _Alloc = std::allocator<_Val> >
+class KDForest
+{
+  typedef std::vector<_Val, _Alloc> _Storage;
+
+public:
+  typedef _Val value_type;
+  typedef value_type const* const_pointer;
+  typedef value_type const& const_reference;
+  typedef typename _Acc::result_type subvalue_type;
+  typedef typename _Dist::distance_type distance_type;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef _Alloc allocator_type;
+
+  // No mutable iterator, the values can't be changed in place.
+  typedef typename _Storage::const_iterator const_iterator;
+  typedef const_iterator iterator;
+
+protected:
+  // A value of the trees: the index of a value of the forest.
+  struct _Ref
+  {
+    size_type _M_index;
+  };
+
+  // Reads dimension _M_dims[__d] where a tree asks for dimension __d, of
+  // the values of the forest, and of the queries.
+  class _Dims_accessor
+  {
+  public:
+    typedef subvalue_type result_type;
+
+    _Dims_accessor(_Acc const& __acc, const_pointer const __values,
+                   size_type const* const __dims)
+      : _M_acc(__acc), _M_values(__values), _M_dims(__dims) {}
+
+    result_type
+    operator()(_Ref const& __r, size_t const __d) const
+    { return _M_acc(_M_values[__r._M_index], _M_dims[__d]); }
+
+    template <typename SearchVal>
+    result_type
+    operator()(SearchVal const& __v, size_t const __d) const
+    { return _M_acc(__v, _M_dims[__d]); }
+
+  private:
+    _Acc _M_acc;
+    const_pointer _M_values;
+    size_type const* _M_dims;
+  };
+
+public:
+  typedef KDTree<__K, _Ref, _Dims_accessor, _Dist, _Cmp> tree_type;
+
+  /*! \brief Builds __trees trees over the values of [__first, __last).
+
+The dimensions the trees split on are drawn from a generator seeded with
+__seed: the same seed builds the same forest.
+   */
+  template <typename _InputIterator>
+  KDForest(_InputIterator __first, _InputIterator __last,
+           size_type const __trees = 4, unsigned const __seed = 5489u,
+           _Acc const& __acc = _Acc(), _Dist const& __dist = _Dist(),
+           _Cmp const& __cmp = _Cmp(),
+           allocator_type const& __a = allocator_type())
+    : _M_values(__first, __last, __a), _M_acc(__acc), _M_dist(__dist),
+      _M_cmp(__cmp)
+  { _M_build(__trees, __seed, NULL); }
+
+  // Same as above, each tree built by all the threads of __pool.
+  template <typename _InputIterator>
+  KDForest(_InputIterator __first, _InputIterator __last,
+           size_type const __trees, unsigned const __seed, thread_pool& __pool,
+           _Acc const& __acc = _Acc(), _Dist const& __dist = _Dist(),
+           _Cmp const& __cmp = _Cmp(),
+           allocator_type const& __a = allocator_type())
+    : _M_values(__first, __last, __a), _M_acc(__acc), _M_dist(__dist),
+      _M_cmp(__cmp)
+  { _M_build(__trees, __seed, &__pool); }
+
+  // The accessors of the trees point into the storage of the forest, which
+  // moves along with it, but is not shared with a copy.
+  KDForest(KDForest const&) = delete;
+  KDForest& operator=(KDForest const&) = delete;
+  KDForest(KDForest&&) = default;
+  KDForest& operator=(KDForest&&) = default;
+
+  allocator_type
+  get_allocator() const
+  { return _M_values.get_allocator(); }
+
+  size_type
+  size() const
+  { return _M_values.size(); }
+
+  bool
+  empty() const
+  { return _M_values.empty(); }
+
+  size_type
+  tree_count() const
+  { return _M_trees.size(); }
+
+  //! The dimension tree __t splits on at depth __depth.
+  size_type
+  split_dimension(size_type const __t, size_type const __depth) const
+  { return _M_dims[__t * __K + __depth % __K]; }
+
+  _Cmp
+  value_comp() const
+  { return _M_cmp; }
+
+  _Acc
+  value_acc() const
+  { return _M_acc; }
+
+  const _Dist&
+  value_distance() const
+  { return _M_dist; }
+
+  const_iterator begin() const { return _M_values.begin(); }
+  const_iterator end() const { return _M_values.end(); }
+
+  /*! \brief The value nearest to __val, within the bounds of __approx,
+      and its distance; end() and 0 if the forest is empty.
+
+Without max checks, the search is as exact as __approx allows, however
+many trees there are: it is the max checks that make the forest pay off.
+The search allocates a queue of branches for each tree.
+   */
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest(SearchVal const& __val,
+               approximation const& __approx = approximation()) const
+  {
+    _Unique<_Nearest_candidate_> __best
+      (_Nearest_candidate_(std::make_pair(end(), distance_type()),
+                           std::numeric_limits<distance_type>::max()),
+       begin());
+    if (!empty())
+      _M_search(__val, __approx, __best);
+    __best.finish(_Square_root());
+    return __best._M_best;
+  }
+
+  // Writes the (at most) __k values nearest to __val, within the bounds of
+  // __approx, with their distances, to __out[0] .. __out[n-1], nearest
+  // first, and returns n.
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<const_iterator, distance_type>* __out,
+                 approximation const& __approx = approximation()) const
+  {
+    if (empty() || !__k) return 0;
+    _Unique<_K_nearest_heap_> __heap
+      (_K_nearest_heap_(__out, __k, std::numeric_limits<distance_type>::max()),
+       begin());
+    _M_search(__val, __approx, __heap);
+    return __heap.finish(_Square_root());
+  }
+
+protected:
+  typedef typename tree_type::_Pending_branch_ _Pending_branch_;
+  typedef _K_nearest_heap<const_iterator, distance_type> _K_nearest_heap_;
+  typedef _Nearest_candidate<const_iterator, distance_type>
+    _Nearest_candidate_;
+
+  // How many values the variances are estimated from, at most.
+  static size_type const _S_sample_size = 1024;
+
+  // How many of the dimensions of highest variance left each level of a
+  // tree draws its split from.
+  static size_type const _S_split_candidates = 5;
+
+  // The candidates of a search, a _K_nearest_heap_ or a
+  // _Nearest_candidate_, where the values of the trees are turned into the
+  // values of the forest they point to, and kept once.
+  template <class _Heap>
+  struct _Unique : _Heap
+  {
+    _Unique(_Heap const& __heap, const_iterator const __values)
+      : _Heap(__heap), _M_values(__values) {}
+
+    void
+    offer(typename tree_type::const_iterator const& __it,
+          distance_type const __d)
+    {
+      const_iterator const __v = _M_values + (*__it)._M_index;
+      if (!this->holds(__v))
+        _Heap::offer(__v, __d);
+    }
+
+    const_iterator _M_values;
+  };
+
+  void
+  _M_build(size_type const __trees, unsigned const __seed,
+           thread_pool* const __pool)
+  {
+    assert(__trees);
+    if (_M_values.empty())
+      return;
+    size_type const __n = _M_values.size();
+    // rounded up, so that no more than _S_sample_size values are sampled
+    size_type const __step = (__n + _S_sample_size - 1) / _S_sample_size;
+    size_type __sampled = 0;
+    std::vector<double> __sum(__K), __sum2(__K);
+    for (size_type __i = 0; __i < __n; __i += __step, ++__sampled)
+      for (size_type __d = 0; __d != __K; ++__d)
+        {
+          double const __x = double(_M_acc(_M_values[__i], __d));
+          __sum[__d] += __x;
+          __sum2[__d] += __x * __x;
+        }
+    // the dimensions by decreasing variance, negated to sort first
+    std::vector<std::pair<double, size_type> > __spread(__K);
+    for (size_type __d = 0; __d != __K; ++__d)
+      {
+        double const __mean = __sum[__d] / __sampled;
+        __spread[__d].first = -(__sum2[__d] / __sampled - __mean * __mean);
+        __spread[__d].second = __d;
+      }
+    std::stable_sort(__spread.begin(), __spread.end());
+
+    std::mt19937 __random(__seed);
+    _M_dims.resize(__trees * __K);
+    for (size_type __t = 0; __t != __trees; ++__t)
+      {
+        std::vector<std::pair<double, size_type> > __left(__spread);
+        for (size_type __depth = 0; __depth != __K; ++__depth)
+          {
+            size_type const __pick = __random()
+              % std::min(size_type(_S_split_candidates), __left.size());
+            _M_dims[__t * __K + __depth] = __left[__pick].second;
+            __left.erase(__left.begin() + __pick);
+          }
+      }
+
+    std::vector<_Ref> __refs(__n);
+    for (size_type __i = 0; __i != __n; ++__i)
+      __refs[__i]._M_index = __i;
+    _M_trees.reserve(__trees);
+    for (size_type __t = 0; __t != __trees; ++__t)
+      {
+        _M_trees.push_back(tree_type(_Dims_accessor(_M_acc, _M_values.data(),
+                                                    &_M_dims[__t * __K]),
+                                     _M_dist, _M_cmp));
+        std::vector<_Ref> __v(__refs);
+        if (__pool)
+          _M_trees.back().efficient_replace_and_optimise(std::move(__v), *__pool);
+        else
+          _M_trees.back().efficient_replace_and_optimise(std::move(__v));
+      }
+  }
+
+  // The search of all the trees, see KDTree::_M_approximate_search(): the
+  // trees each keep a queue of branches, as a min-heap, and the search
+  // resumes the nearest branch at the top of any of them.  The forest is
+  // not empty.
+  template <class SearchVal, class _Heap>
+  void
+  _M_search(SearchVal const& __val, approximation const& __approx,
+            _Heap& __heap) const
+  {
+    double const __slack = (1 + __approx._M_epsilon) * (1 + __approx._M_epsilon);
+    size_type __checks = 0;
+    std::vector<std::vector<_Pending_branch_> > __queues(_M_trees.size());
+    for (size_type __t = 0; __t != _M_trees.size(); ++__t)
+      {
+        _Pending_branch_ const __root =
+          { _M_trees[__t]._M_get_root(), 0, distance_type() };
+        __queues[__t].push_back(__root);
+      }
+    for (;;)
+      {
+        size_type __t = _M_trees.size();
+        for (size_type __i = 0; __i != _M_trees.size(); ++__i)
+          if (!__queues[__i].empty()
+              && (__t == _M_trees.size()
+                  || __queues[__i].front()._M_bound
+                     < __queues[__t].front()._M_bound))
+            __t = __i;
+        if (__t == _M_trees.size())
+          break;
+        std::vector<_Pending_branch_>& __queue = __queues[__t];
+        std::pop_heap(__queue.begin(), __queue.end(),
+                      typename _Pending_branch_::_Further());
+        _Pending_branch_ const __next = __queue.back();
+        __queue.pop_back();
+        if (__heap._M_max < __next._M_bound * __slack
+            || !_M_trees[__t]._M_approximate_descent(__val, __next, __slack,
+                                                     __approx._M_max_checks,
+                                                     __checks, __heap, __queue))
+          break;
+      }
+  }
+
+  _Storage _M_values;
+  std::vector<size_type> _M_dims;
+  std::vector<tree_type> _M_trees;
+  _Acc _M_acc;
+  _Dist _M_dist;
+  _Cmp _M_cmp;
+};
+
+} // namespace KDTree
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
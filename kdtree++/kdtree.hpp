@@ -67,7 +67,9 @@
 #  include <map>
 #endif
 #include <algorithm>
+#include <bitset>
 #include <functional>
+#include <iterator>
 
 #ifdef KDTREE_DEFINE_OSTREAM_OPERATORS
 #  include <ostream>
@@ -77,6 +79,7 @@
 #include <cmath>
 #include <cstddef>
 #include <cassert>
+#include <limits>
 
 #include "function.hpp"
 #include "allocator.hpp"
@@ -84,6 +87,13 @@
 #include "node.hpp"
 #include "region.hpp"
 
+#if __cplusplus >= 201103L
+#  include <exception>
+#  include <type_traits>
+#  include "query_order.hpp"
+#  include "thread_pool.hpp"
+#endif
+
 namespace KDTree
 {
 
@@ -91,6 +101,17 @@ namespace KDTree
    unsigned long long num_dist_calcs = 0;
 #endif
 
+#if __cplusplus >= 201103L
+  //! Whether a KDTree can be moved, or move-assigned, without throwing:
+  //! its functors and its allocator are moved, or swapped, along with it.
+  template <typename _Tp>
+    struct _Nothrow_move
+    : std::integral_constant<bool,
+                             std::is_nothrow_move_constructible<_Tp>::value
+                             && std::is_nothrow_move_assignable<_Tp>::value>
+    {};
+#endif
+
 template <size_t const __K, typename _Val,
           typename _Acc = _Bracket_accessor<_Val>,
           typename _Dist = squared_difference<typename _Acc::result_type,
@@ -105,10 +126,13 @@ protected:
 
   typedef _Node_base* _Base_ptr;
   typedef _Node_base const* _Base_const_ptr;
-  typedef _Node<_Val>* _Link_type;
-  typedef _Node<_Val> const* _Link_const_type;
+  // _Node<_Val> unless _Alloc allocates a node type derived from it
+  typedef typename _Base::_Node_ _Node_type;
+  typedef _Node_type* _Link_type;
+  typedef _Node_type const* _Link_const_type;
 
   typedef _Node_compare<_Val, _Acc, _Cmp> _Node_compare_;
+  typedef _Node_super_compare<__K, _Val, _Acc, _Cmp> _Node_super_compare_;
 
 public:
   typedef _Region<__K, _Val, typename _Acc::result_type, _Acc, _Cmp>
@@ -126,36 +150,54 @@ public:
   KDTree(_Acc const& __acc = _Acc(), _Dist const& __dist = _Dist(),
          _Cmp const& __cmp = _Cmp(), const allocator_type& __a = allocator_type())
     : _Base(__a), _M_header(),
-      _M_count(0), _M_acc(__acc), _M_cmp(__cmp), _M_dist(__dist)
+      _M_count(0), _M_acc(__acc), _M_cmp(__cmp), _M_dist(__dist),
+      _M_balance(0), _M_max_count(0)
   {
      _M_empty_initialise();
   }
 
   KDTree(const KDTree& __x)
      : _Base(__x.get_allocator()), _M_header(), _M_count(0),
-       _M_acc(__x._M_acc), _M_cmp(__x._M_cmp), _M_dist(__x._M_dist)
+       _M_acc(__x._M_acc), _M_cmp(__x._M_cmp), _M_dist(__x._M_dist),
+       _M_balance(__x._M_balance), _M_max_count(0)
   {
      _M_empty_initialise();
      // this is slow:
      // this->insert(begin(), __x.begin(), __x.end());
      // this->optimise();
 
-     // this is much faster, as it skips a lot of useless work
-     // do the optimisation before inserting
-     // Needs to be stored in a vector first as _M_optimise()
-     // sorts the data in the passed iterators directly.
-     std::vector<value_type> temp;
-     temp.reserve(__x.size());
-     std::copy(__x.begin(),__x.end(),std::back_inserter(temp));
-     _M_optimise(temp.begin(), temp.end(), 0);
+     // this is much faster, as it copies the nodes of __x as they are,
+     // in one pass and into one block of nodes, rather than sorting
+     // their values again.
+     _M_clone(__x);
+  }
+
+#if __cplusplus >= 201103L
+  // Takes the nodes of __x over, leaving __x empty: no value is copied or
+  // moved, and iterators into __x now point into this tree.  The functors
+  // and the allocator are moved, so this only throws if moving one of
+  // them does.
+  KDTree(KDTree&& __x)
+    noexcept(_Nothrow_move<_Acc>::value && _Nothrow_move<_Cmp>::value
+             && _Nothrow_move<_Dist>::value
+             && _Nothrow_move<allocator_type>::value)
+     : _Base(std::move(__x)), _M_header(), _M_count(0),
+       _M_acc(std::move(__x._M_acc)), _M_cmp(std::move(__x._M_cmp)),
+       _M_dist(std::move(__x._M_dist)), _M_balance(__x._M_balance),
+       _M_max_count(0)
+  {
+     _M_empty_initialise();
+     _M_swap_nodes(__x);
   }
+#endif
 
   template<typename _InputIterator>
     KDTree(_InputIterator __first, _InputIterator __last,
            _Acc const& acc = _Acc(), _Dist const& __dist = _Dist(),
            _Cmp const& __cmp = _Cmp(), const allocator_type& __a = allocator_type())
     : _Base(__a), _M_header(), _M_count(0),
-      _M_acc(acc), _M_cmp(__cmp), _M_dist(__dist)
+      _M_acc(acc), _M_cmp(__cmp), _M_dist(__dist),
+      _M_balance(0), _M_max_count(0)
   {
      _M_empty_initialise();
      // this is slow:
@@ -163,13 +205,13 @@ public:
      // this->optimise();
 
      // this is much faster, as it skips a lot of useless work
-     // do the optimisation before inserting
+     // _M_optimise() links the medians directly into one block of nodes.
      // Needs to be stored in a vector first as _M_optimise()
      // sorts the data in the passed iterators directly.
      std::vector<value_type> temp;
      temp.reserve(std::distance(__first,__last));
      std::copy(__first,__last,std::back_inserter(temp));
-     _M_optimise(temp.begin(), temp.end(), 0);
+     _M_optimise(temp.begin(), temp.end(), 0, true);
 
      // NOTE: this will BREAK users that are passing in
      // read-once data via the iterator...
@@ -195,6 +237,40 @@ public:
      _M_optimise(writable_vector.begin(), writable_vector.end(), 0);
   }
 
+#if __cplusplus >= 201103L
+  // same as above, but the values are moved out of the vector into the
+  // nodes rather than copied, leaving it with unspecified values.
+  void efficient_replace_and_optimise( std::vector<value_type> && writable_vector )
+  {
+     this->clear();
+     _M_optimise(writable_vector.begin(), writable_vector.end(), 0, true);
+  }
+#endif
+
+#if __cplusplus >= 201103L
+  // same as above, but the tree is built by all the threads of __pool.
+  // The two halves below every median are built as separate tasks, and
+  // the medians of large ranges are selected by a partition that is
+  // itself split in tasks.  The tree is the same as the one built by
+  // efficient_replace_and_optimise(writable_vector), whatever the number
+  // of threads: only values that are equal on every dimension may swap
+  // places.
+  void efficient_replace_and_optimise( std::vector<value_type> & writable_vector,
+                                       thread_pool & __pool )
+  {
+     this->clear();
+     _M_optimise(writable_vector.begin(), writable_vector.end(), 0, __pool);
+  }
+
+  void efficient_replace_and_optimise( std::vector<value_type> && writable_vector,
+                                       thread_pool & __pool )
+  {
+     this->clear();
+     _M_optimise(writable_vector.begin(), writable_vector.end(), 0, __pool,
+                 true);
+  }
+#endif
+
 
 
   KDTree&
@@ -205,22 +281,47 @@ public:
   	    _M_acc = __x._M_acc;
   	    _M_dist = __x._M_dist;
   	    _M_cmp = __x._M_cmp;
-           // this is slow:
-           // this->insert(begin(), __x.begin(), __x.end());
-           // this->optimise();
-
-           // this is much faster, as it skips a lot of useless work
-           // do the optimisation before inserting
-           // Needs to be stored in a vector first as _M_optimise()
-           // sorts the data in the passed iterators directly.
-           std::vector<value_type> temp;
-           temp.reserve(__x.size());
-           std::copy(__x.begin(),__x.end(),std::back_inserter(temp));
-           efficient_replace_and_optimise(temp);
+  	    _M_balance = __x._M_balance;
+           // see the copy constructor
+           this->clear();
+           _M_clone(__x);
   	  }
   	return *this;
   }
 
+#if __cplusplus >= 201103L
+  KDTree&
+  operator=(KDTree&& __x)
+    noexcept(_Nothrow_move<_Acc>::value && _Nothrow_move<_Cmp>::value
+             && _Nothrow_move<_Dist>::value
+             && _Nothrow_move<allocator_type>::value)
+  {
+    if (this != &__x)
+      {
+        this->clear();
+        this->swap(__x);
+      }
+    return *this;
+  }
+#endif
+
+  /*! \brief Exchanges the contents of two trees in constant time.
+
+The nodes change hands along with the allocators, the functors and the
+balance factor; iterators keep pointing to the same values, in the other
+tree.  end() iterators are not exchanged.
+   */
+  void
+  swap(KDTree& __x)
+  {
+    _Base::_M_swap(__x);
+    std::swap(_M_acc, __x._M_acc);
+    std::swap(_M_cmp, __x._M_cmp);
+    std::swap(_M_dist, __x._M_dist);
+    std::swap(_M_balance, __x._M_balance);
+    _M_swap_nodes(__x);
+  }
+
   ~KDTree()
   {
     this->clear();
@@ -253,11 +354,13 @@ public:
   void
   clear()
   {
-    _M_erase_subtree(_M_get_root());
+    _M_clear_nodes(typename _Base::_Use_release_());
+    _Base::_M_deallocate_block();
     _M_set_leftmost(&_M_header);
     _M_set_rightmost(&_M_header);
     _M_set_root(NULL);
     _M_count = 0;
+    _M_max_count = 0;
   }
 
   /*! \brief Comparator for the values in the KDTree.
@@ -316,18 +419,31 @@ behavior of the find and find_nearest functions.
   iterator
   insert(const_reference __V)
   {
-    if (!_M_get_root())
-      {
-        _Link_type __n = _M_new_node(__V, &_M_header);
-        ++_M_count;
-        _M_set_root(__n);
-        _M_set_leftmost(__n);
-        _M_set_rightmost(__n);
-        return iterator(__n);
-      }
-    return _M_insert(_M_get_root(), __V, 0);
+    return _M_insert(_M_new_node(__V));
   }
 
+#if __cplusplus >= 201103L
+  iterator
+  insert(iterator /* ignored */, value_type&& __V)
+  {
+    return this->insert(std::move(__V));
+  }
+
+  iterator
+  insert(value_type&& __V)
+  {
+    return _M_insert(_M_new_node(std::move(__V)));
+  }
+
+  //! Inserts the value constructed from __args right into its node.
+  template <typename... _Args>
+  iterator
+  emplace(_Args&&... __args)
+  {
+    return _M_insert(_M_emplace_node(std::forward<_Args>(__args)...));
+  }
+#endif
+
   template <class _InputIterator>
   void insert(_InputIterator __first, _InputIterator __last) {
      for (; __first != __last; ++__first)
@@ -374,14 +490,24 @@ behavior of the find and find_nearest functions.
   erase(const_iterator const& __IT)
   {
      assert(__IT != this->end());
-    _Link_const_type target = __IT.get_raw_node();
+    _Link_const_type target = static_cast<_Link_const_type>(__IT.get_raw_node());
     _Link_const_type n = target;
     size_type level = 0;
     while ((n = _S_parent(n)) != &_M_header)
        ++level;
     _M_erase( const_cast<_Link_type>(target), level );
+    // every ancestor of target lost one value
+    _Base_ptr const __parent = target->_M_parent;
+    _M_update_path(__parent);
     _M_delete_node( const_cast<_Link_type>(target) );
     --_M_count;
+    if (_M_balance)
+      {
+        if (_M_count < _M_balance * _M_max_count)
+          _M_rebuild(_M_get_root(), 0);
+        else
+          _M_rebalance(__parent);
+      }
   }
 
 /* this does not work since erasure changes sort order
@@ -446,11 +572,8 @@ behavior of the find and find_nearest functions.
   size_type
   count_within_range(_Region_ const& __REGION) const
   {
-    if (!_M_get_root()) return 0;
-
-    _Region_ __bounds(__REGION);
-    return _M_count_within_range(_M_get_root(),
-                         __REGION, __bounds, 0);
+    _Range_counter<value_type> __counter;
+    return _M_visit_within_range(__REGION, __counter)._M_count;
   }
 
   // NOTE: see notes on find_within_range().
@@ -467,12 +590,8 @@ behavior of the find and find_nearest functions.
   Visitor
   visit_within_range(_Region_ const& REGION, Visitor visitor) const
   {
-    if (_M_get_root())
-      {
-        _Region_ bounds(REGION);
-        return _M_visit_within_range(visitor, _M_get_root(), REGION, bounds, 0);
-      }
-    return visitor;
+    _Range_visitor<value_type, Visitor> __v(visitor);
+    return _M_visit_within_range(REGION, __v)._M_visitor;
   }
 
   // NOTE: this will visit points based on 'Manhattan distance' aka city-block distance
@@ -500,63 +619,28 @@ behavior of the find and find_nearest functions.
   find_within_range(_Region_ const& region,
                     _OutputIterator out) const
   {
-    if (_M_get_root())
-      {
-        _Region_ bounds(region);
-        out = _M_find_within_range(out, _M_get_root(),
-                             region, bounds, 0);
-      }
-    return out;
+    _Range_output<value_type, _OutputIterator> __v(out);
+    return _M_visit_within_range(region, __v)._M_out;
   }
 
   template <class SearchVal>
   std::pair<const_iterator, distance_type>
   find_nearest (SearchVal const& __val) const
   {
-  	if (_M_get_root())
-  	  {
-  	    std::pair<const _Node<_Val>*,
-  	      std::pair<size_type, typename _Acc::result_type> >
-  	      best = _S_node_nearest (__K, 0, __val,
-  				      _M_get_root(), &_M_header, _M_get_root(),
-  				      std::sqrt(_S_accumulate_node_distance
-  				      (__K, _M_dist, _M_acc, _M_get_root()->_M_value, __val)),
-  				      _M_cmp, _M_acc, _M_dist,
-  				      always_true<value_type>());
-  	    return std::pair<const_iterator, distance_type>
-  	      (best.first, best.second.second);
-  	  }
-  	return std::pair<const_iterator, distance_type>(end(), 0);
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared(__val);
+    __r.second = std::sqrt(__r.second);
+    return __r;
   }
 
   template <class SearchVal>
   std::pair<const_iterator, distance_type>
   find_nearest (SearchVal const& __val, distance_type __max) const
   {
-  	if (_M_get_root())
-  	  {
-        bool root_is_candidate = false;
-  	    const _Node<_Val>* node = _M_get_root();
-        { // scope to ensure we don't use 'root_dist' anywhere else
-      	  distance_type root_dist = std::sqrt(_S_accumulate_node_distance
-    	      (__K, _M_dist, _M_acc, _M_get_root()->_M_value, __val));
-    	    if (root_dist <= __max)
-    	      {
-                root_is_candidate = true;
-                __max = root_dist;
-    	      }
-        }
-  	    std::pair<const _Node<_Val>*,
-  	      std::pair<size_type, typename _Acc::result_type> >
-  	      best = _S_node_nearest (__K, 0, __val, _M_get_root(), &_M_header,
-  				      node, __max, _M_cmp, _M_acc, _M_dist,
-  				      always_true<value_type>());
-         // make sure we didn't just get stuck with the root node...
-         if (root_is_candidate || best.first != _M_get_root())
-            return std::pair<const_iterator, distance_type>
-              (best.first, best.second.second);
-  	  }
-  	return std::pair<const_iterator, distance_type>(end(), __max);
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared(__val, _S_squared_bound(__max));
+    __r.second = __r.first == end() ? __max : std::sqrt(__r.second);
+    return __r;
   }
 
   template <class SearchVal, class _Predicate>
@@ -564,41 +648,407 @@ behavior of the find and find_nearest functions.
   find_nearest_if (SearchVal const& __val, distance_type __max,
        _Predicate __p) const
   {
-  	if (_M_get_root())
-  	  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared_if(__val, _S_squared_bound(__max), __p);
+    __r.second = __r.first == end() ? __max : std::sqrt(__r.second);
+    return __r;
+  }
+
+  // The find_nearest() functions search in the units of the _Dist functor
+  // (squared distances, for the default one) and only take the square root
+  // of the distance they return.  The functions below skip even that: both
+  // their __max and the distance they return are in the units of _Dist.
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared (SearchVal const& __val) const
+  {
+    if (_M_get_root())
+      {
+        std::pair<_Link_const_type, std::pair<size_type, distance_type> >
+          best = _S_node_nearest<__K> (0, __val,
+                                  _M_get_root(), &_M_header, _M_get_root(),
+                                  _S_accumulate_node_distance<__K>
+                                  (_M_dist, _M_acc, _M_get_root()->_M_value, __val),
+                                  _M_cmp, _M_acc, _M_dist,
+                                  always_true<value_type>());
+        return std::pair<const_iterator, distance_type>
+          (best.first, best.second.second);
+      }
+    return std::pair<const_iterator, distance_type>(end(), 0);
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared (SearchVal const& __val, distance_type __max) const
+  {
+    return this->find_nearest_squared_if(__val, __max,
+                                         always_true<value_type>());
+  }
+
+  template <class SearchVal, class _Predicate>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared_if (SearchVal const& __val, distance_type __max,
+                           _Predicate __p) const
+  {
+    if (_M_get_root())
+      {
         bool root_is_candidate = false;
-  	    const _Node<_Val>* node = _M_get_root();
-  	    if (__p(_M_get_root()->_M_value))
-  	      {
-              { // scope to ensure we don't use root_dist anywhere else
-          	    distance_type root_dist = std::sqrt(_S_accumulate_node_distance
-          		  (__K, _M_dist, _M_acc, _M_get_root()->_M_value, __val));
-            		if (root_dist <= __max)
-            		  {
-                    root_is_candidate = true;
-            		    root_dist = __max;
-            		  }
+        if (__p(_M_get_root()->_M_value))
+          {
+            distance_type const root_dist = _S_accumulate_node_distance<__K>
+              (_M_dist, _M_acc, _M_get_root()->_M_value, __val);
+            if (root_dist <= __max)
+              {
+                root_is_candidate = true;
+                __max = root_dist;
               }
-  	      }
-  	    std::pair<const _Node<_Val>*,
-  	      std::pair<size_type, typename _Acc::result_type> >
-  	      best = _S_node_nearest (__K, 0, __val, _M_get_root(), &_M_header,
-  				      node, __max, _M_cmp, _M_acc, _M_dist, __p);
-         // make sure we didn't just get stuck with the root node...
-         if (root_is_candidate || best.first != _M_get_root())
-            return std::pair<const_iterator, distance_type>
-              (best.first, best.second.second);
-  	  }
-  	return std::pair<const_iterator, distance_type>(end(), __max);
+          }
+        std::pair<_Link_const_type, std::pair<size_type, distance_type> >
+          best = _S_node_nearest<__K> (0, __val, _M_get_root(), &_M_header,
+                                  _M_get_root(), __max, _M_cmp, _M_acc, _M_dist,
+                                  __p);
+        // make sure we didn't just get stuck with the root node...
+        if (root_is_candidate || best.first != _M_get_root())
+          return std::pair<const_iterator, distance_type>
+            (best.first, best.second.second);
+      }
+    return std::pair<const_iterator, distance_type>(end(), __max);
+  }
+
+  /*! \brief Where the last find_nearest() through it went down to, and
+      what it found there.
+
+The next find_nearest() given the cursor climbs from the leaf the last one
+reached only up to the lowest node whose cell holds the new query, and
+searches down from there, with the distance to the last result as its
+first bound, rather than from the root; it then climbs on only as long as
+the ball around the query reaches across the splits above.  When
+consecutive queries are close, as in tracking, it thus stays among the
+nodes near them.  For queries far apart, it costs about as much as a search
+from the root.
+
+A cursor refers to nodes of the tree: like the iterators, it is invalid
+once they are erased, and it must be reset() (or be a new cursor) after any
+change to the tree, or to use it with another tree.
+   */
+  class nearest_cursor
+  {
+  public:
+    nearest_cursor() : _M_best(NULL), _M_leaf(NULL), _M_depth(0) {}
+
+    //! Makes the next search start from the root.
+    void
+    reset()
+    { _M_best = _M_leaf = NULL; _M_depth = 0; }
+
+  private:
+    friend class KDTree;
+
+    _Link_const_type _M_best;
+    _Link_const_type _M_leaf;
+    size_type _M_depth;
+  };
+
+  /*! \brief Same as find_nearest(), but starts from where the previous
+      search with __cursor ended, and leaves __cursor there.
+
+Returns the same distance as find_nearest(); among values tied at that
+distance, it may return another.
+   */
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest (SearchVal const& __val, nearest_cursor& __cursor) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared(__val, __cursor);
+    __r.second = std::sqrt(__r.second);
+    return __r;
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared (SearchVal const& __val, nearest_cursor& __cursor) const
+  {
+    if (!_M_get_root())
+      {
+        __cursor.reset();
+        return std::pair<const_iterator, distance_type>(end(), 0);
+      }
+    if (!__cursor._M_leaf)
+      __cursor._M_best = __cursor._M_leaf = _M_get_root();
+    // up from the last leaf to the lowest node whose cell holds __val...
+    size_type __top_depth = __cursor._M_depth;
+    _Link_const_type __top
+      = _M_lowest_cell_holding(__val, __cursor._M_leaf, __top_depth);
+    // ... and down from there, past the leaf of __val, for the next search
+    _Link_const_type __best = __cursor._M_best;
+    distance_type __max = _S_accumulate_node_distance<__K>
+      (_M_dist, _M_acc, __best->_M_value, __val);
+    _M_nearest_in_subtree(__val, __top, __top_depth, __best, __max, &__cursor);
+    // Nothing outside the subtree of __top is nearer once the ball of
+    // radius __max around __val crosses none of the splits above it, for
+    // the values on the other side of a split are, at least, as far as
+    // the split.  __max only shrinks: the splits above the highest one
+    // crossed stay clear, and it takes climbing past that one to find out
+    // whether another, higher still, is crossed now.
+    _Link_const_type __crossed
+      = _M_highest_split_crossed(__val, __top, __top_depth, __max);
+    while (__crossed)
+      {
+        _Link_const_type const __parent = _S_parent(__top);
+        size_type const __parent_depth = __top_depth - 1;
+        distance_type const __d = _S_accumulate_node_distance<__K>
+          (_M_dist, _M_acc, __parent->_M_value, __val);
+        if (__d < __max)
+          {
+            __best = __parent;
+            __max = __d;
+          }
+        _Link_const_type const __other = _S_left(__parent) == __top
+          ? _S_right(__parent) : _S_left(__parent);
+        if (__other
+            && !(__max < _S_node_distance(__parent_depth % __K, _M_dist, _M_acc,
+                                          __val, __parent->_M_value)))
+          _M_nearest_in_subtree(__val, __other, __parent_depth + 1,
+                                __best, __max);
+        __top = __parent;
+        __top_depth = __parent_depth;
+        if (__top == __crossed)
+          __crossed = _M_highest_split_crossed(__val, __top, __top_depth, __max);
+      }
+    __cursor._M_best = __best;
+    return std::pair<const_iterator, distance_type>(__best, __max);
+  }
+
+  // Finds the (at most) __k values nearest to __val, and writes them with
+  // their distances to __out[0] .. __out[n-1], nearest first.  Returns n,
+  // which is less than __k only if the tree has fewer matching values.
+  //
+  // __out must have room for __k pairs.  The search keeps its candidates
+  // there, as a max-heap, and narrows its radius to the furthest of them
+  // once it has __k: it makes no allocation.  Among values tied at the
+  // distance of the k-th, the first ones found are kept.
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<const_iterator, distance_type>* __out) const
+  {
+    return _M_find_k_nearest(__val, __k, __out,
+                             std::numeric_limits<distance_type>::max(),
+                             always_true<value_type>());
+  }
+
+  // Same as above, but only for the values within __max of __val.
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<const_iterator, distance_type>* __out,
+                 distance_type const __max) const
+  {
+    return _M_find_k_nearest(__val, __k, __out, _S_squared_bound(__max),
+                             always_true<value_type>());
+  }
+
+  // Same as above, but only for the values satisfying the predicate __p.
+  template <class SearchVal, class _Predicate>
+  size_type
+  find_k_nearest_if(SearchVal const& __val, size_type const __k,
+                    std::pair<const_iterator, distance_type>* __out,
+                    distance_type const __max, _Predicate __p) const
+  {
+    return _M_find_k_nearest(__val, __k, __out, _S_squared_bound(__max), __p);
+  }
+
+  /*! \brief Same as find_nearest(), but may settle for a value a little
+      further away in exchange for a shorter search, as set by __approx.
+
+See approximation.  The search allocates a queue for its branches.
+   */
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest (SearchVal const& __val, approximation const& __approx) const
+  {
+    std::vector<_Pending_branch_> __queue;
+    return _M_find_nearest_approximate(__val, __approx, __queue);
+  }
+
+  // Same as find_k_nearest(), with the approximate search above.
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<const_iterator, distance_type>* __out,
+                 approximation const& __approx) const
+  {
+    std::vector<_Pending_branch_> __queue;
+    return _M_find_k_approximate(__val, __k, __out, __approx, __queue);
+  }
+
+  /*! \brief Runs find_nearest() for every query of [__first, __last),
+      writing the result for __first[i] to __out[i].
+
+The searches advance __width at a time, in turn, one node each: each
+prefetches the node it reads next before the others take their turn, so
+that the cache misses of all of them overlap, where a single search waits
+on each of its own.  This pays off once the tree outgrows the caches: on a
+tree that fits, keeping track of the searches costs more than it saves.
+With __width 1, the searches run one after the other; the default, 0,
+interleaves 16 of them only if the nodes are likely to outgrow the caches,
+see _M_interleave_width().  Widths above 16 count as 16.  The results are
+the same as find_nearest()'s, ties included.  Both iterators must be
+random access, and __first[i] must be a reference.
+   */
+  template <class _QueryIter, class _OutputIter>
+  void
+  batch_find_nearest(_QueryIter __first, _QueryIter __last,
+                     _OutputIter __out, size_type const __width = 0) const
+  {
+    _M_interleave_nearest(__first, __out, NULL, 0, __last - __first,
+                          _M_interleave_width(__width));
   }
 
+  // Same as above, with the approximate search of find_nearest(__val,
+  // __approx), one query after the other.  The queries share one queue.
+  template <class _QueryIter, class _OutputIter>
+  void
+  batch_find_nearest(_QueryIter __first, _QueryIter __last,
+                     _OutputIter __out, approximation const& __approx) const
+  {
+    _M_approximate_nearest(__first, __out, __approx, NULL, 0, __last - __first);
+  }
+
+#if __cplusplus >= 201103L
+  /*! \brief Runs find_nearest() for every query of [__first, __last) on
+      the threads of __pool.
+
+The result for __first[i] is written to __out[i]; both iterators must be
+random access.  The queries are run in chunks of __chunk consecutive ones,
+each a single task; the default, 0, makes about eight chunks per thread,
+so that the threads finishing early take over the remaining chunks.  Apart
+from the tasks, nothing is allocated.  The tree must not change meanwhile.
+
+With __order morton_order or hilbert_order, the queries run sorted along
+that curve instead, so that neighbouring ones run one after the other and
+share the nodes in cache, see query_order.hpp.  The results still go to
+the same places.  Sorting allocates only for the whole batch.
+
+Within a chunk, the searches are interleaved __width at a time like in
+the overload below, which also tells what the default, 0, means.
+   */
+  template <class _QueryIter, class _OutputIter>
+  void
+  batch_find_nearest(_QueryIter __first, _QueryIter __last, _OutputIter __out,
+                     thread_pool& __pool, size_type const __chunk = 0,
+                     query_order const __order = given_order,
+                     size_type const __width = 0) const
+  {
+    size_type const __w = _M_interleave_width(__width);
+    _M_run_batch_chunks(__first, __last - __first, __pool, __chunk, __order,
+                        [=](size_type const* __index, size_type const __b,
+                            size_type const __e)
+      {
+        this->_M_interleave_nearest(__first, __out, __index, __b, __e, __w);
+      });
+  }
+
+  // Same as above for find_k_nearest(): the results for __first[i] are
+  // written to __out[i * __k] onwards, and their number to __counts[i].
+  // __out must have room for __k results per query.
+  template <class _QueryIter, class _CountIter>
+  void
+  batch_find_k_nearest(_QueryIter __first, _QueryIter __last,
+                       size_type const __k,
+                       std::pair<const_iterator, distance_type>* __out,
+                       _CountIter __counts, thread_pool& __pool,
+                       size_type const __chunk = 0,
+                       query_order const __order = given_order) const
+  {
+    _M_run_batch(__first, __last - __first, __pool, __chunk, __order,
+                 [=](size_type const __i)
+      {
+        __counts[__i] = this->find_k_nearest(__first[__i], __k,
+                                             __out + __i * __k);
+      });
+  }
+
+  // Same as the two above, with the approximate searches of
+  // find_nearest(__val, __approx) and find_k_nearest(__val, __k, __out,
+  // __approx).  The queries of a chunk share one queue.
+  template <class _QueryIter, class _OutputIter>
+  void
+  batch_find_nearest(_QueryIter __first, _QueryIter __last, _OutputIter __out,
+                     approximation const& __approx, thread_pool& __pool,
+                     size_type const __chunk = 0,
+                     query_order const __order = given_order) const
+  {
+    _M_run_batch_chunks(__first, __last - __first, __pool, __chunk, __order,
+                        [=](size_type const* __index, size_type const __b,
+                            size_type const __e)
+      {
+        this->_M_approximate_nearest(__first, __out, __approx,
+                                     __index, __b, __e);
+      });
+  }
+
+  template <class _QueryIter, class _CountIter>
+  void
+  batch_find_k_nearest(_QueryIter __first, _QueryIter __last,
+                       size_type const __k,
+                       std::pair<const_iterator, distance_type>* __out,
+                       _CountIter __counts, approximation const& __approx,
+                       thread_pool& __pool, size_type const __chunk = 0,
+                       query_order const __order = given_order) const
+  {
+    _M_run_batch_chunks(__first, __last - __first, __pool, __chunk, __order,
+                        [=](size_type const* __index, size_type const __b,
+                            size_type const __e)
+      {
+        std::vector<_Pending_branch_> __queue;
+        for (size_type __i = __b; __i != __e; ++__i)
+          {
+            size_type const __q = __index ? __index[__i] : __i;
+            __counts[__q] = this->_M_find_k_approximate
+              (__first[__q], __k, __out + __q * __k, __approx, __queue);
+          }
+      });
+  }
+
+  // Same as above for count_within_range(), with the same range __R
+  // around every query.
+  template <class _QueryIter, class _CountIter>
+  void
+  batch_count_within_range(_QueryIter __first, _QueryIter __last,
+                           subvalue_type const __R, _CountIter __counts,
+                           thread_pool& __pool,
+                           size_type const __chunk = 0,
+                           query_order const __order = given_order) const
+  {
+    _M_run_batch(__first, __last - __first, __pool, __chunk, __order,
+                 [=](size_type const __i)
+      { __counts[__i] = this->count_within_range(__first[__i], __R); });
+  }
+#endif
+
   void
   optimise()
   {
-    std::vector<value_type> __v(this->begin(),this->end());
+    std::vector<value_type> __v;
+    _M_take_values(__v);
+    this->clear();
+    _M_optimise(__v.begin(), __v.end(), 0, true);
+  }
+
+#if __cplusplus >= 201103L
+  // Rebuilds the tree using all the threads of __pool, see
+  // efficient_replace_and_optimise(writable_vector, __pool).
+  void
+  optimise(thread_pool& __pool)
+  {
+    std::vector<value_type> __v;
+    _M_take_values(__v);
     this->clear();
-    _M_optimise(__v.begin(), __v.end(), 0);
+    _M_optimise(__v.begin(), __v.end(), 0, __pool, true);
   }
+#endif
 
   void
   optimize()
@@ -606,6 +1056,33 @@ behavior of the find and find_nearest functions.
     this->optimise();
   }
 
+  /*! \brief Keeps the tree balanced through insert() and erase().
+
+With a factor __alpha between 0.5 and 1, no subtree is let to hold more
+than __alpha times the values of its parent's: as soon as one would after
+an insert() or erase(), the subtree of the highest such parent is rebuilt
+on its own like optimise() would, by relinking its nodes.  The tree is
+also rebuilt once erase() leaves it with less than __alpha times the
+largest size it had since the last rebuild.  This keeps its depth within
+log(n) / log(1/__alpha) + 1, for an amortised O(log^2 n) per update.
+Smaller factors keep the tree shallower, at the price of more rebuilds;
+0.7 is a good start.  The default, 0, never rebalances.
+
+Existing imbalance is only repaired as updates come across it: call
+optimise() first to start from a balanced tree.
+   */
+  void
+  set_balance_factor(double const __alpha)
+  {
+    assert(__alpha == 0 || (__alpha >= 0.5 && __alpha < 1));
+    _M_balance = __alpha;
+    _M_max_count = _M_count;
+  }
+
+  double
+  balance_factor() const
+  { return _M_balance; }
+
   void check_tree()
   {
      _M_check_node(_M_get_root(),0);
@@ -634,6 +1111,8 @@ protected:
   {
      if (node)
      {
+        assert(node->_M_size == 1 + _Node_base::_S_size(node->_M_left)
+                                  + _Node_base::_S_size(node->_M_right));
         // (comparing on this level)
         // everything to the left of this node must be smaller than this
         _M_check_children( _S_left(node), node, level, true );
@@ -653,52 +1132,222 @@ protected:
     _M_set_root(NULL);
   }
 
+  // Exchanges the nodes of the two trees, but not their allocators: see
+  // swap().
+  void _M_swap_nodes(KDTree& __x)
+  {
+    std::swap(_M_root, __x._M_root);
+    std::swap(_M_header._M_left, __x._M_header._M_left);
+    std::swap(_M_header._M_right, __x._M_header._M_right);
+    std::swap(_M_count, __x._M_count);
+    std::swap(_M_max_count, __x._M_max_count);
+    _M_adopt_header();
+    __x._M_adopt_header();
+  }
+
+  // Points the root back to _M_header, or _M_header to itself if the tree
+  // is empty, after the nodes changed trees.
+  void _M_adopt_header()
+  {
+    if (_M_get_root())
+      _S_set_parent(_M_get_root(), &_M_header);
+    else
+      {
+        _M_set_leftmost(&_M_header);
+        _M_set_rightmost(&_M_header);
+      }
+  }
+
+  // Moves the values out of the nodes into __v, if that cannot throw, and
+  // copies them otherwise.  The tree is only fit to be cleared afterwards.
+  void
+  _M_take_values(std::vector<value_type>& __v)
+  {
+    __v.reserve(this->size());
+#if __cplusplus >= 201103L
+    for (const_iterator __i = this->begin(); __i != this->end(); ++__i)
+      __v.push_back(std::move_if_noexcept(const_cast<reference>(*__i)));
+#else
+    __v.assign(this->begin(), this->end());
+#endif
+  }
+
+  // Links __n, a new node holding the value to insert, as a leaf.
+  iterator
+  _M_insert(_Link_type const __n)
+  {
+    if (!_M_get_root())
+      {
+        _S_set_parent(__n, &_M_header);
+        ++_M_count;
+        _M_max_count = std::max(_M_max_count, _M_count);
+        _M_set_root(__n);
+        _M_set_leftmost(__n);
+        _M_set_rightmost(__n);
+        return iterator(__n);
+      }
+    _Link_type __N = _M_get_root();
+    bool __left;
+    try
+      {
+        for (size_type __L = 0; ; ++__L)
+          {
+            __left = _Node_compare_(__L % __K, _M_acc, _M_cmp)
+              (__n->_M_value, __N->_M_value);
+            if (__left ? !_S_left(__N)
+                : !_S_right(__N) || __N == _M_get_rightmost())
+              break;
+            __N = __left ? _S_left(__N) : _S_right(__N);
+          }
+      }
+    catch (...)
+      {
+        _M_delete_node(__n);
+        throw;
+      }
+    return __left ? _M_insert_left(__N, __n) : _M_insert_right(__N, __n);
+  }
+
   iterator
-  _M_insert_left(_Link_type __N, const_reference __V)
+  _M_insert_left(_Link_type __N, _Link_type const __n)
   {
-    _S_set_left(__N, _M_new_node(__V)); ++_M_count;
+    _S_set_left(__N, __n); ++_M_count;
     _S_set_parent( _S_left(__N), __N );
+    _M_update_path(__N);
     if (__N == _M_get_leftmost())
        _M_set_leftmost( _S_left(__N) );
-    return iterator(_S_left(__N));
+    return _M_inserted(_S_left(__N));
   }
 
   iterator
-  _M_insert_right(_Link_type __N, const_reference __V)
+  _M_insert_right(_Link_type __N, _Link_type const __n)
   {
-    _S_set_right(__N, _M_new_node(__V)); ++_M_count;
+    _S_set_right(__N, __n); ++_M_count;
     _S_set_parent( _S_right(__N), __N );
+    _M_update_path(__N);
     if (__N == _M_get_rightmost())
        _M_set_rightmost( _S_right(__N) );
-    return iterator(_S_right(__N));
+    return _M_inserted(_S_right(__N));
   }
 
   iterator
-  _M_insert(_Link_type __N, const_reference __V,
-         size_type const __L)
+  _M_inserted(_Link_type __N)
+  {
+    _M_max_count = std::max(_M_max_count, _M_count);
+    if (_M_balance)
+      _M_rebalance(__N);
+    return iterator(__N);
+  }
+
+  bool
+  _M_is_unbalanced(_Base_const_ptr __N) const
+  {
+    size_type const __child = std::max(_Node_base::_S_size(__N->_M_left),
+                                       _Node_base::_S_size(__N->_M_right));
+    return __child > _M_balance * __N->_M_size;
+  }
+
+  // Rebuilds the subtree of the highest ancestor of __N (__N included) that
+  // breaks the balance, if any.  Only the ancestors of __N changed size.
+  void
+  _M_rebalance(_Base_ptr __N)
   {
-    if (_Node_compare_(__L % __K, _M_acc, _M_cmp)(__V, __N->_M_value))
+    _Base_ptr __goat = NULL;
+    size_type __goat_height = 0;
+    size_type __height = 0;
+    for (; __N != &_M_header; __N = __N->_M_parent, ++__height)
+      if (_M_is_unbalanced(__N))
+        {
+          __goat = __N;
+          __goat_height = __height;
+        }
+    if (__goat)
+      _M_rebuild(static_cast<_Link_type>(__goat), __height - 1 - __goat_height);
+  }
+
+  // Rebuilds the subtree of __N, which is at depth __L, into a balanced one
+  // out of the same nodes.
+  void
+  _M_rebuild(_Link_type const __N, size_type const __L)
+  {
+    if (!__N) return;
+    std::vector<_Link_type> __nodes;
+    __nodes.reserve(__N->_M_size);
+    _Traversal_stack<_Link_type> __stack;
+    __stack.push(__N);
+    while (!__stack.empty())
+      for (_Link_type __n = __stack.pop(); __n; __n = _S_left(__n))
+        {
+          __nodes.push_back(__n);
+          if (_S_right(__n))
+            __stack.push(_S_right(__n));
+        }
+
+    _Base_ptr const __parent = __N->_M_parent;
+    _Link_type const __root
+      = _M_relink(__nodes.begin(), __nodes.end(), __L, __parent);
+    if (__parent == &_M_header)
       {
-        if (!_S_left(__N))
-          return _M_insert_left(__N, __V);
-        return _M_insert(_S_left(__N), __V, __L+1);
+        _M_set_root(__root);
+        _M_max_count = _M_count;
       }
+    else if (__parent->_M_left == __N)
+      __parent->_M_left = __root;
     else
-      {
-        if (!_S_right(__N) || __N == _M_get_rightmost())
-          return _M_insert_right(__N, __V);
-        return _M_insert(_S_right(__N), __V, __L+1);
-      }
+      __parent->_M_right = __root;
+    _M_set_leftmost(_Node_base::_S_minimum(_M_get_root()));
+    _M_set_rightmost(_Node_base::_S_maximum(_M_get_root()));
   }
 
-  _Link_type
-  _M_erase(_Link_type dead_dad, size_type const level)
+  // Compares nodes on the super key of their values.
+  struct _Link_super_compare
   {
-     // find a new step_dad, he will become a drop-in replacement.
-    _Link_type step_dad = _M_get_erase_replacement(dead_dad, level);
+    _Link_super_compare(_Node_super_compare_ const& __cmp)
+      : _M_cmp(__cmp) {}
 
-     // tell dead_dad's parent that his new child is step_dad
-    if (dead_dad == _M_get_root())
+    bool
+    operator()(_Link_const_type const __a, _Link_const_type const __b) const
+    { return _M_cmp(__a->_M_value, __b->_M_value); }
+
+    _Node_super_compare_ _M_cmp;
+  };
+
+  typedef typename std::vector<_Link_type>::iterator _Link_iterator;
+
+  // Same as _M_build(), but links the nodes of [__A, __B) under __PARENT
+  // rather than constructing new ones.
+  _Link_type
+  _M_relink(_Link_iterator const& __A, _Link_iterator const& __B,
+            size_type const __L, _Base_ptr const __PARENT)
+  {
+    _Link_super_compare compare
+      (_Node_super_compare_(__L % __K, _M_acc, _M_cmp));
+    _Link_iterator __m = __A + (__B - __A) / 2;
+    std::nth_element(__A, __m, __B, compare);
+    _Link_type const __n = *__m;
+    __n->_M_parent = __PARENT;
+    __n->_M_left = __m != __A ? _M_relink(__A, __m, __L+1, __n) : NULL;
+    __n->_M_right = ++__m != __B ? _M_relink(__m, __B, __L+1, __n) : NULL;
+    _Node_type::_S_update(__n);
+    return __n;
+  }
+
+  // The subtrees of __N and of all its ancestors changed.
+  void
+  _M_update_path(_Base_ptr __N)
+  {
+    for (; __N != &_M_header; __N = __N->_M_parent)
+       _Node_type::_S_update(__N);
+  }
+
+  _Link_type
+  _M_erase(_Link_type dead_dad, size_type const level)
+  {
+     // find a new step_dad, he will become a drop-in replacement.
+    _Link_type step_dad = _M_get_erase_replacement(dead_dad, level);
+
+     // tell dead_dad's parent that his new child is step_dad
+    if (dead_dad == _M_get_root())
        _M_set_root(step_dad);
     else if (_S_left(_S_parent(dead_dad)) == dead_dad)
         _S_set_left(_S_parent(dead_dad), step_dad);
@@ -727,6 +1376,7 @@ protected:
         // step_dad gets dead_dad's children
         _S_set_left(step_dad, _S_left(dead_dad));
         _S_set_right(step_dad, _S_right(dead_dad));
+        _Node_type::_S_update(step_dad);
       }
 
     return step_dad;
@@ -775,6 +1425,9 @@ protected:
        _S_set_left(parent, _M_erase(candidate.first, candidate.second));
     else
        _S_set_right(parent, _M_erase(candidate.first, candidate.second));
+    // the nodes between node and the candidate's old place lost one value
+    for (_Base_ptr p = parent; p != node; p = p->_M_parent)
+       _Node_type::_S_update(p);
 
     return candidate.first;
   }
@@ -840,6 +1493,19 @@ protected:
   }
 
 
+  void
+  _M_clear_nodes(_Use_release<false>)
+  {
+    _M_erase_subtree(_M_get_root());
+  }
+
+  // the nodes need no destruction and the allocator can free them in bulk
+  void
+  _M_clear_nodes(_Use_release<true>)
+  {
+    _Base::_M_release_nodes();
+  }
+
   void
   _M_erase_subtree(_Link_type __n)
   {
@@ -926,114 +1592,857 @@ protected:
       && _M_matches_node_in_other_ds(__N, __V, __L);
   }
 
+  typedef _K_nearest_heap<const_iterator, distance_type> _K_nearest_heap_;
+
+  // __max is in the units of _Dist, squared for the default functor.
+  template <class SearchVal, class _Predicate>
   size_type
-  _M_count_within_range(_Link_const_type __N, _Region_ const& __REGION,
-                       _Region_ const& __BOUNDS,
-                       size_type const __L) const
-    {
-       size_type count = 0;
-      if (__REGION.encloses(_S_value(__N)))
-        {
-           ++count;
-        }
-      if (_S_left(__N))
-        {
-          _Region_ __bounds(__BOUNDS);
-          __bounds.set_high_bound(_S_value(__N), __L);
-          if (__REGION.intersects_with(__bounds))
-            count += _M_count_within_range(_S_left(__N),
-                                 __REGION, __bounds, __L+1);
-        }
-      if (_S_right(__N))
-        {
-          _Region_ __bounds(__BOUNDS);
-          __bounds.set_low_bound(_S_value(__N), __L);
-          if (__REGION.intersects_with(__bounds))
-            count += _M_count_within_range(_S_right(__N),
-                                 __REGION, __bounds, __L+1);
-        }
+  _M_find_k_nearest(SearchVal const& __val, size_type const __k,
+                    std::pair<const_iterator, distance_type>* __out,
+                    distance_type const __max, _Predicate __p) const
+  {
+    if (!_M_get_root() || !__k) return 0;
+    _K_nearest_heap_ __heap(__out, __k, __max);
+    _M_find_k_nearest(_M_get_root(), 0, __val, __p, __heap);
+    return __heap.finish(_Square_root());
+  }
 
-      return count;
-    }
+  // Visits the nearer child of __N first, and the further one only if the
+  // splitting plane of __N is within reach of the candidates.
+  template <class SearchVal, class _Predicate>
+  void
+  _M_find_k_nearest(_Link_const_type __N, size_type const __L,
+                    SearchVal const& __val, _Predicate __p,
+                    _K_nearest_heap_& __heap) const
+  {
+    if (__p(_S_value(__N)))
+      {
+        distance_type const __d = _S_accumulate_node_distance<__K>
+          (_M_dist, _M_acc, _S_value(__N), __val);
+        if (!(__heap._M_max < __d))
+          __heap.offer(const_iterator(__N), __d);
+      }
+    _Link_const_type __near = _S_left(__N);
+    _Link_const_type __far = _S_right(__N);
+    if (!_S_node_compare(__L % __K, _M_cmp, _M_acc, __val, _S_value(__N)))
+      std::swap(__near, __far);
+    if (__near)
+      _M_find_k_nearest(__near, __L+1, __val, __p, __heap);
+    if (__far && !(__heap._M_max < _S_node_distance
+                   (__L % __K, _M_dist, _M_acc, __val, _S_value(__N))))
+      _M_find_k_nearest(__far, __L+1, __val, __p, __heap);
+  }
 
+  typedef _Pending_branch<_Node_type, distance_type> _Pending_branch_;
 
-  template <class Visitor>
-  Visitor
-  _M_visit_within_range(Visitor visitor,
-                       _Link_const_type N, _Region_ const& REGION,
-                       _Region_ const& BOUNDS,
-                       size_type const L) const
-    {
-      if (REGION.encloses(_S_value(N)))
-        {
-          visitor(_S_value(N));
-        }
-      if (_S_left(N))
-        {
-          _Region_ bounds(BOUNDS);
-          bounds.set_high_bound(_S_value(N), L);
-          if (REGION.intersects_with(bounds))
-            visitor = _M_visit_within_range(visitor, _S_left(N),
-                                 REGION, bounds, L+1);
-        }
-      if (_S_right(N))
-        {
-          _Region_ bounds(BOUNDS);
-          bounds.set_low_bound(_S_value(N), L);
-          if (REGION.intersects_with(bounds))
-            visitor = _M_visit_within_range(visitor, _S_right(N),
-                                 REGION, bounds, L+1);
-        }
+  // searches its trees together, see kdforest.hpp
+  template <size_t const, typename, typename, typename, typename, typename>
+    friend class KDForest;
 
-      return visitor;
-    }
+  typedef _Nearest_candidate<const_iterator, distance_type>
+    _Nearest_candidate_;
 
+  // find_k_nearest(__val, __k, __out, __approx), see _M_approximate_search().
+  template <class SearchVal>
+  size_type
+  _M_find_k_approximate(SearchVal const& __val, size_type const __k,
+                        std::pair<const_iterator, distance_type>* __out,
+                        approximation const& __approx,
+                        std::vector<_Pending_branch_>& __queue) const
+  {
+    if (!_M_get_root() || !__k) return 0;
+    _K_nearest_heap_ __heap(__out, __k,
+                            std::numeric_limits<distance_type>::max());
+    _M_approximate_search(__val, __approx, __heap, __queue);
+    return __heap.finish(_Square_root());
+  }
 
+  // find_nearest(__val, __approx), the same search for a single candidate.
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  _M_find_nearest_approximate(SearchVal const& __val,
+                              approximation const& __approx,
+                              std::vector<_Pending_branch_>& __queue) const
+  {
+    _Nearest_candidate_ __best(std::make_pair(end(), distance_type()),
+                               std::numeric_limits<distance_type>::max());
+    if (_M_get_root())
+      _M_approximate_search(__val, __approx, __best, __queue);
+    __best.finish(_Square_root());
+    return __best._M_best;
+  }
 
-  template <typename _OutputIterator>
-  _OutputIterator
-  _M_find_within_range(_OutputIterator out,
-                       _Link_const_type __N, _Region_ const& __REGION,
-                       _Region_ const& __BOUNDS,
-                       size_type const __L) const
-    {
-      if (__REGION.encloses(_S_value(__N)))
-        {
-          *out++ = _S_value(__N);
-        }
-      if (_S_left(__N))
-        {
-          _Region_ __bounds(__BOUNDS);
-          __bounds.set_high_bound(_S_value(__N), __L);
-          if (__REGION.intersects_with(__bounds))
-            out = _M_find_within_range(out, _S_left(__N),
-                                 __REGION, __bounds, __L+1);
-        }
-      if (_S_right(__N))
+  // The best-bin-first search of the approximate searches, offering the
+  // values it meets to __heap, a _K_nearest_heap_ or a _Nearest_candidate_,
+  // with __queue for the branches left aside, as a min-heap.  The search
+  // stops when the nearest pending branch is out of reach, so that without
+  // epsilon nor max checks, the result is exact.  The tree is not empty.
+  template <class SearchVal, class _Heap>
+  void
+  _M_approximate_search(SearchVal const& __val, approximation const& __approx,
+                        _Heap& __heap,
+                        std::vector<_Pending_branch_>& __queue) const
+  {
+    double const __slack = (1 + __approx._M_epsilon) * (1 + __approx._M_epsilon);
+    size_type __checks = 0;
+    __queue.clear();
+    _Pending_branch_ const __root = { _M_get_root(), 0, distance_type() };
+    __queue.push_back(__root);
+    while (!__queue.empty())
+      {
+        std::pop_heap(__queue.begin(), __queue.end(),
+                      typename _Pending_branch_::_Further());
+        _Pending_branch_ const __next = __queue.back();
+        __queue.pop_back();
+        if (__heap._M_max < __next._M_bound * __slack
+            || !_M_approximate_descent(__val, __next, __slack,
+                                       __approx._M_max_checks, __checks,
+                                       __heap, __queue))
+          break;
+      }
+  }
+
+  // Goes down from __branch towards __val, offering the values on the way
+  // to __heap, and adds the branches left aside that are still within
+  // reach to the min-heap __queue.  Returns false once __checks, the count
+  // of values measured, reaches __max_checks, unless that is 0.
+  //
+  // The bound of a branch is the distance of the query to its cell, as far
+  // as the splits above it tell.  Above depth __K, they are all on
+  // different dimensions, and the distance to the split the branch lies
+  // beyond adds up with the bound of the branch it was left aside from.
+  // Further down, the bound is the larger of the two.
+  template <class SearchVal, class _Heap>
+  bool
+  _M_approximate_descent(SearchVal const& __val,
+                         _Pending_branch_ const& __branch,
+                         double const __slack, size_type const __max_checks,
+                         size_type& __checks, _Heap& __heap,
+                         std::vector<_Pending_branch_>& __queue) const
+  {
+    size_type __L = __branch._M_depth;
+    for (_Link_const_type __N = __branch._M_node; __N; ++__L)
+      {
+        distance_type const __d = _S_accumulate_node_distance<__K>
+          (_M_dist, _M_acc, _S_value(__N), __val);
+        if (!(__heap._M_max < __d))
+          __heap.offer(const_iterator(__N), __d);
+        if (++__checks == __max_checks)
+          return false;
+        _Link_const_type __near = _S_left(__N);
+        _Link_const_type __far = _S_right(__N);
+        if (!_S_node_compare(__L % __K, _M_cmp, _M_acc, __val, _S_value(__N)))
+          std::swap(__near, __far);
+        if (__far)
+          {
+            distance_type const __split = _S_node_distance
+              (__L % __K, _M_dist, _M_acc, __val, _S_value(__N));
+            _Pending_branch_ const __pending =
+              { __far, __L + 1, __L < __K ? __branch._M_bound + __split
+                                          : std::max(__split, __branch._M_bound) };
+            if (!(__heap._M_max < __pending._M_bound * __slack))
+              {
+                __queue.push_back(__pending);
+                std::push_heap(__queue.begin(), __queue.end(),
+                               typename _Pending_branch_::_Further());
+              }
+          }
+        __N = __near;
+      }
+    return true;
+  }
+
+  // Feeds the values within __REGION to __visitor, in pre-order.
+  //
+  // The cell of a node is only narrower than its parent's in the parent's
+  // split dimension, so a child's cell meets the region as long as the
+  // region reaches the child's side of the split: there is no need to keep
+  // the bounds of the cells, nor to compare them on every dimension.  The
+  // right children still to visit wait on an explicit stack.
+  //
+  // For the same reason, a child's cell lies within the region on the
+  // split dimension once the region reaches past the split; __low and
+  // __high record the dimensions whose lower and upper cell bounds are
+  // inside the region.  Once both are full, the whole subtree is in the
+  // region and is handed to _S_visit_subtree() without any more tests.
+  template <class _Visitor>
+  _Visitor&
+  _M_visit_within_range(_Region_ const& __REGION, _Visitor& __visitor) const
+  {
+    _Traversal_stack<_Range_cell> __stack;
+    if (_M_get_root())
+      __stack.push(_Range_cell(_M_get_root()));
+    while (!__stack.empty())
+      {
+        _Range_cell __cell = __stack.pop();
+        _Link_const_type __N = __cell._M_node;
+        while (__N)
+          {
+            if ((__cell._M_low & __cell._M_high).count() == __K)
+              {
+                _S_visit_subtree(__N, __visitor);
+                break;
+              }
+            if (__REGION.encloses(_S_value(__N)))
+              __visitor(_S_value(__N));
+            size_type const __dim = __cell._M_dim;
+            subvalue_type const __split = _M_acc(_S_value(__N), __dim);
+            bool const __above_low = !_M_cmp(__split, __REGION._M_low_bounds[__dim]);
+            bool const __below_high = !_M_cmp(__REGION._M_high_bounds[__dim], __split);
+            bool const __left = _S_left(__N) && __above_low;
+            bool const __right = _S_right(__N) && __below_high;
+            if (++__cell._M_dim == __K)
+              __cell._M_dim = 0;
+            if (__right)
+              {
+                _Range_cell __right_cell(__cell);
+                __right_cell._M_node = _S_right(__N);
+                if (__above_low)
+                  __right_cell._M_low.set(__dim);
+                if (!__left)
+                  {
+                    __cell = __right_cell;
+                    __N = __cell._M_node;
+                    continue;
+                  }
+                __stack.push(__right_cell);
+              }
+            if (__below_high)
+              __cell._M_high.set(__dim);
+            __N = __left ? _S_left(__N) : NULL;
+          }
+      }
+    return __visitor;
+  }
+
+  // A subtree to visit, with its split dimension and the dimensions on
+  // which its cell is known to lie above the low, and below the high
+  // bounds of the region.
+  struct _Range_cell
+  {
+    _Range_cell(_Link_const_type const __N = NULL)
+      : _M_node(__N), _M_dim(0) {}
+
+    _Link_const_type _M_node;
+    size_type _M_dim;
+    std::bitset<__K> _M_low;
+    std::bitset<__K> _M_high;
+  };
+
+  // Visits every value of the subtree under __N, in pre-order.
+  template <class _Visitor>
+  static void
+  _S_visit_subtree(_Link_const_type __N, _Visitor& __visitor)
+  {
+    _Traversal_stack<_Link_const_type> __stack;
+    __stack.push(__N);
+    while (!__stack.empty())
+      for (__N = __stack.pop(); __N; __N = _S_left(__N))
         {
-          _Region_ __bounds(__BOUNDS);
-          __bounds.set_low_bound(_S_value(__N), __L);
-          if (__REGION.intersects_with(__bounds))
-            out = _M_find_within_range(out, _S_right(__N),
-                                 __REGION, __bounds, __L+1);
+          __visitor(_S_value(__N));
+          if (_S_right(__N))
+            __stack.push(_S_right(__N));
         }
+  }
 
-      return out;
-    }
+  // Counting needs no visit: the subtree knows its size.
+  static void
+  _S_visit_subtree(_Link_const_type __N, _Range_counter<value_type>& __counter)
+  {
+    __counter._M_count += __N->_M_size;
+  }
+
+  // Nor does aggregating, with _Aggregate_node.
+  template <typename _Agg>
+  static void
+  _S_visit_subtree(_Link_const_type __N,
+                   _Range_aggregate<value_type, _Agg>& __aggregate)
+  {
+    __aggregate._M_value
+      = __aggregate._M_agg.combine(__aggregate._M_value, __N->_M_aggregate);
+  }
 
 
+  // Builds a balanced tree out of [__A, __B) into an empty tree.
+  //
+  // Rather than insert()ing every median from the root again, each median
+  // is linked straight under its parent while recursing, and all the nodes
+  // are taken from one block allocation.  The nodes are laid out in
+  // pre-order: a subtree holding n values occupies n consecutive slots,
+  // its root first, followed by its left then its right subtree.
+  //
+  // The medians are selected on the "super key" of the values (see
+  // _Node_super_compare), so that the shape of the tree only depends on
+  // the values, and not on how the partitioning shuffled them.
+  //
+  // With __move, the values are moved out of [__A, __B) rather than copied
+  // (C++11 only).
   template <typename _Iter>
   void
   _M_optimise(_Iter const& __A, _Iter const& __B,
-              size_type const __L)
+              size_type const __L, bool const __move = false)
   {
+    assert(!_M_get_root());
     if (__A == __B) return;
-    _Node_compare_ compare(__L % __K, _M_acc, _M_cmp);
+    _Link_type __block = _Base::_M_allocate_block(__B - __A);
+    try
+      {
+        _M_set_built_root(_M_build(__A, __B, __L, &_M_header, __block,
+                                   __move), __B - __A);
+      }
+    catch (...)
+      {
+        _Base::_M_deallocate_block();
+        throw;
+      }
+  }
+
+  void
+  _M_set_built_root(_Link_type const __root, size_type const __n)
+  {
+    _M_set_root(__root);
+    _M_set_leftmost(_Node_base::_S_minimum(__root));
+    _M_set_rightmost(_Node_base::_S_maximum(__root));
+    _M_count = __n;
+    _M_max_count = __n;
+  }
+
+  // Builds [__A, __B) into the slots [__SLOT, __SLOT + (__B - __A)) and
+  // returns the subtree root.  If a value's copy throws, every node this
+  // call constructed is destroyed again before the exception propagates.
+  template <typename _Iter>
+  _Link_type
+  _M_build(_Iter const& __A, _Iter const& __B, size_type const __L,
+           _Base_ptr const __PARENT, _Link_type const __SLOT,
+           bool const __move)
+  {
+    _Node_super_compare_ compare(__L % __K, _M_acc, _M_cmp);
     _Iter __m = __A + (__B - __A) / 2;
     std::nth_element(__A, __m, __B, compare);
-    this->insert(*__m);
-    if (__m != __A) _M_optimise(__A, __m, __L+1);
-    if (++__m != __B) _M_optimise(__m, __B, __L+1);
+    _M_construct_built(__SLOT, *__m, __PARENT, __move);
+    try
+      {
+        if (__m != __A)
+          _S_set_left(__SLOT, _M_build(__A, __m, __L+1, __SLOT, __SLOT + 1,
+                                       __move));
+        if (++__m != __B)
+          _S_set_right(__SLOT, _M_build(__m, __B, __L+1, __SLOT,
+                                        __SLOT + (__m - __A), __move));
+      }
+    catch (...)
+      {
+        _M_destroy_subtree(__SLOT);
+        throw;
+      }
+    _Node_type::_S_update(__SLOT);
+    return __SLOT;
+  }
+
+  // The median's value is not looked at again once in its node, so it may
+  // be moved there.
+  void
+  _M_construct_built(_Link_type const __SLOT, value_type& __V,
+                     _Base_ptr const __PARENT, bool const __move)
+  {
+#if __cplusplus >= 201103L
+    if (__move)
+      {
+        _Base::_M_construct_node(__SLOT, std::move(__V), __PARENT);
+        return;
+      }
+#else
+    (void) __move;
+#endif
+    _Base::_M_construct_node(__SLOT, __V, __PARENT);
+  }
+
+  // Most searches batch_find_nearest() interleaves.
+  static size_type const _S_interleave_width = 16;
+
+  // Size of the nodes, scattered by insert(), past which interleaving the
+  // searches pays off; about where it did on a 2 MiB L2 cache.
+  static size_type const _S_interleave_bytes = size_type(8) << 20;
+
+  // The number of searches batch_find_nearest(..., __width) interleaves.
+  // For __width 0, 1 unless the nodes take _S_interleave_bytes, or 8 times
+  // as much if most of them lie in the block built by optimise() or by a
+  // copy: in pre-order, the nodes a search goes through are close to each
+  // other, and miss the caches much later.
+  size_type
+  _M_interleave_width(size_type const __width) const
+  {
+    if (__width)
+      return std::min(__width, size_type(_S_interleave_width));
+    size_type __bytes = _M_count * sizeof(_Node_type);
+    if (_Base::_M_block_size * 2 >= _M_count)
+      __bytes /= 8;
+    return __bytes < _S_interleave_bytes ? 1 : _S_interleave_width;
+  }
+
+  // Runs find_nearest() for the queries __first[__index[i]], or
+  // __first[i] if __index is null, for i in [__b, __e), __width at a time.
+  template <class _QueryIter, class _OutputIter>
+  void
+  _M_interleave_nearest(_QueryIter const __first, _OutputIter __out,
+                        size_type const* const __index, size_type const __b,
+                        size_type const __e, size_type const __width) const
+  {
+    typedef typename std::iterator_traits<_QueryIter>::value_type _Query;
+    typedef _Nearest_search<__K, _Query, _Node_type, _Cmp, _Acc, _Dist,
+                            always_true<value_type> > _Search;
+    _Link_const_type const __root = _M_get_root();
+    if (!__root || __width == 1)
+      {
+        for (size_type __i = __b; __i != __e; ++__i)
+          {
+            size_type const __q = __index ? __index[__i] : __i;
+            __out[__q] = find_nearest(__first[__q]);
+          }
+        return;
+      }
+    _Search __searches[_S_interleave_width];
+    size_type __queries[_S_interleave_width];
+    size_type __live = 0;
+    size_type __next = __b;
+    for (;;)
+      {
+        for (; __live != __width && __next != __e; ++__live)
+          {
+            size_type const __q = __index ? __index[__next] : __next;
+            ++__next;
+            _Query const& __val = __first[__q];
+            __searches[__live] = _Search
+              (0, __val, __root, &_M_header, __root,
+               _S_accumulate_node_distance<__K>(_M_dist, _M_acc,
+                                                __root->_M_value, __val),
+               _M_cmp, _M_acc, _M_dist, always_true<value_type>());
+            __queries[__live] = __q;
+            _S_prefetch(__searches[__live].next());
+          }
+        if (!__live)
+          return;
+        for (size_type __j = 0; __j != __live; )
+          if (__searches[__j].step())
+            _S_prefetch(__searches[__j++].next());
+          else
+            {
+              __out[__queries[__j]] = std::pair<const_iterator, distance_type>
+                (const_iterator(__searches[__j]._M_best),
+                 std::sqrt(__searches[__j]._M_max));
+              if (__j != --__live)
+                {
+                  __searches[__j] = __searches[__live];
+                  __queries[__j] = __queries[__live];
+                }
+            }
+      }
+  }
+
+  // Runs find_nearest(__val, __approx) for the same queries as above, one
+  // after the other.
+  template <class _QueryIter, class _OutputIter>
+  void
+  _M_approximate_nearest(_QueryIter const __first, _OutputIter __out,
+                         approximation const& __approx,
+                         size_type const* const __index, size_type const __b,
+                         size_type const __e) const
+  {
+    std::vector<_Pending_branch_> __queue;
+    for (size_type __i = __b; __i != __e; ++__i)
+      {
+        size_type const __q = __index ? __index[__i] : __i;
+        __out[__q] = _M_find_nearest_approximate(__first[__q], __approx,
+                                                 __queue);
+      }
+  }
+
+  // Searches the subtree under __N, at depth __depth, for a value nearer
+  // to __val than __max, updating __best and __max.  Leaves __leaf_cursor,
+  // if any, on the leaf it first went down to.
+  template <class SearchVal>
+  void
+  _M_nearest_in_subtree(SearchVal const& __val, _Link_const_type const __N,
+                        size_type const __depth, _Link_const_type& __best,
+                        distance_type& __max,
+                        nearest_cursor* const __leaf_cursor = NULL) const
+  {
+    distance_type const __d = _S_accumulate_node_distance<__K>
+      (_M_dist, _M_acc, __N->_M_value, __val);
+    if (__d < __max)
+      {
+        __best = __N;
+        __max = __d;
+      }
+    _Nearest_search<__K, SearchVal, _Node_type, _Cmp, _Acc, _Dist,
+                    always_true<value_type> >
+      __search(__depth, __val, __N, __N->_M_parent, __best, __max,
+               _M_cmp, _M_acc, _M_dist, always_true<value_type>());
+    if (__leaf_cursor)
+      {
+        // the search keeps split dimensions, not depths: each step of the
+        // descent goes one level down, but the last one, which goes back
+        // up to the leaf
+        size_type __leaf_depth = __depth;
+        for (; __search._M_descending; ++__leaf_depth)
+          __search.step();
+        __leaf_cursor->_M_leaf = __search._M_cur;
+        __leaf_cursor->_M_depth = __leaf_depth - 1;
+      }
+    while (__search.step())
+      ;
+    __best = __search._M_best;
+    __max = __search._M_max;
+  }
+
+  // Returns the lowest of __N, at depth __depth, and the nodes above it
+  // whose cell holds __val, and sets __depth to its depth.  Like below,
+  // once __val is on the inner side of a split, it is on the inner side of
+  // those higher up on the same side of the same dimension.
+  template <class SearchVal>
+  _Link_const_type
+  _M_lowest_cell_holding(SearchVal const& __val, _Link_const_type __N,
+                         size_type& __depth) const
+  {
+    _Link_const_type __top = __N;
+    size_type __top_depth = __depth;
+    std::bitset<__K> __low_held;
+    std::bitset<__K> __high_held;
+    while (__depth--)
+      {
+        _Link_const_type const __parent = _S_parent(__N);
+        size_type const __dim = __depth % __K;
+        bool const __left = _S_left(__parent) == __N;
+        std::bitset<__K>& __held = __left ? __high_held : __low_held;
+        __N = __parent;
+        if (__held[__dim])
+          continue;
+        // <= on both sides, see the notes atop kdtree.hpp
+        if (__left
+            ? _S_node_compare(__dim, _M_cmp, _M_acc, __N->_M_value, __val)
+            : _S_node_compare(__dim, _M_cmp, _M_acc, __val, __N->_M_value))
+          {
+            __top = __N;
+            __top_depth = __depth;
+          }
+        else
+          {
+            __held.set(__dim);
+            if ((__low_held & __high_held).count() == __K)
+              break;
+          }
+      }
+    __depth = __top_depth;
+    return __top;
+  }
+
+  // Returns the highest of the nodes above __N, at depth __depth, whose
+  // split lies within __max of __val, or null if none does.  The cells
+  // nest: the splits higher up that bound the cell of __N on the same side
+  // of the same dimension as a split out of reach are further still, and
+  // need not be measured.
+  template <class SearchVal>
+  _Link_const_type
+  _M_highest_split_crossed(SearchVal const& __val, _Link_const_type __N,
+                           size_type __depth, distance_type const __max) const
+  {
+    _Link_const_type __crossed = NULL;
+    std::bitset<__K> __low_clear;
+    std::bitset<__K> __high_clear;
+    while (__depth--)
+      {
+        _Link_const_type const __parent = _S_parent(__N);
+        size_type const __dim = __depth % __K;
+        std::bitset<__K>& __clear
+          = _S_left(__parent) == __N ? __high_clear : __low_clear;
+        __N = __parent;
+        if (__clear[__dim])
+          continue;
+        if (__max < _S_node_distance(__dim, _M_dist, _M_acc,
+                                     __val, __N->_M_value))
+          {
+            __clear.set(__dim);
+            if ((__low_clear & __high_clear).count() == __K)
+              break;
+          }
+        else
+          __crossed = __N;
+      }
+    return __crossed;
+  }
+
+#if __cplusplus >= 201103L
+  // Calls __f(__index, b, e) for consecutive chunks [b, e) of the __n
+  // queries from __first, each in a task of __pool, and waits for them
+  // all.  The i-th query is __first[__index[i]], __index sorting them in
+  // __order, or __first[i] if __index is null.
+  template <typename _QueryIter, typename _Func>
+  void
+  _M_run_batch_chunks(_QueryIter const __first, size_type const __n,
+                      thread_pool& __pool, size_type __chunk,
+                      query_order const __order, _Func const& __f) const
+  {
+    std::vector<size_type> __index;
+    if (__order != given_order)
+      _S_sort_queries<__K>(__first, __n, _M_acc, __order, __index);
+    size_type const* const __by_key = __index.empty() ? NULL : &__index[0];
+    if (!__chunk)
+      __chunk = std::max<size_type>(1, __n / (__pool.size() * 8));
+    thread_pool::task_group __group(__pool);
+    for (size_type __b = 0; __b < __n; __b += __chunk)
+      {
+        size_type const __e = std::min(__n, __b + __chunk);
+        __group.run([&__f, __by_key, __b, __e]() { __f(__by_key, __b, __e); });
+      }
+    __group.wait();
+  }
+
+  // Same as above, calling __f(i) for the i-th query.
+  template <typename _QueryIter, typename _Func>
+  void
+  _M_run_batch(_QueryIter const __first, size_type const __n,
+               thread_pool& __pool, size_type const __chunk,
+               query_order const __order, _Func const& __f) const
+  {
+    _M_run_batch_chunks(__first, __n, __pool, __chunk, __order,
+                        [&__f](size_type const* __index, size_type const __b,
+                               size_type const __e)
+      {
+        for (size_type __i = __b; __i != __e; ++__i)
+          __f(__index ? __index[__i] : __i);
+      });
+  }
+
+  // Ranges at most this long are built by a single task.
+  static size_type const _S_parallel_build_cutoff = 1 << 12;
+  // Medians of ranges at most this long are selected by a single task.
+  static size_type const _S_parallel_select_cutoff = 1 << 16;
+
+  template <typename _Iter>
+  void
+  _M_optimise(_Iter const& __A, _Iter const& __B,
+              size_type const __L, thread_pool& __pool,
+              bool const __move = false)
+  {
+    assert(!_M_get_root());
+    if (__A == __B) return;
+    _Link_type __block = _Base::_M_allocate_block(__B - __A);
+    try
+      {
+        _M_set_built_root(_M_build(__A, __B, __L, &_M_header, __block,
+                                   __pool, __move), __B - __A);
+      }
+    catch (...)
+      {
+        _Base::_M_deallocate_block();
+        throw;
+      }
+  }
+
+  // The slots of a subtree depend only on its size, so both halves can be
+  // built concurrently: the left one as a new task, the right one by the
+  // current thread.
+  template <typename _Iter>
+  _Link_type
+  _M_build(_Iter const& __A, _Iter const& __B, size_type const __L,
+           _Base_ptr const __PARENT, _Link_type const __SLOT,
+           thread_pool& __pool, bool const __move)
+  {
+    if (size_type(__B - __A) <= _S_parallel_build_cutoff)
+      return _M_build(__A, __B, __L, __PARENT, __SLOT, __move);
+    _Node_super_compare_ compare(__L % __K, _M_acc, _M_cmp);
+    _Iter const __m = __A + (__B - __A) / 2;
+    _Iter const __r = __m + 1;
+    _M_select(__A, __m, __B, compare, __pool);
+    _M_construct_built(__SLOT, *__m, __PARENT, __move);
+
+    _Link_type __left = NULL;
+    _Link_type __right = NULL;
+    std::exception_ptr __error;
+    thread_pool::task_group __group(__pool);
+    __group.run([&]()
+      { __left = _M_build(__A, __m, __L+1, __SLOT, __SLOT + 1, __pool,
+                          __move); });
+    try
+      {
+        __right = _M_build(__r, __B, __L+1, __SLOT, __SLOT + (__r - __A),
+                           __pool, __move);
+      }
+    catch (...)
+      {
+        __error = std::current_exception();
+      }
+    try
+      {
+        __group.wait();
+      }
+    catch (...)
+      {
+        if (!__error) __error = std::current_exception();
+      }
+    _S_set_left(__SLOT, __left);
+    _S_set_right(__SLOT, __right);
+    if (__error)
+      {
+        _M_destroy_subtree(__SLOT);
+        std::rethrow_exception(__error);
+      }
+    _Node_type::_S_update(__SLOT);
+    return __SLOT;
+  }
+
+  // Puts the __M-th value of [__A, __B) in place, like std::nth_element.
+  //
+  // While the range is large, it is narrowed quickselect-style: the chunks
+  // of the range are partitioned around a pivot concurrently, then the
+  // values left on the wrong side of the split are swapped across, again
+  // in parallel.  Because compare is a strict order on the super key, the
+  // outcome is the same as std::nth_element's up to equal values.
+  template <typename _Iter>
+  void
+  _M_select(_Iter __A, _Iter const& __M, _Iter __B,
+            _Node_super_compare_ const& compare, thread_pool& __pool)
+  {
+    typedef typename std::iterator_traits<_Iter>::difference_type _Diff;
+    typedef std::pair<_Diff, _Diff> _Segment;
+
+    while (size_type(__B - __A) > _S_parallel_select_cutoff)
+      {
+        _Diff const __n = __B - __A;
+        value_type const __pivot(_S_median_of_9(__A, __n, compare));
+        size_type const __chunks = std::min<size_type>(
+          __pool.size() * 4, __n / (_S_parallel_select_cutoff / 4));
+
+        // partition every chunk on its own
+        std::vector<_Diff> __lefts(__chunks);
+        {
+          thread_pool::task_group __group(__pool);
+          for (size_type __c = 0; __c != __chunks; ++__c)
+            __group.run([&, __c]()
+              {
+                _Iter const __first = __A + __n * __c / __chunks;
+                _Iter const __last = __A + __n * (__c + 1) / __chunks;
+                __lefts[__c] = std::partition(__first, __last,
+                  [&](value_type const& __v) { return compare(__v, __pivot); })
+                  - __first;
+              });
+          __group.wait();
+        }
+        _Diff __split = 0;
+        for (size_type __c = 0; __c != __chunks; ++__c)
+          __split += __lefts[__c];
+        if (__split == 0 || __split == __n)
+          break; // the pivot does not split the range, finish it serially
+
+        // the right values in front of the split, and the left values
+        // behind it, in order
+        std::vector<_Segment> __rights, __leftovers;
+        for (size_type __c = 0; __c != __chunks; ++__c)
+          {
+            _Diff const __first = __n * __c / __chunks;
+            _Diff const __mid = __first + __lefts[__c];
+            _Diff const __last = __n * (__c + 1) / __chunks;
+            if (__mid < std::min(__last, __split))
+              __rights.push_back(_Segment(__mid, std::min(__last, __split)));
+            if (std::max(__first, __split) < __mid)
+              __leftovers.push_back(_Segment(std::max(__first, __split), __mid));
+          }
+        _Diff __misplaced = 0;
+        for (size_type __i = 0; __i != __rights.size(); ++__i)
+          __misplaced += __rights[__i].second - __rights[__i].first;
+
+        {
+          thread_pool::task_group __group(__pool);
+          for (size_type __c = 0; __c != __chunks; ++__c)
+            __group.run([&, __c]()
+              {
+                _S_swap_segments(__A, __rights, __leftovers,
+                                 __misplaced * __c / __chunks,
+                                 __misplaced * (__c + 1) / __chunks);
+              });
+          __group.wait();
+        }
+
+        if (__M - __A < __split)
+          __B = __A + __split;
+        else
+          __A = __A + __split;
+      }
+    std::nth_element(__A, __M, __B, compare);
+  }
+
+  // Swaps the values ranked [__from, __to) in the concatenation of the
+  // segments __X with those of the same rank in the segments __Y.
+  template <typename _Iter, typename _Segments>
+  static void
+  _S_swap_segments(_Iter const& __A, _Segments const& __X,
+                   _Segments const& __Y,
+                   typename std::iterator_traits<_Iter>::difference_type __from,
+                   typename std::iterator_traits<_Iter>::difference_type const __to)
+  {
+    if (__from == __to) return;
+    size_type __i = 0, __j = 0;
+    typename std::iterator_traits<_Iter>::difference_type __x = __from, __y = __from;
+    while (__x >= __X[__i].second - __X[__i].first)
+      {
+        __x -= __X[__i].second - __X[__i].first;
+        ++__i;
+      }
+    while (__y >= __Y[__j].second - __Y[__j].first)
+      {
+        __y -= __Y[__j].second - __Y[__j].first;
+        ++__j;
+      }
+    for (; __from != __to; ++__from)
+      {
+        std::iter_swap(__A + (__X[__i].first + __x), __A + (__Y[__j].first + __y));
+        if (++__x == __X[__i].second - __X[__i].first)
+          { ++__i; __x = 0; }
+        if (++__y == __Y[__j].second - __Y[__j].first)
+          { ++__j; __y = 0; }
+      }
+  }
+
+  static value_type const&
+  _S_median_of_3(value_type const& __a, value_type const& __b,
+                 value_type const& __c, _Node_super_compare_ const& compare)
+  {
+    if (compare(__a, __b))
+      {
+        if (compare(__b, __c)) return __b;
+        return compare(__a, __c) ? __c : __a;
+      }
+    if (compare(__a, __c)) return __a;
+    return compare(__b, __c) ? __c : __b;
+  }
+
+  // Ninther of 9 values spread evenly over the __n values at __A.
+  template <typename _Iter>
+  static value_type const&
+  _S_median_of_9(_Iter const& __A,
+                 typename std::iterator_traits<_Iter>::difference_type const __n,
+                 _Node_super_compare_ const& compare)
+  {
+    value_type const* __s[9];
+    for (int __i = 0; __i != 9; ++__i)
+      __s[__i] = &*(__A + __n * (2 * __i + 1) / 18);
+    return _S_median_of_3(_S_median_of_3(*__s[0], *__s[1], *__s[2], compare),
+                          _S_median_of_3(*__s[3], *__s[4], *__s[5], compare),
+                          _S_median_of_3(*__s[6], *__s[7], *__s[8], compare),
+                          compare);
+  }
+#endif
+
+  // Destroys the values of a subtree without giving back its storage.
+  void
+  _M_destroy_subtree(_Link_type __n)
+  {
+    while (__n)
+      {
+        _M_destroy_subtree(_S_right(__n));
+        _Link_type __t = _S_left(__n);
+        _Base::_M_destroy_node(__n);
+        __n = __t;
+      }
   }
 
   _Link_const_type
@@ -1175,15 +2584,81 @@ protected:
      return new_node;
   }
 
-  /* WHAT was this for?
+#if __cplusplus >= 201103L
   _Link_type
-  _M_clone_node(_Link_const_type __X)
+  _M_new_node(value_type&& __V)
   {
-    _Link_type __ret = _M_allocate_node(__X->_M_value);
-    // TODO
-    return __ret;
+     typename _Base::NoLeakAlloc noleak(this);
+     _Link_type new_node = noleak.get();
+     _Base::_M_construct_node(new_node, std::move(__V));
+     noleak.disconnect();
+     return new_node;
+  }
+
+  template <typename... _Args>
+  _Link_type
+  _M_emplace_node(_Args&&... __args)
+  {
+     typename _Base::NoLeakAlloc noleak(this);
+     _Link_type new_node = noleak.get();
+     _Base::_M_emplace_node(new_node, std::forward<_Args>(__args)...);
+     noleak.disconnect();
+     return new_node;
+  }
+#endif
+
+  // Copies the nodes of __x into an empty tree, keeping the shape of its
+  // tree along with whatever its nodes hold (subtree sizes, aggregates).
+  // The copies are laid out in pre-order in one block, like _M_build()
+  // does, in a single pass.  If a value's copy throws, the tree is left
+  // empty.
+  void
+  _M_clone(KDTree const& __x)
+  {
+    assert(!_M_get_root());
+    if (!__x._M_get_root()) return;
+    _Link_type const __block = _Base::_M_allocate_block(__x.size());
+    _Link_type __slot = __block;
+    try
+      {
+        // the next node of __x to copy, and the copy of its parent
+        _Traversal_stack<std::pair<_Link_const_type, _Base_ptr> > __stack;
+        __stack.push(std::make_pair(__x._M_get_root(), &_M_header));
+        while (!__stack.empty())
+          {
+            std::pair<_Link_const_type, _Base_ptr> const __next
+              = __stack.pop();
+            _Link_const_type const __n = __next.first;
+            _Base::_M_clone_node(__slot, *__n, __next.second);
+            if (__next.second == &_M_header)
+              _M_set_root(__slot);
+            else if (__n == __n->_M_parent->_M_left)
+              __next.second->_M_left = __slot;
+            else
+              __next.second->_M_right = __slot;
+            if (__n == __x._M_get_leftmost())
+              _M_set_leftmost(__slot);
+            if (__n == __x._M_get_rightmost())
+              _M_set_rightmost(__slot);
+            // the left subtree goes first, right after its parent
+            if (_S_right(__n))
+              __stack.push(std::make_pair(_S_right(__n), __slot));
+            if (_S_left(__n))
+              __stack.push(std::make_pair(_S_left(__n), __slot));
+            ++__slot;
+          }
+      }
+    catch (...)
+      {
+        while (__slot != __block)
+          _Base::_M_destroy_node(--__slot);
+        _Base::_M_deallocate_block();
+        _M_empty_initialise();
+        throw;
+      }
+    _M_count = __x._M_count;
+    _M_max_count = __x._M_max_count;
   }
-  */
 
   void
   _M_delete_node(_Link_type __p)
@@ -1198,6 +2673,9 @@ protected:
   _Acc _M_acc;
   _Cmp _M_cmp;
   _Dist _M_dist;
+  // see set_balance_factor()
+  double _M_balance;
+  size_type _M_max_count;
 
 #ifdef KDTREE_DEFINE_OSTREAM_OPERATORS
   friend std::ostream&
@@ -1234,6 +2712,12 @@ protected:
 
 }; // class KDTree
 
+template <size_t const __K, typename _Val, typename _Acc, typename _Dist,
+          typename _Cmp, typename _Alloc>
+inline void
+swap(KDTree<__K, _Val, _Acc, _Dist, _Cmp, _Alloc>& __a,
+     KDTree<__K, _Val, _Acc, _Dist, _Cmp, _Alloc>& __b)
+{ __a.swap(__b); }
 
 } // namespace KDTree
 
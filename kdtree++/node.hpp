@@ -11,11 +11,19 @@
 #  include <ostream>
 #endif
 
+#include <algorithm>
 #include <cstddef>
 #include <cmath>
+#include <utility>
+#include <vector>
 
 namespace KDTree
 {
+#if __cplusplus >= 201103L
+  //! Selects the node constructors building the value from their arguments.
+  struct _Emplace_tag {};
+#endif
+
   struct _Node_base
   {
     typedef _Node_base* _Base_ptr;
@@ -24,11 +32,26 @@ namespace KDTree
     _Base_ptr _M_parent;
     _Base_ptr _M_left;
     _Base_ptr _M_right;
+    //! Number of nodes in the subtree rooted here, this one included.
+    size_t _M_size;
 
     _Node_base(_Base_ptr const __PARENT = NULL,
                _Base_ptr const __LEFT = NULL,
                _Base_ptr const __RIGHT = NULL)
-      : _M_parent(__PARENT), _M_left(__LEFT), _M_right(__RIGHT) {}
+      : _M_parent(__PARENT), _M_left(__LEFT), _M_right(__RIGHT), _M_size(1) {}
+
+    static size_t
+    _S_size(_Base_const_ptr __x)
+    { return __x ? __x->_M_size : 0; }
+
+    /*! Recomputes what __x keeps about its subtree from its children.
+
+        Node types that keep more about their subtree (see _Aggregate_node)
+        hide this function with their own, which the tree calls instead.
+     */
+    static void
+    _S_update(_Base_ptr __x)
+    { __x->_M_size = 1 + _S_size(__x->_M_left) + _S_size(__x->_M_right); }
 
     static _Base_ptr
     _S_minimum(_Base_ptr __x)
@@ -55,6 +78,7 @@ namespace KDTree
          out << " parent: " << node._M_parent;
          out << "; left: " << node._M_left;
          out << "; right: " << node._M_right;
+         out << "; size: " << node._M_size;
          return out;
        }
 #endif
@@ -74,6 +98,19 @@ namespace KDTree
             _Base_ptr const __RIGHT = NULL)
         : _Node_base(__PARENT, __LEFT, __RIGHT), _M_value(__VALUE) {}
 
+#if __cplusplus >= 201103L
+      _Node(_Val&& __VALUE,
+            _Base_ptr const __PARENT = NULL,
+            _Base_ptr const __LEFT = NULL,
+            _Base_ptr const __RIGHT = NULL)
+        : _Node_base(__PARENT, __LEFT, __RIGHT), _M_value(std::move(__VALUE)) {}
+
+      template <typename... _Args>
+        explicit
+        _Node(_Emplace_tag, _Args&&... __args)
+        : _Node_base(), _M_value(std::forward<_Args>(__args)...) {}
+#endif
+
 #ifdef KDTREE_DEFINE_OSTREAM_OPERATORS
      template <typename Char, typename Traits>
        friend
@@ -91,6 +128,63 @@ namespace KDTree
 #endif
     };
 
+  /*! A node that also keeps the aggregate of the values of its subtree.
+
+      _Agg is a commutative monoid over the values, given as a stateless
+      functor with:
+        - a result_type typedef, the type of the aggregates,
+        - result_type identity() const, the aggregate of no value,
+        - result_type lift(_Val const&) const, the aggregate of one value,
+        - result_type combine(result_type, result_type) const, which must be
+          associative and commutative, with identity() as neutral element.
+   */
+  template <typename _Val, typename _Agg>
+    struct _Aggregate_node : public _Node<_Val>
+    {
+      typedef _Node_base::_Base_ptr _Base_ptr;
+      typedef typename _Agg::result_type aggregate_type;
+
+      aggregate_type _M_aggregate;
+
+      _Aggregate_node(_Val const& __VALUE = _Val(),
+                      _Base_ptr const __PARENT = NULL,
+                      _Base_ptr const __LEFT = NULL,
+                      _Base_ptr const __RIGHT = NULL)
+        : _Node<_Val>(__VALUE, __PARENT, __LEFT, __RIGHT),
+          _M_aggregate(_Agg().lift(__VALUE)) {}
+
+#if __cplusplus >= 201103L
+      _Aggregate_node(_Val&& __VALUE,
+                      _Base_ptr const __PARENT = NULL,
+                      _Base_ptr const __LEFT = NULL,
+                      _Base_ptr const __RIGHT = NULL)
+        : _Node<_Val>(std::move(__VALUE), __PARENT, __LEFT, __RIGHT),
+          _M_aggregate(_Agg().lift(this->_M_value)) {}
+
+      template <typename... _Args>
+        explicit
+        _Aggregate_node(_Emplace_tag __tag, _Args&&... __args)
+        : _Node<_Val>(__tag, std::forward<_Args>(__args)...),
+          _M_aggregate(_Agg().lift(this->_M_value)) {}
+#endif
+
+      static void
+      _S_update(_Base_ptr __x)
+      {
+        _Node_base::_S_update(__x);
+        _Aggregate_node* const __n = static_cast<_Aggregate_node*>(__x);
+        _Agg const __agg;
+        aggregate_type __a = __agg.lift(__n->_M_value);
+        if (__x->_M_left)
+          __a = __agg.combine
+            (static_cast<_Aggregate_node*>(__x->_M_left)->_M_aggregate, __a);
+        if (__x->_M_right)
+          __a = __agg.combine
+            (__a, static_cast<_Aggregate_node*>(__x->_M_right)->_M_aggregate);
+        __n->_M_aggregate = __a;
+      }
+    };
+
   template <typename _Val, typename _Acc, typename _Cmp>
     class _Node_compare
     {
@@ -110,6 +204,42 @@ namespace KDTree
       _Cmp _M_cmp;
   };
 
+  /*! Compare two values on dimension __DIM first, breaking ties on the
+      following dimensions in turn (the "super key" of the value).
+
+      Only values that are equal on every dimension compare equivalent, so
+      a tree built by selecting medians with this ordering depends on the
+      values alone and not on the order partitioning left them in.
+   */
+  template <size_t const __K, typename _Val, typename _Acc, typename _Cmp>
+    class _Node_super_compare
+    {
+    public:
+      _Node_super_compare(size_t const __DIM, _Acc const& acc, _Cmp const& cmp)
+	: _M_DIM(__DIM), _M_acc(acc), _M_cmp(cmp) {}
+
+      bool
+      operator()(_Val const& __A, _Val const& __B) const
+      {
+        size_t __d = _M_DIM;
+        for (size_t __i = 0; __i != __K; ++__i)
+          {
+            if (_M_cmp(_M_acc(__A, __d), _M_acc(__B, __d)))
+              return true;
+            if (_M_cmp(_M_acc(__B, __d), _M_acc(__A, __d)))
+              return false;
+            if (++__d == __K)
+              __d = 0;
+          }
+        return false;
+      }
+
+    private:
+      size_t _M_DIM;
+      _Acc _M_acc;
+      _Cmp _M_cmp;
+  };
+
   /*! Compare two values on the same dimension using a comparison functor _Cmp
       and an accessor _Acc.
 
@@ -163,6 +293,107 @@ namespace KDTree
     return d;
   }
 
+  /*! The loops over all __K dimensions of a value, with __K known at
+      compile time: unrolled up to 4 dimensions, so that the coordinates
+      of both values can stay in registers, and left as loops beyond.  The
+      dimensions are taken in the same order either way, and the results
+      are the same.
+   */
+  template <size_t const __K, bool const = (__K <= 4)>
+    struct _Fixed_dimensions
+    {
+      template <typename _ValA, typename _ValB, typename _Dist,
+                typename _Acc>
+      static typename _Dist::distance_type
+      _S_distance(const _Dist& __dist, const _Acc& __acc,
+                  const _ValA& __a, const _ValB& __b)
+      { return _S_accumulate_node_distance(__K, __dist, __acc, __a, __b); }
+
+      //! Whether __v lies within [__low[i], __high[i]] on each dimension i.
+      template <typename _Val, typename _SubVal, typename _Cmp,
+                typename _Acc>
+      static bool
+      _S_within(const _Cmp& __cmp, const _Acc& __acc, const _SubVal* __low,
+                const _SubVal* __high, const _Val& __v)
+      {
+        for (size_t __i = 0; __i != __K; ++__i)
+          if (__cmp(__acc(__v, __i), __low[__i])
+              || __cmp(__high[__i], __acc(__v, __i)))
+            return false;
+        return true;
+      }
+    };
+
+  template <size_t const __K>
+    struct _Fixed_dimensions<__K, true>
+    {
+      template <typename _ValA, typename _ValB, typename _Dist,
+                typename _Acc>
+      static typename _Dist::distance_type
+      _S_distance(const _Dist& __dist, const _Acc& __acc,
+                  const _ValA& __a, const _ValB& __b)
+      {
+        return _Fixed_dimensions<__K - 1>::_S_distance(__dist, __acc, __a, __b)
+          + __dist(__acc(__a, __K - 1), __acc(__b, __K - 1));
+      }
+
+      template <typename _Val, typename _SubVal, typename _Cmp,
+                typename _Acc>
+      static bool
+      _S_within(const _Cmp& __cmp, const _Acc& __acc, const _SubVal* __low,
+                const _SubVal* __high, const _Val& __v)
+      {
+        return _Fixed_dimensions<__K - 1>::_S_within(__cmp, __acc, __low,
+                                                     __high, __v)
+          && !(__cmp(__acc(__v, __K - 1), __low[__K - 1])
+               || __cmp(__high[__K - 1], __acc(__v, __K - 1)));
+      }
+    };
+
+  template <>
+    struct _Fixed_dimensions<1, true>
+    {
+      template <typename _ValA, typename _ValB, typename _Dist,
+                typename _Acc>
+      static typename _Dist::distance_type
+      _S_distance(const _Dist& __dist, const _Acc& __acc,
+                  const _ValA& __a, const _ValB& __b)
+      { return __dist(__acc(__a, 0), __acc(__b, 0)); }
+
+      template <typename _Val, typename _SubVal, typename _Cmp,
+                typename _Acc>
+      static bool
+      _S_within(const _Cmp& __cmp, const _Acc& __acc, const _SubVal* __low,
+                const _SubVal* __high, const _Val& __v)
+      {
+        return !(__cmp(__acc(__v, 0), __low[0])
+                 || __cmp(__high[0], __acc(__v, 0)));
+      }
+    };
+
+  //! Same as above, over __K dimensions known at compile time.
+  template <size_t const __K, typename _ValA, typename _ValB, typename _Dist,
+	    typename _Acc>
+  inline
+  typename _Dist::distance_type
+  _S_accumulate_node_distance (const _Dist& __dist, const _Acc& __acc,
+			       const _ValA& __a, const _ValB& __b)
+  {
+    return _Fixed_dimensions<__K>::_S_distance(__dist, __acc, __a, __b);
+  }
+
+  //! The dimension split after __d, out of __K, without a division.
+  template <size_t const __K>
+  inline size_t
+  _S_next_dim(size_t const __d)
+  { return __d + 1 == __K ? 0 : __d + 1; }
+
+  //! The dimension split before __d, out of __K, without a division.
+  template <size_t const __K>
+  inline size_t
+  _S_previous_dim(size_t const __d)
+  { return (__d ? __d : __K) - 1; }
+
   /*! Descend on the left or the right of the node according to the comparison
       between the node's value and the value.
 
@@ -180,169 +411,472 @@ namespace KDTree
    return static_cast<const NodeType *>(__node->_M_right);
   }
 
+  //! Hints the processor to fetch the memory at __p into the cache.
+  inline void
+  _S_prefetch(const void* __p)
+  {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(__p);
+#else
+    (void) __p;
+#endif
+  }
+
+  /*! The search of _S_node_nearest(), one node at a time.
+
+    step() visits one node and returns false once the search is over, and
+    then _M_best, _M_max and _M_dim hold its result.  In between, next() is
+    the node the following step reads, so that several searches stepped in
+    turn can prefetch it and fetch their nodes in parallel.  The searches
+    are the same whether stepped in turn or one after the other.
+
+    The search keeps the split dimensions of the nodes it is at, wrapping
+    around __K as it goes up and down rather than taking their depths
+    modulo __K.
+   */
+  template <size_t const __K, class SearchVal,
+           typename NodeType, typename _Cmp,
+           typename _Acc, typename _Dist,
+           typename _Predicate>
+  struct _Nearest_search
+  {
+    typedef const NodeType* NodePtr;
+    typedef typename _Dist::distance_type distance_type;
+
+    // for arrays of searches, to be assigned a search before use
+    _Nearest_search() {}
+
+    // __depth is the depth of __node.
+    _Nearest_search (size_t const __depth, SearchVal const& __val,
+                     const NodeType* __node, const _Node_base* __end,
+                     const NodeType* __best, distance_type __max,
+                     const _Cmp& __cmp, const _Acc& __acc,
+                     const _Dist& __dist, _Predicate __p)
+      : _M_val(&__val), _M_end(__end), _M_cmp(&__cmp),
+        _M_acc(&__acc), _M_dist(&__dist), _M_p(__p), _M_descending(true),
+        _M_pcur(__node),
+        _M_cur(_S_node_descend(__depth % __K, __cmp, __acc, __val, __node)),
+        _M_cur_dim(_S_next_dim<__K>(__depth % __K)), _M_probe(NULL),
+        _M_pprobe(NULL), _M_probe_dim(0),
+        _M_best(__best), _M_max(__max), _M_dim(__depth % __K) {}
+
+    //! The node the next step() reads first.
+    const void*
+    next() const
+    {
+      if (_M_descending)
+        return _M_cur ? _M_cur : _M_pcur;
+      return _M_probe != _M_cur ? _M_probe : _M_cur->_M_parent;
+    }
+
+    bool
+    step()
+    {
+      if (_M_descending)
+        {
+          // find the smallest __max distance in direct descent
+          if (_M_cur)
+            {
+              _M_offer(_M_cur, _M_cur_dim);
+              _M_pcur = _M_cur;
+              _M_cur = _S_node_descend(_M_cur_dim, *_M_cmp, *_M_acc,
+                                       *_M_val, _M_cur);
+              _M_cur_dim = _S_next_dim<__K>(_M_cur_dim);
+              return true;
+            }
+          // Swap cur to prev, only prev is a valid node.
+          _M_descending = false;
+          _M_cur = _M_pcur;
+          _M_cur_dim = _S_previous_dim<__K>(_M_cur_dim);
+          _M_pcur = NULL;
+          // Probe all node's children not visited yet (siblings of the
+          // visited nodes).
+          _M_probe = _M_cur;
+          _M_pprobe = _M_probe;
+          _M_probe_dim = _M_cur_dim;
+          NodePtr near_node;
+          if (_S_node_compare(_M_probe_dim, *_M_cmp, *_M_acc, *_M_val,
+                              _M_probe->_M_value))
+            near_node = static_cast<NodePtr>(_M_probe->_M_right);
+          else
+            near_node = static_cast<NodePtr>(_M_probe->_M_left);
+          if (near_node
+              // only visit node's children if node's plane intersect hypersphere
+              && _M_plane_within(_M_probe, _M_probe_dim))
+            {
+              _M_probe = near_node;
+              _M_probe_dim = _S_next_dim<__K>(_M_probe_dim);
+            }
+          return true;
+        }
+
+      if (_M_probe != _M_cur)
+        {
+          NodePtr near_node;
+          NodePtr far_node;
+          if (_S_node_compare(_M_probe_dim, *_M_cmp, *_M_acc, *_M_val,
+                              _M_probe->_M_value))
+            {
+              near_node = static_cast<NodePtr>(_M_probe->_M_left);
+              far_node = static_cast<NodePtr>(_M_probe->_M_right);
+            }
+          else
+            {
+              near_node = static_cast<NodePtr>(_M_probe->_M_right);
+              far_node = static_cast<NodePtr>(_M_probe->_M_left);
+            }
+          if (_M_pprobe == _M_probe->_M_parent) // going downward ...
+            {
+              _M_offer(_M_probe, _M_probe_dim);
+              _M_pprobe = _M_probe;
+              if (near_node)
+                {
+                  _M_probe = near_node;
+                  _M_probe_dim = _S_next_dim<__K>(_M_probe_dim);
+                }
+              else if (far_node &&
+                       // only visit node's children if node's plane intersect hypersphere
+                       _M_plane_within(_M_probe, _M_probe_dim))
+                {
+                  _M_probe = far_node;
+                  _M_probe_dim = _S_next_dim<__K>(_M_probe_dim);
+                }
+              else
+                {
+                  _M_probe = static_cast<NodePtr>(_M_probe->_M_parent);
+                  _M_probe_dim = _S_previous_dim<__K>(_M_probe_dim);
+                }
+            }
+          else // ... and going upward.
+            {
+              if (_M_pprobe == near_node && far_node
+                  // only visit node's children if node's plane intersect hypersphere
+                  && _M_plane_within(_M_probe, _M_probe_dim))
+                {
+                  _M_pprobe = _M_probe;
+                  _M_probe = far_node;
+                  _M_probe_dim = _S_next_dim<__K>(_M_probe_dim);
+                }
+              else
+                {
+                  _M_pprobe = _M_probe;
+                  _M_probe = static_cast<NodePtr>(_M_probe->_M_parent);
+                  _M_probe_dim = _S_previous_dim<__K>(_M_probe_dim);
+                }
+            }
+          return true;
+        }
+
+      _M_pcur = _M_cur;
+      _M_cur = static_cast<NodePtr>(_M_cur->_M_parent);
+      _M_cur_dim = _S_previous_dim<__K>(_M_cur_dim);
+      _M_pprobe = _M_cur;
+      _M_probe = _M_cur;
+      _M_probe_dim = _M_cur_dim;
+      if (_M_cur == _M_end)
+        return false;
+      NodePtr near_node;
+      if (_M_pcur == _M_cur->_M_left)
+        near_node = static_cast<NodePtr>(_M_cur->_M_right);
+      else
+        near_node = static_cast<NodePtr>(_M_cur->_M_left);
+      if (near_node
+          // only visit node's children if node's plane intersect hypersphere
+          && _M_plane_within(_M_cur, _M_cur_dim))
+        {
+          _M_probe = near_node;
+          _M_probe_dim = _S_next_dim<__K>(_M_probe_dim);
+        }
+      return true;
+    }
+
+    void
+    _M_offer(NodePtr __n, size_t const __n_dim)
+    {
+      if ((_M_p)(__n->_M_value))
+        {
+          distance_type const d = _S_accumulate_node_distance<__K>
+            (*_M_dist, *_M_acc, *_M_val, __n->_M_value);
+          if (d <= _M_max)
+            // ("bad candidate notes")
+            // Changed: removed this test: || ( d == __max && cur < __best ))
+            // Can't do this optimisation without checking that the current 'best' is not the root AND is not a valid candidate...
+            // This is because find_nearest() etc will call this function with the best set to _M_root EVEN IF _M_root is not a valid answer (eg too far away or doesn't pass the predicate test)
+            {
+              _M_best = __n;
+              _M_max = d;
+              _M_dim = __n_dim;
+            }
+        }
+    }
+
+    bool
+    _M_plane_within(NodePtr __n, size_t const __n_dim) const
+    {
+      return _S_node_distance(__n_dim, *_M_dist, *_M_acc, *_M_val,
+                              __n->_M_value) <= _M_max;
+    }
+
+    SearchVal const* _M_val;
+    const _Node_base* _M_end;
+    const _Cmp* _M_cmp;
+    const _Acc* _M_acc;
+    const _Dist* _M_dist;
+    _Predicate _M_p;
+    bool _M_descending;
+    NodePtr _M_pcur;
+    NodePtr _M_cur;
+    size_t _M_cur_dim;
+    NodePtr _M_probe;
+    NodePtr _M_pprobe;
+    size_t _M_probe_dim;
+    NodePtr _M_best;
+    distance_type _M_max;
+    size_t _M_dim;
+  };
+
   /*! Find the nearest node to __val from __node
 
     If many nodes are equidistant to __val, the node with the lowest memory
     address is returned.
 
+    The search is done in the units of the _Dist functor, squared for the
+    default one: __max is such a distance, and so is the distance returned,
+    so that no square root is taken while searching.
+
     \return the nearest node of __end node if no nearest node was found for the
     given arguments.
    */
-  template <class SearchVal,
+  template <size_t const __K, class SearchVal,
            typename NodeType, typename _Cmp,
            typename _Acc, typename _Dist,
            typename _Predicate>
   inline
   std::pair<const NodeType*,
 	    std::pair<size_t, typename _Dist::distance_type> >
-  _S_node_nearest (const size_t __k, size_t __dim, SearchVal const& __val,
+  _S_node_nearest (size_t __dim, SearchVal const& __val,
 		   const NodeType* __node, const _Node_base* __end,
 		   const NodeType* __best, typename _Dist::distance_type __max,
 		   const _Cmp& __cmp, const _Acc& __acc, const _Dist& __dist,
 		   _Predicate __p)
   {
-     typedef const NodeType* NodePtr;
-    NodePtr pcur = __node;
-    NodePtr cur = _S_node_descend(__dim % __k, __cmp, __acc, __val, __node);
-    size_t cur_dim = __dim+1;
-    // find the smallest __max distance in direct descent
-    while (cur)
+    _Nearest_search<__K, SearchVal, NodeType, _Cmp, _Acc, _Dist, _Predicate>
+      __search(__dim, __val, __node, __end, __best, __max,
+               __cmp, __acc, __dist, __p);
+    while (__search.step())
+      ;
+    return std::pair<const NodeType*,
+      std::pair<size_t, typename _Dist::distance_type> >
+      (__search._M_best, std::pair<size_t, typename _Dist::distance_type>
+       (__search._M_dim, __search._M_max));
+  }
+
+  /*! A stack of the subtrees a traversal still has to visit.
+
+      The first _Size entries are kept in place, on the traversal's own
+      frame, and only the deeper ones spill to the heap: balanced trees
+      never allocate, and a degenerate tree, as deep as it has nodes,
+      cannot overflow the call stack.
+   */
+  template <typename _Tp, size_t const _Size = 64>
+    class _Traversal_stack
+    {
+    public:
+      _Traversal_stack() : _M_size(0) {}
+
+      bool
+      empty() const
+      { return !_M_size; }
+
+      void
+      push(_Tp const& __x)
       {
-	if (__p(cur->_M_value))
-	  {
-	    typename _Dist::distance_type d = 0;
-	    for (size_t i=0; i != __k; ++i)
-	      d += _S_node_distance(i, __dist, __acc, __val, cur->_M_value);
-       d = std::sqrt(d);
-	    if (d <= __max)
-          // ("bad candidate notes")
-          // Changed: removed this test: || ( d == __max && cur < __best ))
-          // Can't do this optimisation without checking that the current 'best' is not the root AND is not a valid candidate...
-          // This is because find_nearest() etc will call this function with the best set to _M_root EVEN IF _M_root is not a valid answer (eg too far away or doesn't pass the predicate test)
-	      {
-		__best = cur;
-		__max = d;
-		__dim = cur_dim;
-	      }
-	  }
-	pcur = cur;
-	cur = _S_node_descend(cur_dim % __k, __cmp, __acc, __val, cur);
-	++cur_dim;
+        if (_M_size < _Size)
+          _M_local[_M_size] = __x;
+        else
+          _M_spill.push_back(__x);
+        ++_M_size;
       }
-    // Swap cur to prev, only prev is a valid node.
-    cur = pcur;
-    --cur_dim;
-    pcur = NULL;
-    // Probe all node's children not visited yet (siblings of the visited nodes).
-    NodePtr probe = cur;
-    NodePtr pprobe = probe;
-    NodePtr near_node;
-    NodePtr far_node;
-    size_t probe_dim = cur_dim;
-    if (_S_node_compare(probe_dim % __k, __cmp, __acc, __val, probe->_M_value))
-      near_node = static_cast<NodePtr>(probe->_M_right);
-    else
-      near_node = static_cast<NodePtr>(probe->_M_left);
-    if (near_node
-	// only visit node's children if node's plane intersect hypersphere
-	&& (std::sqrt(_S_node_distance(probe_dim % __k, __dist, __acc, __val, probe->_M_value)) <= __max))
+
+      _Tp
+      pop()
       {
-	probe = near_node;
-	++probe_dim;
+        if (--_M_size < _Size)
+          return _M_local[_M_size];
+        _Tp const __x = _M_spill.back();
+        _M_spill.pop_back();
+        return __x;
       }
-    while (cur != __end)
+
+    private:
+      _Tp _M_local[_Size];
+      size_t _M_size;
+      std::vector<_Tp> _M_spill;
+    };
+
+  /*! The best candidates of a k-nearest neighbours search, kept as a
+      max-heap on their distance in a buffer of __k pairs provided by the
+      caller, so that the search makes no allocation.
+
+      _M_max is the distance beyond which a candidate is useless: the
+      search's max distance until the buffer is full, the distance of the
+      furthest candidate kept afterwards.  Distances are in the units of the
+      search, usually squared.
+   */
+  template <typename _Iter, typename _Distance>
+    struct _K_nearest_heap
+    {
+      typedef std::pair<_Iter, _Distance> value_type;
+
+      _K_nearest_heap(value_type* __buffer, size_t const __k,
+                      _Distance const __max)
+        : _M_heap(__buffer), _M_k(__k), _M_size(0), _M_max(__max) {}
+
+      struct _Further
+      {
+        bool
+        operator()(value_type const& __a, value_type const& __b) const
+        { return __a.second < __b.second; }
+      };
+
+      //! Keeps __it, at distance __d no greater than _M_max, if it is
+      //! nearer than the furthest candidate or there is room left.
+      void
+      offer(_Iter const& __it, _Distance const __d)
       {
-	while (probe != cur)
-	  {
-	    if (_S_node_compare(probe_dim % __k, __cmp, __acc, __val, probe->_M_value))
-	      {
-		near_node = static_cast<NodePtr>(probe->_M_left);
-		far_node = static_cast<NodePtr>(probe->_M_right);
-	      }
-	    else
-	      {
-		near_node = static_cast<NodePtr>(probe->_M_right);
-		far_node = static_cast<NodePtr>(probe->_M_left);
-	      }
-	    if (pprobe == probe->_M_parent) // going downward ...
-	      {
-		if (__p(probe->_M_value))
-		  {
-		    typename _Dist::distance_type d = 0;
-		    for (size_t i=0; i < __k; ++i)
-		      d += _S_node_distance(i, __dist, __acc, __val, probe->_M_value);
-          d = std::sqrt(d);
-          if (d <= __max)  // CHANGED, see the above notes ("bad candidate notes")
-		      {
-			__best = probe;
-			__max = d;
-			__dim = probe_dim;
-		      }
-		  }
-		pprobe = probe;
-		if (near_node)
-		  {
-		    probe = near_node;
-		    ++probe_dim;
-		  }
-		else if (far_node &&
-			 // only visit node's children if node's plane intersect hypersphere
-			 std::sqrt(_S_node_distance(probe_dim % __k, __dist, __acc, __val, probe->_M_value)) <= __max)
-		  {
-		    probe = far_node;
-		    ++probe_dim;
-		  }
-		else
-		  {
-		    probe = static_cast<NodePtr>(probe->_M_parent);
-		    --probe_dim;
-		  }
-	      }
-	    else // ... and going upward.
-	      {
-		if (pprobe == near_node && far_node
-		    // only visit node's children if node's plane intersect hypersphere
-		    && std::sqrt(_S_node_distance(probe_dim % __k, __dist, __acc, __val, probe->_M_value)) <= __max)
-		  {
-		    pprobe = probe;
-		    probe = far_node;
-		    ++probe_dim;
-		  }
-		else
-		  {
-		    pprobe = probe;
-		    probe = static_cast<NodePtr>(probe->_M_parent);
-		    --probe_dim;
-		  }
-	      }
-	  }
-	pcur = cur;
-	cur = static_cast<NodePtr>(cur->_M_parent);
-	--cur_dim;
-	pprobe = cur;
-	probe = cur;
-	probe_dim = cur_dim;
-	if (cur != __end)
-	  {
-	    if (pcur == cur->_M_left)
-	      near_node = static_cast<NodePtr>(cur->_M_right);
-	    else
-	      near_node = static_cast<NodePtr>(cur->_M_left);
-	    if (near_node
-		// only visit node's children if node's plane intersect hypersphere
-		&& (std::sqrt(_S_node_distance(cur_dim % __k, __dist, __acc, __val, cur->_M_value)) <= __max))
-	      {
-		probe = near_node;
-		++probe_dim;
-	      }
-	  }
+        if (_M_k == 1)
+          {
+            // a heap of one pair is replaced, not sifted
+            if (_M_size && !(__d < _M_heap[0].second))
+              return;
+            _M_heap[0] = value_type(__it, __d);
+            _M_size = 1;
+            _M_max = __d;
+            return;
+          }
+        if (_M_size == _M_k)
+          {
+            if (!(__d < _M_heap[0].second))
+              return;
+            std::pop_heap(_M_heap, _M_heap + _M_size, _Further());
+            --_M_size;
+          }
+        _M_heap[_M_size++] = value_type(__it, __d);
+        std::push_heap(_M_heap, _M_heap + _M_size, _Further());
+        if (_M_size == _M_k)
+          _M_max = _M_heap[0].second;
       }
-    return std::pair<NodePtr,
-      std::pair<size_t, typename _Dist::distance_type> >
-      (__best, std::pair<size_t, typename _Dist::distance_type>
-       (__dim, __max));
-  }
 
+      //! Whether __it is one of the candidates.
+      bool
+      holds(_Iter const& __it) const
+      {
+        for (size_t __i = 0; __i != _M_size; ++__i)
+          if (_M_heap[__i].first == __it)
+            return true;
+        return false;
+      }
+
+      //! Sorts the candidates nearest first, converting each distance with
+      //! __convert, and returns how many there are.
+      template <typename _Convert>
+      size_t
+      finish(_Convert __convert)
+      {
+        std::sort_heap(_M_heap, _M_heap + _M_size, _Further());
+        for (size_t __i = 0; __i != _M_size; ++__i)
+          _M_heap[__i].second = __convert(_M_heap[__i].second);
+        return _M_size;
+      }
+
+      value_type* _M_heap;
+      size_t _M_k;
+      size_t _M_size;
+      _Distance _M_max;
+    };
+
+  /*! The best candidate of a nearest neighbour search: the same as a
+      _K_nearest_heap of one pair, but holding that pair itself, for the
+      searches written for either.
+   */
+  template <typename _Iter, typename _Distance>
+    struct _Nearest_candidate
+    {
+      typedef std::pair<_Iter, _Distance> value_type;
+
+      //! __none is the result if no candidate is offered.
+      _Nearest_candidate(value_type const& __none, _Distance const __max)
+        : _M_best(__none), _M_size(0), _M_max(__max) {}
+
+      void
+      offer(_Iter const& __it, _Distance const __d)
+      {
+        if (_M_size && !(__d < _M_max))
+          return;
+        _M_best = value_type(__it, __d);
+        _M_size = 1;
+        _M_max = __d;
+      }
+
+      bool
+      holds(_Iter const& __it) const
+      { return _M_size && _M_best.first == __it; }
+
+      template <typename _Convert>
+      size_t
+      finish(_Convert __convert)
+      {
+        if (_M_size)
+          _M_best.second = __convert(_M_best.second);
+        return _M_size;
+      }
+
+      value_type _M_best;
+      size_t _M_size;
+      _Distance _M_max;
+    };
+
+  /*! \brief How far an approximate nearest neighbours search may stray
+      from the exact one.
+
+The search visits the branches of the tree in the order of their distance
+to the query (best-bin-first), nearest first.  With __epsilon, it skips the
+branches that could only hold values nearer than 1/(1+__epsilon) times the
+distance of its candidates: each value it returns is at most 1+__epsilon
+times as far as the exact one of the same rank.  With __max_checks, it
+stops after measuring the distance of that many values, for a bounded cost
+and no bound on the error.  Distances are taken to be squared like for
+find_nearest().  The defaults, 0 and 0 for no limit, give the exact result.
+   */
+  struct approximation
+  {
+    explicit
+    approximation(double const __epsilon = 0, size_t const __max_checks = 0)
+      : _M_epsilon(__epsilon), _M_max_checks(__max_checks) {}
+
+    double _M_epsilon;
+    size_t _M_max_checks;
+  };
+
+  /*! A branch left aside by a best-bin-first search: the subtree under
+      _M_node, at depth _M_depth, and a lower bound of the distance of its
+      values to the query, in the units of the search.
+   */
+  template <typename NodeType, typename _Distance>
+    struct _Pending_branch
+    {
+      const NodeType* _M_node;
+      size_t _M_depth;
+      _Distance _M_bound;
+
+      // for the std:: heap functions, with the nearest on top
+      struct _Further
+      {
+        bool
+        operator()(_Pending_branch const& __a, _Pending_branch const& __b) const
+        { return __b._M_bound < __a._M_bound; }
+      };
+    };
 
 } // namespace KDTree
 
@@ -0,0 +1,146 @@
+/** \file
+ * Orders batches of queries along a space-filling curve.
+ *
+ * The batch queries of the KDTree can run their queries sorted by their
+ * position along a Morton (Z-order) or Hilbert curve, rather than in the
+ * order given: queries near each other then run one after the other, and
+ * find the nodes they share still in the cache.  The curve stretches over
+ * the bounding box of the batch, on which each coordinate is quantised to
+ * 64 / __K bits (one bit for each of the first 64 dimensions, beyond).
+ * Coordinates must convert to double.
+ *
+ * The Hilbert curve keeps neighbouring keys closer in space than the
+ * Morton curve, for a few more operations per key.
+ *
+ * Requires C++11.
+ */
+
+#ifndef INCLUDE_KDTREE_QUERY_ORDER_HPP
+#define INCLUDE_KDTREE_QUERY_ORDER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace KDTree
+{
+
+  //! The order in which a batch runs its queries.
+  enum query_order
+  {
+    given_order,
+    morton_order,
+    hilbert_order
+  };
+
+  // Interleaves the __bits lowest bits of __x[0] .. __x[__n-1], highest
+  // bits first, __x[0] leading.
+  inline std::uint64_t
+  _S_interleave(std::uint64_t const* __x, size_t const __n,
+                unsigned const __bits)
+  {
+    std::uint64_t __key = 0;
+    for (unsigned __b = __bits; __b--; )
+      for (size_t __i = 0; __i != __n; ++__i)
+        __key = (__key << 1) | ((__x[__i] >> __b) & 1);
+    return __key;
+  }
+
+  /*! Turns __x[0] .. __x[__n-1], of __bits bits each, into the transposed
+      Hilbert index, in place: interleaved like a Morton key, its bits are
+      the distance along the Hilbert curve.  Algorithm by J. Skilling,
+      "Programming the Hilbert curve", AIP Conf. Proc. 707 (2004).
+   */
+  inline void
+  _S_hilbert_transpose(std::uint64_t* __x, size_t const __n,
+                       unsigned const __bits)
+  {
+    std::uint64_t const __m = std::uint64_t(1) << (__bits - 1);
+    // inverse undo
+    for (std::uint64_t __q = __m; __q > 1; __q >>= 1)
+      {
+        std::uint64_t const __p = __q - 1;
+        for (size_t __i = 0; __i != __n; ++__i)
+          if (__x[__i] & __q)
+            __x[0] ^= __p;
+          else
+            {
+              std::uint64_t const __t = (__x[0] ^ __x[__i]) & __p;
+              __x[0] ^= __t;
+              __x[__i] ^= __t;
+            }
+      }
+    // Gray encode
+    for (size_t __i = 1; __i != __n; ++__i)
+      __x[__i] ^= __x[__i - 1];
+    std::uint64_t __t = 0;
+    for (std::uint64_t __q = __m; __q > 1; __q >>= 1)
+      if (__x[__n - 1] & __q)
+        __t ^= __q - 1;
+    for (size_t __i = 0; __i != __n; ++__i)
+      __x[__i] ^= __t;
+  }
+
+  /*! Fills __index with the indices of the __n queries from __first,
+      sorted by their key along the curve of __order.
+   */
+  template <size_t const __K, typename _Iter, typename _Acc>
+  void
+  _S_sort_queries(_Iter const __first, size_t const __n, _Acc const& __acc,
+                  query_order const __order, std::vector<size_t>& __index)
+  {
+    size_t const __dims = __K < 64 ? __K : 64;
+    unsigned const __bits = unsigned(64 / __dims);
+    double __low[__K];
+    double __scale[__K];
+    for (size_t __d = 0; __d != __dims; ++__d)
+      {
+        double __high = __low[__d] = __n ? double(__acc(__first[0], __d)) : 0;
+        for (size_t __i = 1; __i < __n; ++__i)
+          {
+            double const __x = double(__acc(__first[__i], __d));
+            __low[__d] = std::min(__low[__d], __x);
+            __high = std::max(__high, __x);
+          }
+        // the largest quantum stays below 2^__bits
+        double const __cells = double(std::uint64_t(1) << (__bits - 1)) * 2;
+        __scale[__d] = __high > __low[__d]
+          ? __cells * (1 - 1e-9) / (__high - __low[__d]) : 0;
+      }
+
+    std::vector<std::pair<std::uint64_t, size_t> > __sorted(__n);
+    std::uint64_t __x[__K];
+    for (size_t __i = 0; __i != __n; ++__i)
+      {
+        for (size_t __d = 0; __d != __dims; ++__d)
+          __x[__d] = std::uint64_t
+            ((double(__acc(__first[__i], __d)) - __low[__d]) * __scale[__d]);
+        if (__order == hilbert_order)
+          _S_hilbert_transpose(__x, __dims, __bits);
+        __sorted[__i].first = _S_interleave(__x, __dims, __bits);
+        __sorted[__i].second = __i;
+      }
+    std::sort(__sorted.begin(), __sorted.end());
+    __index.resize(__n);
+    for (size_t __i = 0; __i != __n; ++__i)
+      __index[__i] = __sorted[__i].second;
+  }
+
+} // namespace KDTree
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
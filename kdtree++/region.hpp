@@ -85,13 +85,8 @@ namespace KDTree
       bool
       encloses(value_type const& __V) const
       {
-        for (size_t __i = 0; __i != __K; ++__i)
-          {
-            if (_M_cmp(_M_acc(__V, __i), _M_low_bounds[__i])
-             || _M_cmp(_M_high_bounds[__i], _M_acc(__V, __i)))
-              return false;
-          }
-        return true;
+        return _Fixed_dimensions<__K>::_S_within(_M_cmp, _M_acc, _M_low_bounds,
+                                                 _M_high_bounds, __V);
       }
 
       _Region&
@@ -113,6 +108,43 @@ namespace KDTree
       _Cmp _M_cmp;
     };
 
+  // What the range queries do with each value found within a region: count
+  // it, pass it to a visitor, or copy it to an output iterator.
+
+  template <typename _Val>
+    struct _Range_counter
+    {
+      _Range_counter() : _M_count(0) {}
+      void operator()(_Val const&) { ++_M_count; }
+      size_t _M_count;
+    };
+
+  template <typename _Val, class _Visitor>
+    struct _Range_visitor
+    {
+      _Range_visitor(_Visitor const& __v) : _M_visitor(__v) {}
+      void operator()(_Val const& __v) { _M_visitor(__v); }
+      _Visitor _M_visitor;
+    };
+
+  template <typename _Val, typename _Agg>
+    struct _Range_aggregate
+    {
+      _Range_aggregate() : _M_agg(), _M_value(_M_agg.identity()) {}
+      void operator()(_Val const& __v)
+      { _M_value = _M_agg.combine(_M_value, _M_agg.lift(__v)); }
+      _Agg _M_agg;
+      typename _Agg::result_type _M_value;
+    };
+
+  template <typename _Val, typename _OutputIterator>
+    struct _Range_output
+    {
+      _Range_output(_OutputIterator const& __out) : _M_out(__out) {}
+      void operator()(_Val const& __v) { *_M_out++ = __v; }
+      _OutputIterator _M_out;
+    };
+
 } // namespace KDTree
 
 #endif // include guard
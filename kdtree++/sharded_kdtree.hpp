@@ -0,0 +1,611 @@
+/** \file
+ * Defines the interface for the ShardedKDTree class, a KD-Tree container
+ * that many threads can update at once.
+ *
+ * Space is partitioned into cells once and for all, from a sample of the
+ * values, the way a KDTree would split it: each cell is the halfspace
+ * below or above a split value, within its parent's.  Each cell holds a
+ * KDTree of its own, its shard, along with a mutex and the bounding box of
+ * the values it has held.  insert() and erase() only lock the shard of the
+ * cell their value falls in, so updates to different cells run in
+ * parallel.  The queries walk the cells like a KDTree walks its nodes,
+ * skip the shards whose box does not meet the region or lies further than
+ * the nearest values found so far, and lock the others one at a time.
+ *
+ * The results of the queries are copies of the values, taken under the
+ * lock of their shard: there is no iterator, as another thread could
+ * erase the value it points to.  A query is not atomic with respect to
+ * the updates: it sees each shard as it is when it gets to it.
+ *
+ * The cells do not change once the container is built, so the sample
+ * should be representative of the values to come.
+ *
+ * Requires C++11.
+ */
+
+#ifndef INCLUDE_KDTREE_SHARDED_KDTREE_HPP
+#define INCLUDE_KDTREE_SHARDED_KDTREE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "kdtree.hpp"
+#include "thread_pool.hpp"
+
+namespace KDTree
+{
+
+template <size_t const __K, typename _Val,
+          typename _Acc = _Bracket_accessor<_Val>,
+          typename _Dist = squared_difference<typename _Acc::result_type,
+          typename _Acc::result_type>,
+          typename _Cmp = std::less<typename _Acc::result_type>,
+          typename _Alloc = std::allocator<_Node<_Val> > >
+class ShardedKDTree
+{
+public:
+  typedef KDTree<__K, _Val, _Acc, _Dist, _Cmp, _Alloc> tree_type;
+  typedef typename tree_type::_Region_ _Region_;
+  typedef _Val value_type;
+  typedef value_type const& const_reference;
+  typedef typename _Acc::result_type subvalue_type;
+  typedef typename _Dist::distance_type distance_type;
+  typedef size_t size_type;
+
+  /*! \brief Partitions space into __shards cells, from the sample values.
+
+Each cell is split in two at the median of its sample values on the
+dimension along which they spread the most, until there are __shards cells
+or a cell has less than two sample values left: there may be fewer shards
+than asked for, but never more.
+   */
+  template <class _InputIterator>
+  ShardedKDTree(_InputIterator __sample_first, _InputIterator __sample_last,
+                size_type const __shards,
+                _Acc const& __acc = _Acc(), _Dist const& __dist = _Dist(),
+                _Cmp const& __cmp = _Cmp())
+    : _M_acc(__acc), _M_cmp(__cmp), _M_dist(__dist)
+  {
+    std::vector<value_type> __sample(__sample_first, __sample_last);
+    size_type __count = 0;
+    _M_partition(__sample.begin(), __sample.end(), __shards ? __shards : 1,
+                 __count);
+    _M_shards.reset(new _Shard[__count]);
+    _M_shard_count = __count;
+    for (size_type __s = 0; __s != __count; ++__s)
+      _M_shards[__s]._M_tree.reset(new tree_type(__acc, __dist, __cmp));
+  }
+
+  ShardedKDTree(ShardedKDTree const&) = delete;
+  ShardedKDTree& operator=(ShardedKDTree const&) = delete;
+
+  size_type
+  shard_count() const
+  { return _M_shard_count; }
+
+  //! Number of values, summed over the shards one at a time.
+  size_type
+  size() const
+  {
+    size_type __n = 0;
+    for (size_type __s = 0; __s != _M_shard_count; ++__s)
+      {
+        std::lock_guard<std::mutex> __lock(_M_shards[__s]._M_mutex);
+        __n += _M_shards[__s]._M_tree->size();
+      }
+    return __n;
+  }
+
+  bool
+  empty() const
+  { return !size(); }
+
+  _Cmp
+  value_comp() const
+  { return _M_cmp; }
+
+  _Acc
+  value_acc() const
+  { return _M_acc; }
+
+  const _Dist&
+  value_distance() const
+  { return _M_dist; }
+
+  void
+  insert(const_reference __V)
+  {
+    _Shard& __shard = _M_shards[_M_route(__V)];
+    std::lock_guard<std::mutex> __lock(__shard._M_mutex);
+    __shard._M_tree->insert(__V);
+    _M_extend(__shard, __V);
+  }
+
+  template <class _InputIterator>
+  void
+  insert(_InputIterator __first, _InputIterator __last)
+  {
+    for (; __first != __last; ++__first)
+      this->insert(*__first);
+  }
+
+  /*! \brief Inserts the values using all the threads of __pool.
+
+The values are dealt to their shards first, then each shard takes its own
+under its lock, in a task of its own.
+   */
+  template <class _InputIterator>
+  void
+  insert(_InputIterator __first, _InputIterator __last, thread_pool& __pool)
+  {
+    std::vector<std::vector<value_type> > __dealt(_M_shard_count);
+    for (; __first != __last; ++__first)
+      __dealt[_M_route(*__first)].push_back(*__first);
+    thread_pool::task_group __group(__pool);
+    for (size_type __s = 0; __s != _M_shard_count; ++__s)
+      if (!__dealt[__s].empty())
+        __group.run([this, __s, &__dealt]()
+          {
+            _Shard& __shard = _M_shards[__s];
+            std::vector<value_type> const& __values = __dealt[__s];
+            std::lock_guard<std::mutex> __lock(__shard._M_mutex);
+            for (size_type __i = 0; __i != __values.size(); ++__i)
+              {
+                __shard._M_tree->insert(__values[__i]);
+                _M_extend(__shard, __values[__i]);
+              }
+          });
+    __group.wait();
+  }
+
+  // Like KDTree::erase(), removes a value at the same location as __V.
+  // Returns whether there was one.
+  bool
+  erase(const_reference __V)
+  {
+    _Shard& __shard = _M_shards[_M_route(__V)];
+    std::lock_guard<std::mutex> __lock(__shard._M_mutex);
+    typename tree_type::const_iterator const __i = __shard._M_tree->find(__V);
+    if (__i == __shard._M_tree->end())
+      return false;
+    __shard._M_tree->erase(__i);
+    return true;
+  }
+
+  //! Removes a value equal to __V, if any, and returns whether there was.
+  bool
+  erase_exact(const_reference __V)
+  {
+    _Shard& __shard = _M_shards[_M_route(__V)];
+    std::lock_guard<std::mutex> __lock(__shard._M_mutex);
+    typename tree_type::const_iterator const __i
+      = __shard._M_tree->find_exact(__V);
+    if (__i == __shard._M_tree->end())
+      return false;
+    __shard._M_tree->erase(__i);
+    return true;
+  }
+
+  //! Empties the shards, one at a time; the cells stay.
+  void
+  clear()
+  {
+    for (size_type __s = 0; __s != _M_shard_count; ++__s)
+      {
+        std::lock_guard<std::mutex> __lock(_M_shards[__s]._M_mutex);
+        _M_shards[__s]._M_tree->clear();
+        _M_shards[__s]._M_bounded = false;
+      }
+  }
+
+  //! Optimises the shards one at a time, and shrinks their boxes to fit.
+  void
+  optimise()
+  {
+    for (size_type __s = 0; __s != _M_shard_count; ++__s)
+      {
+        _Shard& __shard = _M_shards[__s];
+        std::lock_guard<std::mutex> __lock(__shard._M_mutex);
+        __shard._M_tree->optimise();
+        __shard._M_bounded = false;
+        for (typename tree_type::const_iterator __i = __shard._M_tree->begin();
+             __i != __shard._M_tree->end(); ++__i)
+          _M_extend(__shard, *__i);
+      }
+  }
+
+  void
+  optimize()
+  { // cater for people who cannot spell :)
+    this->optimise();
+  }
+
+  //! Copies a value equal to __V to __out, if any, and returns whether
+  //! there was.
+  template <class SearchVal>
+  bool
+  find_exact(SearchVal const& __V, value_type& __out) const
+  {
+    _Shard& __shard = _M_shards[_M_route(__V)];
+    std::lock_guard<std::mutex> __lock(__shard._M_mutex);
+    typename tree_type::const_iterator const __i
+      = __shard._M_tree->find_exact(__V);
+    if (__i == __shard._M_tree->end())
+      return false;
+    __out = *__i;
+    return true;
+  }
+
+  // NOTE: see notes on KDTree::find_within_range().
+  size_type
+  count_within_range(const_reference __V, subvalue_type const __R) const
+  {
+    _Region_ __region(__V, __R, _M_acc, _M_cmp);
+    return this->count_within_range(__region);
+  }
+
+  size_type
+  count_within_range(_Region_ const& __REGION) const
+  {
+    _Range_counter<value_type> __counter;
+    return _M_visit_within_range(__REGION, __counter)._M_count;
+  }
+
+  // The visitor is called under the lock of the shard of the value.
+  template <typename SearchVal, class Visitor>
+  Visitor
+  visit_within_range(SearchVal const& V, subvalue_type const R, Visitor visitor) const
+  {
+    _Region_ region(V, R, _M_acc, _M_cmp);
+    return this->visit_within_range(region, visitor);
+  }
+
+  template <class Visitor>
+  Visitor
+  visit_within_range(_Region_ const& REGION, Visitor visitor) const
+  {
+    _Range_visitor<value_type, Visitor> __v(visitor);
+    return _M_visit_within_range(REGION, __v)._M_visitor;
+  }
+
+  template <typename SearchVal, typename _OutputIterator>
+  _OutputIterator
+  find_within_range(SearchVal const& val, subvalue_type const range,
+                    _OutputIterator out) const
+  {
+    _Region_ region(val, range, _M_acc, _M_cmp);
+    return this->find_within_range(region, out);
+  }
+
+  template <typename _OutputIterator>
+  _OutputIterator
+  find_within_range(_Region_ const& region,
+                    _OutputIterator out) const
+  {
+    _Range_output<value_type, _OutputIterator> __v(out);
+    return _M_visit_within_range(region, __v)._M_out;
+  }
+
+  // The nearest value to __val, if any, is copied to __out along with its
+  // distance.  Returns whether there was one.
+  template <class SearchVal>
+  bool
+  find_nearest(SearchVal const& __val,
+               std::pair<value_type, distance_type>& __out) const
+  {
+    return _M_find_k_nearest(__val, 1, &__out,
+                             std::numeric_limits<distance_type>::max(),
+                             always_true<value_type>());
+  }
+
+  template <class SearchVal>
+  bool
+  find_nearest(SearchVal const& __val, distance_type const __max,
+               std::pair<value_type, distance_type>& __out) const
+  {
+    return _M_find_k_nearest(__val, 1, &__out, __max,
+                             always_true<value_type>());
+  }
+
+  template <class SearchVal, class _Predicate>
+  bool
+  find_nearest_if(SearchVal const& __val, distance_type const __max,
+                  _Predicate __p,
+                  std::pair<value_type, distance_type>& __out) const
+  {
+    return _M_find_k_nearest(__val, 1, &__out, __max, __p);
+  }
+
+  // Same as KDTree::find_k_nearest(), but for copies of the values.
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<value_type, distance_type>* __out) const
+  {
+    return _M_find_k_nearest(__val, __k, __out,
+                             std::numeric_limits<distance_type>::max(),
+                             always_true<value_type>());
+  }
+
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<value_type, distance_type>* __out,
+                 distance_type const __max) const
+  {
+    return _M_find_k_nearest(__val, __k, __out, __max,
+                             always_true<value_type>());
+  }
+
+  template <class SearchVal, class _Predicate>
+  size_type
+  find_k_nearest_if(SearchVal const& __val, size_type const __k,
+                    std::pair<value_type, distance_type>* __out,
+                    distance_type const __max, _Predicate __p) const
+  {
+    return _M_find_k_nearest(__val, __k, __out, __max, __p);
+  }
+
+protected:
+  // A split of the partition, or a leaf cell when _M_dim is __K, in which
+  // case _M_child[0] is the index of its shard.  Values below the split go
+  // to _M_child[0], the others to _M_child[1].
+  struct _Cell
+  {
+    size_type _M_dim;
+    subvalue_type _M_split;
+    size_type _M_child[2];
+  };
+
+  // The box grows with every value inserted, and only shrinks to fit in
+  // clear() and optimise(): erased values leave it as it was.
+  struct _Shard
+  {
+    _Shard() : _M_bounded(false) {}
+
+    mutable std::mutex _M_mutex;
+    std::unique_ptr<tree_type> _M_tree;
+    bool _M_bounded;
+    subvalue_type _M_low[__K];
+    subvalue_type _M_high[__K];
+  };
+
+  // Converts nothing: the distances collected across the shards already
+  // went through their square root.
+  struct _Same_distance
+  {
+    distance_type
+    operator()(distance_type const __d) const
+    { return __d; }
+  };
+
+  // Adds the cells partitioning [__A, __B) into __shards, numbering their
+  // shards from __count on, and returns the index of the topmost.
+  template <typename _Iter>
+  size_type
+  _M_partition(_Iter const __A, _Iter const __B, size_type const __shards,
+               size_type& __count)
+  {
+    size_type const __c = _M_cells.size();
+    _M_cells.push_back(_Cell());
+    if (__shards < 2 || __B - __A < 2)
+      {
+        _M_cells[__c]._M_dim = __K;
+        _M_cells[__c]._M_child[0] = __count++;
+        return __c;
+      }
+
+    size_type __dim = 0;
+    distance_type __widest = distance_type();
+    for (size_type __d = 0; __d != __K; ++__d)
+      {
+        subvalue_type __low = _M_acc(*__A, __d);
+        subvalue_type __high = __low;
+        for (_Iter __i = __A + 1; __i != __B; ++__i)
+          {
+            subvalue_type const __x = _M_acc(*__i, __d);
+            if (_M_cmp(__x, __low)) __low = __x;
+            if (_M_cmp(__high, __x)) __high = __x;
+          }
+        distance_type const __spread = _M_dist(__low, __high);
+        if (__d == 0 || __widest < __spread)
+          {
+            __dim = __d;
+            __widest = __spread;
+          }
+      }
+
+    size_type const __below = __shards / 2;
+    _Iter const __m = __A + (__B - __A) * __below / __shards;
+    _Node_compare<_Val, _Acc, _Cmp> const __compare(__dim, _M_acc, _M_cmp);
+    std::nth_element(__A, __m, __B, __compare);
+    _M_cells[__c]._M_dim = __dim;
+    _M_cells[__c]._M_split = _M_acc(*__m, __dim);
+    size_type const __left = _M_partition(__A, __m, __below, __count);
+    size_type const __right = _M_partition(__m, __B, __shards - __below, __count);
+    _M_cells[__c]._M_child[0] = __left;
+    _M_cells[__c]._M_child[1] = __right;
+    return __c;
+  }
+
+  template <class SearchVal>
+  size_type
+  _M_route(SearchVal const& __V) const
+  {
+    _Cell const* __c = &_M_cells[0];
+    while (__c->_M_dim != __K)
+      __c = &_M_cells[__c->_M_child
+                      [!_M_cmp(_M_acc(__V, __c->_M_dim), __c->_M_split)]];
+    return __c->_M_child[0];
+  }
+
+  // Called under the lock of __shard.
+  void
+  _M_extend(_Shard& __shard, const_reference __V) const
+  {
+    for (size_type __d = 0; __d != __K; ++__d)
+      {
+        subvalue_type const __x = _M_acc(__V, __d);
+        if (!__shard._M_bounded || _M_cmp(__x, __shard._M_low[__d]))
+          __shard._M_low[__d] = __x;
+        if (!__shard._M_bounded || _M_cmp(__shard._M_high[__d], __x))
+          __shard._M_high[__d] = __x;
+      }
+    __shard._M_bounded = true;
+  }
+
+  // The distance from __val to the box of __shard, in the units of _Dist.
+  // Called under the lock of __shard.
+  template <class SearchVal>
+  distance_type
+  _M_box_distance(_Shard const& __shard, SearchVal const& __val) const
+  {
+    distance_type __d = distance_type();
+    for (size_type __i = 0; __i != __K; ++__i)
+      {
+        subvalue_type const __x = _M_acc(__val, __i);
+        if (_M_cmp(__x, __shard._M_low[__i]))
+          __d += _M_dist(__x, __shard._M_low[__i]);
+        else if (_M_cmp(__shard._M_high[__i], __x))
+          __d += _M_dist(__x, __shard._M_high[__i]);
+      }
+    return __d;
+  }
+
+  template <class _Visitor>
+  _Visitor&
+  _M_visit_within_range(_Region_ const& __REGION, _Visitor& __visitor) const
+  {
+    _Traversal_stack<size_type> __stack;
+    __stack.push(0);
+    while (!__stack.empty())
+      {
+        _Cell const& __c = _M_cells[__stack.pop()];
+        if (__c._M_dim != __K)
+          {
+            size_type const __d = __c._M_dim;
+            if (!_M_cmp(__REGION._M_high_bounds[__d], __c._M_split))
+              __stack.push(__c._M_child[1]);
+            if (_M_cmp(__REGION._M_low_bounds[__d], __c._M_split))
+              __stack.push(__c._M_child[0]);
+            continue;
+          }
+        _Shard const& __shard = _M_shards[__c._M_child[0]];
+        std::lock_guard<std::mutex> __lock(__shard._M_mutex);
+        if (!__shard._M_bounded || __shard._M_tree->empty())
+          continue;
+        bool __within = true;
+        bool __disjoint = false;
+        for (size_type __d = 0; __d != __K; ++__d)
+          {
+            if (_M_cmp(__shard._M_high[__d], __REGION._M_low_bounds[__d])
+                || _M_cmp(__REGION._M_high_bounds[__d], __shard._M_low[__d]))
+              __disjoint = true;
+            if (_M_cmp(__shard._M_low[__d], __REGION._M_low_bounds[__d])
+                || _M_cmp(__REGION._M_high_bounds[__d], __shard._M_high[__d]))
+              __within = false;
+          }
+        if (!__disjoint)
+          _S_visit_shard(*__shard._M_tree, __REGION, __within, __visitor);
+      }
+    return __visitor;
+  }
+
+  template <class _Visitor>
+  static void
+  _S_visit_shard(tree_type const& __tree, _Region_ const& __REGION,
+                 bool const __within, _Visitor& __visitor)
+  {
+    if (__within)
+      std::for_each(__tree.begin(), __tree.end(), std::ref(__visitor));
+    else
+      __tree.visit_within_range(__REGION, std::ref(__visitor));
+  }
+
+  // A shard within the region counts without a visit.
+  static void
+  _S_visit_shard(tree_type const& __tree, _Region_ const& __REGION,
+                 bool const __within, _Range_counter<value_type>& __counter)
+  {
+    __counter._M_count += __within ? __tree.size()
+      : __tree.count_within_range(__REGION);
+  }
+
+  typedef _K_nearest_heap<value_type, distance_type> _K_nearest_heap_;
+
+  // Visits the cells under __c nearer side first, like the KDTree its
+  // nodes, offering the k nearest values of each shard to __heap.
+  template <class SearchVal, class _Predicate>
+  void
+  _M_search_nearest(size_type const __c, SearchVal const& __val,
+                    _Predicate __p, _K_nearest_heap_& __heap,
+                    std::pair<typename tree_type::const_iterator,
+                              distance_type>* __found) const
+  {
+    _Cell const& __cell = _M_cells[__c];
+    if (__cell._M_dim != __K)
+      {
+        subvalue_type const __x = _M_acc(__val, __cell._M_dim);
+        bool const __above = !_M_cmp(__x, __cell._M_split);
+        _M_search_nearest(__cell._M_child[__above], __val, __p, __heap, __found);
+        if (!(_S_squared_bound(__heap._M_max) < _M_dist(__x, __cell._M_split)))
+          _M_search_nearest(__cell._M_child[!__above], __val, __p, __heap,
+                            __found);
+        return;
+      }
+    _Shard const& __shard = _M_shards[__cell._M_child[0]];
+    std::lock_guard<std::mutex> __lock(__shard._M_mutex);
+    if (!__shard._M_bounded || __shard._M_tree->empty()
+        || _S_squared_bound(__heap._M_max) < _M_box_distance(__shard, __val))
+      return;
+    size_type const __n = __shard._M_tree->find_k_nearest_if
+      (__val, __heap._M_k, __found, __heap._M_max, __p);
+    for (size_type __i = 0; __i != __n; ++__i)
+      if (!(__heap._M_max < __found[__i].second))
+        __heap.offer(*__found[__i].first, __found[__i].second);
+  }
+
+  template <class SearchVal, class _Predicate>
+  size_type
+  _M_find_k_nearest(SearchVal const& __val, size_type const __k,
+                    std::pair<value_type, distance_type>* __out,
+                    distance_type const __max, _Predicate __p) const
+  {
+    if (!__k) return 0;
+    std::vector<std::pair<typename tree_type::const_iterator, distance_type> >
+      __found(__k);
+    _K_nearest_heap_ __heap(__out, __k, __max);
+    _M_search_nearest(0, __val, __p, __heap, &__found[0]);
+    return __heap.finish(_Same_distance());
+  }
+
+  std::vector<_Cell> _M_cells;
+  std::unique_ptr<_Shard[]> _M_shards;
+  size_type _M_shard_count;
+  _Acc _M_acc;
+  _Cmp _M_cmp;
+  _Dist _M_dist;
+};
+
+} // namespace KDTree
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
@@ -0,0 +1,566 @@
+/** \file
+ * Defines vectorised kernels that compare one query to many points at once,
+ * for float and double coordinates.
+ *
+ * The points are given as one array per dimension, the arrays being
+ * __stride coordinates apart (the layout of the StaticKDTree leaf buckets).
+ * The kernels compute the squared distances of the points to the query and
+ * test whether the points lie within a box.  On x86, the kernels come in
+ * SSE2, AVX2 and AVX-512 flavours, and the best one supported by the
+ * running CPU is picked at runtime.  Elsewhere, or if KDTREE_NO_SIMD is
+ * defined, only the scalar kernels are available.
+ *
+ * Every flavour computes each squared distance with the same operations, in
+ * the same order, as the scalar kernel and as squared_difference, and never
+ * fuses a multiply and an add: the results are identical whatever the CPU,
+ * as long as the scalar code itself is not built with contracted multiply-
+ * adds (e.g. with FMA instructions enabled and -ffp-contract=fast).
+ */
+
+#ifndef INCLUDE_KDTREE_SIMD_HPP
+#define INCLUDE_KDTREE_SIMD_HPP
+
+#include <cstddef>
+#include <functional>
+
+#include "function.hpp"
+
+#if !defined(KDTREE_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) \
+  && (defined(__x86_64__) || defined(__i386__))
+#  define KDTREE_SIMD_X86
+#  include <immintrin.h>
+#endif
+
+namespace KDTree
+{
+
+  //! Instruction sets the kernels may use, from the least to the most capable.
+  enum simd_level
+  {
+    simd_none,
+    simd_sse2,
+    simd_avx2,
+    simd_avx512
+  };
+
+  /*! Squared distances of __count points to __query, in __out.
+
+      Coordinate __d of point __j is at __coords[__d * __stride + __j], and
+      __out[__j] gets the sum over __d, in increasing order, of the squared
+      differences with __query[__d].
+   */
+  template <typename _Tp>
+  inline void
+  _S_squared_distances_scalar(_Tp const* __coords, size_t const __stride,
+                              size_t const __count, size_t const __dims,
+                              _Tp const* __query, _Tp* __out)
+  {
+    for (size_t __j = 0; __j != __count; ++__j)
+      __out[__j] = _Tp();
+    for (size_t __d = 0; __d != __dims; ++__d)
+      {
+        _Tp const* const __c = __coords + __d * __stride;
+        for (size_t __j = 0; __j != __count; ++__j)
+          {
+            _Tp const __diff = __c[__j] - __query[__d];
+            __out[__j] += __diff * __diff;
+          }
+      }
+  }
+
+  /*! Whether each of __count points lies within [__low, __high], in
+      __inside (1 or 0), with the same layout as above.
+
+      Like _Region::encloses(), a coordinate is out only if it compares
+      less than the low bound or greater than the high one.
+   */
+  template <typename _Tp>
+  inline void
+  _S_within_box_scalar(_Tp const* __coords, size_t const __stride,
+                       size_t const __count, size_t const __dims,
+                       _Tp const* __low, _Tp const* __high,
+                       unsigned char* __inside)
+  {
+    for (size_t __j = 0; __j != __count; ++__j)
+      __inside[__j] = 1;
+    for (size_t __d = 0; __d != __dims; ++__d)
+      {
+        _Tp const* const __c = __coords + __d * __stride;
+        for (size_t __j = 0; __j != __count; ++__j)
+          __inside[__j] &= !(__c[__j] < __low[__d] || __high[__d] < __c[__j]);
+      }
+  }
+
+#ifdef KDTREE_SIMD_X86
+
+  // One kernel per instruction set and coordinate type.  Each handles as
+  // many whole vectors as fit in __count, computing a vector of points
+  // across all the dimensions at once, and returns how many points it did;
+  // the caller finishes the others with the scalar kernel.
+  //
+  // AVX-512F has fused multiply-adds, which the compiler would otherwise be
+  // free to contract a multiply and an add into: its kernels use the
+  // explicitly rounded operations, which are never contracted (in their
+  // zero-masked form, whose full mask makes them plain operations).
+
+  __attribute__((target("sse2"))) inline size_t
+  _S_squared_distances_sse2(double const* __coords, size_t const __stride,
+                            size_t const __count, size_t const __dims,
+                            double const* __query, double* __out)
+  {
+    size_t __j = 0;
+    for (; __j + 2 <= __count; __j += 2)
+      {
+        __m128d __sum = _mm_setzero_pd();
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m128d const __diff
+              = _mm_sub_pd(_mm_loadu_pd(__coords + __d * __stride + __j),
+                           _mm_set1_pd(__query[__d]));
+            __sum = _mm_add_pd(__sum, _mm_mul_pd(__diff, __diff));
+          }
+        _mm_storeu_pd(__out + __j, __sum);
+      }
+    return __j;
+  }
+
+  __attribute__((target("sse2"))) inline size_t
+  _S_squared_distances_sse2(float const* __coords, size_t const __stride,
+                            size_t const __count, size_t const __dims,
+                            float const* __query, float* __out)
+  {
+    size_t __j = 0;
+    for (; __j + 4 <= __count; __j += 4)
+      {
+        __m128 __sum = _mm_setzero_ps();
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m128 const __diff
+              = _mm_sub_ps(_mm_loadu_ps(__coords + __d * __stride + __j),
+                           _mm_set1_ps(__query[__d]));
+            __sum = _mm_add_ps(__sum, _mm_mul_ps(__diff, __diff));
+          }
+        _mm_storeu_ps(__out + __j, __sum);
+      }
+    return __j;
+  }
+
+  __attribute__((target("sse2"))) inline size_t
+  _S_within_box_sse2(double const* __coords, size_t const __stride,
+                     size_t const __count, size_t const __dims,
+                     double const* __low, double const* __high,
+                     unsigned char* __inside)
+  {
+    size_t __j = 0;
+    for (; __j + 2 <= __count; __j += 2)
+      {
+        __m128d __in = _mm_castsi128_pd(_mm_set1_epi32(-1));
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m128d const __c = _mm_loadu_pd(__coords + __d * __stride + __j);
+            __in = _mm_and_pd(__in, _mm_cmpnlt_pd(__c, _mm_set1_pd(__low[__d])));
+            __in = _mm_and_pd(__in, _mm_cmpnlt_pd(_mm_set1_pd(__high[__d]), __c));
+          }
+        int const __mask = _mm_movemask_pd(__in);
+        for (size_t __k = 0; __k != 2; ++__k)
+          __inside[__j + __k] = (__mask >> __k) & 1;
+      }
+    return __j;
+  }
+
+  __attribute__((target("sse2"))) inline size_t
+  _S_within_box_sse2(float const* __coords, size_t const __stride,
+                     size_t const __count, size_t const __dims,
+                     float const* __low, float const* __high,
+                     unsigned char* __inside)
+  {
+    size_t __j = 0;
+    for (; __j + 4 <= __count; __j += 4)
+      {
+        __m128 __in = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m128 const __c = _mm_loadu_ps(__coords + __d * __stride + __j);
+            __in = _mm_and_ps(__in, _mm_cmpnlt_ps(__c, _mm_set1_ps(__low[__d])));
+            __in = _mm_and_ps(__in, _mm_cmpnlt_ps(_mm_set1_ps(__high[__d]), __c));
+          }
+        int const __mask = _mm_movemask_ps(__in);
+        for (size_t __k = 0; __k != 4; ++__k)
+          __inside[__j + __k] = (__mask >> __k) & 1;
+      }
+    return __j;
+  }
+
+  __attribute__((target("avx2"))) inline size_t
+  _S_squared_distances_avx2(double const* __coords, size_t const __stride,
+                            size_t const __count, size_t const __dims,
+                            double const* __query, double* __out)
+  {
+    size_t __j = 0;
+    for (; __j + 4 <= __count; __j += 4)
+      {
+        __m256d __sum = _mm256_setzero_pd();
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m256d const __diff
+              = _mm256_sub_pd(_mm256_loadu_pd(__coords + __d * __stride + __j),
+                              _mm256_set1_pd(__query[__d]));
+            __sum = _mm256_add_pd(__sum, _mm256_mul_pd(__diff, __diff));
+          }
+        _mm256_storeu_pd(__out + __j, __sum);
+      }
+    return __j;
+  }
+
+  __attribute__((target("avx2"))) inline size_t
+  _S_squared_distances_avx2(float const* __coords, size_t const __stride,
+                            size_t const __count, size_t const __dims,
+                            float const* __query, float* __out)
+  {
+    size_t __j = 0;
+    for (; __j + 8 <= __count; __j += 8)
+      {
+        __m256 __sum = _mm256_setzero_ps();
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m256 const __diff
+              = _mm256_sub_ps(_mm256_loadu_ps(__coords + __d * __stride + __j),
+                              _mm256_set1_ps(__query[__d]));
+            __sum = _mm256_add_ps(__sum, _mm256_mul_ps(__diff, __diff));
+          }
+        _mm256_storeu_ps(__out + __j, __sum);
+      }
+    return __j;
+  }
+
+  __attribute__((target("avx2"))) inline size_t
+  _S_within_box_avx2(double const* __coords, size_t const __stride,
+                     size_t const __count, size_t const __dims,
+                     double const* __low, double const* __high,
+                     unsigned char* __inside)
+  {
+    size_t __j = 0;
+    for (; __j + 4 <= __count; __j += 4)
+      {
+        __m256d __in = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m256d const __c = _mm256_loadu_pd(__coords + __d * __stride + __j);
+            __in = _mm256_and_pd(__in, _mm256_cmp_pd(__c, _mm256_set1_pd(__low[__d]),
+                                                     _CMP_NLT_UQ));
+            __in = _mm256_and_pd(__in, _mm256_cmp_pd(_mm256_set1_pd(__high[__d]), __c,
+                                                     _CMP_NLT_UQ));
+          }
+        int const __mask = _mm256_movemask_pd(__in);
+        for (size_t __k = 0; __k != 4; ++__k)
+          __inside[__j + __k] = (__mask >> __k) & 1;
+      }
+    return __j;
+  }
+
+  __attribute__((target("avx2"))) inline size_t
+  _S_within_box_avx2(float const* __coords, size_t const __stride,
+                     size_t const __count, size_t const __dims,
+                     float const* __low, float const* __high,
+                     unsigned char* __inside)
+  {
+    size_t __j = 0;
+    for (; __j + 8 <= __count; __j += 8)
+      {
+        __m256 __in = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m256 const __c = _mm256_loadu_ps(__coords + __d * __stride + __j);
+            __in = _mm256_and_ps(__in, _mm256_cmp_ps(__c, _mm256_set1_ps(__low[__d]),
+                                                     _CMP_NLT_UQ));
+            __in = _mm256_and_ps(__in, _mm256_cmp_ps(_mm256_set1_ps(__high[__d]), __c,
+                                                     _CMP_NLT_UQ));
+          }
+        int const __mask = _mm256_movemask_ps(__in);
+        for (size_t __k = 0; __k != 8; ++__k)
+          __inside[__j + __k] = (__mask >> __k) & 1;
+      }
+    return __j;
+  }
+
+  __attribute__((target("avx512f"))) inline size_t
+  _S_squared_distances_avx512(double const* __coords, size_t const __stride,
+                              size_t const __count, size_t const __dims,
+                              double const* __query, double* __out)
+  {
+    size_t __j = 0;
+    for (; __j + 8 <= __count; __j += 8)
+      {
+        __m512d __sum = _mm512_setzero_pd();
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m512d const __diff
+              = _mm512_sub_pd(_mm512_loadu_pd(__coords + __d * __stride + __j),
+                              _mm512_set1_pd(__query[__d]));
+            __m512d const __square
+              = _mm512_maskz_mul_round_pd(__mmask8(0xff), __diff, __diff,
+                                          _MM_FROUND_CUR_DIRECTION);
+            __sum = _mm512_maskz_add_round_pd(__mmask8(0xff), __sum, __square,
+                                             _MM_FROUND_CUR_DIRECTION);
+          }
+        _mm512_storeu_pd(__out + __j, __sum);
+      }
+    return __j;
+  }
+
+  __attribute__((target("avx512f"))) inline size_t
+  _S_squared_distances_avx512(float const* __coords, size_t const __stride,
+                              size_t const __count, size_t const __dims,
+                              float const* __query, float* __out)
+  {
+    size_t __j = 0;
+    for (; __j + 16 <= __count; __j += 16)
+      {
+        __m512 __sum = _mm512_setzero_ps();
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m512 const __diff
+              = _mm512_sub_ps(_mm512_loadu_ps(__coords + __d * __stride + __j),
+                              _mm512_set1_ps(__query[__d]));
+            __m512 const __square
+              = _mm512_maskz_mul_round_ps(__mmask16(0xffff), __diff, __diff,
+                                          _MM_FROUND_CUR_DIRECTION);
+            __sum = _mm512_maskz_add_round_ps(__mmask16(0xffff), __sum, __square,
+                                             _MM_FROUND_CUR_DIRECTION);
+          }
+        _mm512_storeu_ps(__out + __j, __sum);
+      }
+    return __j;
+  }
+
+  __attribute__((target("avx512f"))) inline size_t
+  _S_within_box_avx512(double const* __coords, size_t const __stride,
+                       size_t const __count, size_t const __dims,
+                       double const* __low, double const* __high,
+                       unsigned char* __inside)
+  {
+    size_t __j = 0;
+    for (; __j + 8 <= __count; __j += 8)
+      {
+        __mmask8 __in = 0xff;
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m512d const __c = _mm512_loadu_pd(__coords + __d * __stride + __j);
+            __in &= _mm512_cmp_pd_mask(__c, _mm512_set1_pd(__low[__d]), _CMP_NLT_UQ);
+            __in &= _mm512_cmp_pd_mask(_mm512_set1_pd(__high[__d]), __c, _CMP_NLT_UQ);
+          }
+        for (size_t __k = 0; __k != 8; ++__k)
+          __inside[__j + __k] = (__in >> __k) & 1;
+      }
+    return __j;
+  }
+
+  __attribute__((target("avx512f"))) inline size_t
+  _S_within_box_avx512(float const* __coords, size_t const __stride,
+                       size_t const __count, size_t const __dims,
+                       float const* __low, float const* __high,
+                       unsigned char* __inside)
+  {
+    size_t __j = 0;
+    for (; __j + 16 <= __count; __j += 16)
+      {
+        __mmask16 __in = 0xffff;
+        for (size_t __d = 0; __d != __dims; ++__d)
+          {
+            __m512 const __c = _mm512_loadu_ps(__coords + __d * __stride + __j);
+            __in &= _mm512_cmp_ps_mask(__c, _mm512_set1_ps(__low[__d]), _CMP_NLT_UQ);
+            __in &= _mm512_cmp_ps_mask(_mm512_set1_ps(__high[__d]), __c, _CMP_NLT_UQ);
+          }
+        for (size_t __k = 0; __k != 16; ++__k)
+          __inside[__j + __k] = (__in >> __k) & 1;
+      }
+    return __j;
+  }
+
+  inline simd_level
+  _S_detect_simd_level()
+  {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+      return simd_avx512;
+    if (__builtin_cpu_supports("avx2"))
+      return simd_avx2;
+    if (__builtin_cpu_supports("sse2"))
+      return simd_sse2;
+    return simd_none;
+  }
+
+#endif // KDTREE_SIMD_X86
+
+  //! The most capable instruction set of the running CPU the kernels use.
+  inline simd_level
+  detected_simd_level()
+  {
+#ifdef KDTREE_SIMD_X86
+    static simd_level const __level = _S_detect_simd_level();
+    return __level;
+#else
+    return simd_none;
+#endif
+  }
+
+  /*! Squared distances of points to a query, see
+      _S_squared_distances_scalar().  The overloads for float and double use
+      the kernels of __level, which the CPU must support.
+   */
+  template <typename _Tp>
+  inline void
+  _S_squared_distances(simd_level, _Tp const* __coords, size_t const __stride,
+                       size_t const __count, size_t const __dims,
+                       _Tp const* __query, _Tp* __out)
+  {
+    _S_squared_distances_scalar(__coords, __stride, __count, __dims,
+                                __query, __out);
+  }
+
+  template <typename _Tp>
+  inline void
+  _S_within_box(simd_level, _Tp const* __coords, size_t const __stride,
+                size_t const __count, size_t const __dims,
+                _Tp const* __low, _Tp const* __high, unsigned char* __inside)
+  {
+    _S_within_box_scalar(__coords, __stride, __count, __dims,
+                         __low, __high, __inside);
+  }
+
+#ifdef KDTREE_SIMD_X86
+
+  template <typename _Tp>
+  inline void
+  _S_squared_distances_dispatch(simd_level const __level, _Tp const* __coords,
+                                size_t const __stride, size_t const __count,
+                                size_t const __dims, _Tp const* __query,
+                                _Tp* __out)
+  {
+    size_t __done = 0;
+    switch (__level)
+      {
+      case simd_avx512:
+        __done = _S_squared_distances_avx512(__coords, __stride, __count,
+                                             __dims, __query, __out);
+        break;
+      case simd_avx2:
+        __done = _S_squared_distances_avx2(__coords, __stride, __count,
+                                           __dims, __query, __out);
+        break;
+      case simd_sse2:
+        __done = _S_squared_distances_sse2(__coords, __stride, __count,
+                                           __dims, __query, __out);
+        break;
+      default:
+        break;
+      }
+    _S_squared_distances_scalar(__coords + __done, __stride, __count - __done,
+                                __dims, __query, __out + __done);
+  }
+
+  template <typename _Tp>
+  inline void
+  _S_within_box_dispatch(simd_level const __level, _Tp const* __coords,
+                         size_t const __stride, size_t const __count,
+                         size_t const __dims, _Tp const* __low,
+                         _Tp const* __high, unsigned char* __inside)
+  {
+    size_t __done = 0;
+    switch (__level)
+      {
+      case simd_avx512:
+        __done = _S_within_box_avx512(__coords, __stride, __count, __dims,
+                                      __low, __high, __inside);
+        break;
+      case simd_avx2:
+        __done = _S_within_box_avx2(__coords, __stride, __count, __dims,
+                                    __low, __high, __inside);
+        break;
+      case simd_sse2:
+        __done = _S_within_box_sse2(__coords, __stride, __count, __dims,
+                                    __low, __high, __inside);
+        break;
+      default:
+        break;
+      }
+    _S_within_box_scalar(__coords + __done, __stride, __count - __done,
+                         __dims, __low, __high, __inside + __done);
+  }
+
+  inline void
+  _S_squared_distances(simd_level const __level, double const* __coords,
+                       size_t const __stride, size_t const __count,
+                       size_t const __dims, double const* __query,
+                       double* __out)
+  {
+    _S_squared_distances_dispatch(__level, __coords, __stride, __count,
+                                  __dims, __query, __out);
+  }
+
+  inline void
+  _S_squared_distances(simd_level const __level, float const* __coords,
+                       size_t const __stride, size_t const __count,
+                       size_t const __dims, float const* __query,
+                       float* __out)
+  {
+    _S_squared_distances_dispatch(__level, __coords, __stride, __count,
+                                  __dims, __query, __out);
+  }
+
+  inline void
+  _S_within_box(simd_level const __level, double const* __coords,
+                size_t const __stride, size_t const __count,
+                size_t const __dims, double const* __low,
+                double const* __high, unsigned char* __inside)
+  {
+    _S_within_box_dispatch(__level, __coords, __stride, __count, __dims,
+                           __low, __high, __inside);
+  }
+
+  inline void
+  _S_within_box(simd_level const __level, float const* __coords,
+                size_t const __stride, size_t const __count,
+                size_t const __dims, float const* __low,
+                float const* __high, unsigned char* __inside)
+  {
+    _S_within_box_dispatch(__level, __coords, __stride, __count, __dims,
+                           __low, __high, __inside);
+  }
+
+#endif // KDTREE_SIMD_X86
+
+  /*! Whether the kernels compute what the _Dist and _Cmp functors of a
+      tree would, so that the tree may use them in place of the functors.
+      Only true of the default functors on float and double.
+   */
+  template <typename _Tp, typename _Dist, typename _Cmp>
+  struct _Simd_applies
+  { static bool const value = false; };
+
+  template <>
+  struct _Simd_applies<double, squared_difference<double, double>,
+                       std::less<double> >
+  { static bool const value = true; };
+
+  template <>
+  struct _Simd_applies<float, squared_difference<float, float>,
+                       std::less<float> >
+  { static bool const value = true; };
+
+} // namespace KDTree
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
@@ -0,0 +1,1105 @@
+/** \file
+ * Defines the interface for the SnapshotKDTree class, a KD-Tree container
+ * whose readers query immutable snapshots while a writer updates it.
+ *
+ * The tree is persistent: its nodes are never changed once published.
+ * insert() and erase() path-copy the nodes they touch, from the root down
+ * to the node inserted or removed, and leave every other node shared with
+ * the previous versions.  The changes accumulate in a draft, which
+ * publish() makes visible to the readers at once, with a single atomic
+ * store.  The nodes created since the last publish() belong to the draft
+ * only, so they are changed in place rather than copied again.
+ *
+ * A reader pins the version current at the time with get_snapshot(), without
+ * taking any lock: it announces the version in a reader slot of its own,
+ * and checks that it is still the current one, hazard pointer style.  The
+ * snapshot answers the same queries as a KDTree, on the values of its
+ * version, however many versions are published meanwhile.
+ *
+ * A node is retired by the version that first goes without it, and only
+ * reclaimed once every snapshot pinned is of that version or a later one,
+ * so reclamation proceeds by epochs, the versions.  publish() reclaims
+ * what it can, and so does reclaim().
+ *
+ * There is a single writer: insert(), erase(), clear(), publish() and
+ * reclaim() must not run concurrently.  get_snapshot() and the queries of
+ * snapshots may run on any number of threads, alongside the writer; at
+ * most max_readers() snapshots may be pinned at once, further ones wait
+ * for a slot.
+ *
+ * The tree is not rebalanced.  Like in the KDTree, values with the same
+ * coordinate as a node on its split dimension go right, and the removed
+ * nodes are replaced by the nearest value on the split dimension.
+ *
+ * Requires C++11.
+ */
+
+#ifndef INCLUDE_KDTREE_SNAPSHOT_KDTREE_HPP
+#define INCLUDE_KDTREE_SNAPSHOT_KDTREE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "function.hpp"
+#include "node.hpp"
+#include "region.hpp"
+
+namespace KDTree
+{
+
+template <size_t const __K, typename _Val,
+          typename _Acc = _Bracket_accessor<_Val>,
+          typename _Dist = squared_difference<typename _Acc::result_type,
+          typename _Acc::result_type>,
+          typename _Cmp = std::less<typename _Acc::result_type>,
+          typename _Alloc = std::allocator<_Val> >
+class SnapshotKDTree
+{
+public:
+  typedef _Region<__K, _Val, typename _Acc::result_type, _Acc, _Cmp>
+    _Region_;
+  typedef _Val value_type;
+  typedef value_type* pointer;
+  typedef value_type const* const_pointer;
+  typedef value_type& reference;
+  typedef value_type const& const_reference;
+  typedef typename _Acc::result_type subvalue_type;
+  typedef typename _Dist::distance_type distance_type;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef _Alloc allocator_type;
+
+  // Searches return pointers to the values they find, or end().
+  typedef const_pointer const_iterator;
+
+protected:
+  // Shared by all the versions holding it: only changed while it belongs
+  // to the draft, i.e. while _M_version is the draft's.
+  struct _Node
+  {
+    _Node(_Val const& __v, size_type const __version)
+      : _M_value(__v), _M_left(NULL), _M_right(NULL), _M_size(1),
+        _M_version(__version) {}
+
+    _Node(_Val&& __v, size_type const __version)
+      : _M_value(std::move(__v)), _M_left(NULL), _M_right(NULL), _M_size(1),
+        _M_version(__version) {}
+
+    _Val _M_value;
+    _Node* _M_left;
+    _Node* _M_right;
+    // number of nodes in the subtree rooted here, this one included
+    size_type _M_size;
+    // the version that created the node
+    size_type _M_version;
+  };
+
+  typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<_Node>
+    _Node_allocator;
+  typedef std::allocator_traits<_Node_allocator> _Node_traits;
+
+  struct _Version
+  {
+    _Node const* _M_root;
+    size_type _M_count;
+    size_type _M_number;
+  };
+
+  // The nodes first left out by version _M_number.
+  struct _Retired
+  {
+    size_type _M_number;
+    std::vector<_Node*> _M_nodes;
+  };
+
+  // The version pinned by a reader, if any.  Padded so that two readers
+  // never write to the same cache line.
+  struct _Reader_slot
+  {
+    _Reader_slot() : _M_taken(false), _M_pin(NULL) {}
+
+    std::atomic<bool> _M_taken;
+    std::atomic<_Version const*> _M_pin;
+    char _M_padding[64];
+  };
+
+public:
+  class snapshot;
+
+  // Up to __max_readers snapshots may be pinned at once.
+  explicit
+  SnapshotKDTree(size_type const __max_readers = 64,
+                 _Acc const& __acc = _Acc(), _Dist const& __dist = _Dist(),
+                 _Cmp const& __cmp = _Cmp(),
+                 allocator_type const& __a = allocator_type())
+    : _M_alloc(__a), _M_root(NULL), _M_count(0), _M_draft(1),
+      _M_dirty(false), _M_current(NULL),
+      _M_slots(new _Reader_slot[__max_readers ? __max_readers : 1]),
+      _M_slot_count(__max_readers ? __max_readers : 1),
+      _M_acc(__acc), _M_cmp(__cmp), _M_dist(__dist)
+  {
+    _Version* const __v = new _Version();
+    __v->_M_root = NULL;
+    __v->_M_count = 0;
+    __v->_M_number = 0;
+    _M_versions.push_back(__v);
+    _M_current.store(__v);
+  }
+
+  SnapshotKDTree(SnapshotKDTree const&) = delete;
+  SnapshotKDTree& operator=(SnapshotKDTree const&) = delete;
+
+  // No snapshot may be left pinned.
+  ~SnapshotKDTree()
+  {
+    for (size_type __s = 0; __s != _M_slot_count; ++__s)
+      assert(!_M_slots[__s]._M_taken.load());
+    _M_free_subtree(_M_root);
+    _M_free_nodes(_M_retiring);
+    for (size_type __r = 0; __r != _M_retired.size(); ++__r)
+      _M_free_nodes(_M_retired[__r]._M_nodes);
+    for (size_type __v = 0; __v != _M_versions.size(); ++__v)
+      delete _M_versions[__v];
+  }
+
+  allocator_type
+  get_allocator() const
+  { return allocator_type(_M_alloc); }
+
+  //! Number of values in the draft.
+  size_type
+  size() const
+  { return _M_count; }
+
+  bool
+  empty() const
+  { return !_M_count; }
+
+  size_type
+  max_readers() const
+  { return _M_slot_count; }
+
+  //! Number of the version get_snapshot() currently pins.
+  size_type
+  version() const
+  { return _M_current.load()->_M_number; }
+
+  _Cmp
+  value_comp() const
+  { return _M_cmp; }
+
+  _Acc
+  value_acc() const
+  { return _M_acc; }
+
+  const _Dist&
+  value_distance() const
+  { return _M_dist; }
+
+  void
+  insert(const_reference __V)
+  {
+    _Node* const __leaf = _M_new_node(__V);
+    try
+      {
+        _M_insert(__leaf);
+      }
+    catch (...)
+      {
+        _M_free_node(__leaf);
+        throw;
+      }
+  }
+
+  void
+  insert(value_type&& __V)
+  {
+    _Node* const __leaf = _M_new_node(std::move(__V));
+    try
+      {
+        _M_insert(__leaf);
+      }
+    catch (...)
+      {
+        _M_free_node(__leaf);
+        throw;
+      }
+  }
+
+  template <class _InputIterator>
+  void
+  insert(_InputIterator __first, _InputIterator __last)
+  {
+    for (; __first != __last; ++__first)
+      this->insert(*__first);
+  }
+
+  // Like KDTree::erase(), removes any value at the same location as __V.
+  // Returns whether there was one.
+  bool
+  erase(const_reference __V)
+  { return _M_erase(__V, false); }
+
+  //! Removes a value equal to __V, if any, and returns whether there was.
+  bool
+  erase_exact(const_reference __V)
+  { return _M_erase(__V, true); }
+
+  //! Empties the draft; the published versions keep their values.
+  void
+  clear()
+  {
+    if (!_M_root) return;
+    _M_retiring.reserve(_M_retiring.size() + _M_count);
+    _Traversal_stack<_Node*> __stack;
+    __stack.push(_M_root);
+    while (!__stack.empty())
+      {
+        _Node* const __n = __stack.pop();
+        if (__n->_M_left) __stack.push(__n->_M_left);
+        if (__n->_M_right) __stack.push(__n->_M_right);
+        _M_drop(__n);
+      }
+    _M_root = NULL;
+    _M_count = 0;
+    _M_dirty = true;
+  }
+
+  /*! \brief Makes the draft the current version, and returns its number.
+
+The snapshots taken from then on see all the changes made since the last
+publish(), and those taken before none of them.  Returns the number of the
+current version, unchanged if there were no changes to publish.
+   */
+  size_type
+  publish()
+  {
+    if (!_M_dirty)
+      return _M_draft - 1;
+    _Version* const __v = new _Version();
+    __v->_M_root = _M_root;
+    __v->_M_count = _M_count;
+    __v->_M_number = _M_draft;
+    try
+      {
+        _M_versions.push_back(__v);
+        _M_retired.push_back(_Retired());
+      }
+    catch (...)
+      {
+        if (!_M_versions.empty() && _M_versions.back() == __v)
+          _M_versions.pop_back();
+        delete __v;
+        throw;
+      }
+    _M_retired.back()._M_number = _M_draft;
+    _M_retired.back()._M_nodes.swap(_M_retiring);
+    _M_current.store(__v);
+    ++_M_draft;
+    _M_dirty = false;
+    reclaim();
+    return __v->_M_number;
+  }
+
+  //! Frees the nodes and versions that no pinned snapshot can reach.
+  void
+  reclaim()
+  {
+    std::vector<_Version const*> __pinned;
+    for (size_type __s = 0; __s != _M_slot_count; ++__s)
+      if (_Version const* const __p = _M_slots[__s]._M_pin.load())
+        __pinned.push_back(__p);
+    // A pin may be left over from a reader that failed to validate it, and
+    // point to a version freed already: it is only ever compared.
+    size_type __oldest = _M_draft - 1;
+    for (size_type __v = 0; __v != _M_versions.size(); ++__v)
+      if (std::find(__pinned.begin(), __pinned.end(), _M_versions[__v])
+          != __pinned.end())
+        {
+          __oldest = _M_versions[__v]->_M_number;
+          break;
+        }
+    while (!_M_retired.empty() && _M_retired.front()._M_number <= __oldest)
+      {
+        _M_free_nodes(_M_retired.front()._M_nodes);
+        _M_retired.pop_front();
+      }
+    while (_M_versions.front()->_M_number < __oldest)
+      {
+        delete _M_versions.front();
+        _M_versions.pop_front();
+      }
+  }
+
+  //! Pins the current version, for the lifetime of the snapshot.
+  snapshot
+  get_snapshot() const
+  { return snapshot(this); }
+
+  /*! A version of the tree, pinned: none of its nodes is reclaimed until
+      the snapshot is destroyed.  Only movable.
+   */
+  class snapshot
+  {
+  public:
+    snapshot(snapshot&& __x) noexcept
+      : _M_tree(__x._M_tree), _M_slot(__x._M_slot), _M_version(__x._M_version)
+    { __x._M_slot = NULL; }
+
+    snapshot&
+    operator=(snapshot&& __x) noexcept
+    {
+      if (this != &__x)
+        {
+          _M_release();
+          _M_tree = __x._M_tree;
+          _M_slot = __x._M_slot;
+          _M_version = __x._M_version;
+          __x._M_slot = NULL;
+        }
+      return *this;
+    }
+
+    snapshot(snapshot const&) = delete;
+    snapshot& operator=(snapshot const&) = delete;
+
+    ~snapshot()
+    { _M_release(); }
+
+    size_type
+    size() const
+    { return _M_version->_M_count; }
+
+    bool
+    empty() const
+    { return !_M_version->_M_count; }
+
+    size_type
+    version() const
+    { return _M_version->_M_number; }
+
+    const_iterator end() const { return const_iterator(); }
+
+    //! A value at the same location as __V, like KDTree::find().
+    template <class SearchVal>
+    const_iterator
+    find(SearchVal const& __V) const
+    { return _M_find(__V, false); }
+
+    template <class SearchVal>
+    const_iterator
+    find_exact(SearchVal const& __V) const
+    { return _M_find(__V, true); }
+
+    //! Visits every value, in no particular order.
+    template <class Visitor>
+    Visitor
+    for_each(Visitor __visitor) const
+    {
+      _Range_visitor<value_type, Visitor> __v(__visitor);
+      if (_M_version->_M_root)
+        _S_visit_subtree(_M_version->_M_root, __v);
+      return __v._M_visitor;
+    }
+
+    // NOTE: see notes on KDTree::find_within_range().
+    size_type
+    count_within_range(const_reference __V, subvalue_type const __R) const
+    {
+      _Region_ __region(__V, __R, _M_tree->_M_acc, _M_tree->_M_cmp);
+      return this->count_within_range(__region);
+    }
+
+    size_type
+    count_within_range(_Region_ const& __REGION) const
+    {
+      _Range_counter<value_type> __counter;
+      return _M_visit_within_range(__REGION, __counter)._M_count;
+    }
+
+    template <typename SearchVal, class Visitor>
+    Visitor
+    visit_within_range(SearchVal const& V, subvalue_type const R, Visitor visitor) const
+    {
+      _Region_ region(V, R, _M_tree->_M_acc, _M_tree->_M_cmp);
+      return this->visit_within_range(region, visitor);
+    }
+
+    template <class Visitor>
+    Visitor
+    visit_within_range(_Region_ const& REGION, Visitor visitor) const
+    {
+      _Range_visitor<value_type, Visitor> __v(visitor);
+      return _M_visit_within_range(REGION, __v)._M_visitor;
+    }
+
+    template <typename SearchVal, typename _OutputIterator>
+    _OutputIterator
+    find_within_range(SearchVal const& val, subvalue_type const range,
+                      _OutputIterator out) const
+    {
+      _Region_ region(val, range, _M_tree->_M_acc, _M_tree->_M_cmp);
+      return this->find_within_range(region, out);
+    }
+
+    template <typename _OutputIterator>
+    _OutputIterator
+    find_within_range(_Region_ const& region,
+                      _OutputIterator out) const
+    {
+      _Range_output<value_type, _OutputIterator> __v(out);
+      return _M_visit_within_range(region, __v)._M_out;
+    }
+
+    template <class SearchVal>
+    std::pair<const_iterator, distance_type>
+    find_nearest (SearchVal const& __val) const
+    {
+      std::pair<const_iterator, distance_type> __r
+        = this->find_nearest_squared(__val);
+      __r.second = std::sqrt(__r.second);
+      return __r;
+    }
+
+    template <class SearchVal>
+    std::pair<const_iterator, distance_type>
+    find_nearest (SearchVal const& __val, distance_type __max) const
+    {
+      std::pair<const_iterator, distance_type> __r
+        = this->find_nearest_squared(__val, _S_squared_bound(__max));
+      __r.second = __r.first == end() ? __max : std::sqrt(__r.second);
+      return __r;
+    }
+
+    template <class SearchVal, class _Predicate>
+    std::pair<const_iterator, distance_type>
+    find_nearest_if (SearchVal const& __val, distance_type __max,
+                     _Predicate __p) const
+    {
+      std::pair<const_iterator, distance_type> __r
+        = this->find_nearest_squared_if(__val, _S_squared_bound(__max), __p);
+      __r.second = __r.first == end() ? __max : std::sqrt(__r.second);
+      return __r;
+    }
+
+    // Same as KDTree::find_nearest_squared(): __max and the distance
+    // returned are in the units of _Dist.
+    template <class SearchVal>
+    std::pair<const_iterator, distance_type>
+    find_nearest_squared (SearchVal const& __val) const
+    {
+      std::pair<const_iterator, distance_type> __r
+        = _M_find_nearest(__val, std::numeric_limits<distance_type>::max(),
+                          always_true<value_type>());
+      if (__r.first == end())
+        __r.second = distance_type();
+      return __r;
+    }
+
+    template <class SearchVal>
+    std::pair<const_iterator, distance_type>
+    find_nearest_squared (SearchVal const& __val, distance_type __max) const
+    {
+      return _M_find_nearest(__val, __max, always_true<value_type>());
+    }
+
+    template <class SearchVal, class _Predicate>
+    std::pair<const_iterator, distance_type>
+    find_nearest_squared_if (SearchVal const& __val, distance_type __max,
+                             _Predicate __p) const
+    {
+      return _M_find_nearest(__val, __max, __p);
+    }
+
+    // Same as KDTree::find_k_nearest().
+    template <class SearchVal>
+    size_type
+    find_k_nearest(SearchVal const& __val, size_type const __k,
+                   std::pair<const_iterator, distance_type>* __out) const
+    {
+      return _M_find_k_nearest(__val, __k, __out,
+                               std::numeric_limits<distance_type>::max(),
+                               always_true<value_type>());
+    }
+
+    template <class SearchVal>
+    size_type
+    find_k_nearest(SearchVal const& __val, size_type const __k,
+                   std::pair<const_iterator, distance_type>* __out,
+                   distance_type const __max) const
+    {
+      return _M_find_k_nearest(__val, __k, __out, _S_squared_bound(__max),
+                               always_true<value_type>());
+    }
+
+    template <class SearchVal, class _Predicate>
+    size_type
+    find_k_nearest_if(SearchVal const& __val, size_type const __k,
+                      std::pair<const_iterator, distance_type>* __out,
+                      distance_type const __max, _Predicate __p) const
+    {
+      return _M_find_k_nearest(__val, __k, __out, _S_squared_bound(__max), __p);
+    }
+
+  private:
+    friend class SnapshotKDTree;
+
+    // Takes a free reader slot, starting from one that depends on the
+    // thread so that readers seldom compete for the same, and pins the
+    // current version in it.  The pin holds once the version is seen to be
+    // still current after it was announced: the writer, which scans the
+    // slots after publishing, then cannot miss it.
+    explicit
+    snapshot(SnapshotKDTree const* __tree)
+      : _M_tree(__tree), _M_slot(NULL), _M_version(NULL)
+    {
+      size_type const __n = __tree->_M_slot_count;
+      size_type __s = std::hash<std::thread::id>()(std::this_thread::get_id()) % __n;
+      for (size_type __tries = 0; ; ++__tries, __s = __s + 1 == __n ? 0 : __s + 1)
+        {
+          _Reader_slot& __slot = __tree->_M_slots[__s];
+          bool __free = false;
+          if (!__slot._M_taken.load(std::memory_order_relaxed)
+              && __slot._M_taken.compare_exchange_strong(__free, true))
+            {
+              _M_slot = &__slot;
+              break;
+            }
+          if (__tries % __n == __n - 1)
+            std::this_thread::yield();
+        }
+      _Version const* __v = __tree->_M_current.load();
+      for (;;)
+        {
+          _M_slot->_M_pin.store(__v);
+          _Version const* const __now = __tree->_M_current.load();
+          if (__now == __v)
+            break;
+          __v = __now;
+        }
+      _M_version = __v;
+    }
+
+    void
+    _M_release()
+    {
+      if (!_M_slot) return;
+      _M_slot->_M_pin.store(NULL);
+      _M_slot->_M_taken.store(false, std::memory_order_release);
+      _M_slot = NULL;
+    }
+
+    template <class SearchVal>
+    const_iterator
+    _M_find(SearchVal const& __V, bool const __exact) const
+    {
+      _Acc const& __acc = _M_tree->_M_acc;
+      _Cmp const& __cmp = _M_tree->_M_cmp;
+      _Traversal_stack<std::pair<_Node const*, size_type> > __stack;
+      if (_M_version->_M_root)
+        __stack.push(std::make_pair(_M_version->_M_root, size_type(0)));
+      while (!__stack.empty())
+        {
+          std::pair<_Node const*, size_type> const __next = __stack.pop();
+          _Node const* const __n = __next.first;
+          if (_M_tree->_M_matches(__n->_M_value, __V, __exact))
+            return &__n->_M_value;
+          size_type const __dim = __next.second;
+          size_type const __child_dim = __dim + 1 == __K ? 0 : __dim + 1;
+          // <= on both sides, see the notes atop kdtree.hpp
+          if (__n->_M_right && !__cmp(__acc(__V, __dim), __acc(__n->_M_value, __dim)))
+            __stack.push(std::make_pair(__n->_M_right, __child_dim));
+          if (__n->_M_left && !__cmp(__acc(__n->_M_value, __dim), __acc(__V, __dim)))
+            __stack.push(std::make_pair(__n->_M_left, __child_dim));
+        }
+      return end();
+    }
+
+    // A subtree to visit, with its split dimension and the dimensions on
+    // which its cell is known to lie above the low, and below the high
+    // bounds of the region, like KDTree::_Range_cell.
+    struct _Range_cell
+    {
+      _Range_cell(_Node const* const __N = NULL)
+        : _M_node(__N), _M_dim(0) {}
+
+      _Node const* _M_node;
+      size_type _M_dim;
+      std::bitset<__K> _M_low;
+      std::bitset<__K> _M_high;
+    };
+
+    // Same walk as KDTree::_M_visit_within_range().
+    template <class _Visitor>
+    _Visitor&
+    _M_visit_within_range(_Region_ const& __REGION, _Visitor& __visitor) const
+    {
+      _Acc const& __acc = _M_tree->_M_acc;
+      _Cmp const& __cmp = _M_tree->_M_cmp;
+      _Traversal_stack<_Range_cell> __stack;
+      if (_M_version->_M_root)
+        __stack.push(_Range_cell(_M_version->_M_root));
+      while (!__stack.empty())
+        {
+          _Range_cell __cell = __stack.pop();
+          _Node const* __N = __cell._M_node;
+          while (__N)
+            {
+              if ((__cell._M_low & __cell._M_high).count() == __K)
+                {
+                  _S_visit_subtree(__N, __visitor);
+                  break;
+                }
+              if (__REGION.encloses(__N->_M_value))
+                __visitor(__N->_M_value);
+              size_type const __dim = __cell._M_dim;
+              subvalue_type const __split = __acc(__N->_M_value, __dim);
+              bool const __above_low = !__cmp(__split, __REGION._M_low_bounds[__dim]);
+              bool const __below_high = !__cmp(__REGION._M_high_bounds[__dim], __split);
+              bool const __left = __N->_M_left && __above_low;
+              bool const __right = __N->_M_right && __below_high;
+              if (++__cell._M_dim == __K)
+                __cell._M_dim = 0;
+              if (__right)
+                {
+                  _Range_cell __right_cell(__cell);
+                  __right_cell._M_node = __N->_M_right;
+                  if (__above_low)
+                    __right_cell._M_low.set(__dim);
+                  if (!__left)
+                    {
+                      __cell = __right_cell;
+                      __N = __cell._M_node;
+                      continue;
+                    }
+                  __stack.push(__right_cell);
+                }
+              if (__below_high)
+                __cell._M_high.set(__dim);
+              __N = __left ? __N->_M_left : NULL;
+            }
+        }
+      return __visitor;
+    }
+
+    // Visits every value of the subtree under __N, in pre-order.
+    template <class _Visitor>
+    static void
+    _S_visit_subtree(_Node const* __N, _Visitor& __visitor)
+    {
+      _Traversal_stack<_Node const*> __stack;
+      __stack.push(__N);
+      while (!__stack.empty())
+        for (__N = __stack.pop(); __N; __N = __N->_M_left)
+          {
+            __visitor(__N->_M_value);
+            if (__N->_M_right)
+              __stack.push(__N->_M_right);
+          }
+    }
+
+    // Counting needs no visit: the subtree knows its size.
+    static void
+    _S_visit_subtree(_Node const* __N, _Range_counter<value_type>& __counter)
+    {
+      __counter._M_count += __N->_M_size;
+    }
+
+    // Collects the single nearest value; ties go to the last one offered,
+    // like in the KDTree.
+    struct _Nearest
+    {
+      explicit
+      _Nearest(distance_type const __max)
+        : _M_best(NULL), _M_max(__max) {}
+
+      void
+      offer(const_pointer const __v, distance_type const __d)
+      {
+        _M_best = __v;
+        _M_max = __d;
+      }
+
+      const_pointer _M_best;
+      distance_type _M_max;
+    };
+
+    struct _Pending
+    {
+      _Node const* _M_node;
+      size_type _M_dim;
+      distance_type _M_plane;
+    };
+
+    // Searches in the units of _Dist (squared, for the default functor),
+    // offering __collector every value within its _M_max, which only ever
+    // shrinks, nearer subtrees first.
+    template <class SearchVal, class _Predicate, class _Collector>
+    void
+    _M_search_nearest(SearchVal const& __val, _Predicate __p,
+                      _Collector& __collector) const
+    {
+      _Acc const& __acc = _M_tree->_M_acc;
+      _Cmp const& __cmp = _M_tree->_M_cmp;
+      _Dist const& __dist = _M_tree->_M_dist;
+      _Traversal_stack<_Pending> __stack;
+      if (_M_version->_M_root)
+        {
+          _Pending const __root = { _M_version->_M_root, 0, distance_type() };
+          __stack.push(__root);
+        }
+      while (!__stack.empty())
+        {
+          _Pending const __pending = __stack.pop();
+          if (__collector._M_max < __pending._M_plane)
+            continue;
+          _Node const* __n = __pending._M_node;
+          size_type __dim = __pending._M_dim;
+          while (__n)
+            {
+              if (__p(__n->_M_value))
+                {
+                  distance_type const __d = _S_accumulate_node_distance<__K>
+                    (__dist, __acc, __n->_M_value, __val);
+                  if (!(__collector._M_max < __d))
+                    __collector.offer(&__n->_M_value, __d);
+                }
+              _Node const* __near = __n->_M_left;
+              _Node const* __far = __n->_M_right;
+              if (!_S_node_compare(__dim, __cmp, __acc, __val, __n->_M_value))
+                std::swap(__near, __far);
+              distance_type const __plane
+                = _S_node_distance(__dim, __dist, __acc, __val, __n->_M_value);
+              if (++__dim == __K)
+                __dim = 0;
+              if (__far && !(__collector._M_max < __plane))
+                {
+                  _Pending const __far_pending = { __far, __dim, __plane };
+                  __stack.push(__far_pending);
+                }
+              __n = __near;
+            }
+        }
+    }
+
+    // __max, and the distance returned, are in the units of _Dist.
+    template <class SearchVal, class _Predicate>
+    std::pair<const_iterator, distance_type>
+    _M_find_nearest(SearchVal const& __val, distance_type const __max,
+                    _Predicate __p) const
+    {
+      _Nearest __nearest(__max);
+      _M_search_nearest(__val, __p, __nearest);
+      return std::pair<const_iterator, distance_type>
+        (__nearest._M_best, __nearest._M_max);
+    }
+
+    template <class SearchVal, class _Predicate>
+    size_type
+    _M_find_k_nearest(SearchVal const& __val, size_type const __k,
+                      std::pair<const_iterator, distance_type>* __out,
+                      distance_type const __max, _Predicate __p) const
+    {
+      if (!_M_version->_M_root || !__k) return 0;
+      _K_nearest_heap<const_iterator, distance_type> __heap(__out, __k, __max);
+      _M_search_nearest(__val, __p, __heap);
+      return __heap.finish(_Square_root());
+    }
+
+    SnapshotKDTree const* _M_tree;
+    _Reader_slot* _M_slot;
+    _Version const* _M_version;
+  };
+
+protected:
+  template <class SearchVal>
+  bool
+  _M_matches(const_reference __v, SearchVal const& __V, bool const __exact) const
+  {
+    if (__exact)
+      return __v == __V;
+    for (size_type __i = 0; __i != __K; ++__i)
+      if (_M_cmp(_M_acc(__v, __i), _M_acc(__V, __i))
+          || _M_cmp(_M_acc(__V, __i), _M_acc(__v, __i)))
+        return false;
+    return true;
+  }
+
+  template <typename _Arg>
+  _Node*
+  _M_new_node(_Arg&& __v)
+  {
+    _Node* const __n = _Node_traits::allocate(_M_alloc, 1);
+    try
+      {
+        _Node_traits::construct(_M_alloc, __n, std::forward<_Arg>(__v), _M_draft);
+      }
+    catch (...)
+      {
+        _Node_traits::deallocate(_M_alloc, __n, 1);
+        throw;
+      }
+    return __n;
+  }
+
+  // A draft copy of __shape, children and size included, holding __v.
+  _Node*
+  _M_copy_node(_Node const* const __shape, const_reference __v)
+  {
+    _Node* const __n = _M_new_node(__v);
+    __n->_M_left = __shape->_M_left;
+    __n->_M_right = __shape->_M_right;
+    __n->_M_size = __shape->_M_size;
+    return __n;
+  }
+
+  void
+  _M_free_node(_Node* const __n)
+  {
+    _Node_traits::destroy(_M_alloc, __n);
+    _Node_traits::deallocate(_M_alloc, __n, 1);
+  }
+
+  void
+  _M_free_nodes(std::vector<_Node*>& __nodes)
+  {
+    for (size_type __i = 0; __i != __nodes.size(); ++__i)
+      _M_free_node(__nodes[__i]);
+    __nodes.clear();
+  }
+
+  void
+  _M_free_subtree(_Node* const __N)
+  {
+    _Traversal_stack<_Node*> __stack;
+    if (__N)
+      __stack.push(__N);
+    while (!__stack.empty())
+      {
+        _Node* const __n = __stack.pop();
+        if (__n->_M_left) __stack.push(__n->_M_left);
+        if (__n->_M_right) __stack.push(__n->_M_right);
+        _M_free_node(__n);
+      }
+  }
+
+  // __n leaves the draft: the draft's own nodes can go at once, the others
+  // wait for the versions that hold them.  Room must have been reserved in
+  // _M_retiring.
+  void
+  _M_drop(_Node* const __n)
+  {
+    if (__n->_M_version == _M_draft)
+      _M_free_node(__n);
+    else
+      _M_retiring.push_back(__n);
+  }
+
+  void
+  _M_insert(_Node* const __leaf)
+  {
+    std::vector<_Node*> __chain;
+    bool __left = false;
+    for (_Node* __n = _M_root; __n; __n = __left ? __n->_M_left : __n->_M_right)
+      {
+        __left = _S_node_compare(__chain.size() % __K, _M_cmp, _M_acc,
+                                 __leaf->_M_value, __n->_M_value);
+        __chain.push_back(__n);
+      }
+    _M_rewrite(__chain, std::vector<_Node const*>(__chain.size()),
+               __leaf, __left);
+    ++_M_count;
+  }
+
+  // Appends to __chain the path from __N, at depth __L, down to a node
+  // matching __V, or to __target if given.  Values equal to a node on its
+  // split dimension may lie on either side of it.  Returns false, with
+  // __chain as it was, if there is none.
+  bool
+  _M_find_chain(_Node* const __N, size_type const __L, const_reference __V,
+                _Node const* const __target, bool const __exact,
+                std::vector<_Node*>& __chain) const
+  {
+    if (!__N) return false;
+    __chain.push_back(__N);
+    if (__target ? __N == __target : _M_matches(__N->_M_value, __V, __exact))
+      return true;
+    size_type const __dim = __L % __K;
+    if (!_M_cmp(_M_acc(__N->_M_value, __dim), _M_acc(__V, __dim))
+        && _M_find_chain(__N->_M_left, __L + 1, __V, __target, __exact, __chain))
+      return true;
+    if (!_M_cmp(_M_acc(__V, __dim), _M_acc(__N->_M_value, __dim))
+        && _M_find_chain(__N->_M_right, __L + 1, __V, __target, __exact, __chain))
+      return true;
+    __chain.pop_back();
+    return false;
+  }
+
+  // The node of the subtree of __N, at depth __L, with the smallest (or
+  // largest, with __max) coordinate __dim.
+  _Node*
+  _M_find_extreme(_Node* const __N, size_type const __L, size_type const __dim,
+                  bool const __max) const
+  {
+    _Node* __best = __N;
+    bool const __splits = __L % __K == __dim;
+    _Node* const __children[2] = { __N->_M_left, __N->_M_right };
+    for (size_type __c = 0; __c != 2; ++__c)
+      {
+        // on the split dimension, the left subtree holds nothing larger
+        // and the right one nothing smaller
+        if (!__children[__c] || (__splits && __max != (__c == 1)))
+          continue;
+        _Node* const __b = _M_find_extreme(__children[__c], __L + 1, __dim, __max);
+        subvalue_type const __x = _M_acc(__b->_M_value, __dim);
+        subvalue_type const __y = _M_acc(__best->_M_value, __dim);
+        if (__max ? _M_cmp(__y, __x) : _M_cmp(__x, __y))
+          __best = __b;
+      }
+    return __best;
+  }
+
+  // The node removed is replaced by the value of its right subtree that is
+  // the smallest on its split dimension, or of its left one the largest,
+  // whose node is removed in turn, down to a leaf.  All those nodes lie on
+  // one path from the root, which is path-copied at once.
+  bool
+  _M_erase(const_reference __V, bool const __exact)
+  {
+    std::vector<_Node*> __chain;
+    if (!_M_find_chain(_M_root, 0, __V, NULL, __exact, __chain))
+      return false;
+    std::vector<_Node const*> __values(__chain.size());
+    for (;;)
+      {
+        _Node* const __t = __chain.back();
+        size_type const __L = __chain.size() - 1;
+        _Node* const __sub = __t->_M_right ? __t->_M_right : __t->_M_left;
+        if (!__sub) break;
+        _Node* const __m
+          = _M_find_extreme(__sub, __L + 1, __L % __K, __sub == __t->_M_left);
+        __values.back() = __m;
+        _M_find_chain(__sub, __L + 1, __m->_M_value, __m, true, __chain);
+        __values.resize(__chain.size());
+      }
+    _M_rewrite(__chain, __values, NULL, false);
+    --_M_count;
+    return true;
+  }
+
+  /*! Path-copies __chain, a path from the root down, into the draft.
+
+      The nodes of the chain are given the values of the nodes in __values
+      where these are not null.  Then __leaf, if given, is linked below the
+      last node of the chain, on the left with __left; otherwise, the last
+      node of the chain, a leaf, is unlinked.  The nodes that are not the
+      draft's own yet, or change value, are copied first: if a copy throws,
+      the draft is left as it was.  Linking the copies cannot throw.
+   */
+  void
+  _M_rewrite(std::vector<_Node*> const& __chain,
+             std::vector<_Node const*> const& __values,
+             _Node* const __leaf, bool const __left)
+  {
+    size_type const __kept = __leaf ? __chain.size() : __chain.size() - 1;
+    std::vector<_Node*> __w(__kept);
+    _M_retiring.reserve(_M_retiring.size() + __chain.size());
+    size_type __i = 0;
+    try
+      {
+        for (; __i != __kept; ++__i)
+          {
+            _Node* const __c = __chain[__i];
+            if (__values[__i])
+              __w[__i] = _M_copy_node(__c, __values[__i]->_M_value);
+            else if (__c->_M_version != _M_draft)
+              __w[__i] = _M_copy_node(__c, __c->_M_value);
+            else
+              __w[__i] = __c;
+          }
+      }
+    catch (...)
+      {
+        while (__i--)
+          if (__w[__i] != __chain[__i])
+            _M_free_node(__w[__i]);
+        throw;
+      }
+
+    for (__i = 0; __i != __kept; ++__i)
+      {
+        _Node* const __c = __chain[__i];
+        _Node* const __x = __w[__i];
+        if (__i + 1 != __chain.size())
+          {
+            _Node* const __next = __i + 1 != __kept ? __w[__i + 1] : NULL;
+            if (__c->_M_left == __chain[__i + 1])
+              __x->_M_left = __next;
+            else
+              __x->_M_right = __next;
+          }
+        else if (__left)
+          __x->_M_left = __leaf;
+        else
+          __x->_M_right = __leaf;
+        if (__leaf)
+          ++__x->_M_size;
+        else
+          --__x->_M_size;
+        if (__x != __c)
+          _M_drop(__c);
+      }
+    if (!__leaf)
+      _M_drop(__chain.back());
+    _M_root = __kept ? __w[0] : __leaf;
+    _M_dirty = true;
+  }
+
+  _Node_allocator _M_alloc;
+  // the draft, numbered _M_draft
+  _Node* _M_root;
+  size_type _M_count;
+  size_type _M_draft;
+  bool _M_dirty;
+  // nodes left out by the draft
+  std::vector<_Node*> _M_retiring;
+  // nodes left out by the published versions, oldest first
+  std::deque<_Retired> _M_retired;
+  // the versions that may still be pinned, oldest first; the last one is
+  // the current one
+  std::deque<_Version*> _M_versions;
+  std::atomic<_Version const*> _M_current;
+  std::unique_ptr<_Reader_slot[]> _M_slots;
+  size_type _M_slot_count;
+  _Acc _M_acc;
+  _Cmp _M_cmp;
+  _Dist _M_dist;
+};
+
+} // namespace KDTree
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
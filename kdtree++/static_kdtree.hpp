@@ -0,0 +1,977 @@
+/** \file
+ * Defines the interface for the StaticKDTree class, a read-only KD-Tree
+ * stored without any pointer.
+ *
+ * The values are kept in a single array, in the implicit (Eytzinger) order
+ * of a binary heap: the root is at index 0 and the children of the node at
+ * index i are at 2i+1 and 2i+2.  The tree is complete, i.e. all its levels
+ * are full except maybe the last one, which is filled from the left.  There
+ * are no parent nor children pointers, so the tree takes about the memory of
+ * its values only, and the top levels of the tree share a few cache lines.
+ *
+ * Optionally, the subtrees holding no more than a given number of values
+ * (the leaf size) are replaced by leaf buckets.  The slots past the last
+ * node of the tree, where the children of the bottom nodes would be, are
+ * then buckets instead of nothing.  Queries scan a bucket linearly rather
+ * than descend further.  A bucket keeps the coordinates of its values in
+ * one contiguous array per dimension, which the scan walks a dimension at
+ * a time, and the values themselves apart.  With a leaf size of L, there
+ * are about L+1 times fewer nodes to descend through.
+ *
+ * Buckets trade memory for speed.  The nodes hold nothing but their values,
+ * so buckets save no memory.  A value is opaque to the tree, which cannot
+ * tell its coordinates from the rest of it, so a bucket keeps the whole
+ * value as well as the copy of its coordinates.  Each value in a bucket
+ * thus takes K more subvalues: 24 bytes more for a value of 3 doubles and
+ * an int, 75% more.  Buckets of fewer than 8 values were no faster than
+ * none on 2 to 8 dimensions, and those of 2 were slower.  Buckets of 8 to
+ * 16 values did best on 2 to 4 dimensions, and of 16 to 32 on 8.
+ *
+ * The tree cannot be modified once built.  It answers the same queries as a
+ * KDTree: find_nearest(), find_nearest_if(), find_k_nearest(),
+ * find_k_nearest_if(), find_within_range(), count_within_range() and
+ * visit_within_range().  Its iterators walk the
+ * values in storage order: the nodes first, then the buckets.
+ */
+
+#ifndef INCLUDE_KDTREE_STATIC_KDTREE_HPP
+#define INCLUDE_KDTREE_STATIC_KDTREE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "function.hpp"
+#include "node.hpp"
+#include "region.hpp"
+#include "simd.hpp"
+#include "kdtree.hpp"
+
+namespace KDTree
+{
+
+template <size_t const __K, typename _Val,
+          typename _Acc = _Bracket_accessor<_Val>,
+          typename _Dist = squared_difference<typename _Acc::result_type,
+          typename _Acc::result_type>,
+          typename _Cmp = std::less<typename _Acc::result_type>,
+          typename _Alloc = std::allocator<_Val> >
+class StaticKDTree
+{
+protected:
+  typedef std::vector<_Val, _Alloc> _Storage;
+  typedef _Node_super_compare<__K, _Val, _Acc, _Cmp> _Node_super_compare_;
+
+public:
+  typedef _Region<__K, _Val, typename _Acc::result_type, _Acc, _Cmp>
+    _Region_;
+  typedef _Val value_type;
+  typedef value_type* pointer;
+  typedef value_type const* const_pointer;
+  typedef value_type& reference;
+  typedef value_type const& const_reference;
+  typedef typename _Acc::result_type subvalue_type;
+  typedef typename _Dist::distance_type distance_type;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef _Alloc allocator_type;
+
+  // No mutable iterator, the values can't be changed in place.
+  typedef typename _Storage::const_iterator const_iterator;
+  typedef const_iterator iterator;
+
+  StaticKDTree(_Acc const& __acc = _Acc(), _Dist const& __dist = _Dist(),
+               _Cmp const& __cmp = _Cmp(),
+               allocator_type const& __a = allocator_type())
+    : _M_values(__a), _M_nodes(0), _M_leaf_size(0),
+      _M_acc(__acc), _M_cmp(__cmp), _M_dist(__dist) {}
+
+  // Freezes __tree, usually after it has been optimise()d.  The nodes of a
+  // KDTree are not laid out as a complete tree, so the values are split
+  // again.  A __leaf_size of 0 means no leaf buckets; see above for the
+  // sizes worth their memory.
+  template <typename _TreeAlloc>
+  explicit
+  StaticKDTree(KDTree<__K, _Val, _Acc, _Dist, _Cmp, _TreeAlloc> const& __tree,
+               size_type const __leaf_size = 0,
+               allocator_type const& __a = allocator_type())
+    : _M_values(__a), _M_nodes(0), _M_leaf_size(__leaf_size),
+      _M_acc(__tree.value_acc()), _M_cmp(__tree.value_comp()),
+      _M_dist(__tree.value_distance())
+  {
+    std::vector<value_type> __v(__tree.begin(), __tree.end());
+    _M_build(__v);
+  }
+
+  template <typename _InputIterator>
+  StaticKDTree(_InputIterator __first, _InputIterator __last,
+               _Acc const& __acc = _Acc(), _Dist const& __dist = _Dist(),
+               _Cmp const& __cmp = _Cmp(),
+               allocator_type const& __a = allocator_type())
+    : _M_values(__a), _M_nodes(0), _M_leaf_size(0),
+      _M_acc(__acc), _M_cmp(__cmp), _M_dist(__dist)
+  {
+    std::vector<value_type> __v(__first, __last);
+    _M_build(__v);
+  }
+
+  // Same as KDTree::efficient_replace_and_optimise(): the tree is rebuilt
+  // out of writable_vector, which is shuffled in the process, with leaf
+  // buckets of up to __leaf_size values (0 for none).
+  void
+  efficient_replace_and_optimise(std::vector<value_type>& writable_vector,
+                                 size_type const __leaf_size = 0)
+  {
+    this->clear();
+    _M_leaf_size = __leaf_size;
+    _M_build(writable_vector);
+  }
+
+  allocator_type
+  get_allocator() const
+  { return _M_values.get_allocator(); }
+
+  size_type
+  size() const
+  { return _M_values.size(); }
+
+  bool
+  empty() const
+  { return _M_values.empty(); }
+
+  void
+  clear()
+  {
+    _M_values.clear();
+    _M_buckets.clear();
+    _M_coords.clear();
+    _M_nodes = 0;
+  }
+
+  //! Exchanges the contents of two trees in constant time.
+  void
+  swap(StaticKDTree& __x)
+  {
+    _M_values.swap(__x._M_values);
+    _M_buckets.swap(__x._M_buckets);
+    _M_coords.swap(__x._M_coords);
+    std::swap(_M_nodes, __x._M_nodes);
+    std::swap(_M_leaf_size, __x._M_leaf_size);
+    std::swap(_M_acc, __x._M_acc);
+    std::swap(_M_cmp, __x._M_cmp);
+    std::swap(_M_dist, __x._M_dist);
+  }
+
+  //! Maximum number of values in a leaf bucket, 0 if there are none.
+  size_type
+  leaf_size() const
+  { return _M_leaf_size; }
+
+  //! Number of values stored in nodes rather than in buckets.
+  size_type
+  node_count() const
+  { return _M_nodes; }
+
+  _Cmp
+  value_comp() const
+  { return _M_cmp; }
+
+  _Acc
+  value_acc() const
+  { return _M_acc; }
+
+  const _Dist&
+  value_distance() const
+  { return _M_dist; }
+
+  _Dist&
+  value_distance()
+  { return _M_dist; }
+
+  const_iterator begin() const { return _M_values.begin(); }
+  const_iterator end() const { return _M_values.end(); }
+
+  // NOTE: see notes on KDTree::find_within_range().
+  size_type
+  count_within_range(const_reference __V, subvalue_type const __R) const
+  {
+    _Region_ __region(__V, __R, _M_acc, _M_cmp);
+    return this->count_within_range(__region);
+  }
+
+  size_type
+  count_within_range(_Region_ const& __REGION) const
+  {
+    _Range_counter<value_type> __counter;
+    return _M_visit_within_range(__REGION, __counter)._M_count;
+  }
+
+  template <typename SearchVal, class Visitor>
+  Visitor
+  visit_within_range(SearchVal const& V, subvalue_type const R, Visitor visitor) const
+  {
+    _Region_ region(V, R, _M_acc, _M_cmp);
+    return this->visit_within_range(region, visitor);
+  }
+
+  template <class Visitor>
+  Visitor
+  visit_within_range(_Region_ const& REGION, Visitor visitor) const
+  {
+    _Range_visitor<value_type, Visitor> __v(visitor);
+    return _M_visit_within_range(REGION, __v)._M_visitor;
+  }
+
+  template <typename SearchVal, typename _OutputIterator>
+  _OutputIterator
+  find_within_range(SearchVal const& val, subvalue_type const range,
+                    _OutputIterator out) const
+  {
+    _Region_ region(val, range, _M_acc, _M_cmp);
+    return this->find_within_range(region, out);
+  }
+
+  template <typename _OutputIterator>
+  _OutputIterator
+  find_within_range(_Region_ const& region,
+                    _OutputIterator out) const
+  {
+    _Range_output<value_type, _OutputIterator> __v(out);
+    return _M_visit_within_range(region, __v)._M_out;
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest (SearchVal const& __val) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared(__val);
+    __r.second = std::sqrt(__r.second);
+    return __r;
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest (SearchVal const& __val, distance_type __max) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared(__val, _S_squared_bound(__max));
+    __r.second = __r.first == end() ? __max : std::sqrt(__r.second);
+    return __r;
+  }
+
+  template <class SearchVal, class _Predicate>
+  std::pair<const_iterator, distance_type>
+  find_nearest_if (SearchVal const& __val, distance_type __max,
+                   _Predicate __p) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared_if(__val, _S_squared_bound(__max), __p);
+    __r.second = __r.first == end() ? __max : std::sqrt(__r.second);
+    return __r;
+  }
+
+  // Same as KDTree::find_nearest_squared(): __max and the distance
+  // returned are in the units of _Dist.
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared (SearchVal const& __val) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = _M_find_nearest(__val, std::numeric_limits<distance_type>::max(),
+                        always_true<value_type>());
+    if (__r.first == end())
+      __r.second = distance_type();
+    return __r;
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared (SearchVal const& __val, distance_type __max) const
+  {
+    return _M_find_nearest(__val, __max, always_true<value_type>());
+  }
+
+  template <class SearchVal, class _Predicate>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared_if (SearchVal const& __val, distance_type __max,
+                           _Predicate __p) const
+  {
+    return _M_find_nearest(__val, __max, __p);
+  }
+
+  // Same as KDTree::find_k_nearest().
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<const_iterator, distance_type>* __out) const
+  {
+    return _M_find_k_nearest(__val, __k, __out,
+                             std::numeric_limits<distance_type>::max(),
+                             always_true<value_type>());
+  }
+
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<const_iterator, distance_type>* __out,
+                 distance_type const __max) const
+  {
+    return _M_find_k_nearest(__val, __k, __out, _S_squared_bound(__max),
+                             always_true<value_type>());
+  }
+
+  template <class SearchVal, class _Predicate>
+  size_type
+  find_k_nearest_if(SearchVal const& __val, size_type const __k,
+                    std::pair<const_iterator, distance_type>* __out,
+                    distance_type const __max, _Predicate __p) const
+  {
+    return _M_find_k_nearest(__val, __k, __out, _S_squared_bound(__max), __p);
+  }
+
+protected:
+  // searches the tiers directly, see tiered_kdtree.hpp
+  template <size_t const, typename, typename, typename, typename, typename>
+    friend class TieredKDTree;
+
+  // The tree is complete, so it is never deeper than this.
+  static size_type const _S_max_depth = std::numeric_limits<size_type>::digits;
+
+  // Number of nodes in the left subtree of a complete tree of __n nodes.
+  static size_type
+  _S_left_size(size_type const __n)
+  {
+    size_type __full = 1; // nodes on the full levels: 2^h - 1
+    while (2 * __full + 1 <= __n)
+      __full = 2 * __full + 1;
+    size_type const __half = (__full + 1) / 2; // 2^(h-1)
+    return (__half - 1) + std::min(__n - __full, __half);
+  }
+
+  static size_type
+  _S_next_dim(size_type const __dim)
+  { return __dim + 1 == __K ? 0 : __dim + 1; }
+
+  // Number of values in the buckets of ranks [__first, __last), when
+  // __values values are spread evenly over __buckets buckets.
+  static size_type
+  _S_bucket_values(size_type const __first, size_type const __last,
+                   size_type const __values, size_type const __buckets)
+  {
+    size_type const __extra = __values % __buckets;
+    return (__last - __first) * (__values / __buckets)
+      + std::min(__last, __extra) - std::min(__first, __extra);
+  }
+
+  // Whether slot __i holds a node or a bucket.
+  bool
+  _M_is_slot(size_type const __i) const
+  { return __i < _M_nodes || !_M_buckets.empty(); }
+
+  // The subtree at slot _M_slot of a build, out of the values
+  // [_M_first, _M_last) of the build; see _M_build_step().
+  struct _Build_task
+  {
+    size_type _M_first;
+    size_type _M_last;
+    size_type _M_slot;
+    size_type _M_dim;
+    size_type _M_nodes;
+    size_type _M_rank;
+  };
+
+  // Phases of a build, and steps of the quickselect of a median.
+  enum { _S_select, _S_store, _S_built };
+  enum { _S_new_task, _S_pick, _S_scan_up, _S_scan_down, _S_exchange };
+
+  /*! A build of the tree out of _M_values, which _M_build_step() runs a
+      bounded amount of work at a time, for TieredKDTree.
+
+      The medians are chosen the same way as by a single build, subtree by
+      subtree as the tasks on _M_tasks.  Each is found by a quickselect of
+      _M_values[_M_m] within [_M_lo, _M_hi], whose current partition
+      around _M_values[_M_lo] has reached _M_i from the left and _M_j from
+      the right.  The values are then stored in the tree, _M_stored so far.
+   */
+  struct _Build_state
+  {
+    _Build_state()
+      : _M_m(0), _M_lo(0), _M_hi(0), _M_i(0), _M_j(0), _M_step(_S_new_task),
+        _M_stored(0), _M_phase(_S_built) {}
+
+    std::vector<value_type> _M_values;
+    // where in _M_values the value of each node, and the values of each
+    // bucket, end up; once chosen as a median, a value does not move
+    // anymore.
+    std::vector<size_type> _M_order;
+    std::vector<std::pair<size_type, size_type> > _M_buckets;
+    std::vector<_Build_task> _M_tasks;
+    size_type _M_m;
+    size_type _M_lo;
+    size_type _M_hi;
+    size_type _M_i;
+    size_type _M_j;
+    int _M_step;
+    size_type _M_stored;
+    int _M_phase;
+  };
+
+  void
+  _M_build(std::vector<value_type>& __v)
+  {
+    _Build_state __s;
+    __s._M_values.swap(__v);
+    _M_start_build(__s, _M_leaf_size);
+    size_type __work = std::numeric_limits<size_type>::max();
+    _M_build_step(__s, __work);
+    __v.swap(__s._M_values);
+  }
+
+  // Starts building the tree, which is empty, out of __s._M_values, with
+  // buckets of up to __leaf_size values.
+  void
+  _M_start_build(_Build_state& __s, size_type const __leaf_size)
+  {
+    size_type const __n = __s._M_values.size();
+    _M_leaf_size = __leaf_size;
+    // as few nodes as possible while no bucket gets more than _M_leaf_size
+    // values: the _M_nodes + 1 buckets hold the other values.
+    _M_nodes = __n / (_M_leaf_size + 1);
+    __s._M_order.resize(_M_nodes);
+    __s._M_buckets.clear();
+    if (_M_leaf_size && __n)
+      __s._M_buckets.resize(_M_nodes + 1);
+    __s._M_tasks.clear();
+    if (__n)
+      {
+        _Build_task const __root = { 0, __n, 0, 0, _M_nodes, 0 };
+        __s._M_tasks.push_back(__root);
+      }
+    __s._M_step = _S_new_task;
+    __s._M_stored = 0;
+    __s._M_phase = _S_select;
+  }
+
+  // Runs the build __s for about __work units, each a value compared,
+  // moved or stored, less the units spent, and returns whether the tree
+  // is built.  With enough work left for a whole median, it is found by
+  // std::nth_element() instead, at about 4 units per value.
+  bool
+  _M_build_step(_Build_state& __s, size_type& __work)
+  {
+    while (__s._M_phase == _S_select && __work)
+      if (__s._M_tasks.empty())
+        {
+          size_type const __n = __s._M_values.size();
+          _M_values.reserve(__n);
+          _M_coords.reserve((__n - _M_nodes) * __K);
+          _M_buckets.reserve(__s._M_buckets.size());
+          __s._M_phase = _S_store;
+        }
+      else
+        _M_build_task(__s, __work);
+    while (__s._M_phase == _S_store && __work)
+      _M_store(__s, __work);
+    return __s._M_phase == _S_built;
+  }
+
+  // Goes on with the task on top of __s._M_tasks: chooses the median of
+  // its values, stored at its slot, then leaves the two halves as tasks.
+  // A slot past the nodes is a bucket, which keeps the values as they are.
+  void
+  _M_build_task(_Build_state& __s, size_type& __work)
+  {
+    _Build_task const __t = __s._M_tasks.back();
+    if (__t._M_slot >= _M_nodes)
+      {
+        if (!__s._M_buckets.empty())
+          __s._M_buckets[__t._M_slot - _M_nodes]
+            = std::make_pair(__t._M_first, __t._M_last - __t._M_first);
+        __s._M_tasks.pop_back();
+        --__work;
+        return;
+      }
+    size_type const __left = _S_left_size(__t._M_nodes);
+    if (__s._M_step == _S_new_task)
+      {
+        __s._M_m = __t._M_first + __left;
+        if (!__s._M_buckets.empty())
+          __s._M_m += _S_bucket_values(__t._M_rank, __t._M_rank + __left + 1,
+                                       __s._M_values.size() - _M_nodes,
+                                       __s._M_buckets.size());
+        __s._M_lo = __t._M_first;
+        __s._M_hi = __t._M_last - 1;
+        __s._M_step = _S_pick;
+      }
+    if (!_M_select(__s, _Node_super_compare_(__t._M_dim, _M_acc, _M_cmp),
+                   __work))
+      return;
+    __s._M_order[__t._M_slot] = __s._M_m;
+    __s._M_step = _S_new_task;
+    __s._M_tasks.pop_back();
+    _Build_task const __right =
+      { __s._M_m + 1, __t._M_last, 2 * __t._M_slot + 2,
+        _S_next_dim(__t._M_dim), __t._M_nodes - 1 - __left,
+        __t._M_rank + __left + 1 };
+    _Build_task const __left_task =
+      { __t._M_first, __s._M_m, 2 * __t._M_slot + 1,
+        _S_next_dim(__t._M_dim), __left, __t._M_rank };
+    __s._M_tasks.push_back(__right);
+    __s._M_tasks.push_back(__left_task);
+  }
+
+  // Puts the value of rank __s._M_m in __s._M_values[__s._M_lo,
+  // __s._M_hi] at its place, a step of a quickselect at a time, and
+  // returns whether it is done.  The partitions are Hoare's, around the
+  // median of three values, and stop on equal values.
+  bool
+  _M_select(_Build_state& __s, _Node_super_compare_ const& __less,
+            size_type& __work) const
+  {
+    std::vector<value_type>& __v = __s._M_values;
+    while (__work)
+      if (__s._M_step == _S_pick)
+        {
+          if (__s._M_lo >= __s._M_hi)
+            return true;
+          size_type const __size = __s._M_hi - __s._M_lo + 1;
+          if (__work / 4 >= __size)
+            {
+              std::nth_element(__v.begin() + __s._M_lo, __v.begin() + __s._M_m,
+                               __v.begin() + __s._M_hi + 1, __less);
+              __work -= 4 * __size;
+              return true;
+            }
+          size_type const __mid = __s._M_lo + __size / 2;
+          if (__less(__v[__mid], __v[__s._M_lo]))
+            std::swap(__v[__mid], __v[__s._M_lo]);
+          if (__less(__v[__s._M_hi], __v[__mid]))
+            {
+              std::swap(__v[__s._M_hi], __v[__mid]);
+              if (__less(__v[__mid], __v[__s._M_lo]))
+                std::swap(__v[__mid], __v[__s._M_lo]);
+            }
+          std::swap(__v[__s._M_lo], __v[__mid]);
+          __work -= std::min(__work, size_type(3));
+          __s._M_i = __s._M_lo;
+          __s._M_j = __s._M_hi + 1;
+          __s._M_step = _S_scan_up;
+        }
+      else
+        {
+          // the partition, until it ends or the work runs out
+          value_type const& __pivot = __v[__s._M_lo];
+          size_type const __hi = __s._M_hi;
+          size_type __i = __s._M_i;
+          size_type __j = __s._M_j;
+          int __step = __s._M_step;
+          for (;;)
+            {
+              if (__step == _S_scan_up)
+                for (; __work; )
+                  {
+                    --__work;
+                    if (++__i > __hi || !__less(__v[__i], __pivot))
+                      {
+                        __step = _S_scan_down;
+                        break;
+                      }
+                  }
+              if (__step == _S_scan_down)
+                for (; __work; )
+                  {
+                    // stops on the pivot at the latest
+                    --__work;
+                    if (!__less(__pivot, __v[--__j]))
+                      {
+                        __step = _S_exchange;
+                        break;
+                      }
+                  }
+              if (__step != _S_exchange || __i >= __j)
+                break;
+              std::swap(__v[__i], __v[__j]);
+              __step = _S_scan_up;
+            }
+          __s._M_i = __i;
+          __s._M_j = __j;
+          __s._M_step = __step;
+          if (__step != _S_exchange)
+            return false;
+          // the pivot goes between the two parts
+          std::swap(__v[__s._M_lo], __v[__j]);
+          if (__s._M_m < __j)
+            __s._M_hi = __j - 1;
+          else if (__j < __s._M_m)
+            __s._M_lo = __j + 1;
+          else
+            __s._M_lo = __s._M_hi = __j;
+          __s._M_step = _S_pick;
+        }
+    return false;
+  }
+
+  // Stores the next node, or the next bucket, of the build __s in the
+  // tree: the nodes in implicit order, then the buckets, whose values are
+  // stored whole and their coordinates again, a dimension at a time.
+  void
+  _M_store(_Build_state& __s, size_type& __work)
+  {
+    std::vector<value_type> const& __v = __s._M_values;
+    if (__s._M_stored < _M_nodes)
+      {
+        _M_values.push_back(__v[__s._M_order[__s._M_stored++]]);
+        --__work;
+      }
+    else if (_M_buckets.size() != __s._M_buckets.size())
+      {
+        std::pair<size_type, size_type> const __bucket
+          = __s._M_buckets[_M_buckets.size()];
+        size_type const __offset = _M_values.size() - _M_nodes;
+        size_type const __size = __bucket.second;
+        _M_buckets.push_back(std::make_pair(__offset, __size));
+        _M_coords.resize(_M_coords.size() + __size * __K);
+        for (size_type __j = 0; __j != __size; ++__j)
+          {
+            const_reference __value = __v[__bucket.first + __j];
+            _M_values.push_back(__value);
+            for (size_type __d = 0; __d != __K; ++__d)
+              _M_coords[__offset * __K + __d * __size + __j]
+                = _M_acc(__value, __d);
+          }
+        __s._M_stored += __size;
+        __work -= std::min(__work, __size + 1);
+      }
+    // some buckets may be empty
+    if (__s._M_stored >= _M_nodes
+        && _M_buckets.size() == __s._M_buckets.size())
+      __s._M_phase = _S_built;
+  }
+
+  // Buckets are scanned in chunks of this many values, whose partial
+  // results are kept on the stack.
+  static size_type const _S_scan_chunk = 64;
+
+  template <bool _Simd>
+  struct _Use_simd {};
+
+  typedef _Use_simd<_Simd_applies<subvalue_type, _Dist, _Cmp>::value>
+    _Use_simd_;
+
+  // Whether each of __count values, with coordinate __d at
+  // __c[__d * __stride], lies within [__low, __high].  With the default
+  // functors on float or double, this is the vectorised kernel.
+  void
+  _M_within_box(subvalue_type const* __c, size_type const __stride,
+                size_type const __count, subvalue_type const* __low,
+                subvalue_type const* __high, unsigned char* __inside,
+                _Use_simd<true>) const
+  {
+    _S_within_box(detected_simd_level(), __c, __stride, __count, __K,
+                  __low, __high, __inside);
+  }
+
+  void
+  _M_within_box(subvalue_type const* __c, size_type const __stride,
+                size_type const __count, subvalue_type const* __low,
+                subvalue_type const* __high, unsigned char* __inside,
+                _Use_simd<false>) const
+  {
+    std::fill(__inside, __inside + __count, 1);
+    for (size_type __d = 0; __d != __K; ++__d)
+      for (size_type __j = 0; __j != __count; ++__j)
+        __inside[__j] &= !(_M_cmp(__c[__d * __stride + __j], __low[__d])
+                           || _M_cmp(__high[__d], __c[__d * __stride + __j]));
+  }
+
+  // Distances of __count values to __q, laid out as above, summed one
+  // dimension at a time in the same order as _S_accumulate_node_distance()
+  // so that they come out identical.
+  void
+  _M_distances(subvalue_type const* __c, size_type const __stride,
+               size_type const __count, subvalue_type const* __q,
+               distance_type* __d, _Use_simd<true>) const
+  {
+    _S_squared_distances(detected_simd_level(), __c, __stride, __count, __K,
+                         __q, __d);
+  }
+
+  void
+  _M_distances(subvalue_type const* __c, size_type const __stride,
+               size_type const __count, subvalue_type const* __q,
+               distance_type* __d, _Use_simd<false>) const
+  {
+    std::fill(__d, __d + __count, distance_type());
+    for (size_type __dim = 0; __dim != __K; ++__dim)
+      for (size_type __j = 0; __j != __count; ++__j)
+        __d[__j] += _M_dist(__c[__dim * __stride + __j], __q[__dim]);
+  }
+
+  // Visits the values of bucket __e in __REGION, testing a chunk of
+  // values at once.
+  template <class _Visitor>
+  void
+  _M_visit_bucket(size_type const __e, _Region_ const& __REGION,
+                  _Visitor& __visitor) const
+  {
+    size_type const __offset = _M_buckets[__e].first;
+    size_type const __size = _M_buckets[__e].second;
+    if (!__size) return;
+    subvalue_type const* const __coords = &_M_coords[__offset * __K];
+    const_pointer const __values = &_M_values[_M_nodes + __offset];
+    unsigned char __inside[_S_scan_chunk];
+    for (size_type __j0 = 0; __j0 < __size; __j0 += _S_scan_chunk)
+      {
+        size_type const __chunk
+          = std::min(size_type(_S_scan_chunk), __size - __j0);
+        _M_within_box(__coords + __j0, __size, __chunk,
+                      __REGION._M_low_bounds, __REGION._M_high_bounds,
+                      __inside, _Use_simd_());
+        for (size_type __j = 0; __j != __chunk; ++__j)
+          if (__inside[__j])
+            __visitor(__values[__j0 + __j]);
+      }
+  }
+
+  // Visits the values in __REGION in pre-order, like the KDTree does, a
+  // bucket being visited in place of its slot.  Only the split dimension
+  // changes from a node to its children, so a child is skipped as soon as
+  // the region lies entirely on the other side of its parent's split.
+  template <class _Visitor>
+  _Visitor&
+  _M_visit_within_range(_Region_ const& __REGION, _Visitor& __visitor) const
+  {
+    std::pair<size_type, size_type> __stack[_S_max_depth];
+    size_type __top = 0;
+    if (!_M_values.empty())
+      __stack[__top++] = std::make_pair(size_type(0), size_type(0));
+    while (__top)
+      {
+        size_type __i = __stack[--__top].first;
+        size_type __dim = __stack[__top].second;
+        for (;;)
+          {
+            if (__i >= _M_nodes)
+              {
+                if (!_M_buckets.empty())
+                  _M_visit_bucket(__i - _M_nodes, __REGION, __visitor);
+                break;
+              }
+            const_reference __v = _M_values[__i];
+            if (__REGION.encloses(__v))
+              __visitor(__v);
+            subvalue_type const __split = _M_acc(__v, __dim);
+            bool const __left = !_M_cmp(__split, __REGION._M_low_bounds[__dim]);
+            bool const __right = !_M_cmp(__REGION._M_high_bounds[__dim], __split);
+            __dim = _S_next_dim(__dim);
+            if (__right && _M_is_slot(2 * __i + 2))
+              {
+                if (!__left)
+                  {
+                    __i = 2 * __i + 2;
+                    continue;
+                  }
+                __stack[__top++] = std::make_pair(2 * __i + 2, __dim);
+              }
+            if (!__left || !_M_is_slot(2 * __i + 1))
+              break;
+            __i = 2 * __i + 1;
+          }
+      }
+    return __visitor;
+  }
+
+  // Collects the single nearest value; ties go to the last one offered,
+  // like in the KDTree.
+  struct _Nearest
+  {
+    _Nearest(size_type const __none, distance_type const __max)
+      : _M_best(__none), _M_max(__max) {}
+
+    void
+    offer(size_type const __i, distance_type const __d)
+    {
+      _M_best = __i;
+      _M_max = __d;
+    }
+
+    size_type _M_best;
+    distance_type _M_max;
+  };
+
+  typedef _K_nearest_heap<const_iterator, distance_type> _K_nearest_heap_;
+
+  // Collects the k nearest values into a _K_nearest_heap.
+  struct _K_nearest
+  {
+    _K_nearest(_K_nearest_heap_& __heap, const_iterator const& __begin)
+      : _M_heap(__heap), _M_begin(__begin), _M_max(__heap._M_max) {}
+
+    void
+    offer(size_type const __i, distance_type const __d)
+    {
+      _M_heap.offer(_M_begin + __i, __d);
+      _M_max = _M_heap._M_max;
+    }
+
+    _K_nearest_heap_& _M_heap;
+    const_iterator _M_begin;
+    distance_type _M_max;
+  };
+
+  // Offers the values of bucket __e to the nearest neighbour search, in
+  // storage order.
+  template <class SearchVal, class _Predicate, class _Collector>
+  void
+  _M_nearest_in_bucket(size_type const __e, SearchVal const& __val,
+                       _Predicate __p, _Collector& __collector) const
+  {
+    size_type const __offset = _M_buckets[__e].first;
+    size_type const __size = _M_buckets[__e].second;
+    if (!__size) return;
+    subvalue_type const* const __coords = &_M_coords[__offset * __K];
+    subvalue_type __q[__K];
+    for (size_type __dim = 0; __dim != __K; ++__dim)
+      __q[__dim] = _M_acc(__val, __dim);
+    distance_type __d[_S_scan_chunk];
+    for (size_type __j0 = 0; __j0 < __size; __j0 += _S_scan_chunk)
+      {
+        size_type const __chunk
+          = std::min(size_type(_S_scan_chunk), __size - __j0);
+        _M_distances(__coords + __j0, __size, __chunk, __q, __d, _Use_simd_());
+        for (size_type __j = 0; __j != __chunk; ++__j)
+          {
+            size_type const __i = _M_nodes + __offset + __j0 + __j;
+            if (!(__collector._M_max < __d[__j]) && __p(_M_values[__i]))
+              __collector.offer(__i, __d[__j]);
+          }
+      }
+  }
+
+  struct _Pending
+  {
+    size_type _M_node;
+    size_type _M_dim;
+    distance_type _M_plane;
+  };
+
+  // Searches in the units of _Dist (squared, for the default functor),
+  // offering __collector every value within its _M_max, which only ever
+  // shrinks, nearer subtrees first.
+  template <class SearchVal, class _Predicate, class _Collector>
+  void
+  _M_search_nearest(SearchVal const& __val, _Predicate __p,
+                    _Collector& __collector) const
+  {
+    _Pending __stack[_S_max_depth];
+    size_type __top = 0;
+    if (!_M_values.empty())
+      {
+        _Pending const __root = { 0, 0, distance_type() };
+        __stack[__top++] = __root;
+      }
+    while (__top)
+      {
+        _Pending const& __pending = __stack[--__top];
+        if (__collector._M_max < __pending._M_plane)
+          continue;
+        size_type __i = __pending._M_node;
+        size_type __dim = __pending._M_dim;
+        for (;;)
+          {
+            if (__i >= _M_nodes)
+              {
+                if (!_M_buckets.empty())
+                  _M_nearest_in_bucket(__i - _M_nodes, __val, __p, __collector);
+                break;
+              }
+            const_reference __v = _M_values[__i];
+            if (__p(__v))
+              {
+                distance_type const __d
+                  = _S_accumulate_node_distance<__K>(_M_dist, _M_acc, __v, __val);
+                if (!(__collector._M_max < __d))
+                  __collector.offer(__i, __d);
+              }
+            size_type __near = 2 * __i + 1;
+            size_type __far = 2 * __i + 2;
+            if (!_S_node_compare(__dim, _M_cmp, _M_acc, __val, __v))
+              std::swap(__near, __far);
+            distance_type const __plane
+              = _S_node_distance(__dim, _M_dist, _M_acc, __val, __v);
+            __dim = _S_next_dim(__dim);
+            if (_M_is_slot(__far) && !(__collector._M_max < __plane))
+              {
+                _Pending const __far_pending = { __far, __dim, __plane };
+                __stack[__top++] = __far_pending;
+              }
+            if (!_M_is_slot(__near))
+              break;
+            __i = __near;
+          }
+      }
+  }
+
+  // __max, and the distance returned, are in the units of _Dist.
+  template <class SearchVal, class _Predicate>
+  std::pair<const_iterator, distance_type>
+  _M_find_nearest(SearchVal const& __val, distance_type const __max,
+                  _Predicate __p) const
+  {
+    _Nearest __nearest(_M_values.size(), __max);
+    _M_search_nearest(__val, __p, __nearest);
+    if (__nearest._M_best == _M_values.size())
+      return std::pair<const_iterator, distance_type>(end(), __max);
+    return std::pair<const_iterator, distance_type>
+      (begin() + __nearest._M_best, __nearest._M_max);
+  }
+
+  template <class SearchVal, class _Predicate>
+  size_type
+  _M_find_k_nearest(SearchVal const& __val, size_type const __k,
+                    std::pair<const_iterator, distance_type>* __out,
+                    distance_type const __max, _Predicate __p) const
+  {
+    if (_M_values.empty() || !__k) return 0;
+    _K_nearest_heap_ __heap(__out, __k, __max);
+    _K_nearest __k_nearest(__heap, begin());
+    _M_search_nearest(__val, __p, __k_nearest);
+    return __heap.finish(_Square_root());
+  }
+
+  // The _M_nodes first values are the nodes, in implicit order, and the
+  // others fill the buckets.  _M_buckets gives the offset among the latter
+  // and the size of each bucket, and _M_coords their coordinates, a bucket
+  // of size s at offset o having its coordinate d at [o*K + d*s, o*K + (d+1)*s).
+  // The values of the buckets are also in _M_values, for the iterators.
+  _Storage _M_values;
+  std::vector<std::pair<size_type, size_type> > _M_buckets;
+  std::vector<subvalue_type> _M_coords;
+  size_type _M_nodes;
+  size_type _M_leaf_size;
+  _Acc _M_acc;
+  _Cmp _M_cmp;
+  _Dist _M_dist;
+};
+
+} // namespace KDTree
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
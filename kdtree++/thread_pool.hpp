@@ -0,0 +1,272 @@
+/** \file
+ * Defines a small work-stealing thread pool used by the parallel
+ * operations of the KDTree class.
+ *
+ * Requires C++11.
+ */
+
+#ifndef INCLUDE_KDTREE_THREAD_POOL_HPP
+#define INCLUDE_KDTREE_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace KDTree
+{
+
+  /*! A pool of threads that run tasks pushed through a task_group.
+
+      Every thread owns a deque of tasks.  It pushes the tasks it spawns at
+      the back of its own deque and pops them from there, and when its
+      deque runs dry it steals from the front of the others.  A thread
+      waiting on a task_group keeps running tasks meanwhile, so nested
+      groups (a task spawning and waiting on its own subtasks) never block
+      a thread.
+
+      A pool of size N runs tasks on N threads: N-1 workers plus whichever
+      thread is waiting on a task_group.  A pool of size 1 therefore runs
+      everything on the calling thread.
+   */
+  class thread_pool
+  {
+  public:
+    typedef std::function<void()> task_type;
+
+    explicit
+    thread_pool(size_t __threads = 0)
+      : _M_queued(0), _M_done(false)
+    {
+      if (__threads == 0)
+        __threads = std::thread::hardware_concurrency();
+      if (__threads == 0)
+        __threads = 1;
+      for (size_t __i = 0; __i != __threads; ++__i)
+        _M_queues.push_back(std::unique_ptr<_Queue>(new _Queue));
+      for (size_t __i = 1; __i != __threads; ++__i)
+        _M_workers.push_back(std::thread(&thread_pool::_M_work, this, __i));
+    }
+
+    ~thread_pool()
+    {
+      {
+        std::lock_guard<std::mutex> __lock(_M_sleep_mutex);
+        _M_done = true;
+      }
+      _M_wake.notify_all();
+      for (size_t __i = 0; __i != _M_workers.size(); ++__i)
+        _M_workers[__i].join();
+    }
+
+    //! Number of threads tasks run on, including the waiting thread.
+    size_t
+    size() const
+    { return _M_queues.size(); }
+
+    /*! A set of tasks that can be waited on together.
+
+        The first exception thrown by a task is rethrown by wait(), once
+        all the tasks of the group have finished.
+     */
+    class task_group
+    {
+    public:
+      explicit
+      task_group(thread_pool& __pool)
+        : _M_pool(__pool), _M_pending(0) {}
+
+      ~task_group()
+      {
+        // never leave tasks running that refer to a dead group
+        while (_M_pending.load(std::memory_order_acquire))
+          _M_help();
+      }
+
+      template <class _Func>
+      void
+      run(_Func __f)
+      {
+        _M_pending.fetch_add(1, std::memory_order_relaxed);
+        task_group* __self = this;
+        _M_pool._M_push([__self, __f]() mutable
+          {
+            try { __f(); }
+            catch (...) { __self->_M_set_error(std::current_exception()); }
+            // last access to the group: it may be gone right after this
+            __self->_M_pending.fetch_sub(1, std::memory_order_release);
+          });
+      }
+
+      void
+      wait()
+      {
+        while (_M_pending.load(std::memory_order_acquire))
+          _M_help();
+        if (_M_error)
+          {
+            std::exception_ptr __e = _M_error;
+            _M_error = std::exception_ptr();
+            std::rethrow_exception(__e);
+          }
+      }
+
+    private:
+      task_group(task_group const&);
+      task_group& operator=(task_group const&);
+
+      void
+      _M_help()
+      {
+        if (!_M_pool._M_run_one(_M_pool._M_self()))
+          std::this_thread::yield();
+      }
+
+      void
+      _M_set_error(std::exception_ptr __e)
+      {
+        std::lock_guard<std::mutex> __lock(_M_error_mutex);
+        if (!_M_error)
+          _M_error = __e;
+      }
+
+      thread_pool& _M_pool;
+      std::atomic<size_t> _M_pending;
+      std::mutex _M_error_mutex;
+      std::exception_ptr _M_error;
+    };
+
+  private:
+    thread_pool(thread_pool const&);
+    thread_pool& operator=(thread_pool const&);
+
+    struct _Queue
+    {
+      std::mutex _M_mutex;
+      std::deque<task_type> _M_tasks;
+    };
+
+    struct _Identity
+    {
+      thread_pool const* _M_pool;
+      size_t _M_index;
+    };
+
+    static _Identity&
+    _S_identity()
+    {
+      static thread_local _Identity __id = { nullptr, 0 };
+      return __id;
+    }
+
+    // Index of the calling thread's own deque.  Threads that are not
+    // workers of this pool all share deque 0.
+    size_t
+    _M_self() const
+    {
+      _Identity const& __id = _S_identity();
+      return __id._M_pool == this ? __id._M_index : 0;
+    }
+
+    void
+    _M_push(task_type __task)
+    {
+      _Queue& __q = *_M_queues[_M_self()];
+      {
+        std::lock_guard<std::mutex> __lock(__q._M_mutex);
+        __q._M_tasks.push_back(std::move(__task));
+      }
+      _M_queued.fetch_add(1, std::memory_order_release);
+      if (!_M_workers.empty())
+        {
+          // taking the lock orders us against a worker about to sleep
+          { std::lock_guard<std::mutex> __lock(_M_sleep_mutex); }
+          _M_wake.notify_one();
+        }
+    }
+
+    bool
+    _M_pop(size_t const __index, bool const __back, task_type& __task)
+    {
+      _Queue& __q = *_M_queues[__index];
+      std::lock_guard<std::mutex> __lock(__q._M_mutex);
+      if (__q._M_tasks.empty())
+        return false;
+      if (__back)
+        {
+          __task = std::move(__q._M_tasks.back());
+          __q._M_tasks.pop_back();
+        }
+      else
+        {
+          __task = std::move(__q._M_tasks.front());
+          __q._M_tasks.pop_front();
+        }
+      _M_queued.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    // Runs one task, from the back of our own deque if possible, else
+    // stolen from the front of another one.
+    bool
+    _M_run_one(size_t const __self)
+    {
+      if (!_M_queued.load(std::memory_order_acquire))
+        return false;
+      task_type __task;
+      bool __found = _M_pop(__self, true, __task);
+      for (size_t __i = 1; !__found && __i != _M_queues.size(); ++__i)
+        __found = _M_pop((__self + __i) % _M_queues.size(), false, __task);
+      if (__found)
+        __task();
+      return __found;
+    }
+
+    void
+    _M_work(size_t const __index)
+    {
+      _Identity& __id = _S_identity();
+      __id._M_pool = this;
+      __id._M_index = __index;
+      for (;;)
+        {
+          if (_M_run_one(__index))
+            continue;
+          std::unique_lock<std::mutex> __lock(_M_sleep_mutex);
+          _M_wake.wait(__lock, [this]()
+            { return _M_done || _M_queued.load(std::memory_order_acquire); });
+          if (_M_done)
+            return;
+        }
+    }
+
+    std::vector<std::unique_ptr<_Queue> > _M_queues;
+    std::vector<std::thread> _M_workers;
+    std::atomic<size_t> _M_queued;
+    bool _M_done;
+    std::mutex _M_sleep_mutex;
+    std::condition_variable _M_wake;
+  };
+
+} // namespace KDTree
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
@@ -0,0 +1,591 @@
+/** \file
+ * Defines the interface for the TieredKDTree class, a KD-Tree container
+ * optimised for inserting values.
+ *
+ * New values are appended to a small unsorted buffer, which queries scan
+ * linearly.  Once the buffer is full, its values are merged into tiers of
+ * StaticKDTree with the logarithmic method of Bentley and Saxe, made
+ * incremental after Overmars and van Leeuwen.  The buffer becomes a tier
+ * of level 0, and level i holds at most four tiers of about
+ * buffer_size() * 4^i values each.  Once a level holds four, they are
+ * merged into a tier of the next level, but a few steps at each insert(),
+ * while they stay where they are for the queries.  Each merge is paced to end
+ * before its level can get another tier, half-way through.  A value is
+ * thus rebuilt into a new tier O(log n) times over its life.  An insert()
+ * does O(log^2 n) steps of the merges under way, plus the build of the
+ * buffer when it is full, and never rebuilds the whole container at once.
+ * Only optimise() does.
+ *
+ * Queries are asked to the buffer and to every tier, and their results
+ * merged: find_nearest() and find_k_nearest() narrow their search radius
+ * from one tier to the next.  The container answers the same queries as a
+ * StaticKDTree, but the values it returns are pointed to rather than
+ * iterated to, and there is no way to erase a value.  Any insert() may
+ * end a merge, which invalidates the pointers returned earlier.
+ */
+
+#ifndef INCLUDE_KDTREE_TIERED_KDTREE_HPP
+#define INCLUDE_KDTREE_TIERED_KDTREE_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "function.hpp"
+#include "node.hpp"
+#include "region.hpp"
+#include "static_kdtree.hpp"
+
+namespace KDTree
+{
+
+template <size_t const __K, typename _Val,
+          typename _Acc = _Bracket_accessor<_Val>,
+          typename _Dist = squared_difference<typename _Acc::result_type,
+          typename _Acc::result_type>,
+          typename _Cmp = std::less<typename _Acc::result_type>,
+          typename _Alloc = std::allocator<_Val> >
+class TieredKDTree
+{
+protected:
+  typedef StaticKDTree<__K, _Val, _Acc, _Dist, _Cmp, _Alloc> _Tier;
+  typedef std::vector<_Val, _Alloc> _Buffer;
+
+public:
+  typedef typename _Tier::_Region_ _Region_;
+  typedef _Val value_type;
+  typedef value_type* pointer;
+  typedef value_type const* const_pointer;
+  typedef value_type& reference;
+  typedef value_type const& const_reference;
+  typedef typename _Acc::result_type subvalue_type;
+  typedef typename _Dist::distance_type distance_type;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef _Alloc allocator_type;
+
+  // Searches return pointers to the values they find, or end().
+  typedef const_pointer const_iterator;
+
+  // The buffer holds up to __buffer_size values, and the tiers have leaf
+  // buckets of up to __leaf_size values (0 for none).
+  explicit
+  TieredKDTree(size_type const __buffer_size = 256,
+               size_type const __leaf_size = 0,
+               _Acc const& __acc = _Acc(), _Dist const& __dist = _Dist(),
+               _Cmp const& __cmp = _Cmp(),
+               allocator_type const& __a = allocator_type())
+    : _M_buffer(__a), _M_levels(),
+      _M_buffer_size(__buffer_size ? __buffer_size : 1),
+      _M_leaf_size(__leaf_size), _M_count(0),
+      _M_acc(__acc), _M_cmp(__cmp), _M_dist(__dist)
+  {
+    _M_buffer.reserve(_M_buffer_size);
+  }
+
+  allocator_type
+  get_allocator() const
+  { return _M_buffer.get_allocator(); }
+
+  size_type
+  size() const
+  { return _M_count; }
+
+  bool
+  empty() const
+  { return !_M_count; }
+
+  void
+  clear()
+  {
+    _M_buffer.clear();
+    _M_levels.clear();
+    _M_count = 0;
+  }
+
+  size_type
+  buffer_size() const
+  { return _M_buffer_size; }
+
+  size_type
+  leaf_size() const
+  { return _M_leaf_size; }
+
+  //! Number of tiers holding values, not counting the buffer.
+  size_type
+  tier_count() const
+  {
+    size_type __n = 0;
+    for (size_type __t = 0; __t != _S_level_tiers * _M_levels.size(); ++__t)
+      if (_M_tier(__t))
+        ++__n;
+    return __n;
+  }
+
+  _Cmp
+  value_comp() const
+  { return _M_cmp; }
+
+  _Acc
+  value_acc() const
+  { return _M_acc; }
+
+  const _Dist&
+  value_distance() const
+  { return _M_dist; }
+
+  const_iterator end() const { return const_iterator(); }
+
+  void
+  insert(const_reference __V)
+  {
+    _M_buffer.push_back(__V);
+    ++_M_count;
+    _M_advance_merges();
+    if (_M_buffer.size() == _M_buffer_size)
+      _M_flush();
+  }
+
+  template <class _InputIterator>
+  void
+  insert(_InputIterator __first, _InputIterator __last)
+  {
+    for (; __first != __last; ++__first)
+      this->insert(*__first);
+  }
+
+  //! Merges the buffer and all the tiers into a single tier, at once.
+  void
+  optimise()
+  {
+    std::vector<value_type> __v(_M_buffer.begin(), _M_buffer.end());
+    for (size_type __t = 0; __t != _S_level_tiers * _M_levels.size(); ++__t)
+      if (_Tier const* const __tier = _M_tier(__t))
+        __v.insert(__v.end(), __tier->begin(), __tier->end());
+    _M_buffer.clear();
+    _M_levels.clear();
+    if (__v.empty()) return;
+    // level i holds about buffer_size() * 4^i values per tier
+    size_type __l = 0;
+    while ((_M_buffer_size << 2 * __l) < __v.size())
+      ++__l;
+    _M_levels.resize(__l + 1, _Level(_M_empty_tier()));
+    _M_levels[__l]._M_tiers.push_back(_M_empty_tier());
+    _M_levels[__l]._M_tiers.back().efficient_replace_and_optimise(__v, _M_leaf_size);
+  }
+
+  // NOTE: see notes on KDTree::find_within_range().
+  size_type
+  count_within_range(const_reference __V, subvalue_type const __R) const
+  {
+    _Region_ __region(__V, __R, _M_acc, _M_cmp);
+    return this->count_within_range(__region);
+  }
+
+  size_type
+  count_within_range(_Region_ const& __REGION) const
+  {
+    _Range_counter<value_type> __counter;
+    _M_scan_buffer(__REGION, __counter);
+    for (size_type __t = 0; __t != _S_level_tiers * _M_levels.size(); ++__t)
+      if (_Tier const* const __tier = _M_tier(__t))
+        __counter._M_count += __tier->count_within_range(__REGION);
+    return __counter._M_count;
+  }
+
+  template <typename SearchVal, class Visitor>
+  Visitor
+  visit_within_range(SearchVal const& V, subvalue_type const R, Visitor visitor) const
+  {
+    _Region_ region(V, R, _M_acc, _M_cmp);
+    return this->visit_within_range(region, visitor);
+  }
+
+  template <class Visitor>
+  Visitor
+  visit_within_range(_Region_ const& REGION, Visitor visitor) const
+  {
+    _Range_visitor<value_type, Visitor> __v(visitor);
+    visitor = _M_scan_buffer(REGION, __v)._M_visitor;
+    for (size_type __t = 0; __t != _S_level_tiers * _M_levels.size(); ++__t)
+      if (_Tier const* const __tier = _M_tier(__t))
+        visitor = __tier->visit_within_range(REGION, visitor);
+    return visitor;
+  }
+
+  template <typename SearchVal, typename _OutputIterator>
+  _OutputIterator
+  find_within_range(SearchVal const& val, subvalue_type const range,
+                    _OutputIterator out) const
+  {
+    _Region_ region(val, range, _M_acc, _M_cmp);
+    return this->find_within_range(region, out);
+  }
+
+  template <typename _OutputIterator>
+  _OutputIterator
+  find_within_range(_Region_ const& region,
+                    _OutputIterator out) const
+  {
+    _Range_output<value_type, _OutputIterator> __v(out);
+    out = _M_scan_buffer(region, __v)._M_out;
+    for (size_type __t = 0; __t != _S_level_tiers * _M_levels.size(); ++__t)
+      if (_Tier const* const __tier = _M_tier(__t))
+        out = __tier->find_within_range(region, out);
+    return out;
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest (SearchVal const& __val) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared(__val);
+    __r.second = std::sqrt(__r.second);
+    return __r;
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest (SearchVal const& __val, distance_type __max) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared(__val, _S_squared_bound(__max));
+    __r.second = __r.first == end() ? __max : std::sqrt(__r.second);
+    return __r;
+  }
+
+  template <class SearchVal, class _Predicate>
+  std::pair<const_iterator, distance_type>
+  find_nearest_if (SearchVal const& __val, distance_type __max,
+                   _Predicate __p) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = this->find_nearest_squared_if(__val, _S_squared_bound(__max), __p);
+    __r.second = __r.first == end() ? __max : std::sqrt(__r.second);
+    return __r;
+  }
+
+  // Same as KDTree::find_nearest_squared(): __max and the distance
+  // returned are in the units of _Dist.
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared (SearchVal const& __val) const
+  {
+    std::pair<const_iterator, distance_type> __r
+      = _M_find_nearest(__val, std::numeric_limits<distance_type>::max(),
+                        always_true<value_type>());
+    if (__r.first == end())
+      __r.second = distance_type();
+    return __r;
+  }
+
+  template <class SearchVal>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared (SearchVal const& __val, distance_type __max) const
+  {
+    return _M_find_nearest(__val, __max, always_true<value_type>());
+  }
+
+  template <class SearchVal, class _Predicate>
+  std::pair<const_iterator, distance_type>
+  find_nearest_squared_if (SearchVal const& __val, distance_type __max,
+                           _Predicate __p) const
+  {
+    return _M_find_nearest(__val, __max, __p);
+  }
+
+  // Same as KDTree::find_k_nearest().
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<const_iterator, distance_type>* __out) const
+  {
+    return _M_find_k_nearest(__val, __k, __out,
+                             std::numeric_limits<distance_type>::max(),
+                             always_true<value_type>());
+  }
+
+  template <class SearchVal>
+  size_type
+  find_k_nearest(SearchVal const& __val, size_type const __k,
+                 std::pair<const_iterator, distance_type>* __out,
+                 distance_type const __max) const
+  {
+    return _M_find_k_nearest(__val, __k, __out, _S_squared_bound(__max),
+                             always_true<value_type>());
+  }
+
+  template <class SearchVal, class _Predicate>
+  size_type
+  find_k_nearest_if(SearchVal const& __val, size_type const __k,
+                    std::pair<const_iterator, distance_type>* __out,
+                    distance_type const __max, _Predicate __p) const
+  {
+    return _M_find_k_nearest(__val, __k, __out, _S_squared_bound(__max), __p);
+  }
+
+protected:
+
+  typedef typename _Tier::_Build_state _Build_state;
+
+  // Merging four tiers at a time, rather than two, rebuilds each value
+  // half as many times for as many tiers to query.
+  static const size_type _S_level_tiers = 4;
+
+  // The tiers of level i, built, and the merge of all of them into a tier
+  // of level i+1 once they are _S_level_tiers: _M_merge gathers their
+  // values, then builds _M_merged out of them, _M_work units at each
+  // insert().
+  struct _Level
+  {
+    explicit
+    _Level(_Tier const& __empty)
+      : _M_merged(__empty), _M_work(0) {}
+
+    std::vector<_Tier> _M_tiers;
+    _Tier _M_merged;
+    _Build_state _M_merge;
+    size_type _M_work;
+  };
+
+  _Tier
+  _M_empty_tier() const
+  { return _Tier(_M_acc, _M_dist, _M_cmp, get_allocator()); }
+
+  // Tier __t % _S_level_tiers of level __t / _S_level_tiers, if it holds
+  // values.
+  _Tier const*
+  _M_tier(size_type const __t) const
+  {
+    _Level const& __level = _M_levels[__t / _S_level_tiers];
+    size_type const __i = __t % _S_level_tiers;
+    return __i < __level._M_tiers.size() && !__level._M_tiers[__i].empty()
+      ? &__level._M_tiers[__i] : NULL;
+  }
+
+  // Builds the full buffer into a tier of level 0.
+  void
+  _M_flush()
+  {
+    std::vector<value_type> __v(_M_buffer.begin(), _M_buffer.end());
+    _M_buffer.clear();
+    _Tier __tier(_M_empty_tier());
+    __tier.efficient_replace_and_optimise(__v, _M_leaf_size);
+    _M_add_tier(0, __tier);
+  }
+
+  // Takes the values of __tier over as a tier of level __l, and starts
+  // merging the tiers of __l if they are _S_level_tiers now.  The merge the level
+  // was already going through is ended at once, if it could not end in
+  // time; it is paced not to happen.
+  void
+  _M_add_tier(size_type const __l, _Tier& __tier)
+  {
+    if (__l == _M_levels.size())
+      _M_levels.push_back(_Level(_M_empty_tier()));
+    // no reference to _M_levels is invalidated by push_back()
+    _Level& __level = _M_levels[__l];
+    if (__level._M_tiers.size() == _S_level_tiers)
+      {
+        size_type __work = std::numeric_limits<size_type>::max();
+        _M_merge_step(__level, __work);
+        _M_end_merge(__l);
+      }
+    // the tiers are never copied to make room for the next one
+    if (__level._M_tiers.empty())
+      __level._M_tiers.reserve(_S_level_tiers);
+    __level._M_tiers.push_back(_M_empty_tier());
+    __level._M_tiers.back().swap(__tier);
+    if (__level._M_tiers.size() == _S_level_tiers)
+      {
+        // Merging n values costs about n * (4 * log2(n) + 8) units, see
+        // _Tier::_M_build_step(), and has to end within the inserts that
+        // bring the level its next tier, buffer_size() * 4^__l, halved.
+        size_type __n = 0;
+        for (size_type __i = 0; __i != _S_level_tiers; ++__i)
+          __n += __level._M_tiers[__i].size();
+        size_type __log = 1;
+        while ((size_type(1) << __log) < __n)
+          ++__log;
+        size_type const __inserts = std::max(size_type(1),
+                                             (_M_buffer_size << 2 * __l) / 2);
+        __level._M_work = __n * (4 * __log + 8) / __inserts + 1;
+        __level._M_merge = _Build_state();
+        __level._M_merge._M_values.reserve(__n);
+      }
+  }
+
+  // Runs __work units of the merge of __level: copies the values of its
+  // tiers, one unit each, then builds them; returns whether it is done.
+  bool
+  _M_merge_step(_Level& __level, size_type& __work)
+  {
+    _Build_state& __s = __level._M_merge;
+    size_type __n = 0;
+    for (size_type __t = 0; __t != _S_level_tiers; ++__t)
+      __n += __level._M_tiers[__t].size();
+    if (__s._M_values.size() != __n)
+      {
+        size_type __t = 0;
+        size_type __i = __s._M_values.size();
+        while (__i >= __level._M_tiers[__t].size())
+          __i -= __level._M_tiers[__t++].size();
+        for (; __work && __t != _S_level_tiers; --__work)
+          {
+            __s._M_values.push_back(__level._M_tiers[__t].begin()[__i]);
+            if (++__i == __level._M_tiers[__t].size())
+              {
+                __i = 0;
+                ++__t;
+              }
+          }
+        if (__t != _S_level_tiers)
+          return false;
+        __level._M_merged._M_start_build(__s, _M_leaf_size);
+      }
+    return __level._M_merged._M_build_step(__s, __work);
+  }
+
+  // Replaces the tiers of level __l by their merge, in level __l + 1.
+  void
+  _M_end_merge(size_type const __l)
+  {
+    _Tier __merged(_M_empty_tier());
+    __merged.swap(_M_levels[__l]._M_merged);
+    _M_levels[__l]._M_tiers.clear();
+    _M_levels[__l]._M_merge = _Build_state();
+    _M_add_tier(__l + 1, __merged);
+  }
+
+  // Runs the merges under way for an insert().
+  void
+  _M_advance_merges()
+  {
+    for (size_type __l = 0; __l != _M_levels.size(); ++__l)
+      if (_M_levels[__l]._M_tiers.size() == _S_level_tiers)
+        {
+          size_type __work = _M_levels[__l]._M_work;
+          if (_M_merge_step(_M_levels[__l], __work))
+            _M_end_merge(__l);
+        }
+  }
+
+  template <class _Visitor>
+  _Visitor&
+  _M_scan_buffer(_Region_ const& __REGION, _Visitor& __visitor) const
+  {
+    for (size_type __i = 0; __i != _M_buffer.size(); ++__i)
+      if (__REGION.encloses(_M_buffer[__i]))
+        __visitor(_M_buffer[__i]);
+    return __visitor;
+  }
+
+  // __max, and the distance returned, are in the units of _Dist.  Each
+  // tier is only searched within the nearest distance found so far.
+  template <class SearchVal, class _Predicate>
+  std::pair<const_iterator, distance_type>
+  _M_find_nearest(SearchVal const& __val, distance_type __max,
+                  _Predicate __p) const
+  {
+    const_iterator __best = end();
+    for (size_type __i = 0; __i != _M_buffer.size(); ++__i)
+      if (__p(_M_buffer[__i]))
+        {
+          distance_type const __d = _S_accumulate_node_distance<__K>
+            (_M_dist, _M_acc, _M_buffer[__i], __val);
+          if (!(__max < __d))
+            {
+              __best = &_M_buffer[__i];
+              __max = __d;
+            }
+        }
+    for (size_type __t = 0; __t != _S_level_tiers * _M_levels.size(); ++__t)
+      if (_Tier const* const __tier = _M_tier(__t))
+        {
+          std::pair<typename _Tier::const_iterator, distance_type> const __r
+            = __tier->_M_find_nearest(__val, __max, __p);
+          if (__r.first != __tier->end())
+            {
+              __best = &*__r.first;
+              __max = __r.second;
+            }
+        }
+    return std::pair<const_iterator, distance_type>(__best, __max);
+  }
+
+  typedef _K_nearest_heap<const_iterator, distance_type> _K_nearest_heap_;
+
+  // Collects the k nearest values of a tier into the heap shared by all.
+  struct _K_nearest
+  {
+    _K_nearest(_K_nearest_heap_& __heap, const_iterator const __begin)
+      : _M_heap(__heap), _M_begin(__begin), _M_max(__heap._M_max) {}
+
+    void
+    offer(size_type const __i, distance_type const __d)
+    {
+      _M_heap.offer(_M_begin + __i, __d);
+      _M_max = _M_heap._M_max;
+    }
+
+    _K_nearest_heap_& _M_heap;
+    const_iterator _M_begin;
+    distance_type _M_max;
+  };
+
+  template <class SearchVal, class _Predicate>
+  size_type
+  _M_find_k_nearest(SearchVal const& __val, size_type const __k,
+                    std::pair<const_iterator, distance_type>* __out,
+                    distance_type const __max, _Predicate __p) const
+  {
+    if (!_M_count || !__k) return 0;
+    _K_nearest_heap_ __heap(__out, __k, __max);
+    for (size_type __i = 0; __i != _M_buffer.size(); ++__i)
+      if (__p(_M_buffer[__i]))
+        {
+          distance_type const __d = _S_accumulate_node_distance<__K>
+            (_M_dist, _M_acc, _M_buffer[__i], __val);
+          if (!(__heap._M_max < __d))
+            __heap.offer(&_M_buffer[__i], __d);
+        }
+    for (size_type __t = 0; __t != _S_level_tiers * _M_levels.size(); ++__t)
+      if (_Tier const* const __tier = _M_tier(__t))
+        {
+          _K_nearest __k_nearest(__heap, &*__tier->begin());
+          __tier->_M_search_nearest(__val, __p, __k_nearest);
+        }
+    return __heap.finish(_Square_root());
+  }
+
+  _Buffer _M_buffer;
+  std::deque<_Level> _M_levels;
+  size_type _M_buffer_size;
+  size_type _M_leaf_size;
+  size_type _M_count;
+  _Acc _M_acc;
+  _Cmp _M_cmp;
+  _Dist _M_dist;
+};
+
+} // namespace KDTree
+
+#endif // include guard
+
+/* COPYRIGHT --
+ *
+ * This file is part of libkdtree++, a C++ template KD-Tree sorting container.
+ * libkdtree++ is (c) 2004-2007 Martin F. Krafft <libkdtree@pobox.madduck.net>
+ * and Sylvain Bougerel <sylvain.bougerel.devel@gmail.com> distributed under the
+ * terms of the Artistic License 2.0. See the ./COPYING file in the source tree
+ * root for more information.
+ *
+ * THIS PACKAGE IS PROVIDED "AS IS" AND WITHOUT ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED WARRANTIES
+ * OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */